@@ -0,0 +1,433 @@
+/*=========================================================================
+
+  Program:   Visualization Toolkit
+  Module:    vtkCMAESMinimizer.cxx
+
+=========================================================================*/
+#include "vtkCMAESMinimizer.h"
+#include "vtkObjectFactory.h"
+#include "vtkMath.h"
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+vtkStandardNewMacro(vtkCMAESMinimizer);
+
+//----------------------------------------------------------------------------
+vtkCMAESMinimizer::vtkCMAESMinimizer()
+{
+  this->PopulationSize = 0;
+  this->InitialStepSize = 1.0;
+  this->RandomSeed = 1;
+
+  // specific to CMA-ES
+  this->CMAESWorkspace = 0;
+  this->CMAESMatrices = 0;
+  this->StepSize = 1.0;
+  this->RandomState = 1;
+}
+
+//----------------------------------------------------------------------------
+vtkCMAESMinimizer::~vtkCMAESMinimizer()
+{
+  delete [] this->CMAESMatrices;
+  delete [] this->CMAESWorkspace;
+}
+
+//----------------------------------------------------------------------------
+void vtkCMAESMinimizer::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+  os << indent << "PopulationSize: " << this->PopulationSize << "\n";
+  os << indent << "InitialStepSize: " << this->InitialStepSize << "\n";
+  os << indent << "RandomSeed: " << this->RandomSeed << "\n";
+}
+
+//----------------------------------------------------------------------------
+namespace {
+
+// Compare the function values of two candidates for sorting
+struct vtkCMAESCompare
+{
+  const double *Values;
+
+  vtkCMAESCompare(const double *values) : Values(values) {}
+
+  bool operator()(int a, int b) const
+  {
+    return (this->Values[a] < this->Values[b]);
+  }
+};
+
+// The strategy parameters, which depend only on the number of
+// parameters and on the population size
+struct vtkCMAESStrategy
+{
+  int Lambda;
+  int Mu;
+  double Weights[64];
+  double MuEff;
+  double CC;
+  double CS;
+  double C1;
+  double CMu;
+  double Damps;
+  double ChiN;
+
+  vtkCMAESStrategy(int n, int lambda)
+  {
+    this->Lambda = lambda;
+    this->Mu = lambda/2;
+    if (this->Mu > 64)
+      {
+      this->Mu = 64;
+      }
+
+    // log-linear weights for the best mu candidates
+    double sum = 0.0;
+    for (int i = 0; i < this->Mu; i++)
+      {
+      this->Weights[i] = log(this->Mu + 0.5) - log(i + 1.0);
+      sum += this->Weights[i];
+      }
+    double sum2 = 0.0;
+    for (int i = 0; i < this->Mu; i++)
+      {
+      this->Weights[i] /= sum;
+      sum2 += this->Weights[i]*this->Weights[i];
+      }
+    this->MuEff = 1.0/sum2;
+
+    double mueff = this->MuEff;
+    this->CC = (4 + mueff/n)/(n + 4 + 2*mueff/n);
+    this->CS = (mueff + 2)/(n + mueff + 5);
+    this->C1 = 2/((n + 1.3)*(n + 1.3) + mueff);
+    this->CMu = 2*(mueff - 2 + 1/mueff)/((n + 2)*(n + 2) + mueff);
+    if (this->CMu > 1 - this->C1)
+      {
+      this->CMu = 1 - this->C1;
+      }
+    double d = sqrt((mueff - 1)/(n + 1)) - 1;
+    this->Damps = 1 + 2*(d > 0 ? d : 0) + this->CS;
+    this->ChiN = sqrt(static_cast<double>(n))*(1 - 1.0/(4*n) + 1.0/(21*n*n));
+  }
+};
+
+int vtkCMAESDefaultPopulation(int n)
+{
+  return 4 + static_cast<int>(3*log(static_cast<double>(n)));
+}
+
+} // end anonymous namespace
+
+//----------------------------------------------------------------------------
+double vtkCMAESMinimizer::CMAESGaussian()
+{
+  // use the Box-Muller transform with a linear congruential generator
+  double u1;
+  double u2;
+  do
+    {
+    this->RandomState = this->RandomState*1664525u + 1013904223u;
+    u1 = (this->RandomState >> 8)/16777216.0;
+    this->RandomState = this->RandomState*1664525u + 1013904223u;
+    u2 = (this->RandomState >> 8)/16777216.0;
+    }
+  while (u1 <= 0.0);
+
+  return sqrt(-2.0*log(u1))*cos(2.0*vtkMath::Pi()*u2);
+}
+
+//----------------------------------------------------------------------------
+// The workspace holds (in order): the mean, the previous mean, the two
+// evolution paths, the axis lengths, a temporary vector, the three
+// NxN matrices (covariance, eigenvectors, scratch), the population,
+// and the function values of the population.
+void vtkCMAESMinimizer::CMAESInitialize()
+{
+  int n = this->NumberOfParameters;
+  int lambda = this->PopulationSize;
+  if (lambda <= 0)
+    {
+    lambda = vtkCMAESDefaultPopulation(n);
+    }
+  lambda = (lambda >= 2 ? lambda : 2);
+
+  delete [] this->CMAESMatrices;
+  delete [] this->CMAESWorkspace;
+
+  this->CMAESWorkspace = new double[6*n + 3*n*n + lambda*n + lambda];
+  this->CMAESMatrices = new double *[3*n];
+
+  double *work = this->CMAESWorkspace;
+  for (int i = 0; i < 3*n; i++)
+    {
+    this->CMAESMatrices[i] = work + 6*n + i*n;
+    }
+
+  double *mean = work;
+  double **C = this->CMAESMatrices;
+  double **B = C + n;
+  for (int i = 0; i < n; i++)
+    {
+    // the search is done with the parameters divided by their scales
+    mean[i] = this->ParameterValues[i]/this->ParameterScales[i];
+    work[2*n + i] = 0.0;
+    work[3*n + i] = 0.0;
+    work[4*n + i] = 1.0;
+    for (int j = 0; j < n; j++)
+      {
+      C[i][j] = (i == j ? 1.0 : 0.0);
+      B[i][j] = (i == j ? 1.0 : 0.0);
+      }
+    }
+
+  this->StepSize = this->InitialStepSize;
+  this->RandomState = static_cast<unsigned int>(this->RandomSeed);
+
+  // evaluate the starting point
+  this->EvaluateFunction();
+}
+
+//----------------------------------------------------------------------------
+void vtkCMAESMinimizer::CMAESDecompose()
+{
+  int n = this->NumberOfParameters;
+  double **C = this->CMAESMatrices;
+  double **B = C + n;
+  double **T = B + n;
+  double *D = this->CMAESWorkspace + 4*n;
+
+  // JacobiN modifies its input, so decompose a copy
+  for (int i = 0; i < n; i++)
+    {
+    for (int j = 0; j < n; j++)
+      {
+      T[i][j] = C[i][j];
+      }
+    }
+
+  vtkMath::JacobiN(T, n, D, B);
+
+  for (int i = 0; i < n; i++)
+    {
+    D[i] = sqrt(D[i] > 1e-20 ? D[i] : 1e-20);
+    }
+}
+
+//----------------------------------------------------------------------------
+int vtkCMAESMinimizer::CMAESIterate()
+{
+  int n = this->NumberOfParameters;
+  int lambda = this->PopulationSize;
+  if (lambda <= 0)
+    {
+    lambda = vtkCMAESDefaultPopulation(n);
+    }
+  lambda = (lambda >= 2 ? lambda : 2);
+
+  vtkCMAESStrategy s(n, lambda);
+  int mu = s.Mu;
+
+  double *work = this->CMAESWorkspace;
+  double *mean = work;
+  double *oldMean = work + n;
+  double *pc = work + 2*n;
+  double *ps = work + 3*n;
+  double *D = work + 4*n;
+  double *tmp = work + 5*n;
+  double **C = this->CMAESMatrices;
+  double **B = C + n;
+  double *pop = work + 6*n + 3*n*n;
+  double *values = pop + lambda*n;
+  const double *scales = this->ParameterScales;
+  double sigma = this->StepSize;
+
+  // draw the population: y = mean + sigma*B*D*z
+  for (int k = 0; k < lambda; k++)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      tmp[i] = D[i]*this->CMAESGaussian();
+      }
+    double *y = pop + k*n;
+    for (int i = 0; i < n; i++)
+      {
+      double sum = 0.0;
+      for (int j = 0; j < n; j++)
+        {
+        sum += B[i][j]*tmp[j];
+        }
+      y[i] = mean[i] + sigma*sum;
+      }
+    }
+
+  // convert to the actual parameter values and evaluate
+  double *parameters = new double[lambda*n];
+  for (int k = 0; k < lambda; k++)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      parameters[k*n + i] = pop[k*n + i]*scales[i];
+      }
+    }
+  this->EvaluateFunctions(lambda, parameters, values);
+
+  // sort the candidates by their values
+  std::vector<int> order(lambda);
+  for (int k = 0; k < lambda; k++)
+    {
+    order[k] = k;
+    }
+  std::sort(order.begin(), order.end(), vtkCMAESCompare(values));
+
+  // keep the best candidate that has been found so far
+  double oldBestValue = this->FunctionValue;
+  if (values[order[0]] < this->FunctionValue)
+    {
+    this->FunctionValue = values[order[0]];
+    for (int i = 0; i < n; i++)
+      {
+      this->ParameterValues[i] = parameters[order[0]*n + i];
+      }
+    }
+  delete [] parameters;
+
+  // recombination: the new mean is the weighted mean of the best
+  for (int i = 0; i < n; i++)
+    {
+    oldMean[i] = mean[i];
+    double sum = 0.0;
+    for (int k = 0; k < mu; k++)
+      {
+      sum += s.Weights[k]*pop[order[k]*n + i];
+      }
+    mean[i] = sum;
+    }
+
+  // update the evolution path for sigma: uses C^(-1/2)*(mean - oldMean)
+  for (int i = 0; i < n; i++)
+    {
+    double sum = 0.0;
+    for (int j = 0; j < n; j++)
+      {
+      sum += B[j][i]*(mean[j] - oldMean[j]);
+      }
+    tmp[i] = sum/D[i];
+    }
+  double csn = sqrt(s.CS*(2 - s.CS)*s.MuEff)/sigma;
+  double psNorm2 = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    double sum = 0.0;
+    for (int j = 0; j < n; j++)
+      {
+      sum += B[i][j]*tmp[j];
+      }
+    ps[i] = (1 - s.CS)*ps[i] + csn*sum;
+    psNorm2 += ps[i]*ps[i];
+    }
+  double psNorm = sqrt(psNorm2);
+
+  // update the evolution path for the covariance
+  double gen = this->Iterations + 1;
+  bool hsig = (psNorm/sqrt(1 - pow(1 - s.CS, 2*gen))/s.ChiN <
+               1.4 + 2.0/(n + 1));
+  double ccn = sqrt(s.CC*(2 - s.CC)*s.MuEff)/sigma;
+  for (int i = 0; i < n; i++)
+    {
+    pc[i] = (1 - s.CC)*pc[i] + (hsig ? ccn*(mean[i] - oldMean[i]) : 0.0);
+    }
+
+  // adapt the covariance with the rank-one and rank-mu updates
+  double c1a = s.C1*(hsig ? 0.0 : s.CC*(2 - s.CC));
+  for (int i = 0; i < n; i++)
+    {
+    for (int j = 0; j <= i; j++)
+      {
+      double rankMu = 0.0;
+      for (int k = 0; k < mu; k++)
+        {
+        const double *y = pop + order[k]*n;
+        rankMu += s.Weights[k]*(y[i] - oldMean[i])*(y[j] - oldMean[j]);
+        }
+      rankMu /= sigma*sigma;
+      double c = ((1 - s.C1 - s.CMu + c1a)*C[i][j] +
+                  s.C1*pc[i]*pc[j] + s.CMu*rankMu);
+      C[i][j] = c;
+      C[j][i] = c;
+      }
+    }
+
+  // adapt the step size
+  this->StepSize = sigma*exp((s.CS/s.Damps)*(psNorm/s.ChiN - 1));
+
+  this->CMAESDecompose();
+
+  // check the tolerance on the parameters, which is measured in units
+  // of the parameter scales, like for Powell's method
+  double maxw = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    double w = this->StepSize*sqrt(C[i][i]);
+    maxw = (maxw > w ? maxw : w);
+    }
+
+  // check the tolerance on the function value over the population
+  double y0 = values[order[0]];
+  double y1 = values[order[lambda - 1]];
+  double ftol = this->Tolerance;
+  const double tiny = 1e-20;
+  if (2*fabs(y1 - y0) <= ftol*(fabs(y0) + fabs(y1)) + tiny &&
+      2*fabs(oldBestValue - this->FunctionValue) <=
+        ftol*(fabs(oldBestValue) + fabs(this->FunctionValue)) + tiny &&
+      maxw < this->ParameterTolerance)
+    {
+    return 0;
+    }
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkCMAESMinimizer::Iterate()
+{
+  if (this->Iterations == 0)
+    {
+    if (!this->Function)
+      {
+      vtkErrorMacro("Iterate: Function is NULL");
+      return 0;
+      }
+    this->CMAESInitialize();
+    }
+
+  int stillgood = this->CMAESIterate();
+  this->Iterations++;
+
+  return stillgood;
+}
+
+//----------------------------------------------------------------------------
+void vtkCMAESMinimizer::Minimize()
+{
+  if (this->Iterations == 0)
+    {
+    if (!this->Function)
+      {
+      vtkErrorMacro("Minimize: Function is NULL");
+      return;
+      }
+    this->CMAESInitialize();
+    }
+
+  for (; this->Iterations < this->MaxIterations; this->Iterations++)
+    {
+    int stillgood = this->CMAESIterate();
+    if (!stillgood)
+      {
+      break;
+      }
+    }
+}
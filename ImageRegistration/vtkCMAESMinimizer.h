@@ -0,0 +1,101 @@
+/*=========================================================================
+
+  Program:   Visualization Toolkit
+  Module:    vtkCMAESMinimizer.h
+
+=========================================================================*/
+// .NAME vtkCMAESMinimizer - use CMA-ES to minimize a function
+// .SECTION Description
+// vtkCMAESMinimizer will modify a set of parameters in order to find
+// the minimum of a specified function.  It uses the covariance matrix
+// adaptation evolution strategy (CMA-ES): at each iteration, a population
+// of candidate parameter sets is drawn from a multivariate normal
+// distribution, and the mean and covariance of the distribution are
+// adapted according to the best candidates.  This makes it much less
+// likely than Powell's method to become trapped in a local minimum.
+// The candidates for each iteration are independent of each other, so
+// if a batch function is provided with SetBatchFunction(), they are all
+// evaluated in one call.
+// The ParameterValues and the FunctionValue are those of the best
+// candidate found so far.
+// .SECTION See also
+// vtkPowellMinimizer
+
+#ifndef __vtkCMAESMinimizer_h
+#define __vtkCMAESMinimizer_h
+
+#include "vtkPowellMinimizer.h"
+
+class VTK_EXPORT vtkCMAESMinimizer : public vtkPowellMinimizer
+{
+public:
+  static vtkCMAESMinimizer *New();
+  vtkTypeMacro(vtkCMAESMinimizer,vtkPowellMinimizer);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Set the number of candidates per iteration.  If this is zero, then
+  // the usual default of 4 + 3*ln(N) will be used, where N is the number
+  // of parameters.  Larger populations are more robust, but require
+  // more function evaluations.
+  vtkSetMacro(PopulationSize, int);
+  vtkGetMacro(PopulationSize, int);
+
+  // Description:
+  // Set the initial step size, as a multiple of the parameter scales.
+  // The default is 1.0.
+  vtkSetMacro(InitialStepSize, double);
+  vtkGetMacro(InitialStepSize, double);
+
+  // Description:
+  // The seed for the random number generator.  The same seed always
+  // gives the same sequence of candidates.  The default is 1.
+  vtkSetMacro(RandomSeed, int);
+  vtkGetMacro(RandomSeed, int);
+
+  // Description:
+  // Iterate until the minimum is found to within the specified tolerance,
+  // or until the MaxIterations has been reached.
+  virtual void Minimize();
+
+  // Description:
+  // Perform one iteration of minimization, i.e. evaluate one population
+  // of candidates.  Returns zero if the tolerance stopping criterion has
+  // been met.
+  virtual int Iterate();
+
+protected:
+  vtkCMAESMinimizer();
+  ~vtkCMAESMinimizer();
+
+  int PopulationSize;
+  double InitialStepSize;
+  int RandomSeed;
+
+private:
+  // Description:
+  // Initialize the distribution and the workspace.
+  void CMAESInitialize();
+
+  // Description:
+  // Run one generation of CMA-ES.
+  int CMAESIterate();
+
+  // Description:
+  // Compute the eigenvectors and eigenvalues of the covariance.
+  void CMAESDecompose();
+
+  // Description:
+  // Get a random number from the standard normal distribution.
+  double CMAESGaussian();
+
+  double *CMAESWorkspace;
+  double **CMAESMatrices;
+  double StepSize;
+  unsigned int RandomState;
+
+  vtkCMAESMinimizer(const vtkCMAESMinimizer&);  // Not implemented.
+  void operator=(const vtkCMAESMinimizer&);  // Not implemented.
+};
+
+#endif
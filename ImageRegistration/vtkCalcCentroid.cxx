@@ -0,0 +1,380 @@
+/*=========================================================================
+
+  Program:   Visualization Toolkit
+  Module:    $RCSfile: vtkCalcCentroid.h,v $
+  Language:  C++
+  Date:      $Date: 2007/08/24 20:02:25 $
+  Version:   $Revision: 1.9 $
+  Thanks:    Thanks to Yves who developed this class.
+
+Copyright (c) 1993-2000 Ken Martin, Will Schroeder, Bill Lorensen 
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+ * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+ * Neither name of Ken Martin, Will Schroeder, or Bill Lorensen nor the names
+   of any contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+ * Modified source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS''
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+=========================================================================*/
+#include "vtkCalcCentroid.h"
+#include "vtkObjectFactory.h"
+#include "vtkImageData.h"
+#include "vtkImageStencilData.h"
+#include "vtkMultiThreader.h"
+#include "vtkTemplateAliasMacro.h"
+
+vtkStandardNewMacro(vtkCalcCentroid);
+
+//--------------------------------------------------------------------------
+// Constructs with initial 0 values.
+vtkCalcCentroid::vtkCalcCentroid()
+{
+  this->Input = NULL;
+  this->Stencil = NULL;
+  this->BackgroundLevel = 0.0;
+  this->NumberOfThreads =
+    vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  this->TotalWeight = 0.0;
+  this->Centroid[0] = 0.0;
+  this->Centroid[1] = 0.0;
+  this->Centroid[2] = 0.0;
+  for (int i = 0; i < 9; i++)
+    {
+    this->CovarianceMatrix[i] = 0.0;
+    }
+}
+
+//--------------------------------------------------------------------------
+vtkCalcCentroid::~vtkCalcCentroid()
+{
+  this->SetInput(NULL);
+  this->SetStencil(NULL);
+}
+
+//--------------------------------------------------------------------------
+void vtkCalcCentroid::SetInput(vtkImageData *input)
+{
+  if (this->Input != input)
+    {
+    if (this->Input)
+      {
+      this->Input->Delete();
+      }
+    if (input)
+      {
+      input->Register(this);
+      }
+    this->Input = input;
+    this->Modified();
+    }
+}
+
+//--------------------------------------------------------------------------
+void vtkCalcCentroid::SetStencil(vtkImageStencilData *stencil)
+{
+  if (this->Stencil != stencil)
+    {
+    if (this->Stencil)
+      {
+      this->Stencil->Delete();
+      }
+    if (stencil)
+      {
+      stencil->Register(this);
+      }
+    this->Stencil = stencil;
+    this->Modified();
+    }
+}
+
+//--------------------------------------------------------------------------
+namespace {
+
+// The number of sums needed for the moments up to second order
+const int vtkCalcCentroidNumberOfSums = 10;
+
+struct vtkCalcCentroidThreadStruct
+{
+  vtkImageData *Input;
+  vtkImageStencilData *Stencil;
+  double BackgroundLevel;
+  double Center[3];
+  double *Sums;
+};
+
+//--------------------------------------------------------------------------
+// Accumulate the moments for a range of rows, where the coordinates are
+// measured from the center of the extent to reduce roundoff error.
+template <class T>
+void vtkCalcCentroidExecute(
+  vtkCalcCentroidThreadStruct *ts, const T *inPtr,
+  int rowBegin, int rowEnd, double *sums)
+{
+  vtkImageData *input = ts->Input;
+  vtkImageStencilData *stencil = ts->Stencil;
+  double background = ts->BackgroundLevel;
+
+  int extent[6];
+  input->GetExtent(extent);
+  vtkIdType inc[3];
+  input->GetIncrements(inc);
+  int numRows = extent[3] - extent[2] + 1;
+
+  double s = 0.0;
+  double sx = 0.0, sy = 0.0, sz = 0.0;
+  double sxx = 0.0, sxy = 0.0, sxz = 0.0;
+  double syy = 0.0, syz = 0.0, szz = 0.0;
+
+  for (int row = rowBegin; row < rowEnd; row++)
+    {
+    int j = extent[2] + row % numRows;
+    int k = extent[4] + row / numRows;
+    double y = j - ts->Center[1];
+    double z = k - ts->Center[2];
+    const T *rowPtr = inPtr + (j - extent[2])*inc[1] + (k - extent[4])*inc[2];
+
+    int iter = 0;
+    int r1 = extent[0];
+    int r2 = extent[1];
+    for (;;)
+      {
+      if (stencil)
+        {
+        if (!stencil->GetNextExtent(
+              r1, r2, extent[0], extent[1], j, k, iter))
+          {
+          break;
+          }
+        }
+
+      // the row sums are accumulated separately, then added
+      double rs = 0.0, rsx = 0.0, rsxx = 0.0;
+      const T *ptr = rowPtr + (r1 - extent[0])*inc[0];
+      for (int i = r1; i <= r2; i++)
+        {
+        double w = static_cast<double>(*ptr) - background;
+        ptr += inc[0];
+        if (w > 0)
+          {
+          double x = i - ts->Center[0];
+          rs += w;
+          rsx += w*x;
+          rsxx += w*x*x;
+          }
+        }
+
+      s += rs;
+      sx += rsx;
+      sy += rs*y;
+      sz += rs*z;
+      sxx += rsxx;
+      sxy += rsx*y;
+      sxz += rsx*z;
+      syy += rs*y*y;
+      syz += rs*y*z;
+      szz += rs*z*z;
+
+      if (!stencil)
+        {
+        break;
+        }
+      }
+    }
+
+  sums[0] += s;
+  sums[1] += sx;
+  sums[2] += sy;
+  sums[3] += sz;
+  sums[4] += sxx;
+  sums[5] += sxy;
+  sums[6] += sxz;
+  sums[7] += syy;
+  sums[8] += syz;
+  sums[9] += szz;
+}
+
+//--------------------------------------------------------------------------
+VTK_THREAD_RETURN_TYPE vtkCalcCentroidThreadedExecute(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  vtkCalcCentroidThreadStruct *ts =
+    static_cast<vtkCalcCentroidThreadStruct *>(ti->UserData);
+  int threadId = ti->ThreadID;
+  int threadCount = ti->NumberOfThreads;
+
+  // divide the rows evenly between the threads
+  int extent[6];
+  ts->Input->GetExtent(extent);
+  int numRows = (extent[3] - extent[2] + 1)*(extent[5] - extent[4] + 1);
+  int rowBegin = static_cast<int>(
+    static_cast<vtkIdType>(numRows)*threadId/threadCount);
+  int rowEnd = static_cast<int>(
+    static_cast<vtkIdType>(numRows)*(threadId + 1)/threadCount);
+
+  double *sums = ts->Sums + threadId*vtkCalcCentroidNumberOfSums;
+  void *inPtr = ts->Input->GetScalarPointerForExtent(extent);
+
+  switch (ts->Input->GetScalarType())
+    {
+    vtkTemplateAliasMacro(
+      vtkCalcCentroidExecute(
+        ts, static_cast<const VTK_TT *>(inPtr), rowBegin, rowEnd, sums));
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+} // end anonymous namespace
+
+//--------------------------------------------------------------------------
+void vtkCalcCentroid::ComputeMoments()
+{
+  // make sure input is available
+  if (!this->Input)
+    {
+    vtkErrorMacro(<< "No input...can't execute!");
+    return;
+    }
+
+  // only recompute if something has changed
+  if (this->ComputeTime > this->GetMTime() &&
+      this->ComputeTime > this->Input->GetMTime() &&
+      (!this->Stencil || this->ComputeTime > this->Stencil->GetMTime()))
+    {
+    return;
+    }
+
+  int extent[6];
+  this->Input->GetExtent(extent);
+  if (extent[0] > extent[1] || extent[2] > extent[3] || extent[4] > extent[5])
+    {
+    vtkErrorMacro(<< "The input is empty.");
+    return;
+    }
+
+  int numThreads = this->NumberOfThreads;
+  double *sums = new double[numThreads*vtkCalcCentroidNumberOfSums];
+  for (int i = 0; i < numThreads*vtkCalcCentroidNumberOfSums; i++)
+    {
+    sums[i] = 0.0;
+    }
+
+  vtkCalcCentroidThreadStruct ts;
+  ts.Input = this->Input;
+  ts.Stencil = this->Stencil;
+  ts.BackgroundLevel = this->BackgroundLevel;
+  ts.Center[0] = 0.5*(extent[0] + extent[1]);
+  ts.Center[1] = 0.5*(extent[2] + extent[3]);
+  ts.Center[2] = 0.5*(extent[4] + extent[5]);
+  ts.Sums = sums;
+
+  vtkMultiThreader *threader = vtkMultiThreader::New();
+  threader->SetNumberOfThreads(numThreads);
+  threader->SetSingleMethod(vtkCalcCentroidThreadedExecute, &ts);
+  threader->SingleMethodExecute();
+  threader->Delete();
+
+  // add the sums from all of the threads
+  for (int t = 1; t < numThreads; t++)
+    {
+    for (int i = 0; i < vtkCalcCentroidNumberOfSums; i++)
+      {
+      sums[i] += sums[t*vtkCalcCentroidNumberOfSums + i];
+      }
+    }
+
+  double spacing[3];
+  double origin[3];
+  this->Input->GetSpacing(spacing);
+  this->Input->GetOrigin(origin);
+
+  this->TotalWeight = sums[0];
+  double s = (sums[0] > 0 ? sums[0] : 1.0);
+
+  // convert the centroid to world coordinates
+  double mean[3];
+  for (int i = 0; i < 3; i++)
+    {
+    mean[i] = sums[1 + i]/s;
+    this->Centroid[i] = (mean[i] + ts.Center[i])*spacing[i] + origin[i];
+    }
+
+  // compute the covariance from the second moments
+  static const int sumIndex[3][3] = { { 4, 5, 6 }, { 5, 7, 8 }, { 6, 8, 9 } };
+  for (int i = 0; i < 3; i++)
+    {
+    for (int j = 0; j < 3; j++)
+      {
+      double c = sums[sumIndex[i][j]]/s - mean[i]*mean[j];
+      this->CovarianceMatrix[3*i + j] = c*spacing[i]*spacing[j];
+      }
+    }
+
+  delete [] sums;
+
+  this->ComputeTime.Modified();
+}
+
+//--------------------------------------------------------------------------
+double *vtkCalcCentroid::GetCentroid()
+{
+  this->ComputeMoments();
+  return this->Centroid;
+}
+
+//--------------------------------------------------------------------------
+double *vtkCalcCentroid::GetCovarianceMatrix()
+{
+  this->ComputeMoments();
+  return this->CovarianceMatrix;
+}
+
+//--------------------------------------------------------------------------
+double vtkCalcCentroid::GetTotalWeight()
+{
+  this->ComputeMoments();
+  return this->TotalWeight;
+}
+
+//--------------------------------------------------------------------------
+void vtkCalcCentroid::PrintSelf(ostream& os, vtkIndent indent)
+{
+  double *mat = this->CovarianceMatrix;
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "Input: " << this->Input << "\n";
+  os << indent << "Stencil: " << this->Stencil << "\n";
+  os << indent << "BackgroundLevel: " << this->BackgroundLevel << "\n";
+  os << indent << "NumberOfThreads: " << this->NumberOfThreads << "\n";
+  os << indent << "TotalWeight: " << this->TotalWeight << "\n";
+  os << indent << "Centroid: [" << this->Centroid[0] << "," <<
+    this->Centroid[1] << "," << this->Centroid[2] << "]\n";
+  os << indent << "Covariance Matrix:\n" \
+     << indent << "[" << mat[0] << "," << mat[1] << "," << mat[2] << "]\n"\
+     << indent << "[" << mat[3] << "," << mat[4] << "," << mat[5] << "]\n"\
+     << indent << "[" << mat[6] << "," << mat[7] << "," << mat[8] << "]\n";
+}
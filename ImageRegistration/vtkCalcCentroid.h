@@ -41,47 +41,80 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 =========================================================================*/
 // .NAME vtkCalcCentroid - compute centre of gravity of vtkImageData
 // .SECTION Description
-// vtkCalcCentroid computes the centre of gravity of vtkImageData.
-
+// vtkCalcCentroid computes the centre of gravity of vtkImageData, and
+// the covariance matrix of the intensity distribution about the centre,
+// from which the principal axes of the image can be found.  The voxel
+// values are used as weights after the BackgroundLevel is subtracted,
+// and voxels at or below the BackgroundLevel are ignored.  A stencil can
+// be used to restrict the computation to a region of the image.  The
+// input must be up-to-date before the centroid is requested.
+// .SECTION See also
+// vtkImageRegistration
 
 #ifndef __vtkCalcCentroid_h
 #define __vtkCalcCentroid_h
 
-#include "vtkSystemIncludes.h"
-#ifndef vtkFloatingPointType
-#define vtkFloatingPointType vtkFloatingPointType
-typedef float vtkFloatingPointType;
-#endif
-
 #include "vtkObject.h"
-#include "vtkImageData.h"
+
+class vtkImageData;
+class vtkImageStencilData;
 
 class VTK_EXPORT vtkCalcCentroid : public vtkObject
 {
 public:
   vtkTypeMacro(vtkCalcCentroid, vtkObject);
   static vtkCalcCentroid *New();
-  
-  void PrintSelf(ostream& os, vtkIndent indent);
 
-  vtkSetObjectMacro(Input, vtkImageData);
-  vtkGetObjectMacro(Input, vtkImageData);
+  void PrintSelf(ostream& os, vtkIndent indent);
 
+  // Description:
+  // Set the image.  Only the first component is used.
+  void SetInput(vtkImageData *input);
+  vtkImageData *GetInput() { return this->Input; }
+
+  // Description:
+  // Set a stencil to restrict the computation to part of the image.
+  void SetStencil(vtkImageStencilData *stencil);
+  vtkImageStencilData *GetStencil() { return this->Stencil; }
+
+  // Description:
+  // The value to subtract from the voxels to get their weights.  Voxels
+  // at or below this value are ignored.  The default is zero.
+  vtkSetMacro(BackgroundLevel, double);
+  vtkGetMacro(BackgroundLevel, double);
+
+  // Description:
+  // Set the number of threads to use.
+  vtkSetClampMacro(NumberOfThreads, int, 1, VTK_MAX_THREADS);
+  vtkGetMacro(NumberOfThreads, int);
+
+  // Description:
+  // Get the centroid in world coordinates.
   double *GetCentroid();
-  double *GetCovarianceMatrix();
 
+  // Description:
+  // Get the 3x3 covariance matrix in world coordinates, in row-major
+  // order.  The eigenvectors of this matrix are the principal axes.
+  double *GetCovarianceMatrix();
 
+  // Description:
+  // Get the sum of the weights of all of the voxels that were used.
+  double GetTotalWeight();
 
 protected:
   vtkCalcCentroid();
   ~vtkCalcCentroid();
-  
-  void ComputeCentroid();
-  void ComputeCovarianceMatrix();
+
+  void ComputeMoments();
 
   double Centroid[3];
   double CovarianceMatrix[9];
+  double TotalWeight;
+  double BackgroundLevel;
+  int NumberOfThreads;
   vtkImageData *Input;
+  vtkImageStencilData *Stencil;
+  vtkTimeStamp ComputeTime;
 
 private:
   vtkCalcCentroid(const vtkCalcCentroid&); // Not implemented.
@@ -89,5 +122,3 @@ private:
 };
 
 #endif
-
-
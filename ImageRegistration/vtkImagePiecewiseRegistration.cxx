@@ -0,0 +1,726 @@
+/*=========================================================================
+  Program:   Atamai Image Registration and Segmentation
+  Module:    vtkImagePiecewiseRegistration.cxx
+
+  Copyright (c) 2014 David Gobbi
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+
+  * Neither the name of the Calgary Image Processing and Analysis Centre
+    (CIPAC), the University of Calgary, nor the names of any authors nor
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+=========================================================================*/
+
+#include "vtkImagePiecewiseRegistration.h"
+#include "vtkImageRegistration.h"
+#include "vtkImageConnectivityFilter.h"
+#include "vtkObjectFactory.h"
+#include "vtkImageData.h"
+#include "vtkImageStencilData.h"
+#include "vtkIntArray.h"
+#include "vtkMatrix4x4.h"
+#include "vtkTransform.h"
+#include "vtkMultiThreader.h"
+#include "vtkMutexLock.h"
+#include "vtkTemplateAliasMacro.h"
+#include "vtkVersion.h"
+
+#include <math.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+// A macro to assist VTK 5 backwards compatibility
+#if VTK_MAJOR_VERSION >= 6
+#define SET_INPUT_DATA SetInputData
+#else
+#define SET_INPUT_DATA SetInput
+#endif
+
+// The cropped images and the results for each label
+struct vtkImagePiecewiseRegistrationRegion
+{
+  vtkImagePiecewiseRegistrationRegion() :
+    Label(0), Source(NULL), Target(NULL), Labels(NULL), Transform(NULL),
+    MetricValue(0.0), Converged(0)
+  {
+    for (int i = 0; i < 6; i++)
+      {
+      this->Extent[i] = -(i & 1);
+      this->TargetExtent[i] = -(i & 1);
+      }
+  }
+
+  int Label;
+  int Extent[6];
+  int TargetExtent[6];
+  vtkImageData *Source;
+  vtkImageData *Target;
+  vtkImageData *Labels;
+  vtkTransform *Transform;
+  double MetricValue;
+  int Converged;
+};
+
+vtkStandardNewMacro(vtkImagePiecewiseRegistration);
+vtkCxxSetObjectMacro(vtkImagePiecewiseRegistration, SourceImage,
+                     vtkImageData);
+vtkCxxSetObjectMacro(vtkImagePiecewiseRegistration, TargetImage,
+                     vtkImageData);
+vtkCxxSetObjectMacro(vtkImagePiecewiseRegistration, LabelImage,
+                     vtkImageData);
+vtkCxxSetObjectMacro(vtkImagePiecewiseRegistration, Registration,
+                     vtkImageRegistration);
+
+//----------------------------------------------------------------------------
+vtkImagePiecewiseRegistration::vtkImagePiecewiseRegistration()
+{
+  this->SourceImage = NULL;
+  this->TargetImage = NULL;
+  this->LabelImage = NULL;
+  this->Registration = NULL;
+  this->CropMargin = 20.0;
+  this->NumberOfConcurrentRegistrations =
+    vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  this->NumberOfRegions = 0;
+  this->Regions = NULL;
+}
+
+//----------------------------------------------------------------------------
+vtkImagePiecewiseRegistration::~vtkImagePiecewiseRegistration()
+{
+  this->SetSourceImage(NULL);
+  this->SetTargetImage(NULL);
+  this->SetLabelImage(NULL);
+  this->SetRegistration(NULL);
+  this->ClearRegions();
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePiecewiseRegistration::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "SourceImage: " << this->SourceImage << "\n";
+  os << indent << "TargetImage: " << this->TargetImage << "\n";
+  os << indent << "LabelImage: " << this->LabelImage << "\n";
+  os << indent << "Registration: " << this->Registration << "\n";
+  os << indent << "CropMargin: " << this->CropMargin << "\n";
+  os << indent << "NumberOfConcurrentRegistrations: "
+     << this->NumberOfConcurrentRegistrations << "\n";
+  os << indent << "NumberOfLabels: " << this->NumberOfRegions << "\n";
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePiecewiseRegistration::ClearRegions()
+{
+  for (int i = 0; i < this->NumberOfRegions; i++)
+    {
+    vtkImagePiecewiseRegistrationRegion *region = &this->Regions[i];
+    if (region->Source) { region->Source->Delete(); }
+    if (region->Target) { region->Target->Delete(); }
+    if (region->Labels) { region->Labels->Delete(); }
+    if (region->Transform) { region->Transform->Delete(); }
+    }
+  delete [] this->Regions;
+  this->Regions = NULL;
+  this->NumberOfRegions = 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePiecewiseRegistration::GetNumberOfLabels()
+{
+  return this->NumberOfRegions;
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePiecewiseRegistration::GetLabel(int n)
+{
+  if (n < 0 || n >= this->NumberOfRegions)
+    {
+    vtkErrorMacro("GetLabel: Index " << n << " is out of range");
+    return 0;
+    }
+  return this->Regions[n].Label;
+}
+
+//----------------------------------------------------------------------------
+vtkLinearTransform *vtkImagePiecewiseRegistration::GetTransform(int n)
+{
+  if (n < 0 || n >= this->NumberOfRegions)
+    {
+    vtkErrorMacro("GetTransform: Index " << n << " is out of range");
+    return NULL;
+    }
+  return this->Regions[n].Transform;
+}
+
+//----------------------------------------------------------------------------
+double vtkImagePiecewiseRegistration::GetMetricValue(int n)
+{
+  if (n < 0 || n >= this->NumberOfRegions)
+    {
+    vtkErrorMacro("GetMetricValue: Index " << n << " is out of range");
+    return 0.0;
+    }
+  return this->Regions[n].MetricValue;
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePiecewiseRegistration::GetConverged(int n)
+{
+  if (n < 0 || n >= this->NumberOfRegions)
+    {
+    vtkErrorMacro("GetConverged: Index " << n << " is out of range");
+    return 0;
+    }
+  return this->Regions[n].Converged;
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePiecewiseRegistration::GetSourceExtent(int n, int extent[6])
+{
+  if (n < 0 || n >= this->NumberOfRegions)
+    {
+    vtkErrorMacro("GetSourceExtent: Index " << n << " is out of range");
+    return;
+    }
+  for (int i = 0; i < 6; i++)
+    {
+    extent[i] = this->Regions[n].Extent[i];
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImagePiecewiseRegistration::GetTargetExtent(int n, int extent[6])
+{
+  if (n < 0 || n >= this->NumberOfRegions)
+    {
+    vtkErrorMacro("GetTargetExtent: Index " << n << " is out of range");
+    return;
+    }
+  for (int i = 0; i < 6; i++)
+    {
+    extent[i] = this->Regions[n].TargetExtent[i];
+    }
+}
+
+//----------------------------------------------------------------------------
+vtkLinearTransform *vtkImagePiecewiseRegistration::GetTransformForLabel(
+  int label)
+{
+  for (int i = 0; i < this->NumberOfRegions; i++)
+    {
+    if (this->Regions[i].Label == label)
+      {
+      return this->Regions[i].Transform;
+      }
+    }
+  return NULL;
+}
+
+// begin anonymous namespace
+namespace {
+
+//----------------------------------------------------------------------------
+// Find the extent of every nonzero label in the first component.  The
+// labels are returned in increasing order, with six extent values each.
+template<class T>
+void vtkImagePiecewiseRegistrationFindLabels(
+  vtkImageData *image, T *inPtr, std::vector<int> *labels,
+  std::vector<int> *extents)
+{
+  int extent[6];
+  vtkIdType inc[3];
+  image->GetExtent(extent);
+  image->GetIncrements(inc);
+
+  std::map<int, int> extentMap;
+  std::vector<int> found;
+  int lastLabel = 0;
+  int *e = NULL;
+
+  for (int k = extent[4]; k <= extent[5]; k++)
+    {
+    for (int j = extent[2]; j <= extent[3]; j++)
+      {
+      T *ptr = inPtr + (j - extent[2])*inc[1] + (k - extent[4])*inc[2];
+      for (int i = extent[0]; i <= extent[1]; i++)
+        {
+        int label = static_cast<int>(*ptr);
+        ptr += inc[0];
+        if (label == 0)
+          {
+          continue;
+          }
+        if (label != lastLabel || e == NULL)
+          {
+          // use the map only when the label changes
+          std::map<int, int>::iterator iter = extentMap.find(label);
+          if (iter == extentMap.end())
+            {
+            iter = extentMap.insert(
+              std::make_pair(label, static_cast<int>(found.size()))).first;
+            int newExtent[6] = { i, i, j, j, k, k };
+            found.insert(found.end(), newExtent, newExtent + 6);
+            }
+          e = &found[iter->second];
+          lastLabel = label;
+          }
+        e[0] = (i < e[0] ? i : e[0]);
+        e[1] = (i > e[1] ? i : e[1]);
+        e[2] = (j < e[2] ? j : e[2]);
+        e[3] = (j > e[3] ? j : e[3]);
+        e[5] = k;
+        }
+      }
+    }
+
+  for (std::map<int, int>::iterator iter = extentMap.begin();
+       iter != extentMap.end(); ++iter)
+    {
+    labels->push_back(iter->first);
+    extents->insert(extents->end(), &found[iter->second],
+                    &found[iter->second] + 6);
+    }
+}
+
+//----------------------------------------------------------------------------
+// Copy part of an image into a new image, which keeps the same indices.
+vtkImageData *vtkImagePiecewiseRegistrationCrop(
+  vtkImageData *image, const int extent[6])
+{
+  int numComponents = image->GetNumberOfScalarComponents();
+  vtkImageData *output = vtkImageData::New();
+  output->SetOrigin(image->GetOrigin());
+  output->SetSpacing(image->GetSpacing());
+  output->SetExtent(const_cast<int *>(extent));
+#if VTK_MAJOR_VERSION >= 6
+  output->AllocateScalars(image->GetScalarType(), numComponents);
+#else
+  output->SetScalarType(image->GetScalarType());
+  output->SetNumberOfScalarComponents(numComponents);
+  output->AllocateScalars();
+#endif
+
+  size_t rowSize = static_cast<size_t>(extent[1] - extent[0] + 1)*
+    numComponents*image->GetScalarSize();
+  for (int k = extent[4]; k <= extent[5]; k++)
+    {
+    for (int j = extent[2]; j <= extent[3]; j++)
+      {
+      memcpy(output->GetScalarPointer(extent[0], j, k),
+             image->GetScalarPointer(extent[0], j, k), rowSize);
+      }
+    }
+
+  return output;
+}
+
+//----------------------------------------------------------------------------
+// Find the target extent that covers the source extent after it has been
+// mapped through the matrix and padded by the margin.  Returns zero if
+// it does not overlap the target.
+int vtkImagePiecewiseRegistrationTargetExtent(
+  vtkImageData *source, const int sourceExtent[6], vtkMatrix4x4 *matrix,
+  double margin, vtkImageData *target, int extent[6])
+{
+  double origin[3], spacing[3];
+  source->GetOrigin(origin);
+  source->GetSpacing(spacing);
+
+  // the bounds of the mapped corners of the source extent
+  double bounds[6] = { VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX,
+                       VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX,
+                       VTK_DOUBLE_MAX, -VTK_DOUBLE_MAX };
+  for (int c = 0; c < 8; c++)
+    {
+    double point[4];
+    point[0] = origin[0] + spacing[0]*sourceExtent[0 + (c & 1)];
+    point[1] = origin[1] + spacing[1]*sourceExtent[2 + ((c >> 1) & 1)];
+    point[2] = origin[2] + spacing[2]*sourceExtent[4 + ((c >> 2) & 1)];
+    point[3] = 1.0;
+    matrix->MultiplyPoint(point, point);
+    for (int i = 0; i < 3; i++)
+      {
+      bounds[2*i] = (point[i] < bounds[2*i] ? point[i] : bounds[2*i]);
+      bounds[2*i + 1] =
+        (point[i] > bounds[2*i + 1] ? point[i] : bounds[2*i + 1]);
+      }
+    }
+
+  // convert the padded bounds to target indices
+  int wholeExtent[6];
+  target->GetExtent(wholeExtent);
+  target->GetOrigin(origin);
+  target->GetSpacing(spacing);
+  for (int i = 0; i < 3; i++)
+    {
+    double x1 = (bounds[2*i] - margin - origin[i])/spacing[i];
+    double x2 = (bounds[2*i + 1] + margin - origin[i])/spacing[i];
+    if (x1 > x2)
+      {
+      double tmp = x1;
+      x1 = x2;
+      x2 = tmp;
+      }
+    double lo = floor(x1);
+    double hi = ceil(x2);
+    if (lo > wholeExtent[2*i + 1] || hi < wholeExtent[2*i])
+      {
+      return 0;
+      }
+    extent[2*i] = (lo > wholeExtent[2*i] ?
+                   static_cast<int>(lo) : wholeExtent[2*i]);
+    extent[2*i + 1] = (hi < wholeExtent[2*i + 1] ?
+                       static_cast<int>(hi) : wholeExtent[2*i + 1]);
+    }
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+// Build a stencil from the nonzero voxels of a mask, within an extent.
+void vtkImagePiecewiseRegistrationStencil(
+  vtkImageData *mask, const int extent[6], vtkImageStencilData *stencil)
+{
+  stencil->SetOrigin(mask->GetOrigin());
+  stencil->SetSpacing(mask->GetSpacing());
+  stencil->SetExtent(const_cast<int *>(extent));
+  stencil->AllocateExtents();
+
+  for (int k = extent[4]; k <= extent[5]; k++)
+    {
+    for (int j = extent[2]; j <= extent[3]; j++)
+      {
+      unsigned char *maskPtr = static_cast<unsigned char *>(
+        mask->GetScalarPointer(extent[0], j, k));
+      int i = extent[0];
+      while (i <= extent[1])
+        {
+        while (i <= extent[1] && !maskPtr[i - extent[0]]) { i++; }
+        int r1 = i;
+        while (i <= extent[1] && maskPtr[i - extent[0]]) { i++; }
+        if (i > r1)
+          {
+          stencil->InsertNextExtent(r1, i - 1, j, k);
+          }
+        }
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+// Copy the settings from one registration to another.
+void vtkImagePiecewiseRegistrationCopySettings(
+  vtkImageRegistration *from, vtkImageRegistration *to)
+{
+  to->SetOptimizerType(from->GetOptimizerType());
+  to->SetMetricType(from->GetMetricType());
+  to->SetInterpolatorType(from->GetInterpolatorType());
+  to->SetTransformType(from->GetTransformType());
+  to->SetTransformDimensionality(from->GetTransformDimensionality());
+  to->SetInitializerType(from->GetInitializerType());
+  to->SetGridSearchRange(from->GetGridSearchRange());
+  to->SetGridSearchStep(from->GetGridSearchStep());
+  to->SetGridSearchFlips(from->GetGridSearchFlips());
+  to->SetJointHistogramSize(from->GetJointHistogramSize());
+  to->SetSourceImageRange(from->GetSourceImageRange());
+  to->SetTargetImageRange(from->GetTargetImageRange());
+  to->SetCompactStorage(from->GetCompactStorage());
+  to->SetSampleFraction(from->GetSampleFraction());
+  to->SetUseSampleBuffer(from->GetUseSampleBuffer());
+  to->SetSampleTileSize(from->GetSampleTileSize());
+  to->SetMaximumNumberOfSamples(from->GetMaximumNumberOfSamples());
+  to->SetProgressiveFidelity(from->GetProgressiveFidelity());
+  to->SetAutomaticParameterScales(from->GetAutomaticParameterScales());
+  to->SetMetricTolerance(from->GetMetricTolerance());
+  to->SetTransformTolerance(from->GetTransformTolerance());
+  to->SetMaximumNumberOfIterations(from->GetMaximumNumberOfIterations());
+  to->SetTimeLimit(from->GetTimeLimit());
+}
+
+//----------------------------------------------------------------------------
+// The data that is shared by all of the threads
+struct vtkImagePiecewiseRegistrationThreadStruct
+{
+  vtkImagePiecewiseRegistrationRegion *Regions;
+  int NumberOfRegions;
+  int NextRegion;
+  vtkMutexLock *Lock;
+  vtkImageRegistration *Settings;
+  vtkMatrix4x4 *Matrix;
+  int ThreadsPerRegistration;
+};
+
+//----------------------------------------------------------------------------
+// Register one label: find its largest connected region, make a stencil
+// from it, and register the cropped source to the cropped target.
+void vtkImagePiecewiseRegistrationExecuteRegion(
+  vtkImagePiecewiseRegistrationThreadStruct *ts,
+  vtkImagePiecewiseRegistrationRegion *region)
+{
+  vtkImageConnectivityFilter *connectivity =
+    vtkImageConnectivityFilter::New();
+  connectivity->SET_INPUT_DATA(region->Labels);
+  connectivity->SetScalarRange(region->Label, region->Label);
+  connectivity->SetExtractionModeToLargestRegion();
+  connectivity->SetLabelModeToConstantValue();
+  connectivity->SetLabelConstantValue(1);
+  connectivity->SetLabelScalarTypeToUnsignedChar();
+  connectivity->GenerateRegionExtentsOn();
+  connectivity->Update();
+
+  if (connectivity->GetNumberOfExtractedRegions() == 0)
+    {
+    connectivity->Delete();
+    return;
+    }
+
+  vtkImageStencilData *stencil = vtkImageStencilData::New();
+  vtkImagePiecewiseRegistrationStencil(
+    connectivity->GetOutput(),
+    connectivity->GetExtractedRegionExtents()->GetPointer(0), stencil);
+  connectivity->Delete();
+
+  vtkImageRegistration *registration = vtkImageRegistration::New();
+  vtkImagePiecewiseRegistrationCopySettings(ts->Settings, registration);
+  registration->SetNumberOfThreads(ts->ThreadsPerRegistration);
+  registration->SetSourceImage(region->Source);
+  registration->SetTargetImage(region->Target);
+  registration->SetSourceImageStencil(stencil);
+  registration->Initialize(ts->Matrix);
+  while (registration->Iterate())
+    {
+    // iterate until convergence or failure
+    }
+
+  region->Transform->SetMatrix(registration->GetTransform()->GetMatrix());
+  region->MetricValue = registration->GetMetricValue();
+  region->Converged = registration->GetConverged();
+
+  registration->Delete();
+  stencil->Delete();
+}
+
+//----------------------------------------------------------------------------
+// Each thread takes the next label that has not been done yet
+VTK_THREAD_RETURN_TYPE vtkImagePiecewiseRegistrationThreadedExecute(
+  void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  vtkImagePiecewiseRegistrationThreadStruct *ts =
+    static_cast<vtkImagePiecewiseRegistrationThreadStruct *>(ti->UserData);
+
+  for (;;)
+    {
+    ts->Lock->Lock();
+    int n = ts->NextRegion++;
+    ts->Lock->Unlock();
+    if (n >= ts->NumberOfRegions)
+      {
+      break;
+      }
+
+    vtkImagePiecewiseRegistrationRegion *region = &ts->Regions[n];
+    if (region->Target)
+      {
+      vtkImagePiecewiseRegistrationExecuteRegion(ts, region);
+      }
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+} // end anonymous namespace
+
+//----------------------------------------------------------------------------
+void vtkImagePiecewiseRegistration::FindLabels()
+{
+  vtkImageData *image = this->LabelImage;
+  int extent[6];
+  image->GetExtent(extent);
+  void *inPtr = image->GetScalarPointerForExtent(extent);
+
+  std::vector<int> labels;
+  std::vector<int> extents;
+  switch (image->GetScalarType())
+    {
+    vtkTemplateAliasMacro(
+      vtkImagePiecewiseRegistrationFindLabels(
+        image, static_cast<VTK_TT *>(inPtr), &labels, &extents));
+    default:
+      vtkErrorMacro("FindLabels: Unknown ScalarType");
+      return;
+    }
+
+  this->NumberOfRegions = static_cast<int>(labels.size());
+  this->Regions =
+    new vtkImagePiecewiseRegistrationRegion[this->NumberOfRegions];
+  for (int i = 0; i < this->NumberOfRegions; i++)
+    {
+    this->Regions[i].Label = labels[i];
+    for (int j = 0; j < 6; j++)
+      {
+      this->Regions[i].Extent[j] = extents[6*i + j];
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+int vtkImagePiecewiseRegistration::Register(vtkMatrix4x4 *matrix)
+{
+  this->ClearRegions();
+
+  if (this->SourceImage == NULL || this->TargetImage == NULL ||
+      this->LabelImage == NULL)
+    {
+    vtkErrorMacro("Register: The source, target, and label images "
+                  "must be set");
+    return 0;
+    }
+
+  int sourceExtent[6], labelExtent[6];
+  double sourceOrigin[3], labelOrigin[3];
+  double sourceSpacing[3], labelSpacing[3];
+  this->SourceImage->GetExtent(sourceExtent);
+  this->SourceImage->GetOrigin(sourceOrigin);
+  this->SourceImage->GetSpacing(sourceSpacing);
+  this->LabelImage->GetExtent(labelExtent);
+  this->LabelImage->GetOrigin(labelOrigin);
+  this->LabelImage->GetSpacing(labelSpacing);
+  for (int i = 0; i < 3; i++)
+    {
+    if (sourceExtent[2*i] != labelExtent[2*i] ||
+        sourceExtent[2*i + 1] != labelExtent[2*i + 1] ||
+        fabs(sourceOrigin[i] - labelOrigin[i]) > 1e-3*fabs(sourceSpacing[i]) ||
+        fabs(sourceSpacing[i] - labelSpacing[i]) > 1e-6*fabs(sourceSpacing[i]))
+      {
+      vtkErrorMacro("Register: The label image must have the same "
+                    "extent, origin, and spacing as the source image");
+      return 0;
+      }
+    }
+
+  this->FindLabels();
+  if (this->NumberOfRegions == 0)
+    {
+    this->Modified();
+    return 0;
+    }
+
+  vtkMatrix4x4 *initialMatrix = vtkMatrix4x4::New();
+  if (matrix)
+    {
+    initialMatrix->DeepCopy(matrix);
+    }
+
+  // crop the images for each label, in this thread, so that the worker
+  // threads never share any pipeline or data with each other
+  for (int n = 0; n < this->NumberOfRegions; n++)
+    {
+    vtkImagePiecewiseRegistrationRegion *region = &this->Regions[n];
+    region->Transform = vtkTransform::New();
+    region->Transform->SetMatrix(initialMatrix);
+
+    int *targetExtent = region->TargetExtent;
+    if (vtkImagePiecewiseRegistrationTargetExtent(
+          this->SourceImage, region->Extent, initialMatrix,
+          this->CropMargin, this->TargetImage, targetExtent))
+      {
+      region->Source = vtkImagePiecewiseRegistrationCrop(
+        this->SourceImage, region->Extent);
+      region->Labels = vtkImagePiecewiseRegistrationCrop(
+        this->LabelImage, region->Extent);
+      region->Target = vtkImagePiecewiseRegistrationCrop(
+        this->TargetImage, targetExtent);
+      }
+    else
+      {
+      for (int i = 0; i < 6; i++)
+        {
+        targetExtent[i] = -(i & 1);
+        }
+      }
+    }
+
+  // use the settings of the template registration, or the defaults
+  vtkImageRegistration *settings = this->Registration;
+  if (settings == NULL)
+    {
+    settings = vtkImageRegistration::New();
+    }
+  else
+    {
+    settings->Register(this);
+    }
+
+  // divide the threads among the concurrent registrations
+  int numJobs = this->NumberOfConcurrentRegistrations;
+  numJobs = (numJobs < this->NumberOfRegions ?
+             numJobs : this->NumberOfRegions);
+  int numThreads = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+
+  vtkImagePiecewiseRegistrationThreadStruct ts;
+  ts.Regions = this->Regions;
+  ts.NumberOfRegions = this->NumberOfRegions;
+  ts.NextRegion = 0;
+  ts.Lock = vtkMutexLock::New();
+  ts.Settings = settings;
+  ts.Matrix = initialMatrix;
+  ts.ThreadsPerRegistration =
+    (numThreads > numJobs ? numThreads/numJobs : 1);
+
+  vtkMultiThreader *threader = vtkMultiThreader::New();
+  threader->SetNumberOfThreads(numJobs);
+  threader->SetSingleMethod(
+    vtkImagePiecewiseRegistrationThreadedExecute, &ts);
+  threader->SingleMethodExecute();
+  threader->Delete();
+
+  ts.Lock->Delete();
+  settings->UnRegister(this);
+  initialMatrix->Delete();
+
+  // the cropped images are not needed any more
+  int numConverged = 0;
+  for (int n = 0; n < this->NumberOfRegions; n++)
+    {
+    vtkImagePiecewiseRegistrationRegion *region = &this->Regions[n];
+    if (region->Source) { region->Source->Delete(); }
+    if (region->Target) { region->Target->Delete(); }
+    if (region->Labels) { region->Labels->Delete(); }
+    region->Source = NULL;
+    region->Target = NULL;
+    region->Labels = NULL;
+    numConverged += (region->Converged != 0);
+    }
+
+  this->Modified();
+  return numConverged;
+}
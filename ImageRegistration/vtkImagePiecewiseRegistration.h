@@ -0,0 +1,166 @@
+/*=========================================================================
+  Program:   Atamai Image Registration and Segmentation
+  Module:    vtkImagePiecewiseRegistration.h
+
+  Copyright (c) 2014 David Gobbi
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+
+  * Neither the name of the Calgary Image Processing and Analysis Centre
+    (CIPAC), the University of Calgary, nor the names of any authors nor
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+=========================================================================*/
+// .NAME vtkImagePiecewiseRegistration - register each labeled part separately
+// .SECTION Description
+// vtkImagePiecewiseRegistration does an independent registration for each
+// labeled structure in a source image, e.g. for each vertebra of a spine
+// or for each bone of a joint.  The label image must have the same
+// geometry as the source image.  For each label, the largest connected
+// region with that label is found with vtkImageConnectivityFilter, and
+// its region extent and its voxels are used to build a stencil for the
+// source.  The source is cropped to the extent of the label, and the
+// target is cropped to the same region after it has been mapped through
+// the initial transform and padded by the CropMargin.  The resulting
+// small registrations are run concurrently, and one transform is
+// produced for each label.  The settings for the registrations, such as
+// the metric and the optimizer, are copied from a vtkImageRegistration
+// that is given as a template.
+// .SECTION See also
+// vtkImageRegistration vtkImageConnectivityFilter
+
+#ifndef __vtkImagePiecewiseRegistration_h
+#define __vtkImagePiecewiseRegistration_h
+
+#include "vtkObject.h"
+
+class vtkImageData;
+class vtkImageRegistration;
+class vtkLinearTransform;
+class vtkMatrix4x4;
+struct vtkImagePiecewiseRegistrationRegion;
+
+class VTK_EXPORT vtkImagePiecewiseRegistration : public vtkObject
+{
+public:
+  static vtkImagePiecewiseRegistration *New();
+  vtkTypeMacro(vtkImagePiecewiseRegistration, vtkObject);
+  virtual void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // The source image, the target image, and the label image.  The label
+  // image must have the same extent, origin, and spacing as the source,
+  // and every label other than zero is registered.
+  virtual void SetSourceImage(vtkImageData *image);
+  vtkGetObjectMacro(SourceImage, vtkImageData);
+  virtual void SetTargetImage(vtkImageData *image);
+  vtkGetObjectMacro(TargetImage, vtkImageData);
+  virtual void SetLabelImage(vtkImageData *image);
+  vtkGetObjectMacro(LabelImage, vtkImageData);
+
+  // Description:
+  // A registration whose settings will be used for every label.  Its
+  // inputs are ignored.  The InitializerType should usually be None,
+  // so that every label starts from the initial matrix.  If this is not
+  // set, then the vtkImageRegistration defaults are used.
+  virtual void SetRegistration(vtkImageRegistration *registration);
+  vtkGetObjectMacro(Registration, vtkImageRegistration);
+
+  // Description:
+  // The distance, in physical units, by which the target is padded
+  // around each labeled region after it has been mapped through the
+  // initial transform.  This must be larger than the motion that is
+  // expected for each part.  The default is 20.
+  vtkSetMacro(CropMargin, double);
+  vtkGetMacro(CropMargin, double);
+
+  // Description:
+  // The number of registrations to run at the same time.  The threads
+  // are divided evenly among them.  The default is the number of
+  // processors.
+  vtkSetClampMacro(NumberOfConcurrentRegistrations, int, 1, VTK_INT_MAX);
+  vtkGetMacro(NumberOfConcurrentRegistrations, int);
+
+  // Description:
+  // Do the registrations, starting from the given matrix, which maps
+  // source coordinates to target coordinates.  If the matrix is NULL,
+  // then the identity matrix is used.  Returns the number of labels for
+  // which the registration converged.
+  int Register(vtkMatrix4x4 *matrix);
+
+  // Description:
+  // Get the number of labels that were found.
+  int GetNumberOfLabels();
+
+  // Description:
+  // Get the label value, the transform, the final metric value, and
+  // whether the registration converged, for the label at index n.  The
+  // transform is the initial transform if the label's region was empty
+  // or if it did not overlap the target.
+  int GetLabel(int n);
+  vtkLinearTransform *GetTransform(int n);
+  double GetMetricValue(int n);
+  int GetConverged(int n);
+
+  // Description:
+  // Get the extent to which the source and label images were cropped
+  // for the label at index n, and the extent to which the target image
+  // was cropped.  The target extent is empty if it did not overlap.
+  void GetSourceExtent(int n, int extent[6]);
+  void GetTargetExtent(int n, int extent[6]);
+
+  // Description:
+  // Get the transform for the given label value, or NULL if there is no
+  // such label.
+  vtkLinearTransform *GetTransformForLabel(int label);
+
+protected:
+  vtkImagePiecewiseRegistration();
+  ~vtkImagePiecewiseRegistration();
+
+  // Description:
+  // Find the labels and the extent of each label.
+  void FindLabels();
+
+  // Description:
+  // Free the regions from the previous call to Register().
+  void ClearRegions();
+
+  vtkImageData *SourceImage;
+  vtkImageData *TargetImage;
+  vtkImageData *LabelImage;
+  vtkImageRegistration *Registration;
+  double CropMargin;
+  int NumberOfConcurrentRegistrations;
+
+  int NumberOfRegions;
+  vtkImagePiecewiseRegistrationRegion *Regions;
+
+private:
+  vtkImagePiecewiseRegistration(const vtkImagePiecewiseRegistration&);  // Not implemented.
+  void operator=(const vtkImagePiecewiseRegistration&);  // Not implemented.
+};
+
+#endif
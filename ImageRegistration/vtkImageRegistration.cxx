@@ -37,6 +37,7 @@ POSSIBILITY OF SUCH DAMAGES.
 =========================================================================*/
 
 #include "vtkImageRegistration.h"
+#include "vtkImageRegistrationTarget.h"
 
 // VTK header files
 #include "vtkTimerLog.h"
@@ -48,6 +49,8 @@ POSSIBILITY OF SUCH DAMAGES.
 #include "vtkMatrixToLinearTransform.h"
 #include "vtkMatrix4x4.h"
 #include "vtkImageReslice.h"
+#include "vtkImageInterpolator.h"
+#include "vtkMultiThreader.h"
 #include "vtkImageShiftScale.h"
 #include "vtkCommand.h"
 #include "vtkPointData.h"
@@ -55,10 +58,13 @@ POSSIBILITY OF SUCH DAMAGES.
 #include "vtkInformation.h"
 #include "vtkInformationVector.h"
 #include "vtkStreamingDemandDrivenPipeline.h"
-#include "vtkAmoebaMinimizer.h"
 #include "vtkPowellMinimizer.h"
+#include "vtkSimplexMinimizer.h"
+#include "vtkCMAESMinimizer.h"
+#include "vtkTrustRegionMinimizer.h"
 #include "vtkImageHistogramStatistics.h"
-#include "vtkImageBSplineCoefficients.h"
+#include "vtkIdTypeArray.h"
+#include "vtkTemplateAliasMacro.h"
 #include "vtkImageBSplineInterpolator.h"
 #include "vtkImageSincInterpolator.h"
 #include "vtkLabelInterpolator.h"
@@ -70,10 +76,24 @@ POSSIBILITY OF SUCH DAMAGES.
 #include "vtkImageCorrelationRatio.h"
 #include "vtkImageCrossCorrelation.h"
 #include "vtkImageNeighborhoodCorrelation.h"
+#include "vtkImageSampleBuffer.h"
+#include "vtkCalcCentroid.h"
 
 // C header files
 #include <math.h>
 
+// C++ header files
+#include <algorithm>
+#include <vector>
+
+// The cancel flag is atomic if the compiler supports it
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1700)
+#include <atomic>
+typedef std::atomic<int> vtkImageRegistrationFlag;
+#else
+typedef volatile int vtkImageRegistrationFlag;
+#endif
+
 // A macro to assist VTK 5 backwards compatibility
 #if VTK_MAJOR_VERSION >= 6
 #define SET_INPUT_DATA SetInputData
@@ -83,6 +103,11 @@ POSSIBILITY OF SUCH DAMAGES.
 #define SET_STENCIL_DATA SetStencil
 #endif
 
+// The output scalar type and scale of vtkImageReslice appeared in VTK 6.2
+#if VTK_MAJOR_VERSION > 6 || (VTK_MAJOR_VERSION == 6 && VTK_MINOR_VERSION >= 2)
+#define VTK_RESLICE_HAS_OUTPUT_SCALAR_TYPE
+#endif
+
 // A helper class for the optimizer
 struct vtkImageRegistrationInfo
 {
@@ -99,6 +124,56 @@ struct vtkImageRegistrationInfo
   double Center[3];
 
   int NumberOfEvaluations;
+
+  // A small cache of metric values, keyed on the parameters after they
+  // have been quantized with CacheQuanta, to avoid repeated evaluations
+  std::vector<double> CacheQuanta;
+  std::vector<double> CacheKeys;
+  std::vector<double> CacheValues;
+  int CacheNext;
+  int NumberOfCacheHits;
+
+  // Adjustments to the parameter scales, from CalibrateParameterScales
+  std::vector<double> ScaleFactors;
+
+  // The time (from vtkTimerLog) at which to stop computing the metric,
+  // a flag that can be set from any thread to stop the computation,
+  // and the best full fidelity value that has been computed so far
+  double Deadline;
+  vtkImageRegistrationFlag Cancelled;
+  bool Stopped;
+  double BestValue;
+  std::vector<double> BestParameters;
+
+  // The optimizer can ask for a lower fidelity, in which case only
+  // every 2^FidelityLevel rows of the sample buffer are used
+  int FidelityLevel;
+
+  // For computing the metric directly from the sample buffer
+  vtkAbstractImageInterpolator *Interpolator;
+  vtkImageSampleBuffer *SampleBuffer;
+  vtkMultiThreader *Threader;
+  double SourceMatrix[16];
+  double TargetMatrix[16];
+  double TargetScale;
+  vtkImageStencilData *TargetStencil;
+  double StencilScale[3];
+  double StencilOffset[3];
+  int NumberOfBins[2];
+  double BinOrigin[2];
+  double BinSpacing[2];
+
+  // For a source that is a single slice, the index bounds of the target
+  // that are safely within the interpolator's bounds
+  bool SourceIsSlice;
+  double TargetBounds[6];
+
+  // The source extent and the bins that were used for the sample buffer,
+  // so that InitializeNextSlice() can rebuild the buffer the same way
+  int SourceExtent[6];
+  bool SourceQuantized;
+  double SampleBinOrigin;
+  double SampleBinSpacing;
 };
 
 //----------------------------------------------------------------------------
@@ -126,6 +201,7 @@ vtkImageRegistration::vtkImageRegistration()
   this->TransformType = vtkImageRegistration::Rigid;
   this->InitializerType = vtkImageRegistration::None;
   this->TransformDimensionality = 3;
+  this->CompactStorage = 0;
 
   this->Transform = vtkTransform::New();
   this->Metric = NULL;
@@ -142,6 +218,22 @@ vtkImageRegistration::vtkImageRegistration()
   this->RegistrationInfo->OptimizerType = 0;
   this->RegistrationInfo->MetricType = 0;
   this->RegistrationInfo->NumberOfEvaluations = 0;
+  this->RegistrationInfo->CacheNext = 0;
+  this->RegistrationInfo->NumberOfCacheHits = 0;
+  this->RegistrationInfo->FidelityLevel = 0;
+  this->RegistrationInfo->Deadline = 0.0;
+  this->RegistrationInfo->Cancelled = 0;
+  this->RegistrationInfo->Stopped = false;
+  this->RegistrationInfo->BestValue = VTK_DOUBLE_MAX;
+  this->RegistrationInfo->Interpolator = NULL;
+  this->RegistrationInfo->SampleBuffer = NULL;
+  this->RegistrationInfo->Threader = vtkMultiThreader::New();
+  this->RegistrationInfo->TargetScale = 1.0;
+  this->RegistrationInfo->TargetStencil = NULL;
+  this->RegistrationInfo->NumberOfBins[0] = 0;
+  this->RegistrationInfo->NumberOfBins[1] = 0;
+  this->RegistrationInfo->SourceIsSlice = false;
+  this->RegistrationInfo->SourceQuantized = false;
 
   this->JointHistogramSize[0] = 64;
   this->JointHistogramSize[1] = 64;
@@ -152,18 +244,33 @@ vtkImageRegistration::vtkImageRegistration()
 
   this->InitialTransformMatrix = vtkMatrix4x4::New();
   this->ImageReslice = vtkImageReslice::New();
-  this->ImageBSpline = vtkImageBSplineCoefficients::New();
+  this->PreparedTarget = NULL;
+  this->InternalTarget = vtkImageRegistrationTarget::New();
   this->TargetImageTypecast = vtkImageShiftScale::New();
   this->SourceImageTypecast = vtkImageShiftScale::New();
+  this->SampleBuffer = vtkImageSampleBuffer::New();
+  this->SampleFraction = 1.0;
+  this->UseSampleBuffer = 1;
+  this->SampleTileSize = 0;
+  this->MaximumNumberOfSamples = 0;
+  this->AutomaticSourceStencil = 0;
+  this->ProgressiveFidelity = 0;
+  this->AutomaticParameterScales = 0;
+  this->GridSearchRange = 90.0;
+  this->GridSearchStep = 30.0;
+  this->GridSearchFlips = 0;
+  this->ForegroundStencil = NULL;
 
   this->MetricValue = 0.0;
 
   this->MetricTolerance = 1e-4;
   this->TransformTolerance = 1e-1;
   this->MaximumNumberOfIterations = 500;
+  this->TimeLimit = 0.0;
+  this->Converged = 0;
 
-  // we have the image inputs and the optional stencil input
-  this->SetNumberOfInputPorts(3);
+  // we have the image inputs and the optional stencil inputs
+  this->SetNumberOfInputPorts(4);
   this->SetNumberOfOutputPorts(0);
 }
 
@@ -179,10 +286,6 @@ vtkImageRegistration::~vtkImageRegistration()
     {
     this->Metric->Delete();
     }
-  if (this->Interpolator)
-    {
-    this->Interpolator->Delete();
-    }
   if (this->Transform)
     {
     this->Transform->Delete();
@@ -190,6 +293,7 @@ vtkImageRegistration::~vtkImageRegistration()
 
   if (this->RegistrationInfo)
     {
+    this->RegistrationInfo->Threader->Delete();
     delete this->RegistrationInfo;
     }
 
@@ -209,9 +313,21 @@ vtkImageRegistration::~vtkImageRegistration()
     {
     this->TargetImageTypecast->Delete();
     }
-  if (this->ImageBSpline)
+  if (this->PreparedTarget)
+    {
+    this->PreparedTarget->UnRegister(this);
+    }
+  if (this->InternalTarget)
+    {
+    this->InternalTarget->Delete();
+    }
+  if (this->SampleBuffer)
+    {
+    this->SampleBuffer->Delete();
+    }
+  if (this->ForegroundStencil)
     {
-    this->ImageBSpline->Delete();
+    this->ForegroundStencil->Delete();
     }
 }
 
@@ -227,19 +343,42 @@ void vtkImageRegistration::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "TransformDimensionality: "
      << this->TransformDimensionality << "\n";
   os << indent << "InitializerType: " << this->InitializerType << "\n";
+  os << indent << "GridSearchRange: " << this->GridSearchRange << "\n";
+  os << indent << "GridSearchStep: " << this->GridSearchStep << "\n";
+  os << indent << "GridSearchFlips: "
+     << (this->GridSearchFlips ? "On\n" : "Off\n");
+  os << indent << "CompactStorage: "
+     << (this->CompactStorage ? "On\n" : "Off\n");
   os << indent << "MetricTolerance: " << this->MetricTolerance << "\n";
   os << indent << "TransformTolerance: " << this->TransformTolerance << "\n";
+  os << indent << "SampleFraction: " << this->SampleFraction << "\n";
+  os << indent << "UseSampleBuffer: "
+     << (this->UseSampleBuffer ? "On\n" : "Off\n");
+  os << indent << "SampleTileSize: " << this->SampleTileSize << "\n";
+  os << indent << "MaximumNumberOfSamples: "
+     << this->MaximumNumberOfSamples << "\n";
+  os << indent << "AutomaticSourceStencil: "
+     << (this->AutomaticSourceStencil ? "On\n" : "Off\n");
+  os << indent << "ProgressiveFidelity: "
+     << (this->ProgressiveFidelity ? "On\n" : "Off\n");
+  os << indent << "AutomaticParameterScales: "
+     << (this->AutomaticParameterScales ? "On\n" : "Off\n");
   os << indent << "MaximumNumberOfIterations: "
      << this->MaximumNumberOfIterations << "\n";
+  os << indent << "TimeLimit: " << this->TimeLimit << "\n";
+  os << indent << "Converged: " << this->Converged << "\n";
   os << indent << "JointHistogramSize: " << this->JointHistogramSize[0] << " "
      << this->JointHistogramSize[1] << "\n";
   os << indent << "SourceImageRange: " << this->SourceImageRange[0] << " "
      << this->SourceImageRange[1] << "\n";
   os << indent << "TargetImageRange: " << this->TargetImageRange[0] << " "
      << this->TargetImageRange[1] << "\n";
+  os << indent << "PreparedTarget: " << this->PreparedTarget << "\n";
   os << indent << "MetricValue: " << this->MetricValue << "\n";
   os << indent << "NumberOfEvaluations: "
      << this->RegistrationInfo->NumberOfEvaluations << "\n";
+  os << indent << "NumberOfCacheHits: "
+     << this->RegistrationInfo->NumberOfCacheHits << "\n";
 }
 
 //----------------------------------------------------------------------------
@@ -248,6 +387,56 @@ int vtkImageRegistration::GetNumberOfEvaluations()
   return this->RegistrationInfo->NumberOfEvaluations;
 }
 
+//----------------------------------------------------------------------------
+int vtkImageRegistration::GetNumberOfCacheHits()
+{
+  return this->RegistrationInfo->NumberOfCacheHits;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::Cancel()
+{
+  this->RegistrationInfo->Cancelled = 1;
+  // vtkImageReslice checks for this after every row, and the member is
+  // set directly because the setter would call Modified()
+  this->ImageReslice->AbortExecute = 1;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::ResetCancel()
+{
+  this->RegistrationInfo->Cancelled = 0;
+  this->ImageReslice->AbortExecute = 0;
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistration::GetCancelled()
+{
+  return this->RegistrationInfo->Cancelled;
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::SetNumberOfThreads(int n)
+{
+  if (n != this->RegistrationInfo->Threader->GetNumberOfThreads())
+    {
+    this->RegistrationInfo->Threader->SetNumberOfThreads(n);
+    this->Modified();
+    }
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistration::GetNumberOfThreads()
+{
+  return this->RegistrationInfo->Threader->GetNumberOfThreads();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::ResetParameterScales()
+{
+  this->RegistrationInfo->ScaleFactors.clear();
+}
+
 //----------------------------------------------------------------------------
 void vtkImageRegistration::SetTargetImage(vtkImageData *input)
 {
@@ -313,6 +502,51 @@ vtkImageStencilData* vtkImageRegistration::GetSourceImageStencil()
     this->GetExecutive()->GetInputData(2, 0));
 }
 
+//----------------------------------------------------------------------------
+void vtkImageRegistration::SetTargetImageStencil(vtkImageStencilData *stencil)
+{
+  // if stencil is null, then set the input port to null
+#if VTK_MAJOR_VERSION >= 6
+  this->SetInputDataInternal(3, stencil);
+#else
+  this->SetNthInputConnection(3, 0,
+    (stencil ? stencil->GetProducerPort() : 0));
+#endif
+}
+
+//----------------------------------------------------------------------------
+vtkImageStencilData* vtkImageRegistration::GetTargetImageStencil()
+{
+  if (this->GetNumberOfInputConnections(3) < 1)
+    {
+    return NULL;
+    }
+  return vtkImageStencilData::SafeDownCast(
+    this->GetExecutive()->GetInputData(3, 0));
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistration::SetPreparedTarget(
+  vtkImageRegistrationTarget *target)
+{
+  if (target != this->PreparedTarget)
+    {
+    // the interpolator belongs to the old target
+    this->Interpolator = NULL;
+    this->RegistrationInfo->Interpolator = NULL;
+    if (this->PreparedTarget)
+      {
+      this->PreparedTarget->UnRegister(this);
+      }
+    if (target)
+      {
+      target->Register(this);
+      }
+    this->PreparedTarget = target;
+    this->Modified();
+    }
+}
+
 //--------------------------------------------------------------------------
 namespace {
 
@@ -371,24 +605,24 @@ void vtkTransformRotation(
     }
 }
 
-void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
+//--------------------------------------------------------------------------
+// Build the transform from the given optimizer parameters
+void vtkSetTransformParameters(
+  vtkImageRegistrationInfo *registrationInfo, const double *parameters,
+  vtkTransform *transform)
 {
-  vtkPowellMinimizer* optimizer =
-    vtkPowellMinimizer::SafeDownCast(registrationInfo->Optimizer);
-  vtkTransform* transform =
-    vtkTransform::SafeDownCast(registrationInfo->Transform);
   vtkMatrix4x4 *initialMatrix = registrationInfo->InitialMatrix;
   int transformType = registrationInfo->TransformType;
   int transformDim = registrationInfo->TransformDimensionality;
 
   int pcount = 0;
 
-  double tx = optimizer->GetParameterValue(pcount++);
-  double ty = optimizer->GetParameterValue(pcount++);
+  double tx = parameters[pcount++];
+  double ty = parameters[pcount++];
   double tz = 0.0;
   if (transformDim > 2)
     {
-    tz = optimizer->GetParameterValue(pcount++);
+    tz = parameters[pcount++];
     }
 
   double rx = 0.0;
@@ -399,10 +633,10 @@ void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
     {
     if (transformDim > 2)
       {
-      rx = optimizer->GetParameterValue(pcount++);
-      ry = optimizer->GetParameterValue(pcount++);
+      rx = parameters[pcount++];
+      ry = parameters[pcount++];
       }
-    rz = optimizer->GetParameterValue(pcount++);
+    rz = parameters[pcount++];
     }
 
   double sx = 1.0;
@@ -411,7 +645,7 @@ void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
 
   if (transformType > vtkImageRegistration::Rigid)
     {
-    sx = exp(optimizer->GetParameterValue(pcount++));
+    sx = exp(parameters[pcount++]);
     sy = sx;
     if (transformDim > 2)
       {
@@ -423,9 +657,9 @@ void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
     {
     if (transformDim > 2)
       {
-      sx = sz*exp(optimizer->GetParameterValue(pcount++));
+      sx = sz*exp(parameters[pcount++]);
       }
-    sy = sz*exp(optimizer->GetParameterValue(pcount++));
+    sy = sz*exp(parameters[pcount++]);
     }
 
   bool scaledAtSource =
@@ -439,10 +673,10 @@ void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
     {
     if (transformDim > 2)
       {
-      qx = optimizer->GetParameterValue(pcount++);
-      qy = optimizer->GetParameterValue(pcount++);
+      qx = parameters[pcount++];
+      qy = parameters[pcount++];
       }
-    qz = optimizer->GetParameterValue(pcount++);
+    qz = parameters[pcount++];
     }
 
   double *center = registrationInfo->Center;
@@ -471,200 +705,1691 @@ void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
 }
 
 //--------------------------------------------------------------------------
-void vtkEvaluateFunction(void * arg)
+// Build the registration transform from the current optimizer parameters
+void vtkSetTransformParameters(vtkImageRegistrationInfo *registrationInfo)
 {
-  vtkImageRegistrationInfo *registrationInfo =
-    static_cast<vtkImageRegistrationInfo*>(arg);
-
-  double val = 0.0;
-
   vtkPowellMinimizer* optimizer =
     vtkPowellMinimizer::SafeDownCast(registrationInfo->Optimizer);
-  vtkImageMutualInformation *miMetric =
-    vtkImageMutualInformation::SafeDownCast(registrationInfo->Metric);
-  vtkImageCrossCorrelation *ccMetric =
-    vtkImageCrossCorrelation::SafeDownCast(registrationInfo->Metric);
-  vtkImageSquaredDifference *sdMetric =
-    vtkImageSquaredDifference::SafeDownCast(registrationInfo->Metric);
-  vtkImageNeighborhoodCorrelation *ncMetric =
-    vtkImageNeighborhoodCorrelation::SafeDownCast(registrationInfo->Metric);
-  vtkImageCorrelationRatio *crMetric =
-    vtkImageCorrelationRatio::SafeDownCast(registrationInfo->Metric);
-
-  vtkSetTransformParameters(registrationInfo);
-
-  registrationInfo->Metric->Update();
+  vtkTransform* transform =
+    vtkTransform::SafeDownCast(registrationInfo->Transform);
 
-  switch (registrationInfo->MetricType)
+  int n = optimizer->GetNumberOfParameters();
+  std::vector<double> parameters(n > 0 ? n : 1);
+  for (int i = 0; i < n; i++)
     {
-    case vtkImageRegistration::SquaredDifference:
-      val = sdMetric->GetSquaredDifference();
-      break;
-    case vtkImageRegistration::CrossCorrelation:
-      val = - ccMetric->GetCrossCorrelation();
-      break;
-    case vtkImageRegistration::NormalizedCrossCorrelation:
-      val = - ccMetric->GetNormalizedCrossCorrelation();
-      break;
-    case vtkImageRegistration::NeighborhoodCorrelation:
-      val = ncMetric->GetValueToMinimize();
-      break;
-    case vtkImageRegistration::CorrelationRatio:
-      val = - crMetric->GetCorrelationRatio();
-      break;
-    case vtkImageRegistration::MutualInformation:
-      val = - miMetric->GetMutualInformation();
-      break;
-    case vtkImageRegistration::NormalizedMutualInformation:
-      val = - miMetric->GetNormalizedMutualInformation();
-      break;
+    parameters[i] = optimizer->GetParameterValue(i);
     }
 
-  optimizer->SetFunctionValue(val);
-
-  registrationInfo->NumberOfEvaluations++;
+  vtkSetTransformParameters(registrationInfo, &parameters[0], transform);
 }
 
-} // end anonymous namespace
-
 //--------------------------------------------------------------------------
-void vtkImageRegistration::ComputeImageRange(
-  vtkImageData *data, vtkImageStencilData *stencil, double range[2])
+// Accumulators for computing the metrics from the sample buffer.  Each
+// one is called with the source value, the source bin, and the target
+// value for every sample that maps to a point within the target image.
+
+struct vtkSquaredDifferenceAccumulator
 {
-  vtkImageHistogramStatistics *hist =
-    vtkImageHistogramStatistics::New();
-  hist->SET_STENCIL_DATA(stencil);
-  hist->SET_INPUT_DATA(data);
-  hist->SetActiveComponent(0);
-  hist->Update();
+  double *Sums;
+
+  void operator()(double x, int, double y)
+  {
+    double d = y - x;
+    this->Sums[0] += d*d;
+    this->Sums[1]++;
+  }
+};
 
-  range[0] = hist->GetMinimum();
-  range[1] = hist->GetMaximum();
+struct vtkCrossCorrelationAccumulator
+{
+  double *Sums;
+
+  void operator()(double x, int, double y)
+  {
+    this->Sums[0] += x;
+    this->Sums[1] += y;
+    this->Sums[2] += x*x;
+    this->Sums[3] += y*y;
+    this->Sums[4] += x*y;
+    this->Sums[5]++;
+  }
+};
 
-  if (range[0] >= range[1])
-    {
-    range[1] = range[0] + 1.0;
-    }
+struct vtkCorrelationRatioAccumulator
+{
+  double *Sums;
+
+  void operator()(double, int xi, double y)
+  {
+    double *sums = this->Sums + 3*xi;
+    sums[0]++;
+    sums[1] += y;
+    sums[2] += y*y;
+  }
+};
 
-  hist->SET_INPUT_DATA(NULL);
-  hist->Delete();
-}
+struct vtkMutualInformationAccumulator
+{
+  double *Sums;
+  int XSize;
+  double YShift;
+  double YScale;
+  double YMax;
+
+  void operator()(double, int xi, double y)
+  {
+    y += this->YShift;
+    y *= this->YScale;
+    y = (y > 0 ? y : 0);
+    y = (y < this->YMax ? y : this->YMax);
+    int yi = static_cast<int>(y + 0.5);
+    this->Sums[yi*this->XSize + xi]++;
+  }
+};
 
 //--------------------------------------------------------------------------
-void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
+// A version of vtkImageRegistrationSampleRows for a source that is a
+// single slice.  Every row lies in the same plane, so the plane origin
+// is computed once and each row start is a step along j from it.  For
+// each row, the range of i that maps to within the target bounds is
+// found by clipping the row against the bounds, so that the samples in
+// that range can skip the bounds check.
+template<class F>
+void vtkImageRegistrationSamplePlane(
+  vtkImageRegistrationInfo *info, const double *matrix,
+  vtkIdType rowBegin, vtkIdType rowEnd, F &accumulator)
 {
-  // update our inputs
-  this->Update();
-
-  int transformDim = this->TransformDimensionality;
-  if (transformDim < 2) { transformDim = 2; }
-  if (transformDim > 3) { transformDim = 3; }
-
-  vtkImageData *targetImage = this->GetTargetImage();
-  vtkImageData *sourceImage = this->GetSourceImage();
-
-  if (targetImage == NULL || sourceImage == NULL)
+  vtkImageSampleBuffer *buffer = info->SampleBuffer;
+  vtkAbstractImageInterpolator *interpolator = info->Interpolator;
+  vtkImageStencilData *stencil = info->TargetStencil;
+  const double *bounds = info->TargetBounds;
+  double scale = info->TargetScale;
+
+  const int *rowJ = buffer->GetRowJ();
+  const int *rowK = buffer->GetRowK();
+  const vtkIdType *rowStart = buffer->GetRowStart();
+  const int *sampleI = buffer->GetSampleI();
+  const float *sampleValue = buffer->GetSampleValue();
+  const unsigned short *sampleBin = buffer->GetSampleBin();
+
+  vtkIdType stride = (static_cast<vtkIdType>(1) << info->FidelityLevel);
+  rowBegin += (stride - rowBegin % stride) % stride;
+  if (rowBegin >= rowEnd)
     {
-    vtkErrorMacro("Initialize: Input images are not set");
     return;
     }
 
-  // get the source image center
-  double bounds[6];
-  double center[3];
-  double size[3];
-  sourceImage->GetBounds(bounds);
-  center[0] = 0.5*(bounds[0] + bounds[1]);
-  center[1] = 0.5*(bounds[2] + bounds[3]);
-  center[2] = 0.5*(bounds[4] + bounds[5]);
-  size[0] = (bounds[1] - bounds[0]);
-  size[1] = (bounds[3] - bounds[2]);
-  size[2] = (bounds[5] - bounds[4]);
-
-  vtkTransform *transform =
-    vtkTransform::SafeDownCast(this->Transform);
-  vtkMatrix4x4 *initialMatrix = this->InitialTransformMatrix;
+  // the plane origin, and the steps along i and j
+  double k = rowK[rowBegin];
+  double origin[3];
+  origin[0] = matrix[2]*k + matrix[3];
+  origin[1] = matrix[6]*k + matrix[7];
+  origin[2] = matrix[10]*k + matrix[11];
+  double stepI[3];
+  stepI[0] = matrix[0];
+  stepI[1] = matrix[4];
+  stepI[2] = matrix[8];
+
+  for (vtkIdType r = rowBegin; r < rowEnd; r += stride)
+    {
+    double j = rowJ[r];
+    double p0[3];
+    p0[0] = origin[0] + matrix[1]*j;
+    p0[1] = origin[1] + matrix[5]*j;
+    p0[2] = origin[2] + matrix[9]*j;
+
+    // clip the row against the target bounds
+    double iMin = -VTK_DOUBLE_MAX;
+    double iMax = VTK_DOUBLE_MAX;
+    for (int a = 0; a < 3; a++)
+      {
+      double lo = bounds[2*a] - p0[a];
+      double hi = bounds[2*a + 1] - p0[a];
+      if (stepI[a] > 0)
+        {
+        iMin = (iMin > lo/stepI[a] ? iMin : lo/stepI[a]);
+        iMax = (iMax < hi/stepI[a] ? iMax : hi/stepI[a]);
+        }
+      else if (stepI[a] < 0)
+        {
+        iMin = (iMin > hi/stepI[a] ? iMin : hi/stepI[a]);
+        iMax = (iMax < lo/stepI[a] ? iMax : lo/stepI[a]);
+        }
+      else if (lo > 0 || hi < 0)
+        {
+        iMin = VTK_DOUBLE_MAX;
+        iMax = -VTK_DOUBLE_MAX;
+        }
+      }
 
-  // create an initial transform
-  initialMatrix->Identity();
-  transform->Identity();
+    vtkIdType sEnd = rowStart[r + 1];
+    for (vtkIdType s = rowStart[r]; s < sEnd; s++)
+      {
+      double i = sampleI[s];
+      double point[3];
+      point[0] = p0[0] + stepI[0]*i;
+      point[1] = p0[1] + stepI[1]*i;
+      point[2] = p0[2] + stepI[2]*i;
+
+      if (stencil &&
+          !stencil->IsInside(
+            vtkMath::Floor(point[0]*info->StencilScale[0] +
+                           info->StencilOffset[0] + 0.5),
+            vtkMath::Floor(point[1]*info->StencilScale[1] +
+                           info->StencilOffset[1] + 0.5),
+            vtkMath::Floor(point[2]*info->StencilScale[2] +
+                           info->StencilOffset[2] + 0.5)))
+        {
+        continue;
+        }
 
-  // the initial translation
-  double tx = 0.0;
-  double ty = 0.0;
-  double tz = 0.0;
+      if ((i >= iMin && i <= iMax) || interpolator->CheckBoundsIJK(point))
+        {
+        double value;
+        interpolator->InterpolateIJK(point, &value);
+        accumulator(sampleValue[s], (sampleBin ? sampleBin[s] : 0),
+                    value*scale);
+        }
+      }
+    }
+}
 
-  // initialize from the supplied matrix
-  if (matrix)
+//--------------------------------------------------------------------------
+// Go through the rows of the sample buffer, map each sample into the
+// target image with the supplied matrix, and interpolate the target.
+template<class F>
+void vtkImageRegistrationSampleRows(
+  vtkImageRegistrationInfo *info, const double *matrix,
+  vtkIdType rowBegin, vtkIdType rowEnd, F &accumulator)
+{
+  if (info->SourceIsSlice)
     {
-    // move the translation into tx, ty, tz variables
-    tx = matrix->Element[0][3];
-    ty = matrix->Element[1][3];
-    tz = matrix->Element[2][3];
-
-    // move rotation/scale/shear into the InitialTransformMatrix
-    initialMatrix->DeepCopy(matrix);
-    initialMatrix->Element[0][3] = 0.0;
-    initialMatrix->Element[1][3] = 0.0;
-    initialMatrix->Element[2][3] = 0.0;
+    vtkImageRegistrationSamplePlane(
+      info, matrix, rowBegin, rowEnd, accumulator);
+    return;
+    }
 
-    // adjust the translation for the transform centering
-    double scenter[4];
-    scenter[0] = center[0];
-    scenter[1] = center[1];
-    scenter[2] = center[2];
-    scenter[3] = 1.0;
+  vtkImageSampleBuffer *buffer = info->SampleBuffer;
+  vtkAbstractImageInterpolator *interpolator = info->Interpolator;
+  vtkImageStencilData *stencil = info->TargetStencil;
+  double scale = info->TargetScale;
 
-    initialMatrix->MultiplyPoint(scenter, scenter);
+  const int *rowJ = buffer->GetRowJ();
+  const int *rowK = buffer->GetRowK();
+  const vtkIdType *rowStart = buffer->GetRowStart();
+  const int *sampleI = buffer->GetSampleI();
+  const float *sampleValue = buffer->GetSampleValue();
+  const unsigned short *sampleBin = buffer->GetSampleBin();
 
-    tx -= center[0] - scenter[0];
-    ty -= center[1] - scenter[1];
-    tz -= center[2] - scenter[2];
-    }
+  // at lower fidelity, only use the rows that are multiples of the stride
+  vtkIdType stride = (static_cast<vtkIdType>(1) << info->FidelityLevel);
+  rowBegin += (stride - rowBegin % stride) % stride;
 
-  if (this->InitializerType == vtkImageRegistration::Centered)
+  for (vtkIdType r = rowBegin; r < rowEnd; r += stride)
     {
-    // set an initial translation from one image center to the other image center
-    double tbounds[6];
-    double tcenter[3];
-    targetImage->GetBounds(tbounds);
-    tcenter[0] = 0.5*(tbounds[0] + tbounds[1]);
-    tcenter[1] = 0.5*(tbounds[2] + tbounds[3]);
-    tcenter[2] = 0.5*(tbounds[4] + tbounds[5]);
+    // the position of the start of the row
+    double j = rowJ[r];
+    double k = rowK[r];
+    double x0 = matrix[1]*j + matrix[2]*k + matrix[3];
+    double y0 = matrix[5]*j + matrix[6]*k + matrix[7];
+    double z0 = matrix[9]*j + matrix[10]*k + matrix[11];
+
+    vtkIdType sEnd = rowStart[r + 1];
+    for (vtkIdType s = rowStart[r]; s < sEnd; s++)
+      {
+      double i = sampleI[s];
+      double point[3];
+      point[0] = x0 + matrix[0]*i;
+      point[1] = y0 + matrix[4]*i;
+      point[2] = z0 + matrix[8]*i;
+
+      // skip points that are outside the target stencil
+      if (stencil &&
+          !stencil->IsInside(
+            vtkMath::Floor(point[0]*info->StencilScale[0] +
+                           info->StencilOffset[0] + 0.5),
+            vtkMath::Floor(point[1]*info->StencilScale[1] +
+                           info->StencilOffset[1] + 0.5),
+            vtkMath::Floor(point[2]*info->StencilScale[2] +
+                           info->StencilOffset[2] + 0.5)))
+        {
+        continue;
+        }
 
-    tx = tcenter[0] - center[0];
-    ty = tcenter[1] - center[1];
-    tz = tcenter[2] - center[2];
+      if (interpolator->CheckBoundsIJK(point))
+        {
+        double value;
+        interpolator->InterpolateIJK(point, &value);
+        accumulator(sampleValue[s], (sampleBin ? sampleBin[s] : 0),
+                    value*scale);
+        }
+      }
     }
+}
 
-  if (transformDim <= 2)
+//--------------------------------------------------------------------------
+// Get the number of partial sums that are needed for the metric
+vtkIdType vtkImageRegistrationSumSize(vtkImageRegistrationInfo *info)
+{
+  vtkIdType n = 0;
+
+  switch (info->MetricType)
     {
-    center[2] = 0.0;
-    tz = 0.0;
+    case vtkImageRegistration::SquaredDifference:
+      n = 2;
+      break;
+    case vtkImageRegistration::CrossCorrelation:
+    case vtkImageRegistration::NormalizedCrossCorrelation:
+      n = 6;
+      break;
+    case vtkImageRegistration::CorrelationRatio:
+      n = 3*static_cast<vtkIdType>(info->NumberOfBins[0]);
+      break;
+    case vtkImageRegistration::MutualInformation:
+    case vtkImageRegistration::NormalizedMutualInformation:
+      n = static_cast<vtkIdType>(info->NumberOfBins[0])*info->NumberOfBins[1];
+      break;
     }
 
-  // do the setup for mutual information
-  double sourceImageRange[2];
-  double targetImageRange[2];
-  sourceImageRange[0] = this->SourceImageRange[0];
-  sourceImageRange[1] = this->SourceImageRange[1];
-  targetImageRange[0] = this->TargetImageRange[0];
-  targetImageRange[1] = this->TargetImageRange[1];
+  return n;
+}
 
-  if (this->MetricType == vtkImageRegistration::MutualInformation ||
-      this->MetricType == vtkImageRegistration::NormalizedMutualInformation)
+//--------------------------------------------------------------------------
+// Accumulate the partial sums for a range of rows
+void vtkImageRegistrationAccumulate(
+  vtkImageRegistrationInfo *info, const double *matrix,
+  vtkIdType rowBegin, vtkIdType rowEnd, double *sums)
+{
+  switch (info->MetricType)
     {
-    if (sourceImageRange[0] >= sourceImageRange[1])
+    case vtkImageRegistration::SquaredDifference:
       {
-      this->ComputeImageRange(sourceImage, this->GetSourceImageStencil(),
-        sourceImageRange);
+      vtkSquaredDifferenceAccumulator accumulator;
+      accumulator.Sums = sums;
+      vtkImageRegistrationSampleRows(
+        info, matrix, rowBegin, rowEnd, accumulator);
       }
-    if (targetImageRange[0] >= targetImageRange[1])
+      break;
+    case vtkImageRegistration::CrossCorrelation:
+    case vtkImageRegistration::NormalizedCrossCorrelation:
       {
-      this->ComputeImageRange(targetImage, NULL,
-        targetImageRange);
+      vtkCrossCorrelationAccumulator accumulator;
+      accumulator.Sums = sums;
+      vtkImageRegistrationSampleRows(
+        info, matrix, rowBegin, rowEnd, accumulator);
       }
-
+      break;
+    case vtkImageRegistration::CorrelationRatio:
+      {
+      vtkCorrelationRatioAccumulator accumulator;
+      accumulator.Sums = sums;
+      vtkImageRegistrationSampleRows(
+        info, matrix, rowBegin, rowEnd, accumulator);
+      }
+      break;
+    case vtkImageRegistration::MutualInformation:
+    case vtkImageRegistration::NormalizedMutualInformation:
+      {
+      vtkMutualInformationAccumulator accumulator;
+      accumulator.Sums = sums;
+      accumulator.XSize = info->NumberOfBins[0];
+      accumulator.YShift = -info->BinOrigin[1];
+      accumulator.YScale = 1.0/info->BinSpacing[1];
+      accumulator.YMax = info->NumberOfBins[1] - 1;
+      vtkImageRegistrationSampleRows(
+        info, matrix, rowBegin, rowEnd, accumulator);
+      }
+      break;
+    }
+}
+
+//--------------------------------------------------------------------------
+// Compute the value to minimize from the partial sums
+double vtkImageRegistrationMetricValue(
+  vtkImageRegistrationInfo *info, const double *sums)
+{
+  double val = 0.0;
+
+  switch (info->MetricType)
+    {
+    case vtkImageRegistration::SquaredDifference:
+      {
+      double count = (sums[1] > 0 ? sums[1] : 1.0);
+      val = sums[0]/count;
+      }
+      break;
+
+    case vtkImageRegistration::CrossCorrelation:
+    case vtkImageRegistration::NormalizedCrossCorrelation:
+      {
+      double xSum = sums[0];
+      double ySum = sums[1];
+      double xxSum = sums[2];
+      double yySum = sums[3];
+      double xySum = sums[4];
+      double count = sums[5];
+
+      // minimum possible values
+      double crossCorrelation = 0;
+      double normalizedCrossCorrelation = 1.0;
+
+      if (count > 0)
+        {
+        crossCorrelation = (xySum - xSum*ySum/count)/count;
+
+        double d = (xxSum - xSum*xSum/count)*(yySum - ySum*ySum/count);
+        if (d > 0)
+          {
+          normalizedCrossCorrelation = (xySum - xSum*ySum/count)/sqrt(d);
+          }
+        }
+
+      if (info->MetricType == vtkImageRegistration::CrossCorrelation)
+        {
+        val = -crossCorrelation;
+        }
+      else
+        {
+        val = -normalizedCrossCorrelation;
+        }
+      }
+      break;
+
+    case vtkImageRegistration::CorrelationRatio:
+      {
+      double n = 0;
+      double ySum = 0;
+      double yySum = 0;
+      double viSum = 0;
+
+      int nx = info->NumberOfBins[0];
+      for (int ix = 0; ix < nx; ++ix)
+        {
+        const double *binSums = sums + 3*ix;
+        double ni = binSums[0];
+        if (ni > 0)
+          {
+          double yi = binSums[1];
+          double yyi = binSums[2];
+          n += ni;
+          ySum += yi;
+          yySum += yyi;
+          viSum += (yyi - yi*yi/ni);
+          }
+        }
+
+      // compute the total variance and the correlation ratio
+      double v = 0;
+      if (n > 0)
+        {
+        v = (yySum - ySum*ySum/n);
+        }
+      if (v > 0)
+        {
+        val = -(1.0 - viSum/v);
+        }
+      }
+      break;
+
+    case vtkImageRegistration::MutualInformation:
+    case vtkImageRegistration::NormalizedMutualInformation:
+      {
+      int nx = info->NumberOfBins[0];
+      int ny = info->NumberOfBins[1];
+
+      double xEntropy = 0;
+      double yEntropy = 0;
+      double xyEntropy = 0;
+      double count = 0;
+
+      double *xHist = new double[nx];
+      for (int ix = 0; ix < nx; ++ix)
+        {
+        xHist[ix] = 0;
+        }
+
+      for (int iy = 0; iy < ny; ++iy)
+        {
+        const double *xyHist = sums + static_cast<vtkIdType>(nx)*iy;
+        double a = 0;
+        for (int ix = 0; ix < nx; ++ix)
+          {
+          double c = xyHist[ix];
+          a += c;
+          xHist[ix] += c;
+          if (c > 0)
+            {
+            xyEntropy += c*log(c);
+            }
+          }
+        if (a > 0)
+          {
+          yEntropy += a*log(a);
+          }
+        count += a;
+        }
+
+      for (int ix = 0; ix < nx; ++ix)
+        {
+        double b = xHist[ix];
+        if (b > 0)
+          {
+          xEntropy += b*log(b);
+          }
+        }
+
+      delete [] xHist;
+
+      // minimum possible values
+      double mutualInformation = 0.0;
+      double normalizedMutualInformation = 1.0;
+
+      if (count > 0)
+        {
+        // correct for total voxel count, convert to negative
+        double ldc = log(count);
+        xEntropy = -xEntropy/count + ldc;
+        yEntropy = -yEntropy/count + ldc;
+        xyEntropy = -xyEntropy/count + ldc;
+
+        mutualInformation = xEntropy + yEntropy - xyEntropy;
+        if (xyEntropy > 0)
+          {
+          normalizedMutualInformation = (xEntropy + yEntropy)/xyEntropy;
+          }
+        }
+
+      if (info->MetricType == vtkImageRegistration::MutualInformation)
+        {
+        val = -mutualInformation;
+        }
+      else
+        {
+        val = -normalizedMutualInformation;
+        }
+      }
+      break;
+    }
+
+  return val;
+}
+
+//--------------------------------------------------------------------------
+// Find the first row that begins at or after the given sample
+vtkIdType vtkImageRegistrationFindRow(
+  const vtkIdType *rowStart, vtkIdType numRows, vtkIdType sample)
+{
+  return (std::lower_bound(rowStart, rowStart + numRows, sample) - rowStart);
+}
+
+//--------------------------------------------------------------------------
+// The data that is shared by all of the threads
+struct vtkImageRegistrationThreadStruct
+{
+  vtkImageRegistrationInfo *Info;
+  int NumberOfMatrices;
+  const double *Matrices;
+  double *Sums;
+  vtkIdType SumSize;
+};
+
+//--------------------------------------------------------------------------
+// Each thread does a share of the samples, for all of the matrices
+VTK_THREAD_RETURN_TYPE vtkImageRegistrationThreadedExecute(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  vtkImageRegistrationThreadStruct *ts =
+    static_cast<vtkImageRegistrationThreadStruct *>(ti->UserData);
+  int threadId = ti->ThreadID;
+  int threadCount = ti->NumberOfThreads;
+
+  vtkImageSampleBuffer *buffer = ts->Info->SampleBuffer;
+  const vtkIdType *rowStart = buffer->GetRowStart();
+  vtkIdType numRows = buffer->GetNumberOfRows();
+  vtkIdType numSamples = buffer->GetNumberOfSamples();
+
+  // divide the rows so that each thread gets a similar number of samples
+  vtkIdType rowBegin = vtkImageRegistrationFindRow(
+    rowStart, numRows, numSamples*threadId/threadCount);
+  vtkIdType rowEnd = numRows;
+  if (threadId + 1 < threadCount)
+    {
+    rowEnd = vtkImageRegistrationFindRow(
+      rowStart, numRows, numSamples*(threadId + 1)/threadCount);
+    }
+
+  int n = ts->NumberOfMatrices;
+  double *sums = ts->Sums + threadId*n*ts->SumSize;
+
+  // do the rows in small chunks, and do all the matrices for each
+  // chunk, so that the samples stay in the cache, and check for
+  // cancellation after each chunk
+  const vtkIdType chunkSize = 4096;
+  vtkIdType r = rowBegin;
+  while (r < rowEnd && !ts->Info->Cancelled)
+    {
+    vtkIdType chunkEnd = vtkImageRegistrationFindRow(
+      rowStart, rowEnd, rowStart[r] + chunkSize);
+    chunkEnd = (chunkEnd > r ? chunkEnd : r + 1);
+
+    for (int m = 0; m < n; m++)
+      {
+      vtkImageRegistrationAccumulate(
+        ts->Info, ts->Matrices + 16*m, r, chunkEnd, sums + m*ts->SumSize);
+      }
+
+    r = chunkEnd;
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+//--------------------------------------------------------------------------
+// Compute the metric for several transform matrices in a single pass
+// through the sample buffer.  The matrices are 4x4 row-major matrices
+// that map source world coordinates to target world coordinates.
+void vtkImageRegistrationEvaluateMatrices(
+  vtkImageRegistrationInfo *info, int n, const double *matrices,
+  double *values)
+{
+  // convert to matrices that map source indices to target indices
+  double *ijkMatrices = new double[16*n];
+  for (int m = 0; m < n; m++)
+    {
+    double tmp[16];
+    vtkMatrix4x4::Multiply4x4(matrices + 16*m, info->SourceMatrix, tmp);
+    vtkMatrix4x4::Multiply4x4(info->TargetMatrix, tmp, ijkMatrices + 16*m);
+    }
+
+  // allocate the partial sums for each thread
+  int numThreads = info->Threader->GetNumberOfThreads();
+  vtkIdType sumSize = vtkImageRegistrationSumSize(info);
+  vtkIdType threadSize = n*sumSize;
+  double *sums = new double[numThreads*threadSize];
+  for (vtkIdType i = 0; i < numThreads*threadSize; i++)
+    {
+    sums[i] = 0.0;
+    }
+
+  vtkImageRegistrationThreadStruct ts;
+  ts.Info = info;
+  ts.NumberOfMatrices = n;
+  ts.Matrices = ijkMatrices;
+  ts.Sums = sums;
+  ts.SumSize = sumSize;
+
+  info->Threader->SetSingleMethod(vtkImageRegistrationThreadedExecute, &ts);
+  info->Threader->SingleMethodExecute();
+
+  // add the partial sums from all of the threads
+  for (int t = 1; t < numThreads; t++)
+    {
+    const double *threadSums = sums + t*threadSize;
+    for (vtkIdType i = 0; i < threadSize; i++)
+      {
+      sums[i] += threadSums[i];
+      }
+    }
+
+  for (int m = 0; m < n; m++)
+    {
+    values[m] = vtkImageRegistrationMetricValue(info, sums + m*sumSize);
+    }
+
+  delete [] sums;
+  delete [] ijkMatrices;
+}
+
+//--------------------------------------------------------------------------
+// Get the value to minimize from the metric filter, after updating it
+double vtkImageRegistrationFilterValue(
+  vtkImageRegistrationInfo *registrationInfo)
+{
+  double val = 0.0;
+
+  vtkImageMutualInformation *miMetric =
+    vtkImageMutualInformation::SafeDownCast(registrationInfo->Metric);
+  vtkImageCrossCorrelation *ccMetric =
+    vtkImageCrossCorrelation::SafeDownCast(registrationInfo->Metric);
+  vtkImageSquaredDifference *sdMetric =
+    vtkImageSquaredDifference::SafeDownCast(registrationInfo->Metric);
+  vtkImageNeighborhoodCorrelation *ncMetric =
+    vtkImageNeighborhoodCorrelation::SafeDownCast(registrationInfo->Metric);
+  vtkImageCorrelationRatio *crMetric =
+    vtkImageCorrelationRatio::SafeDownCast(registrationInfo->Metric);
+
+  registrationInfo->Metric->Update();
+
+  switch (registrationInfo->MetricType)
+    {
+    case vtkImageRegistration::SquaredDifference:
+      val = sdMetric->GetSquaredDifference();
+      break;
+    case vtkImageRegistration::CrossCorrelation:
+      val = - ccMetric->GetCrossCorrelation();
+      break;
+    case vtkImageRegistration::NormalizedCrossCorrelation:
+      val = - ccMetric->GetNormalizedCrossCorrelation();
+      break;
+    case vtkImageRegistration::NeighborhoodCorrelation:
+      val = ncMetric->GetValueToMinimize();
+      break;
+    case vtkImageRegistration::CorrelationRatio:
+      val = - crMetric->GetCorrelationRatio();
+      break;
+    case vtkImageRegistration::MutualInformation:
+      val = - miMetric->GetMutualInformation();
+      break;
+    case vtkImageRegistration::NormalizedMutualInformation:
+      val = - miMetric->GetNormalizedMutualInformation();
+      break;
+    }
+
+  return val;
+}
+
+//--------------------------------------------------------------------------
+// Compute the metric for a list of transform matrices, in batches if
+// the sample buffer is in use, or else one at a time with the filter
+void vtkImageRegistrationEvaluateMatrixList(
+  vtkImageRegistrationInfo *info, int n, const double *matrices,
+  double *values)
+{
+  if (info->Interpolator)
+    {
+    // evaluate in batches, to limit the memory used for the sums
+    vtkIdType sumSize = vtkImageRegistrationSumSize(info);
+    int batchSize = static_cast<int>(262144/(sumSize > 0 ? sumSize : 1));
+    batchSize = (batchSize > 1 ? batchSize : 1);
+    for (int b = 0; b < n; b += batchSize)
+      {
+      int m = (n - b < batchSize ? n - b : batchSize);
+      vtkImageRegistrationEvaluateMatrices(
+        info, m, matrices + 16*b, values + b);
+      }
+    }
+  else
+    {
+    // evaluate one at a time with the metric filter
+    vtkTransform *regTransform = vtkTransform::SafeDownCast(info->Transform);
+    for (int m = 0; m < n; m++)
+      {
+      regTransform->SetMatrix(matrices + 16*m);
+      values[m] = vtkImageRegistrationFilterValue(info);
+      }
+    }
+  info->NumberOfEvaluations += n;
+}
+
+//--------------------------------------------------------------------------
+// The number of metric values that are kept in the cache
+const int vtkImageRegistrationCacheSize = 256;
+
+//--------------------------------------------------------------------------
+// Clear the cache, and set the quantization step for each parameter to
+// a small fraction of the parameter tolerance
+void vtkImageRegistrationResetCache(
+  vtkImageRegistrationInfo *info, vtkPowellMinimizer *optimizer)
+{
+  int n = optimizer->GetNumberOfParameters();
+  double tol = optimizer->GetParameterTolerance();
+  info->CacheQuanta.resize(n);
+  for (int i = 0; i < n; i++)
+    {
+    info->CacheQuanta[i] = 1e-3*tol*optimizer->GetParameterScale(i);
+    }
+  info->CacheKeys.clear();
+  info->CacheValues.clear();
+  info->CacheNext = 0;
+  info->NumberOfCacheHits = 0;
+}
+
+//--------------------------------------------------------------------------
+// Compute the cache key for a set of parameters, the last element of
+// the key is the fidelity level at which the metric is evaluated
+void vtkImageRegistrationCacheKey(
+  vtkImageRegistrationInfo *info, const double *parameters, double *key)
+{
+  int n = static_cast<int>(info->CacheQuanta.size());
+  for (int i = 0; i < n; i++)
+    {
+    double q = info->CacheQuanta[i];
+    key[i] = (q > 0 ? floor(parameters[i]/q + 0.5) : parameters[i]);
+    }
+  key[n] = info->FidelityLevel;
+}
+
+//--------------------------------------------------------------------------
+// Look for a key in the cache, and return true if it was found
+bool vtkImageRegistrationCacheLookup(
+  vtkImageRegistrationInfo *info, const double *key, double *value)
+{
+  int n = static_cast<int>(info->CacheQuanta.size()) + 1;
+  int m = static_cast<int>(info->CacheValues.size());
+  for (int j = 0; j < m; j++)
+    {
+    const double *k = &info->CacheKeys[j*n];
+    int i = 0;
+    while (i < n && k[i] == key[i])
+      {
+      i++;
+      }
+    if (i == n)
+      {
+      *value = info->CacheValues[j];
+      info->NumberOfCacheHits++;
+      return true;
+      }
+    }
+  return false;
+}
+
+//--------------------------------------------------------------------------
+// Add a value to the cache, replacing the oldest value if it is full
+void vtkImageRegistrationCacheStore(
+  vtkImageRegistrationInfo *info, const double *key, double value)
+{
+  int n = static_cast<int>(info->CacheQuanta.size()) + 1;
+  int m = static_cast<int>(info->CacheValues.size());
+  if (n == 1)
+    {
+    return;
+    }
+  if (m < vtkImageRegistrationCacheSize)
+    {
+    info->CacheKeys.insert(info->CacheKeys.end(), key, key + n);
+    info->CacheValues.push_back(value);
+    }
+  else
+    {
+    int j = info->CacheNext;
+    std::copy(key, key + n, info->CacheKeys.begin() + j*n);
+    info->CacheValues[j] = value;
+    info->CacheNext = (j + 1) % vtkImageRegistrationCacheSize;
+    }
+}
+
+//--------------------------------------------------------------------------
+// Check whether the registration was cancelled or the time limit expired
+bool vtkImageRegistrationStopped(vtkImageRegistrationInfo *info)
+{
+  if (!info->Stopped &&
+      (info->Cancelled || (info->Deadline > 0 &&
+       vtkTimerLog::GetUniversalTime() > info->Deadline)))
+    {
+    info->Stopped = true;
+    }
+  return info->Stopped;
+}
+
+//--------------------------------------------------------------------------
+// Keep track of the best full fidelity value and its parameters
+void vtkImageRegistrationKeepBest(
+  vtkImageRegistrationInfo *info, int n, const double *parameters,
+  double value)
+{
+  if (info->FidelityLevel == 0 && value < info->BestValue)
+    {
+    info->BestValue = value;
+    info->BestParameters.assign(parameters, parameters + n);
+    }
+}
+
+//--------------------------------------------------------------------------
+// If the optimizer's current point is not the best point that has been
+// evaluated (e.g. because it was stopped early), then go to the best
+void vtkImageRegistrationUseBest(vtkImageRegistrationInfo *info)
+{
+  vtkPowellMinimizer* optimizer =
+    vtkPowellMinimizer::SafeDownCast(info->Optimizer);
+  int n = optimizer->GetNumberOfParameters();
+  if (static_cast<int>(info->BestParameters.size()) == n &&
+      info->BestValue < optimizer->GetFunctionValue())
+    {
+    for (int i = 0; i < n; i++)
+      {
+      optimizer->SetParameterValue(i, info->BestParameters[i]);
+      }
+    optimizer->SetFunctionValue(info->BestValue);
+    }
+}
+
+//--------------------------------------------------------------------------
+void vtkEvaluateFunction(void * arg)
+{
+  vtkImageRegistrationInfo *registrationInfo =
+    static_cast<vtkImageRegistrationInfo*>(arg);
+
+  double val = 0.0;
+
+  vtkPowellMinimizer* optimizer =
+    vtkPowellMinimizer::SafeDownCast(registrationInfo->Optimizer);
+
+  // after the time limit or after cancellation, return a value that
+  // the optimizer will reject
+  if (vtkImageRegistrationStopped(registrationInfo))
+    {
+    optimizer->SetFunctionValue(VTK_DOUBLE_MAX);
+    return;
+    }
+
+  // check whether the metric was already computed for these parameters
+  registrationInfo->FidelityLevel = optimizer->GetFidelityLevel();
+  int numberOfParameters = optimizer->GetNumberOfParameters();
+  std::vector<double> parameters(numberOfParameters + 1);
+  std::vector<double> key(numberOfParameters + 1);
+  for (int i = 0; i < numberOfParameters; i++)
+    {
+    parameters[i] = optimizer->GetParameterValue(i);
+    }
+  vtkImageRegistrationCacheKey(registrationInfo, &parameters[0], &key[0]);
+  if (vtkImageRegistrationCacheLookup(registrationInfo, &key[0], &val))
+    {
+    optimizer->SetFunctionValue(val);
+    registrationInfo->FidelityLevel = 0;
+    return;
+    }
+
+  vtkSetTransformParameters(registrationInfo);
+
+  if (registrationInfo->Interpolator)
+    {
+    // compute the metric directly from the sample buffer
+    double matrix[16];
+    vtkMatrix4x4::DeepCopy(matrix, registrationInfo->Transform->GetMatrix());
+    vtkImageRegistrationEvaluateMatrices(registrationInfo, 1, matrix, &val);
+    }
+  else
+    {
+    val = vtkImageRegistrationFilterValue(registrationInfo);
+    }
+
+  // if cancelled during the computation, the value is incomplete
+  if (vtkImageRegistrationStopped(registrationInfo) &&
+      registrationInfo->Cancelled)
+    {
+    val = VTK_DOUBLE_MAX;
+    optimizer->SetFunctionValue(val);
+    registrationInfo->FidelityLevel = 0;
+    return;
+    }
+
+  optimizer->SetFunctionValue(val);
+  vtkImageRegistrationCacheStore(registrationInfo, &key[0], val);
+  vtkImageRegistrationKeepBest(
+    registrationInfo, numberOfParameters, &parameters[0], val);
+
+  registrationInfo->FidelityLevel = 0;
+  registrationInfo->NumberOfEvaluations++;
+}
+
+//--------------------------------------------------------------------------
+// Evaluate several sets of parameters at once, for population-based
+// optimizers such as CMA-ES
+void vtkBatchEvaluateFunction(
+  void *arg, int n, const double *parameters, double *values)
+{
+  vtkImageRegistrationInfo *registrationInfo =
+    static_cast<vtkImageRegistrationInfo*>(arg);
+
+  vtkPowellMinimizer* optimizer =
+    vtkPowellMinimizer::SafeDownCast(registrationInfo->Optimizer);
+  int numberOfParameters = optimizer->GetNumberOfParameters();
+  int keySize = numberOfParameters + 1;
+
+  // after the time limit or after cancellation, return values that
+  // the optimizer will reject
+  if (vtkImageRegistrationStopped(registrationInfo))
+    {
+    for (int m = 0; m < n; m++)
+      {
+      values[m] = VTK_DOUBLE_MAX;
+      }
+    return;
+    }
+
+  registrationInfo->FidelityLevel = optimizer->GetFidelityLevel();
+
+  // build matrices for the parameter sets that are not in the cache
+  std::vector<double> keys(n*keySize);
+  std::vector<double> matrices(16*n);
+  std::vector<int> misses;
+  vtkTransform *transform = vtkTransform::New();
+  for (int m = 0; m < n; m++)
+    {
+    const double *p = parameters + m*numberOfParameters;
+    double *key = &keys[m*keySize];
+    vtkImageRegistrationCacheKey(registrationInfo, p, key);
+    if (!vtkImageRegistrationCacheLookup(registrationInfo, key, &values[m]))
+      {
+      vtkSetTransformParameters(registrationInfo, p, transform);
+      vtkMatrix4x4::DeepCopy(
+        &matrices[16*misses.size()], transform->GetMatrix());
+      misses.push_back(m);
+      }
+    }
+  transform->Delete();
+
+  int numberOfMisses = static_cast<int>(misses.size());
+  if (numberOfMisses > 0)
+    {
+    std::vector<double> missValues(numberOfMisses);
+    vtkImageRegistrationEvaluateMatrixList(
+      registrationInfo, numberOfMisses, &matrices[0], &missValues[0]);
+    if (vtkImageRegistrationStopped(registrationInfo) &&
+        registrationInfo->Cancelled)
+      {
+      // if cancelled during the computation, the values are incomplete
+      for (int m = 0; m < n; m++)
+        {
+        values[m] = VTK_DOUBLE_MAX;
+        }
+      numberOfMisses = 0;
+      }
+    for (int j = 0; j < numberOfMisses; j++)
+      {
+      int m = misses[j];
+      values[m] = missValues[j];
+      vtkImageRegistrationCacheStore(
+        registrationInfo, &keys[m*keySize], values[m]);
+      vtkImageRegistrationKeepBest(
+        registrationInfo, numberOfParameters,
+        parameters + m*numberOfParameters, values[m]);
+      }
+    }
+
+  registrationInfo->FidelityLevel = 0;
+}
+
+//--------------------------------------------------------------------------
+// Use Otsu's method to find the threshold that best separates the
+// histogram into two classes.
+double vtkImageRegistrationOtsuThreshold(
+  vtkIdTypeArray *histogram, double binOrigin, double binSpacing)
+{
+  vtkIdType n = histogram->GetMaxId() + 1;
+  const vtkIdType *h = histogram->GetPointer(0);
+
+  double total = 0.0;
+  double totalSum = 0.0;
+  for (vtkIdType i = 0; i < n; i++)
+    {
+    total += h[i];
+    totalSum += static_cast<double>(i)*h[i];
+    }
+
+  double count0 = 0.0;
+  double sum0 = 0.0;
+  double bestScore = -1.0;
+  vtkIdType bestBin = 0;
+  for (vtkIdType t = 0; t < n - 1; t++)
+    {
+    count0 += h[t];
+    sum0 += static_cast<double>(t)*h[t];
+    double count1 = total - count0;
+    if (count0 > 0 && count1 > 0)
+      {
+      // maximize the between-class variance
+      double d = sum0/count0 - (totalSum - sum0)/count1;
+      double score = count0*count1*d*d;
+      if (score > bestScore)
+        {
+        bestScore = score;
+        bestBin = t;
+        }
+      }
+    }
+
+  if (bestScore < 0)
+    {
+    // fewer than two bins are occupied, so everything is foreground
+    return -VTK_DOUBLE_MAX;
+    }
+
+  // the threshold is the upper edge of the best bin
+  return binOrigin + (bestBin + 0.5)*binSpacing;
+}
+
+//--------------------------------------------------------------------------
+// Set the mask to one for every voxel above the threshold.
+template<class T>
+void vtkImageRegistrationThresholdMask(
+  const T *inPtr, int numComponents, vtkIdType n, double threshold,
+  unsigned char *mask)
+{
+  for (vtkIdType i = 0; i < n; i++)
+    {
+    mask[i] = (static_cast<double>(*inPtr) > threshold);
+    inPtr += numComponents;
+    }
+}
+
+//--------------------------------------------------------------------------
+// Dilate one line of the mask by keeping a running count of the voxels
+// within the radius, so that the cost does not depend on the radius.
+void vtkImageRegistrationDilateLine(
+  unsigned char *line, int n, vtkIdType stride, int radius,
+  unsigned char *work)
+{
+  for (int i = 0; i < n; i++)
+    {
+    work[i] = line[i*stride];
+    }
+
+  int count = 0;
+  for (int i = 0; i < radius && i < n; i++)
+    {
+    count += work[i];
+    }
+
+  for (int i = 0; i < n; i++)
+    {
+    if (i + radius < n)
+      {
+      count += work[i + radius];
+      }
+    if (i - radius - 1 >= 0)
+      {
+      count -= work[i - radius - 1];
+      }
+    line[i*stride] = (count > 0);
+    }
+}
+
+//--------------------------------------------------------------------------
+// Compute the principal axes from a covariance matrix.  The axes are
+// the columns of the rotation matrix, sorted by decreasing variance.
+void vtkImageRegistrationPrincipalAxes(
+  const double covariance[9], int dim, double axes[3][3])
+{
+  double a[3][3];
+  for (int i = 0; i < 3; i++)
+    {
+    for (int j = 0; j < 3; j++)
+      {
+      a[i][j] = covariance[3*i + j];
+      }
+    }
+
+  if (dim <= 2)
+    {
+    // force the z axis to be the last axis
+    a[0][2] = a[2][0] = 0.0;
+    a[1][2] = a[2][1] = 0.0;
+    a[2][2] = -1.0;
+    }
+
+  double w[3];
+  double *aPtr[3] = { a[0], a[1], a[2] };
+  double *vPtr[3] = { axes[0], axes[1], axes[2] };
+  vtkMath::Jacobi(aPtr, w, vPtr);
+
+  if (dim <= 2 && axes[2][2] < 0)
+    {
+    axes[0][2] = -axes[0][2];
+    axes[1][2] = -axes[1][2];
+    axes[2][2] = -axes[2][2];
+    }
+
+  // make sure that the axes are right-handed
+  if (vtkMath::Determinant3x3(axes) < 0)
+    {
+    int c = (dim <= 2 ? 1 : 2);
+    axes[0][c] = -axes[0][c];
+    axes[1][c] = -axes[1][c];
+    axes[2][c] = -axes[2][c];
+    }
+}
+
+//--------------------------------------------------------------------------
+// Compute the candidate orientations and translations that map the
+// source centroid and principal axes onto the target centroid and axes.
+// There is one candidate for each way of choosing the signs of the axes.
+// If rotation is not allowed, then the initial orientation is kept.
+void vtkImageRegistrationMomentsCandidates(
+  const double sourceCentroid[3], const double sourceCovariance[9],
+  const double targetCentroid[3], const double targetCovariance[9],
+  const double center[3], int dim, bool rotate, const double initial[16],
+  std::vector<double> *orientations, std::vector<double> *translations)
+{
+  double sourceAxes[3][3];
+  double targetAxes[3][3];
+  vtkImageRegistrationPrincipalAxes(sourceCovariance, dim, sourceAxes);
+  vtkImageRegistrationPrincipalAxes(targetCovariance, dim, targetAxes);
+
+  // the sign changes that keep the axes right-handed
+  static const double signs[4][3] = {
+    { 1.0, 1.0, 1.0 },
+    { -1.0, -1.0, 1.0 },
+    { 1.0, -1.0, -1.0 },
+    { -1.0, 1.0, -1.0 } };
+  int ns = (rotate ? (dim <= 2 ? 2 : 4) : 1);
+
+  for (int s = 0; s < ns; s++)
+    {
+    // rotation = targetAxes * signs * transpose(sourceAxes)
+    double orientation[16];
+    for (int i = 0; i < 16; i++)
+      {
+      orientation[i] = initial[i];
+      }
+    if (rotate)
+      {
+      for (int i = 0; i < 3; i++)
+        {
+        for (int j = 0; j < 3; j++)
+          {
+          double r = 0.0;
+          for (int k = 0; k < 3; k++)
+            {
+            r += targetAxes[i][k]*signs[s][k]*sourceAxes[j][k];
+            }
+          orientation[4*i + j] = r;
+          }
+        }
+      }
+
+    // the translation that maps the source centroid to the target centroid
+    double v[3];
+    v[0] = sourceCentroid[0] - center[0];
+    v[1] = sourceCentroid[1] - center[1];
+    v[2] = sourceCentroid[2] - center[2];
+    double t[3];
+    for (int i = 0; i < 3; i++)
+      {
+      t[i] = targetCentroid[i] - center[i] - (orientation[4*i]*v[0] +
+                                              orientation[4*i + 1]*v[1] +
+                                              orientation[4*i + 2]*v[2]);
+      }
+    if (dim <= 2)
+      {
+      t[2] = 0.0;
+      }
+
+    orientations->insert(orientations->end(), orientation, orientation + 16);
+    translations->insert(translations->end(), t, t + 3);
+    }
+}
+
+//--------------------------------------------------------------------------
+// Split a matrix into the orientation, which is stored in initialMatrix,
+// and a translation that is relative to the transform center.
+void vtkImageRegistrationSplitMatrix(
+  vtkMatrix4x4 *matrix, const double center[3], vtkMatrix4x4 *initialMatrix,
+  double translation[3])
+{
+  // move rotation/scale/shear into the initialMatrix
+  initialMatrix->DeepCopy(matrix);
+  initialMatrix->Element[0][3] = 0.0;
+  initialMatrix->Element[1][3] = 0.0;
+  initialMatrix->Element[2][3] = 0.0;
+
+  // adjust the translation for the transform centering
+  double scenter[4];
+  scenter[0] = center[0];
+  scenter[1] = center[1];
+  scenter[2] = center[2];
+  scenter[3] = 1.0;
+
+  initialMatrix->MultiplyPoint(scenter, scenter);
+
+  translation[0] = matrix->Element[0][3] - (center[0] - scenter[0]);
+  translation[1] = matrix->Element[1][3] - (center[1] - scenter[1]);
+  translation[2] = matrix->Element[2][3] - (center[2] - scenter[2]);
+}
+
+} // end anonymous namespace
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::ComputeImageRange(
+  vtkImageData *data, vtkImageStencilData *stencil, double range[2])
+{
+  vtkImageRegistrationTarget::ComputeImageRange(data, stencil, range);
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::ComputeForegroundStencil(
+  vtkImageData *data, vtkImageStencilData *stencil)
+{
+  // the dilation radius, in voxels
+  const int radius = 2;
+
+  // find the threshold between the background and the foreground
+  vtkImageHistogramStatistics *hist =
+    vtkImageHistogramStatistics::New();
+  hist->SET_INPUT_DATA(data);
+  hist->SetActiveComponent(0);
+  hist->Update();
+
+  double threshold = vtkImageRegistrationOtsuThreshold(
+    hist->GetHistogram(), hist->GetBinOrigin(), hist->GetBinSpacing());
+
+  hist->SET_INPUT_DATA(NULL);
+  hist->Delete();
+
+  // make a mask of the foreground voxels
+  int extent[6];
+  data->GetExtent(extent);
+  int size[3];
+  size[0] = extent[1] - extent[0] + 1;
+  size[1] = extent[3] - extent[2] + 1;
+  size[2] = extent[5] - extent[4] + 1;
+  vtkIdType rowSize = size[0];
+  vtkIdType sliceSize = rowSize*size[1];
+  vtkIdType n = sliceSize*size[2];
+
+  unsigned char *mask = new unsigned char[n];
+  void *inPtr = data->GetScalarPointer();
+  int numComponents = data->GetNumberOfScalarComponents();
+
+  switch (data->GetScalarType())
+    {
+    vtkTemplateAliasMacro(
+      vtkImageRegistrationThresholdMask(
+        static_cast<VTK_TT *>(inPtr), numComponents, n, threshold, mask));
+    default:
+      vtkErrorMacro("ComputeForegroundStencil: Unknown ScalarType");
+      std::fill(mask, mask + n, 1);
+    }
+
+  // dilate the mask along each axis in turn
+  int maxSize = size[0];
+  maxSize = (size[1] > maxSize ? size[1] : maxSize);
+  maxSize = (size[2] > maxSize ? size[2] : maxSize);
+  unsigned char *work = new unsigned char[maxSize];
+
+  for (vtkIdType k = 0; k < size[2]; k++)
+    {
+    for (vtkIdType j = 0; j < size[1]; j++)
+      {
+      vtkImageRegistrationDilateLine(
+        mask + k*sliceSize + j*rowSize, size[0], 1, radius, work);
+      }
+    for (vtkIdType i = 0; i < size[0]; i++)
+      {
+      vtkImageRegistrationDilateLine(
+        mask + k*sliceSize + i, size[1], rowSize, radius, work);
+      }
+    }
+  for (vtkIdType j = 0; j < size[1]; j++)
+    {
+    for (vtkIdType i = 0; i < size[0]; i++)
+      {
+      vtkImageRegistrationDilateLine(
+        mask + j*rowSize + i, size[2], sliceSize, radius, work);
+      }
+    }
+
+  delete [] work;
+
+  // convert the mask into a stencil
+  stencil->SetExtent(extent);
+  stencil->SetOrigin(data->GetOrigin());
+  stencil->SetSpacing(data->GetSpacing());
+  stencil->AllocateExtents();
+
+  const unsigned char *maskPtr = mask;
+  for (int k = extent[4]; k <= extent[5]; k++)
+    {
+    for (int j = extent[2]; j <= extent[3]; j++)
+      {
+      int i = 0;
+      while (i < size[0])
+        {
+        while (i < size[0] && !maskPtr[i]) { i++; }
+        int r1 = i;
+        while (i < size[0] && maskPtr[i]) { i++; }
+        if (i > r1)
+          {
+          stencil->InsertNextExtent(
+            extent[0] + r1, extent[0] + i - 1, j, k);
+          }
+        }
+      maskPtr += rowSize;
+      }
+    }
+
+  delete [] mask;
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::InitializeSampleBuffer(
+  vtkImageData *sourceImage, vtkImageStencilData *sourceStencil,
+  vtkImageRegistrationTarget *target, const double sourceImageRange[2])
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  vtkImageData *targetImage = target->GetPreparedImage();
+
+  // the reslice filter is not used, so release its inputs
+  this->ImageReslice->SetInformationInput(NULL);
+  this->ImageReslice->SET_INPUT_DATA(NULL);
+  this->ImageReslice->SET_STENCIL_DATA(NULL);
+
+  // the interpolator belongs to the target, and no reference is taken
+  // because the target might be shared with registrations on other
+  // threads, but the target is kept alive by this object
+  this->Interpolator = target->GetInterpolator();
+
+  // gather the source voxels that are within the stencil
+  vtkImageSampleBuffer *buffer = this->SampleBuffer;
+  buffer->SetSampleFraction(this->SampleFraction);
+  buffer->SetTileSize(this->SampleTileSize);
+  buffer->SetMaximumNumberOfSamples(this->MaximumNumberOfSamples);
+  buffer->BuildBuffer(sourceImage, sourceStencil);
+
+  // the matrix to go from source indices to source coords
+  double origin[3];
+  double spacing[3];
+  sourceImage->GetOrigin(origin);
+  sourceImage->GetSpacing(spacing);
+  vtkMatrix4x4::Identity(info->SourceMatrix);
+  for (int i = 0; i < 3; i++)
+    {
+    info->SourceMatrix[4*i + i] = spacing[i];
+    info->SourceMatrix[4*i + 3] = origin[i];
+    }
+
+  // the matrix to go from target coords to target indices
+  targetImage->GetOrigin(origin);
+  targetImage->GetSpacing(spacing);
+  vtkMatrix4x4::Identity(info->TargetMatrix);
+  for (int i = 0; i < 3; i++)
+    {
+    info->TargetMatrix[4*i + i] = 1.0/spacing[i];
+    info->TargetMatrix[4*i + 3] = -origin[i]/spacing[i];
+    }
+
+  // the scale and offset to go from target indices to stencil indices
+  info->TargetStencil = target->GetStencil();
+  if (info->TargetStencil)
+    {
+    double stencilOrigin[3];
+    double stencilSpacing[3];
+    info->TargetStencil->GetOrigin(stencilOrigin);
+    info->TargetStencil->GetSpacing(stencilSpacing);
+    for (int i = 0; i < 3; i++)
+      {
+      info->StencilScale[i] = spacing[i]/stencilSpacing[i];
+      info->StencilOffset[i] = (origin[i] - stencilOrigin[i])/stencilSpacing[i];
+      }
+    }
+
+  // undo the scaling of the b-spline coefficients
+  info->TargetScale = 1.0/target->GetCoefficientScale();
+
+  // a single slice is sampled plane by plane, and the bounds for doing
+  // so are the target extent, pulled in slightly so that roundoff can
+  // never put a point outside of the interpolator's bounds
+  sourceImage->GetExtent(info->SourceExtent);
+  info->SourceIsSlice = (info->SourceExtent[4] == info->SourceExtent[5]);
+  int targetExtent[6];
+  targetImage->GetExtent(targetExtent);
+  for (int i = 0; i < 3; i++)
+    {
+    info->TargetBounds[2*i] = targetExtent[2*i] + 1e-3;
+    info->TargetBounds[2*i + 1] = targetExtent[2*i + 1] - 1e-3;
+    }
+
+  // quantize the source values for the histogram-based metrics
+  info->NumberOfBins[0] = 0;
+  info->NumberOfBins[1] = 0;
+
+  if (this->MetricType == vtkImageRegistration::CorrelationRatio)
+    {
+    // use the same bins as vtkImageCorrelationRatio
+    int scalarType = sourceImage->GetScalarType();
+    int numBins = 4096;
+    double binOrigin = sourceImageRange[0];
+    double binSpacing = 1.0;
+    if (scalarType == VTK_FLOAT || scalarType == VTK_DOUBLE)
+      {
+      binSpacing = (sourceImageRange[1] - sourceImageRange[0])/(numBins - 1);
+      // round to the nearest bin
+      binOrigin -= 0.5*binSpacing;
+      }
+    else
+      {
+      int intOrigin = static_cast<int>(sourceImageRange[0]);
+      int l = static_cast<int>(sourceImageRange[1]) - intOrigin;
+      if (l < numBins)
+        {
+        numBins = l + 1;
+        }
+      binOrigin = intOrigin;
+      binSpacing = (l + numBins)/numBins;
+      }
+    info->SampleBinOrigin = binOrigin;
+    info->SampleBinSpacing = binSpacing;
+    info->NumberOfBins[0] = numBins;
+    }
+  else if (
+    this->MetricType == vtkImageRegistration::MutualInformation ||
+    this->MetricType == vtkImageRegistration::NormalizedMutualInformation)
+    {
+    // use the same bins as vtkImageMutualInformation
+    for (int i = 0; i < 2; i++)
+      {
+      const double *range =
+        (i == 0 ? sourceImageRange : target->GetHistogramRange());
+      info->NumberOfBins[i] = this->JointHistogramSize[i];
+      info->BinOrigin[i] = range[0];
+      info->BinSpacing[i] =
+        (range[1] - range[0])/(this->JointHistogramSize[i] - 1);
+      }
+    info->SampleBinOrigin = info->BinOrigin[0] - 0.5*info->BinSpacing[0];
+    info->SampleBinSpacing = info->BinSpacing[0];
+    }
+
+  if (info->NumberOfBins[0] > 0)
+    {
+    buffer->ComputeBins(info->SampleBinOrigin, info->SampleBinSpacing,
+                        info->NumberOfBins[0]);
+    }
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
+{
+  // the time limit includes the time needed for initialization
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  info->Deadline = 0.0;
+  if (this->TimeLimit > 0)
+    {
+    info->Deadline = vtkTimerLog::GetUniversalTime() + this->TimeLimit;
+    }
+  info->Stopped = false;
+  info->BestValue = VTK_DOUBLE_MAX;
+  info->BestParameters.clear();
+  info->SourceQuantized = false;
+  this->Converged = 0;
+
+  // update our inputs
+  this->Update();
+
+  int transformDim = this->TransformDimensionality;
+  if (transformDim < 2) { transformDim = 2; }
+  if (transformDim > 3) { transformDim = 3; }
+
+  // the target preprocessing is done by a vtkImageRegistrationTarget,
+  // either one that was supplied or one that belongs to this object
+  vtkImageRegistrationTarget *target = this->PreparedTarget;
+  vtkImageData *targetImage =
+    (target ? target->GetImage() : this->GetTargetImage());
+  vtkImageData *sourceImage = this->GetSourceImage();
+
+  if (targetImage == NULL || sourceImage == NULL)
+    {
+    vtkErrorMacro("Initialize: Input images are not set");
+    return;
+    }
+
+  if (target)
+    {
+    // the shared target is never modified here, since it might be in
+    // use by other registrations
+    if (!target->IsPrepared())
+      {
+      vtkErrorMacro("Initialize: The PreparedTarget has not been prepared");
+      return;
+      }
+    if (target->GetMetricType() != this->MetricType ||
+        target->GetInterpolatorType() != this->InterpolatorType ||
+        target->GetJointHistogramSize()[0] != this->JointHistogramSize[0] ||
+        target->GetJointHistogramSize()[1] != this->JointHistogramSize[1] ||
+        target->GetImageRange()[0] != this->TargetImageRange[0] ||
+        target->GetImageRange()[1] != this->TargetImageRange[1] ||
+        target->GetCompactStorage() != this->CompactStorage)
+      {
+      vtkErrorMacro("Initialize: The PreparedTarget settings do not match "
+                    "the registration settings");
+      return;
+      }
+    }
+  else
+    {
+    target = this->InternalTarget;
+    target->SetImage(targetImage);
+    target->SetStencil(this->GetTargetImageStencil());
+    target->SetMetricType(this->MetricType);
+    target->SetInterpolatorType(this->InterpolatorType);
+    target->SetJointHistogramSize(this->JointHistogramSize);
+    target->SetImageRange(this->TargetImageRange);
+    target->SetCompactStorage(this->CompactStorage);
+    target->SetCoefficientScalarType(
+      sourceImage->GetScalarType() == VTK_DOUBLE ? VTK_DOUBLE : VTK_FLOAT);
+    target->Prepare();
+    }
+
+  // generate a foreground stencil if no source stencil was given
+  vtkImageStencilData *sourceStencil = this->GetSourceImageStencil();
+  if (sourceStencil == NULL && this->AutomaticSourceStencil)
+    {
+    if (this->ForegroundStencil == NULL)
+      {
+      this->ForegroundStencil = vtkImageStencilData::New();
+      }
+    this->ComputeForegroundStencil(sourceImage, this->ForegroundStencil);
+    sourceStencil = this->ForegroundStencil;
+    }
+
+  // get the source image center
+  double bounds[6];
+  double center[3];
+  double size[3];
+  sourceImage->GetBounds(bounds);
+  center[0] = 0.5*(bounds[0] + bounds[1]);
+  center[1] = 0.5*(bounds[2] + bounds[3]);
+  center[2] = 0.5*(bounds[4] + bounds[5]);
+  size[0] = (bounds[1] - bounds[0]);
+  size[1] = (bounds[3] - bounds[2]);
+  size[2] = (bounds[5] - bounds[4]);
+
+  vtkTransform *transform =
+    vtkTransform::SafeDownCast(this->Transform);
+  vtkMatrix4x4 *initialMatrix = this->InitialTransformMatrix;
+
+  // create an initial transform
+  initialMatrix->Identity();
+  transform->Identity();
+
+  // the initial translation
+  double tx = 0.0;
+  double ty = 0.0;
+  double tz = 0.0;
+
+  // initialize from the supplied matrix
+  if (matrix)
+    {
+    double translation[3];
+    vtkImageRegistrationSplitMatrix(
+      matrix, center, initialMatrix, translation);
+    tx = translation[0];
+    ty = translation[1];
+    tz = translation[2];
+    }
+
+  if (this->InitializerType == vtkImageRegistration::Centered ||
+      this->InitializerType == vtkImageRegistration::GridSearch)
+    {
+    // set an initial translation from one image center to the other image center
+    double tbounds[6];
+    double tcenter[3];
+    targetImage->GetBounds(tbounds);
+    tcenter[0] = 0.5*(tbounds[0] + tbounds[1]);
+    tcenter[1] = 0.5*(tbounds[2] + tbounds[3]);
+    tcenter[2] = 0.5*(tbounds[4] + tbounds[5]);
+
+    tx = tcenter[0] - center[0];
+    ty = tcenter[1] - center[1];
+    tz = tcenter[2] - center[2];
+    }
+
+  if (transformDim <= 2)
+    {
+    center[2] = 0.0;
+    tz = 0.0;
+    }
+
+  // compute the candidate transforms from the principal axes
+  std::vector<double> momentsOrientations;
+  std::vector<double> momentsTranslations;
+  if (this->InitializerType == vtkImageRegistration::Moments)
+    {
+    vtkImageStencilData *targetStencil = target->GetStencil();
+    double sourceRange[2];
+    double *targetRange = target->GetDataRange();
+    this->ComputeImageRange(sourceImage, sourceStencil, sourceRange);
+
+    vtkCalcCentroid *sourceMoments = vtkCalcCentroid::New();
+    sourceMoments->SetInput(sourceImage);
+    sourceMoments->SetStencil(sourceStencil);
+    sourceMoments->SetBackgroundLevel(sourceRange[0]);
+    vtkCalcCentroid *targetMoments = vtkCalcCentroid::New();
+    targetMoments->SetInput(targetImage);
+    targetMoments->SetStencil(targetStencil);
+    targetMoments->SetBackgroundLevel(targetRange[0]);
+
+    if (sourceMoments->GetTotalWeight() > 0 &&
+        targetMoments->GetTotalWeight() > 0)
+      {
+      double initial[16];
+      vtkMatrix4x4::DeepCopy(initial, initialMatrix);
+      vtkImageRegistrationMomentsCandidates(
+        sourceMoments->GetCentroid(), sourceMoments->GetCovarianceMatrix(),
+        targetMoments->GetCentroid(), targetMoments->GetCovarianceMatrix(),
+        center, transformDim,
+        (this->TransformType > vtkImageRegistration::Translation), initial,
+        &momentsOrientations, &momentsTranslations);
+      }
+    else
+      {
+      vtkWarningMacro("Initialize: Cannot compute moments for empty "
+                      "image, using Centered initializer.");
+      }
+
+    sourceMoments->Delete();
+    targetMoments->Delete();
+    }
+
+  // do the setup for mutual information, the target was already done
+  double sourceImageRange[2];
+  double targetImageRange[2];
+  sourceImageRange[0] = this->SourceImageRange[0];
+  sourceImageRange[1] = this->SourceImageRange[1];
+  targetImageRange[0] = target->GetHistogramRange()[0];
+  targetImageRange[1] = target->GetHistogramRange()[1];
+  targetImage = target->GetPreparedImage();
+
+  if (this->MetricType == vtkImageRegistration::MutualInformation ||
+      this->MetricType == vtkImageRegistration::NormalizedMutualInformation)
+    {
+    if (sourceImageRange[0] >= sourceImageRange[1])
+      {
+      this->ComputeImageRange(sourceImage, sourceStencil,
+        sourceImageRange);
+      }
+
     if (this->InterpolatorType == vtkImageRegistration::Nearest &&
         this->JointHistogramSize[0] <= 256 &&
         this->JointHistogramSize[1] <= 256)
@@ -688,24 +2413,10 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
       sourceQuantizer->Update();
       sourceImage = sourceQuantizer->GetOutput();
 
-      double targetScale = ((this->JointHistogramSize[0] - 1)/
-        (targetImageRange[1] - targetImageRange[0]));
-      double targetShift = (-targetImageRange[0] + 0.5/targetScale);
-
-      vtkImageShiftScale *targetQuantizer = this->TargetImageTypecast;
-      targetQuantizer->SET_INPUT_DATA(targetImage);
-      targetQuantizer->SetOutputScalarTypeToUnsignedChar();
-      targetQuantizer->ClampOverflowOn();
-      targetQuantizer->SetShift(targetShift);
-      targetQuantizer->SetScale(targetScale);
-      targetQuantizer->Update();
-      targetImage = targetQuantizer->GetOutput();
-
       // the rescaled image range is now the histogram range
-      targetImageRange[0] = 0;
-      targetImageRange[1] = this->JointHistogramSize[0] - 1;
       sourceImageRange[0] = 0;
       sourceImageRange[1] = this->JointHistogramSize[1] - 1;
+      info->SourceQuantized = true;
       }
     }
 
@@ -714,22 +2425,47 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
     {
     if (sourceImageRange[0] >= sourceImageRange[1])
       {
-      this->ComputeImageRange(sourceImage, this->GetSourceImageStencil(),
+      this->ComputeImageRange(sourceImage, sourceStencil,
         sourceImageRange);
       }
     }
 
-  // apply b-spline prefilter if b-spline interpolator is used
+  // the metric is computed directly from a buffer of source samples,
+  // except for NeighborhoodCorrelation, which needs whole neighborhoods,
+  // and for ASinc, which needs vtkImageReslice to set the blur factors
+  bool useSampleBuffer =
+    (this->UseSampleBuffer != 0 &&
+     this->MetricType != vtkImageRegistration::NeighborhoodCorrelation &&
+     this->InterpolatorType != vtkImageRegistration::ASinc);
+
+  // the scale to apply to the interpolated values, if compact storage
+  // is used for the b-spline coefficients
+  double coefficientScale = target->GetCoefficientScale();
+#ifndef VTK_RESLICE_HAS_OUTPUT_SCALAR_TYPE
+  if (!useSampleBuffer && coefficientScale != 1.0)
+    {
+    vtkErrorMacro("Initialize: CompactStorage requires VTK 6.2 or later "
+                  "when UseSampleBuffer is Off");
+    return;
+    }
+#endif
+  bool compactCoefficients = false;
+#ifndef VTK_RESLICE_HAS_OUTPUT_SCALAR_TYPE
+  if (useSampleBuffer)
+#endif
+    {
+    compactCoefficients = (this->CompactStorage != 0);
+    }
+
+  // the target has the b-spline coefficients, so make the source match
   if (this->InterpolatorType == vtkImageRegistration::BSpline)
     {
-    int scalarType = VTK_FLOAT;
-    if (targetImage->GetScalarType() == VTK_DOUBLE ||
-        sourceImage->GetScalarType() == VTK_DOUBLE)
-      {
-      scalarType = VTK_DOUBLE;
-      }
+    int scalarType = targetImage->GetScalarType();
 
-    if (sourceImage->GetScalarType() != scalarType)
+    // with compact storage, the reslice output will be float, and
+    // the sample buffer converts the source to float by itself
+    if (sourceImage->GetScalarType() != scalarType &&
+        !compactCoefficients && !useSampleBuffer)
       {
       vtkImageShiftScale *sourceCast = this->SourceImageTypecast;
       sourceCast->SET_INPUT_DATA(sourceImage);
@@ -740,16 +2476,26 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
       sourceCast->Update();
       sourceImage = sourceCast->GetOutput();
       }
+    }
 
-    vtkImageBSplineCoefficients *bspline = this->ImageBSpline;
-    bspline->SET_INPUT_DATA(targetImage);
-    bspline->SetOutputScalarType(scalarType);
-    bspline->Update();
-    targetImage = bspline->GetOutput();
+  // a shared target must not be connected to our filters, because other
+  // registrations might be updating their own filters concurrently
+  vtkImageData *targetCopy = NULL;
+  if (target == this->PreparedTarget && !useSampleBuffer)
+    {
+    targetCopy = vtkImageData::New();
+    targetCopy->ShallowCopy(targetImage);
+    targetImage = targetCopy;
     }
 
+  // with compact coefficients, vtkImageReslice produces float values
+  bool resliceToFloat = (compactCoefficients && !useSampleBuffer &&
+    this->InterpolatorType == vtkImageRegistration::BSpline);
+  int resliceType = (resliceToFloat ?
+                     VTK_FLOAT : targetImage->GetScalarType());
+
   // coerce types if NeighborhoodCorrelation
-  if (sourceImage->GetScalarType() != targetImage->GetScalarType() &&
+  if (sourceImage->GetScalarType() != resliceType &&
       this->MetricType == vtkImageRegistration::NeighborhoodCorrelation)
     {
     // coerce the types to make them compatible
@@ -759,7 +2505,13 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
     int targetSize = targetImage->GetScalarSize();
     int coercedType = VTK_DOUBLE;
 
-    if (sourceSize < targetSize)
+    if (resliceToFloat)
+      {
+      // the target is converted to float by vtkImageReslice
+      coercedType = VTK_FLOAT;
+      targetType = VTK_FLOAT;
+      }
+    else if (sourceSize < targetSize)
       {
       coercedType = targetType;
       }
@@ -797,133 +2549,173 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
       }
     }
 
-  vtkImageReslice *reslice = this->ImageReslice;
-  reslice->SetInformationInput(sourceImage);
-  reslice->SET_INPUT_DATA(targetImage);
-  reslice->SET_STENCIL_DATA(this->GetSourceImageStencil());
-  reslice->SetResliceTransform(this->Transform);
-  reslice->GenerateStencilOutputOn();
-  reslice->SetInterpolator(0);
-  switch (this->InterpolatorType)
-    {
-    case vtkImageRegistration::Nearest:
-      reslice->SetInterpolationModeToNearestNeighbor();
-      break;
-    case vtkImageRegistration::Linear:
-      reslice->SetInterpolationModeToLinear();
-      break;
-    case vtkImageRegistration::Cubic:
-      reslice->SetInterpolationModeToCubic();
-      break;
-    case vtkImageRegistration::BSpline:
-      {
-      vtkImageBSplineInterpolator *interp = vtkImageBSplineInterpolator::New();
-      reslice->SetInterpolator(interp);
-      interp->Delete();
-      }
-      break;
-    case vtkImageRegistration::Sinc:
-      {
-      vtkImageSincInterpolator *interp = vtkImageSincInterpolator::New();
-      interp->SetWindowFunctionToBlackman();
-      reslice->SetInterpolator(interp);
-      interp->Delete();
-      }
-      break;
-    case vtkImageRegistration::ASinc:
-      {
-      vtkImageSincInterpolator *interp = vtkImageSincInterpolator::New();
-      interp->SetWindowFunctionToBlackman();
-      interp->AntialiasingOn();
-      reslice->SetInterpolator(interp);
-      interp->Delete();
-      }
-      break;
-    case vtkImageRegistration::Label:
-      {
-      vtkLabelInterpolator *interp = vtkLabelInterpolator::New();
-      reslice->SetInterpolator(interp);
-      interp->Delete();
-      }
-      break;
-    }
-
   if (this->Metric)
     {
     this->Metric->RemoveAllInputs();
     this->Metric->Delete();
+    this->Metric = NULL;
     }
+  this->Interpolator = NULL;
+  this->SampleBuffer->Initialize();
+  this->RegistrationInfo->TargetStencil = NULL;
+  this->RegistrationInfo->SourceIsSlice = false;
 
-  switch (this->MetricType)
+  if (useSampleBuffer)
     {
-    case vtkImageRegistration::SquaredDifference:
+    this->InitializeSampleBuffer(sourceImage, sourceStencil, target,
+      sourceImageRange);
+    }
+  else
+    {
+    if (target->GetStencil())
       {
-      vtkImageSquaredDifference *metric = vtkImageSquaredDifference::New();
-      this->Metric = metric;
-
-      metric->SET_INPUT_DATA(sourceImage);
-      metric->SetInputConnection(1, reslice->GetOutputPort());
-      metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+      vtkWarningMacro("Initialize: The target stencil is not supported "
+                      "for this metric and interpolator, ignoring it.");
       }
-      break;
 
-    case vtkImageRegistration::CrossCorrelation:
-    case vtkImageRegistration::NormalizedCrossCorrelation:
+    vtkImageReslice *reslice = this->ImageReslice;
+    reslice->SetInformationInput(sourceImage);
+    reslice->SET_INPUT_DATA(targetImage);
+    reslice->SET_STENCIL_DATA(sourceStencil);
+    reslice->SetResliceTransform(this->Transform);
+    reslice->GenerateStencilOutputOn();
+#ifdef VTK_RESLICE_HAS_OUTPUT_SCALAR_TYPE
+    if (compactCoefficients &&
+        this->InterpolatorType == vtkImageRegistration::BSpline)
       {
-      vtkImageCrossCorrelation *metric = vtkImageCrossCorrelation::New();
-      this->Metric = metric;
-
-      metric->SET_INPUT_DATA(sourceImage);
-      metric->SetInputConnection(1, reslice->GetOutputPort());
-      metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+      // undo the coefficient scaling, and keep the full precision
+      reslice->SetOutputScalarType(VTK_FLOAT);
+      reslice->SetScalarShift(0.0);
+      reslice->SetScalarScale(1.0/coefficientScale);
       }
-      break;
-
-    case vtkImageRegistration::NeighborhoodCorrelation:
+    else
       {
-      vtkImageNeighborhoodCorrelation *metric =
-        vtkImageNeighborhoodCorrelation::New();
-      this->Metric = metric;
-
-      metric->SET_INPUT_DATA(sourceImage);
-      metric->SetInputConnection(1, reslice->GetOutputPort());
-      metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+      reslice->SetOutputScalarType(-1);
+      reslice->SetScalarShift(0.0);
+      reslice->SetScalarScale(1.0);
+      }
+#endif
+    reslice->SetInterpolator(0);
+    switch (this->InterpolatorType)
+      {
+      case vtkImageRegistration::Nearest:
+        reslice->SetInterpolationModeToNearestNeighbor();
+        break;
+      case vtkImageRegistration::Linear:
+        reslice->SetInterpolationModeToLinear();
+        break;
+      case vtkImageRegistration::Cubic:
+        reslice->SetInterpolationModeToCubic();
+        break;
+      case vtkImageRegistration::BSpline:
+        {
+        vtkImageBSplineInterpolator *interp = vtkImageBSplineInterpolator::New();
+        reslice->SetInterpolator(interp);
+        interp->Delete();
+        }
+        break;
+      case vtkImageRegistration::Sinc:
+        {
+        vtkImageSincInterpolator *interp = vtkImageSincInterpolator::New();
+        interp->SetWindowFunctionToBlackman();
+        reslice->SetInterpolator(interp);
+        interp->Delete();
+        }
+        break;
+      case vtkImageRegistration::ASinc:
+        {
+        vtkImageSincInterpolator *interp = vtkImageSincInterpolator::New();
+        interp->SetWindowFunctionToBlackman();
+        interp->AntialiasingOn();
+        reslice->SetInterpolator(interp);
+        interp->Delete();
+        }
+        break;
+      case vtkImageRegistration::Label:
+        {
+        vtkLabelInterpolator *interp = vtkLabelInterpolator::New();
+        reslice->SetInterpolator(interp);
+        interp->Delete();
+        }
+        break;
       }
-      break;
 
-    case vtkImageRegistration::CorrelationRatio:
+    switch (this->MetricType)
       {
-      vtkImageCorrelationRatio *metric = vtkImageCorrelationRatio::New();
-      this->Metric = metric;
+      case vtkImageRegistration::SquaredDifference:
+        {
+        vtkImageSquaredDifference *metric = vtkImageSquaredDifference::New();
+        this->Metric = metric;
 
-      metric->SET_INPUT_DATA(sourceImage);
-      metric->SetInputConnection(1, reslice->GetOutputPort());
-      metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+        metric->SET_INPUT_DATA(sourceImage);
+        metric->SetInputConnection(1, reslice->GetOutputPort());
+        metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+        }
+        break;
 
-      metric->SetDataRange(sourceImageRange);
-      }
-      break;
+      case vtkImageRegistration::CrossCorrelation:
+      case vtkImageRegistration::NormalizedCrossCorrelation:
+        {
+        vtkImageCrossCorrelation *metric = vtkImageCrossCorrelation::New();
+        this->Metric = metric;
 
-    case vtkImageRegistration::MutualInformation:
-    case vtkImageRegistration::NormalizedMutualInformation:
-      {
-      vtkImageMutualInformation *metric = vtkImageMutualInformation::New();
-      this->Metric = metric;
+        metric->SET_INPUT_DATA(sourceImage);
+        metric->SetInputConnection(1, reslice->GetOutputPort());
+        metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+        }
+        break;
+
+      case vtkImageRegistration::NeighborhoodCorrelation:
+        {
+        vtkImageNeighborhoodCorrelation *metric =
+          vtkImageNeighborhoodCorrelation::New();
+        this->Metric = metric;
+
+        metric->SET_INPUT_DATA(sourceImage);
+        metric->SetInputConnection(1, reslice->GetOutputPort());
+        metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+        }
+        break;
+
+      case vtkImageRegistration::CorrelationRatio:
+        {
+        vtkImageCorrelationRatio *metric = vtkImageCorrelationRatio::New();
+        this->Metric = metric;
 
-      metric->SET_INPUT_DATA(sourceImage);
-      metric->SetInputConnection(1, reslice->GetOutputPort());
-      metric->SetInputConnection(2, reslice->GetStencilOutputPort());
-      metric->SetNumberOfBins(this->JointHistogramSize);
+        metric->SET_INPUT_DATA(sourceImage);
+        metric->SetInputConnection(1, reslice->GetOutputPort());
+        metric->SetInputConnection(2, reslice->GetStencilOutputPort());
 
-      metric->SetBinOrigin(
-        sourceImageRange[0], targetImageRange[0]);
-      metric->SetBinSpacing(
-        (sourceImageRange[1] - sourceImageRange[0])/
-          (this->JointHistogramSize[0]-1),
-        (targetImageRange[1] - targetImageRange[0])/
-          (this->JointHistogramSize[1]-1));
+        metric->SetDataRange(sourceImageRange);
+        }
+        break;
+
+      case vtkImageRegistration::MutualInformation:
+      case vtkImageRegistration::NormalizedMutualInformation:
+        {
+        vtkImageMutualInformation *metric = vtkImageMutualInformation::New();
+        this->Metric = metric;
+
+        metric->SET_INPUT_DATA(sourceImage);
+        metric->SetInputConnection(1, reslice->GetOutputPort());
+        metric->SetInputConnection(2, reslice->GetStencilOutputPort());
+        metric->SetNumberOfBins(this->JointHistogramSize);
+
+        metric->SetBinOrigin(
+          sourceImageRange[0], targetImageRange[0]);
+        metric->SetBinSpacing(
+          (sourceImageRange[1] - sourceImageRange[0])/
+            (this->JointHistogramSize[0]-1),
+          (targetImageRange[1] - targetImageRange[0])/
+            (this->JointHistogramSize[1]-1));
+        }
+        break;
       }
-      break;
+    }
+
+  if (targetCopy)
+    {
+    targetCopy->Delete();
     }
 
   if (this->Optimizer != NULL)
@@ -931,8 +2723,29 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
     this->Optimizer->Delete();
     }
 
-  vtkPowellMinimizer *optimizer = vtkPowellMinimizer::New();
+  vtkPowellMinimizer *optimizer = 0;
+  if (this->OptimizerType == vtkImageRegistration::CMAES)
+    {
+    optimizer = vtkCMAESMinimizer::New();
+    }
+  else if (this->OptimizerType == vtkImageRegistration::TrustRegion)
+    {
+    optimizer = vtkTrustRegionMinimizer::New();
+    }
+  else if (this->OptimizerType == vtkImageRegistration::Amoeba)
+    {
+    vtkSimplexMinimizer *amoeba = vtkSimplexMinimizer::New();
+    // use golden ratio for amoeba
+    amoeba->SetExpansionRatio(1.618);
+    amoeba->SetContractionRatio(0.618);
+    optimizer = amoeba;
+    }
+  else
+    {
+    optimizer = vtkPowellMinimizer::New();
+    }
   this->Optimizer = optimizer;
+  optimizer->SetBatchFunction(&vtkBatchEvaluateFunction);
   optimizer->SetTolerance(this->MetricTolerance);
   optimizer->SetParameterTolerance(this->TransformTolerance);
   optimizer->SetMaxIterations(this->MaximumNumberOfIterations);
@@ -940,8 +2753,17 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
   this->RegistrationInfo->Transform = this->Transform;
   this->RegistrationInfo->Optimizer = this->Optimizer;
   this->RegistrationInfo->Metric = this->Metric;
+  this->RegistrationInfo->Interpolator =
+    vtkAbstractImageInterpolator::SafeDownCast(this->Interpolator);
+  this->RegistrationInfo->SampleBuffer = this->SampleBuffer;
   this->RegistrationInfo->InitialMatrix = this->InitialTransformMatrix;
 
+  // lower fidelity is only possible when using the sample buffer
+  if (this->ProgressiveFidelity && this->RegistrationInfo->Interpolator)
+    {
+    optimizer->SetNumberOfFidelityLevels(3);
+    }
+
   this->RegistrationInfo->TransformDimensionality =
     this->TransformDimensionality;
   this->RegistrationInfo->TransformType = this->TransformType;
@@ -954,15 +2776,25 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
   this->RegistrationInfo->Center[1] = center[1];
   this->RegistrationInfo->Center[2] = center[2];
 
-  /*
-  vtkAmoebaOptimizer *amoeba = vtkAmoebaOptimizer::SafeDownCast(optimizer);
-  if (amoeba)
+  // choose the initial orientation from the candidates
+  double translation[3];
+  translation[0] = tx;
+  translation[1] = ty;
+  translation[2] = tz;
+  if (this->InitializerType == vtkImageRegistration::GridSearch)
     {
-    // use golden ratio for amoeba
-    amoeba->SetExpansionRatio(1.618);
-    amoeba->SetContractionRatio(0.618);
+    this->ExecuteGridSearch(translation);
     }
-  */
+  else if (this->InitializerType == vtkImageRegistration::Moments &&
+           !momentsTranslations.empty())
+    {
+    this->SelectInitialTransform(
+      static_cast<int>(momentsTranslations.size()/3),
+      &momentsOrientations[0], &momentsTranslations[0], translation);
+    }
+  tx = translation[0];
+  ty = translation[1];
+  tz = translation[2];
 
   optimizer->SetFunction(&vtkEvaluateFunction,
                          (void*)(this->RegistrationInfo));
@@ -1061,12 +2893,352 @@ void vtkImageRegistration::Initialize(vtkMatrix4x4 *matrix)
     optimizer->SetParameterScale(pcount++, rscale*0.25);
     }
 
+  // adjust the scales according to the curvature of the metric
+  if (this->AutomaticParameterScales)
+    {
+    this->CalibrateParameterScales();
+    }
+
+  // the cache of metric values is only valid for these parameters
+  vtkImageRegistrationResetCache(this->RegistrationInfo, optimizer);
+
   // build the initial transform from the parameters
   vtkSetTransformParameters(this->RegistrationInfo);
 
   this->Modified();
 }
 
+//--------------------------------------------------------------------------
+void vtkImageRegistration::InitializeNextSlice(vtkMatrix4x4 *matrix)
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  vtkPowellMinimizer *optimizer =
+    vtkPowellMinimizer::SafeDownCast(this->Optimizer);
+
+  // copy the matrix, since it might be the matrix of our own transform
+  vtkMatrix4x4 *startMatrix = vtkMatrix4x4::New();
+  startMatrix->DeepCopy(matrix ? matrix : this->Transform->GetMatrix());
+
+  this->Update();
+  vtkImageData *sourceImage = this->GetSourceImage();
+
+  // the previous initialization can only be kept if it used the sample
+  // buffer for a slice, and if the slice geometry and target are the same
+  bool keep = (optimizer != NULL && info->Interpolator != NULL &&
+               info->SourceIsSlice && sourceImage != NULL);
+  if (keep)
+    {
+    vtkImageRegistrationTarget *target = this->PreparedTarget;
+    if (target == NULL)
+      {
+      target = this->InternalTarget;
+      keep = (target->GetImage() == this->GetTargetImage() &&
+              target->GetStencil() == this->GetTargetImageStencil());
+      }
+    keep = (keep && target->IsPrepared());
+
+    int extent[6];
+    double origin[3];
+    double spacing[3];
+    sourceImage->GetExtent(extent);
+    sourceImage->GetOrigin(origin);
+    sourceImage->GetSpacing(spacing);
+    for (int i = 0; i < 3; i++)
+      {
+      keep = (keep &&
+              extent[2*i] == info->SourceExtent[2*i] &&
+              extent[2*i + 1] == info->SourceExtent[2*i + 1] &&
+              origin[i] == info->SourceMatrix[4*i + 3] &&
+              spacing[i] == info->SourceMatrix[4*i + i]);
+      }
+    }
+
+  if (!keep)
+    {
+    this->Initialize(startMatrix);
+    startMatrix->Delete();
+    return;
+    }
+
+  info->Deadline = 0.0;
+  if (this->TimeLimit > 0)
+    {
+    info->Deadline = vtkTimerLog::GetUniversalTime() + this->TimeLimit;
+    }
+  info->Stopped = false;
+  info->BestValue = VTK_DOUBLE_MAX;
+  info->BestParameters.clear();
+  info->NumberOfEvaluations = 0;
+  this->Converged = 0;
+
+  // the stencil and the quantization are redone for the new values
+  vtkImageStencilData *sourceStencil = this->GetSourceImageStencil();
+  if (sourceStencil == NULL && this->AutomaticSourceStencil)
+    {
+    if (this->ForegroundStencil == NULL)
+      {
+      this->ForegroundStencil = vtkImageStencilData::New();
+      }
+    this->ComputeForegroundStencil(sourceImage, this->ForegroundStencil);
+    sourceStencil = this->ForegroundStencil;
+    }
+  if (info->SourceQuantized)
+    {
+    vtkImageShiftScale *sourceQuantizer = this->SourceImageTypecast;
+    sourceQuantizer->SET_INPUT_DATA(sourceImage);
+    sourceQuantizer->Update();
+    sourceImage = sourceQuantizer->GetOutput();
+    }
+
+  // refill the sample buffer, which reuses its memory, and use the same
+  // bins as before so that the metric values are comparable
+  vtkImageSampleBuffer *buffer = this->SampleBuffer;
+  buffer->BuildBuffer(sourceImage, sourceStencil);
+  if (info->NumberOfBins[0] > 0)
+    {
+    buffer->ComputeBins(info->SampleBinOrigin, info->SampleBinSpacing,
+                        info->NumberOfBins[0]);
+    }
+
+  // restart the optimizer from the matrix, with the same scales
+  int n = optimizer->GetNumberOfParameters();
+  std::vector<double> scales(n);
+  for (int i = 0; i < n; i++)
+    {
+    scales[i] = optimizer->GetParameterScale(i);
+    }
+
+  double translation[3];
+  vtkImageRegistrationSplitMatrix(
+    startMatrix, info->Center, this->InitialTransformMatrix, translation);
+  startMatrix->Delete();
+  if (info->TransformDimensionality <= 2)
+    {
+    translation[2] = 0.0;
+    }
+
+  optimizer->Initialize();
+  int pcount = (info->TransformDimensionality > 2 ? 3 : 2);
+  for (int i = 0; i < n; i++)
+    {
+    optimizer->SetParameterValue(i, (i < pcount ? translation[i] : 0.0));
+    optimizer->SetParameterScale(i, scales[i]);
+    }
+
+  vtkImageRegistrationResetCache(info, optimizer);
+  vtkSetTransformParameters(info);
+
+  this->Modified();
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::ExecuteGridSearch(double translation[3])
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  bool is3D = (info->TransformDimensionality > 2);
+
+  // the rotation angles to try for each axis
+  std::vector<double> angles;
+  if (this->TransformType > vtkImageRegistration::Translation &&
+      this->GridSearchStep > 0)
+    {
+    int m = static_cast<int>(this->GridSearchRange/this->GridSearchStep +
+                             1e-6);
+    for (int i = -m; i <= m; i++)
+      {
+      angles.push_back(vtkMath::RadiansFromDegrees(i*this->GridSearchStep));
+      }
+    }
+  else
+    {
+    angles.push_back(0.0);
+    }
+  int na = static_cast<int>(angles.size());
+  int nax = (is3D ? na : 1);
+
+  // the flips to try, as scale factors for the source axes
+  static const double flips[4][3] = {
+    { 1.0, 1.0, 1.0 },
+    { -1.0, 1.0, 1.0 },
+    { 1.0, -1.0, 1.0 },
+    { 1.0, 1.0, -1.0 } };
+  int nf = (this->GridSearchFlips ? (is3D ? 4 : 3) : 1);
+
+  // build the orientation matrix for each candidate, where the first
+  // candidate is the initial orientation
+  std::vector<double> orientations;
+  std::vector<double> translations;
+  vtkTransform *transform = vtkTransform::New();
+  transform->PostMultiply();
+  for (int f = 0; f < nf; f++)
+    {
+    for (int a = -1; a < nax*nax*na; a++)
+      {
+      double rx = 0.0;
+      double ry = 0.0;
+      double rz = 0.0;
+      if (a >= 0)
+        {
+        if (is3D)
+          {
+          rx = angles[a/(na*na)];
+          ry = angles[(a/na) % na];
+          }
+        rz = angles[a % na];
+        if (f == 0 && rx == 0 && ry == 0 && rz == 0)
+          {
+          // this is the initial orientation, which is already present
+          continue;
+          }
+        }
+      else if (f != 0)
+        {
+        continue;
+        }
+
+      transform->Identity();
+      transform->Scale(flips[f][0], flips[f][1], flips[f][2]);
+      transform->Concatenate(info->InitialMatrix);
+      vtkTransformRotation(transform, rx, ry, rz);
+      double orientation[16];
+      vtkMatrix4x4::DeepCopy(orientation, transform->GetMatrix());
+      orientations.insert(orientations.end(), orientation, orientation + 16);
+      translations.insert(translations.end(), translation, translation + 3);
+      }
+    }
+  transform->Delete();
+
+  int n = static_cast<int>(orientations.size()/16);
+  this->SelectInitialTransform(
+    n, &orientations[0], &translations[0], translation);
+}
+
+//--------------------------------------------------------------------------
+// Evaluate the metric at the initial parameters, and at one scale unit
+// to either side along each parameter, to estimate the curvature along
+// each parameter.  The scales are then adjusted so that the curvature is
+// the same (the geometric mean) for all parameters.  The adjustments are
+// stored as factors relative to the heuristic scales, so that they can
+// be reused at other resolutions.
+void vtkImageRegistration::CalibrateParameterScales()
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  vtkPowellMinimizer *optimizer =
+    vtkPowellMinimizer::SafeDownCast(this->Optimizer);
+  int n = optimizer->GetNumberOfParameters();
+
+  std::vector<double> &factors = info->ScaleFactors;
+  if (static_cast<int>(factors.size()) != n)
+    {
+    // the probes: the initial point, and two points per parameter
+    std::vector<double> probes((2*n + 1)*n);
+    for (int m = 0; m < 2*n + 1; m++)
+      {
+      for (int i = 0; i < n; i++)
+        {
+        probes[m*n + i] = optimizer->GetParameterValue(i);
+        }
+      if (m > 0)
+        {
+        int i = (m - 1)/2;
+        double h = optimizer->GetParameterScale(i);
+        probes[m*n + i] += (m % 2 == 1 ? h : -h);
+        }
+      }
+
+    // evaluate all of the probes in a single pass
+    std::vector<double> values(2*n + 1);
+    vtkImageRegistrationResetCache(info, optimizer);
+    vtkBatchEvaluateFunction(info, 2*n + 1, &probes[0], &values[0]);
+    if (info->Stopped)
+      {
+      return;
+      }
+
+    // the curvature along each parameter, in units of the scales
+    std::vector<double> curvature(n);
+    double logsum = 0.0;
+    int count = 0;
+    for (int i = 0; i < n; i++)
+      {
+      curvature[i] = values[2*i + 1] + values[2*i + 2] - 2*values[0];
+      if (curvature[i] > 0)
+        {
+        logsum += log(curvature[i]);
+        count++;
+        }
+      }
+
+    // parameters with no measurable curvature keep their scales, and
+    // the factors are limited so that noise cannot do much harm
+    factors.assign(n, 1.0);
+    if (count > 0)
+      {
+      double mean = exp(logsum/count);
+      for (int i = 0; i < n; i++)
+        {
+        if (curvature[i] > 0)
+          {
+          double f = sqrt(mean/curvature[i]);
+          f = (f > 0.25 ? f : 0.25);
+          f = (f < 4.0 ? f : 4.0);
+          factors[i] = f;
+          }
+        }
+      }
+    }
+
+  for (int i = 0; i < n; i++)
+    {
+    optimizer->SetParameterScale(
+      i, optimizer->GetParameterScale(i)*factors[i]);
+    }
+}
+
+//--------------------------------------------------------------------------
+void vtkImageRegistration::SelectInitialTransform(
+  int n, const double *orientations, const double *translations,
+  double translation[3])
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  const double *center = info->Center;
+
+  // build the full matrix for each candidate
+  std::vector<double> matrices(16*n);
+  vtkTransform *transform = vtkTransform::New();
+  transform->PostMultiply();
+  for (int m = 0; m < n; m++)
+    {
+    const double *t = translations + 3*m;
+    transform->Identity();
+    transform->Translate(-center[0], -center[1], -center[2]);
+    transform->Concatenate(orientations + 16*m);
+    transform->Translate(center[0], center[1], center[2]);
+    transform->Translate(t[0], t[1], t[2]);
+    vtkMatrix4x4::DeepCopy(&matrices[16*m], transform->GetMatrix());
+    }
+  transform->Delete();
+
+  // evaluate the metric for all of the candidates
+  std::vector<double> values(n);
+  vtkImageRegistrationEvaluateMatrixList(info, n, &matrices[0], &values[0]);
+
+  // use the candidate with the best value
+  int best = 0;
+  for (int m = 1; m < n; m++)
+    {
+    if (values[m] < values[best])
+      {
+      best = m;
+      }
+    }
+
+  this->InitialTransformMatrix->DeepCopy(orientations + 16*best);
+  translation[0] = translations[3*best];
+  translation[1] = translations[3*best + 1];
+  translation[2] = translations[3*best + 2];
+}
+
 //--------------------------------------------------------------------------
 int vtkImageRegistration::ExecuteRegistration()
 {
@@ -1096,10 +3268,20 @@ int vtkImageRegistration::ExecuteRegistration()
         break;
         }
       converged = !optimizer->Iterate();
+      if (this->RegistrationInfo->Stopped)
+        {
+        converged = 0;
+        break;
+        }
       vtkSetTransformParameters(this->RegistrationInfo);
       this->MetricValue = optimizer->GetFunctionValue();
       }
 
+    vtkImageRegistrationUseBest(this->RegistrationInfo);
+    vtkSetTransformParameters(this->RegistrationInfo);
+    this->MetricValue = optimizer->GetFunctionValue();
+    this->Converged = converged;
+
     if (converged && !this->AbortExecute)
       {
       this->UpdateProgress(1.0);
@@ -1112,6 +3294,27 @@ int vtkImageRegistration::ExecuteRegistration()
   return converged;
 }
 
+//--------------------------------------------------------------------------
+double vtkImageRegistration::EvaluateMetric(vtkMatrix4x4 *matrix)
+{
+  vtkImageRegistrationInfo *info = this->RegistrationInfo;
+  if (info->Optimizer == NULL)
+    {
+    vtkErrorMacro("EvaluateMetric: Initialize() must be called first");
+    return VTK_DOUBLE_MAX;
+    }
+
+  double elements[16];
+  vtkMatrix4x4::DeepCopy(elements, matrix);
+  double value = 0.0;
+  vtkImageRegistrationEvaluateMatrixList(info, 1, elements, &value);
+
+  // the metric filter uses the registration transform, so restore it
+  vtkSetTransformParameters(info);
+
+  return value;
+}
+
 //--------------------------------------------------------------------------
 int vtkImageRegistration::Iterate()
 {
@@ -1121,10 +3324,21 @@ int vtkImageRegistration::Iterate()
   if (optimizer)
     {
     int result = optimizer->Iterate();
-    if (optimizer->GetIterations() >= this->MaximumNumberOfIterations)
+    this->Converged = !result;
+    if (this->RegistrationInfo->Stopped)
       {
+      this->Converged = 0;
       result = 0;
       }
+    else if (result &&
+             optimizer->GetIterations() >= this->MaximumNumberOfIterations)
+      {
+      result = 0;
+      }
+    if (result == 0)
+      {
+      vtkImageRegistrationUseBest(this->RegistrationInfo);
+      }
     vtkSetTransformParameters(this->RegistrationInfo);
     this->MetricValue = optimizer->GetFunctionValue();
     return result;
@@ -1144,7 +3358,7 @@ int vtkImageRegistration::UpdateRegistration()
 int vtkImageRegistration::FillInputPortInformation(int port,
                                                    vtkInformation* info)
 {
-  if (port == 2)
+  if (port == 2 || port == 3)
     {
     info->Set(vtkAlgorithm::INPUT_REQUIRED_DATA_TYPE(), "vtkImageStencilData");
     // the stencil input is optional
@@ -1154,6 +3368,11 @@ int vtkImageRegistration::FillInputPortInformation(int port,
     {
     info->Set(vtkAlgorithm::INPUT_REQUIRED_DATA_TYPE(), "vtkImageData");
     info->Set(vtkAlgorithm::INPUT_IS_REPEATABLE(), 1);
+    if (port == 1)
+      {
+      // the target input is not needed if a prepared target is set
+      info->Set(vtkAlgorithm::INPUT_IS_OPTIONAL(), 1);
+      }
     }
 
   return 1;
@@ -1182,24 +3401,38 @@ int vtkImageRegistration::RequestUpdateExtent(
   vtkInformationVector *vtkNotUsed(outputVector))
 {
   int inExt[6];
+  int targetExt[6];
 
   // source image
   vtkInformation *inInfo = inputVector[0]->GetInformationObject(0);
   inInfo->Get(vtkStreamingDemandDrivenPipeline::WHOLE_EXTENT(), inExt);
   inInfo->Set(vtkStreamingDemandDrivenPipeline::UPDATE_EXTENT(), inExt, 6);
 
-  // target image
-  inInfo = inputVector[1]->GetInformationObject(0);
-  inInfo->Get(vtkStreamingDemandDrivenPipeline::WHOLE_EXTENT(), inExt);
-  inInfo->Set(vtkStreamingDemandDrivenPipeline::UPDATE_EXTENT(), inExt, 6);
+  // target image, which is optional if a prepared target is used
+  if (this->GetNumberOfInputConnections(1) > 0)
+    {
+    inInfo = inputVector[1]->GetInformationObject(0);
+    inInfo->Get(vtkStreamingDemandDrivenPipeline::WHOLE_EXTENT(), targetExt);
+    inInfo->Set(vtkStreamingDemandDrivenPipeline::UPDATE_EXTENT(),
+                targetExt, 6);
+    }
 
-  // stencil for target image
+  // stencil for source image
   if (this->GetNumberOfInputConnections(2) > 0)
     {
     vtkInformation *inInfo2 = inputVector[2]->GetInformationObject(0);
     inInfo2->Set(vtkStreamingDemandDrivenPipeline::UPDATE_EXTENT(), inExt, 6);
     }
 
+  // stencil for target image
+  if (this->GetNumberOfInputConnections(1) > 0 &&
+      this->GetNumberOfInputConnections(3) > 0)
+    {
+    vtkInformation *inInfo3 = inputVector[3]->GetInformationObject(0);
+    inInfo3->Set(vtkStreamingDemandDrivenPipeline::UPDATE_EXTENT(),
+                 targetExt, 6);
+    }
+
   return 1;
 }
 //----------------------------------------------------------------------------
@@ -51,7 +51,8 @@ class vtkLinearTransform;
 class vtkMatrix4x4;
 class vtkImageReslice;
 class vtkImageShiftScale;
-class vtkImageBSplineCoefficients;
+class vtkImageSampleBuffer;
+class vtkImageRegistrationTarget;
 
 struct vtkImageRegistrationInfo;
 
@@ -93,11 +94,39 @@ public:
   void SetSourceImageStencil(vtkImageStencilData *stencil);
   vtkImageStencilData *GetSourceImageStencil();
 
+  // Description:
+  // Set a stencil for the target image, in the target image coordinates.
+  // Source voxels that map to positions outside of this stencil will be
+  // ignored, without the target being interpolated at those positions.
+  // This is useful for restricting the registration to the anatomy of
+  // interest, or to the reconstructed field of view of the target.
+  // The target stencil is ignored for the NeighborhoodCorrelation metric
+  // and for the ASinc interpolator.
+  void SetTargetImageStencil(vtkImageStencilData *stencil);
+  vtkImageStencilData *GetTargetImageStencil();
+
+  // Description:
+  // Use a target that has already been prepared, instead of the target
+  // image and the target stencil.  This allows many registrations to
+  // share a target without each of them repeating the preprocessing,
+  // and the registrations can run concurrently on different threads.
+  // The target must be prepared before Initialize() is called, and its
+  // settings must match those of the registration.  This method changes
+  // the reference count of the target, as does the destructor, so if the
+  // target is shared between threads then the caller must serialize
+  // these calls, e.g. with a lock.  Initialize() and Iterate() do not
+  // change the reference counts of the target or its interpolator.
+  virtual void SetPreparedTarget(vtkImageRegistrationTarget *target);
+  vtkImageRegistrationTarget *GetPreparedTarget() {
+    return this->PreparedTarget; }
+
   // Optimizer types
   enum
   {
     Amoeba,
-    Powell
+    Powell,
+    CMAES,
+    TrustRegion
   };
 
   // Metric types
@@ -139,7 +168,9 @@ public:
   enum
   {
     None,
-    Centered
+    Centered,
+    GridSearch,
+    Moments
   };
 
   // Description:
@@ -160,12 +191,23 @@ public:
   vtkGetMacro(MetricType, int);
 
   // Description:
-  // Set the optimizer.  The default is Powell.
+  // Set the optimizer.  The default is Powell.  Amoeba is the simplex
+  // method, which evaluates the vertices of its initial simplex (and of
+  // the simplex after each shrink step) in one pass through the sample
+  // buffer.  CMAES is a population-based global optimizer that is slower,
+  // but less likely to be caught in a local minimum.  It evaluates each
+  // population of candidate transforms in one pass through the sample
+  // buffer.  TrustRegion builds quadratic models of the metric, and
+  // usually needs the fewest metric evaluations for smooth metrics.
   vtkSetMacro(OptimizerType, int);
   void SetOptimizerTypeToAmoeba() {
     this->SetOptimizerType(Amoeba); }
   void SetOptimizerTypeToPowell() {
     this->SetOptimizerType(Powell); }
+  void SetOptimizerTypeToCMAES() {
+    this->SetOptimizerType(CMAES); }
+  void SetOptimizerTypeToTrustRegion() {
+    this->SetOptimizerType(TrustRegion); }
   vtkGetMacro(OptimizerType, int);
 
   // Description:
@@ -219,14 +261,42 @@ public:
   // Description:
   // Set the initializer type.  The default is None.  The Centered
   // initializer sets an initial translation that will center the
-  // images over each other.
+  // images over each other.  The GridSearch initializer centers the
+  // images, and then evaluates the metric over a grid of rotations
+  // (and optionally flips) to choose the initial orientation.  It is
+  // meant to be used at the coarsest resolution.  The Moments initializer
+  // matches the centroids and the principal axes of the two images, and
+  // uses the metric to choose between the possible directions of the axes.
+  // For Moments, the rotation part of the supplied matrix is only used
+  // if the TransformType is Translation.
   vtkSetMacro(InitializerType, int);
   void SetInitializerTypeToNone() {
     this->SetInitializerType(None); }
   void SetInitializerTypeToCentered() {
     this->SetInitializerType(Centered); }
+  void SetInitializerTypeToGridSearch() {
+    this->SetInitializerType(GridSearch); }
+  void SetInitializerTypeToMoments() {
+    this->SetInitializerType(Moments); }
   vtkGetMacro(InitializerType, int);
 
+  // Description:
+  // Set the range and the step size, in degrees, for the rotations that
+  // are tried by the GridSearch initializer.  The rotations are sampled
+  // over this range for each axis.  The defaults are 90 and 30 degrees.
+  vtkSetMacro(GridSearchRange, double);
+  vtkGetMacro(GridSearchRange, double);
+  vtkSetMacro(GridSearchStep, double);
+  vtkGetMacro(GridSearchStep, double);
+
+  // Description:
+  // Also try flipping each source axis for the GridSearch initializer.
+  // This is useful if the handedness of one image might be wrong.
+  // The default is Off.
+  vtkSetMacro(GridSearchFlips, int);
+  vtkBooleanMacro(GridSearchFlips, int);
+  vtkGetMacro(GridSearchFlips, int);
+
   // Description:
   // Set the size of the joint histogram for mutual information.
   // The default size is 64 by 64.
@@ -243,6 +313,105 @@ public:
   vtkGetVector2Macro(SourceImageRange, double);
   vtkGetVector2Macro(TargetImageRange, double);
 
+  // Description:
+  // Store the b-spline coefficients of the target image as scaled 16-bit
+  // integers instead of as float or double.  This reduces the memory
+  // needed for the coefficients by a factor of two or four, at the cost
+  // of a small quantization error.  Usually the metric is computed from
+  // a buffer of source samples, which rescales the interpolated values
+  // itself and works with any VTK version.  For NeighborhoodCorrelation,
+  // vtkImageReslice is used instead, and it rescales the values and
+  // converts them to float, which requires VTK 6.2 or later (with older
+  // versions, this setting is ignored for NeighborhoodCorrelation).  This
+  // setting is ignored unless the interpolator is BSpline.  The default
+  // is Off.
+  vtkSetMacro(CompactStorage, int);
+  vtkBooleanMacro(CompactStorage, int);
+  vtkGetMacro(CompactStorage, int);
+
+  // Description:
+  // Set the fraction of the source voxels to use when computing the
+  // metric.  If this is less than one, then the voxels will be chosen
+  // at random when Initialize() is called, and the same voxels will
+  // be used until Initialize() is called again.  The default is 1.0.
+  vtkSetClampMacro(SampleFraction, double, 0.0, 1.0);
+  vtkGetMacro(SampleFraction, double);
+
+  // Description:
+  // Compute the metric from a buffer of the source samples, instead of
+  // with vtkImageReslice and a metric filter.  The buffer is much faster,
+  // and it is the only path that supports the TargetImageStencil.  It is
+  // never used for NeighborhoodCorrelation or for the ASinc interpolator.
+  // Turning this off is mainly useful for testing.  The default is On.
+  vtkSetMacro(UseSampleBuffer, int);
+  vtkBooleanMacro(UseSampleBuffer, int);
+  vtkGetMacro(UseSampleBuffer, int);
+
+  // Description:
+  // Gather the source samples in square tiles of this size, rather than
+  // in whole rows, when computing the metric.  This is meant for very
+  // large 2D images, e.g. whole-slide histology, where each image row is
+  // so long that the target voxels for one row fall out of the cache
+  // before the next row is done.  The default is 0, for no tiling.
+  vtkSetClampMacro(SampleTileSize, int, 0, VTK_INT_MAX);
+  vtkGetMacro(SampleTileSize, int);
+
+  // Description:
+  // Limit the number of source samples that are used to compute the
+  // metric.  Each sample needs around 10 bytes of memory, so for very
+  // large images, this limit keeps the memory use in check by using a
+  // random subset of the voxels, as if SampleFraction had been reduced.
+  // The default is 0, for no limit.
+  vtkSetClampMacro(MaximumNumberOfSamples, vtkIdType, 0, VTK_ID_MAX);
+  vtkGetMacro(MaximumNumberOfSamples, vtkIdType);
+
+  // Description:
+  // Automatically generate a stencil for the source image if none was
+  // set, so that background voxels are not used for the registration.
+  // The foreground is found by thresholding the source image at a value
+  // computed from its histogram with Otsu's method, and it is then
+  // dilated by a few voxels so that the edges of the foreground are kept.
+  // The default is Off.
+  vtkSetMacro(AutomaticSourceStencil, int);
+  vtkBooleanMacro(AutomaticSourceStencil, int);
+  vtkGetMacro(AutomaticSourceStencil, int);
+
+  // Description:
+  // Let the Powell optimizer evaluate the metric at a lower fidelity
+  // while it brackets the minimum along each direction, by using only
+  // every second or every fourth row of the source samples.  The full
+  // set of samples is used for the final refinement of each line search.
+  // This is ignored for the NeighborhoodCorrelation metric and for the
+  // ASinc interpolator.  The default is Off.
+  vtkSetMacro(ProgressiveFidelity, int);
+  vtkBooleanMacro(ProgressiveFidelity, int);
+  vtkGetMacro(ProgressiveFidelity, int);
+
+  // Description:
+  // Calibrate the parameter scales from the curvature of the metric.
+  // The first time that Initialize() is called with this option on, the
+  // metric is evaluated (as a single batch) at a small set of probe
+  // points around the initial transform, and the scales are adjusted so
+  // that the metric has a similar curvature along each parameter.  The
+  // adjustments are kept and reused by later calls to Initialize(), e.g.
+  // for each level of a multi-resolution registration, until
+  // ResetParameterScales() is called.  The default is Off.
+  vtkSetMacro(AutomaticParameterScales, int);
+  vtkBooleanMacro(AutomaticParameterScales, int);
+  vtkGetMacro(AutomaticParameterScales, int);
+
+  // Description:
+  // Set the number of threads to use when computing the metric.  The
+  // default is the number of processors.  When several registrations
+  // are run concurrently, this can be set to avoid oversubscription.
+  void SetNumberOfThreads(int n);
+  int GetNumberOfThreads();
+
+  // Description:
+  // Discard the calibrated parameter scales, so that they will be
+  // calibrated again the next time that Initialize() is called.
+  void ResetParameterScales();
+
   // Description:
   // Initialize the transform.  This will also initialize the
   // NumberOfEvaluations to zero.  If a TransformInitializer is
@@ -250,6 +419,18 @@ public:
   // and the initial translation will be set from the initializer.
   void Initialize(vtkMatrix4x4 *matrix);
 
+  // Description:
+  // Initialize for the next slice of a sequence of 2D slices that are
+  // being tracked within a 3D target.  The source image must have new
+  // values, but the same extent, origin and spacing as when Initialize()
+  // was called, and the other settings must not have changed.  Only the
+  // source samples are rebuilt: the prepared target, the histogram bins
+  // and the parameter scales are kept, and no initializer is run.  The
+  // registration starts from the given matrix, or from the current
+  // transform if the matrix is NULL.  If the previous initialization
+  // cannot be kept, then Initialize() is called instead.
+  void InitializeNextSlice(vtkMatrix4x4 *matrix);
+
   // Description:
   // Set the tolerance that the optimizer will apply to the value returned
   // by the image similarity metric.  The default value is 1e-4.
@@ -270,10 +451,27 @@ public:
   vtkSetMacro(MaximumNumberOfIterations, int);
   vtkGetMacro(MaximumNumberOfIterations, int);
 
+  // Description:
+  // Set a time limit, in seconds, that is measured from the start of
+  // Initialize().  When the time has expired, the metric is no longer
+  // computed, the optimizer is stopped, and the transform is set to the
+  // best transform that was found so far.  The default is zero, which
+  // means that there is no time limit.
+  vtkSetClampMacro(TimeLimit, double, 0.0, VTK_DOUBLE_MAX);
+  vtkGetMacro(TimeLimit, double);
+
   // Description:
   // Get the number of times that the metric has been evaluated.
   int GetNumberOfEvaluations();
 
+  // Description:
+  // Get the number of times that the optimizer asked for the metric at
+  // a point where it had already been evaluated, so that the value was
+  // taken from the cache instead.  Points are considered to be the same
+  // if they differ by less than 0.1% of the TransformTolerance.  The
+  // cache is cleared whenever the registration is initialized.
+  int GetNumberOfCacheHits();
+
   // Description:
   // Get the last transform that was produced by the optimizer.
   vtkLinearTransform *GetTransform() { return this->Transform; }
@@ -282,6 +480,32 @@ public:
   // Get the value that is being minimized.
   vtkGetMacro(MetricValue, double);
 
+  // Description:
+  // Stop the registration as soon as possible.  Unlike AbortExecute,
+  // this can be called from any thread while Iterate() is running.  The
+  // metric computation checks for cancellation after every few thousand
+  // samples (or after every row, when vtkImageReslice is used), and once
+  // it is cancelled, Iterate() returns zero and the transform is set to
+  // the best transform found so far.  The flag is not cleared by
+  // Initialize(), so a cancel cannot be lost if it arrives before the
+  // registration starts.  Instead, the caller must call ResetCancel()
+  // before the next registration is started.
+  void Cancel();
+  void ResetCancel();
+  int GetCancelled();
+
+  // Description:
+  // Check whether the optimizer met its tolerance criterion, as opposed
+  // to being stopped by MaximumNumberOfIterations or by the TimeLimit.
+  vtkGetMacro(Converged, int);
+
+  // Description:
+  // Compute the metric for the given matrix, which maps source coordinates
+  // to target coordinates, with the settings and images that were used by
+  // the last call to Initialize().  The registration transform is not
+  // changed.  The returned value is the value that is minimized.
+  double EvaluateMetric(vtkMatrix4x4 *matrix);
+
   // Description:
   // Iterate the registration.  Returns zero if the termination condition has
   // been reached.
@@ -301,7 +525,19 @@ protected:
 
   void ComputeImageRange(vtkImageData *data, vtkImageStencilData *stencil,
                          double range[2]);
+  void ComputeForegroundStencil(vtkImageData *data,
+                                vtkImageStencilData *stencil);
   int ExecuteRegistration();
+  void ExecuteGridSearch(double translation[3]);
+  void CalibrateParameterScales();
+  void SelectInitialTransform(int n, const double *orientations,
+                              const double *translations,
+                              double translation[3]);
+
+  void InitializeSampleBuffer(vtkImageData *sourceImage,
+                              vtkImageStencilData *sourceStencil,
+                              vtkImageRegistrationTarget *target,
+                              const double sourceImageRange[2]);
 
   // Functions overridden from Superclass
   virtual int ProcessRequest(vtkInformation *,
@@ -325,8 +561,21 @@ protected:
   int                              TransformType;
   int                              InitializerType;
   int                              TransformDimensionality;
+  int                              CompactStorage;
+  double                           SampleFraction;
+  int                              UseSampleBuffer;
+  int                              SampleTileSize;
+  vtkIdType                        MaximumNumberOfSamples;
+  int                              AutomaticSourceStencil;
+  int                              ProgressiveFidelity;
+  int                              AutomaticParameterScales;
+  double                           GridSearchRange;
+  double                           GridSearchStep;
+  int                              GridSearchFlips;
 
   int                              MaximumNumberOfIterations;
+  double                           TimeLimit;
+  int                              Converged;
   double                           MetricTolerance;
   double                           TransformTolerance;
   double                           MetricValue;
@@ -344,9 +593,12 @@ protected:
 
   vtkMatrix4x4                    *InitialTransformMatrix;
   vtkImageReslice                 *ImageReslice;
-  vtkImageBSplineCoefficients     *ImageBSpline;
   vtkImageShiftScale              *SourceImageTypecast;
   vtkImageShiftScale              *TargetImageTypecast;
+  vtkImageSampleBuffer            *SampleBuffer;
+  vtkImageStencilData             *ForegroundStencil;
+  vtkImageRegistrationTarget      *PreparedTarget;
+  vtkImageRegistrationTarget      *InternalTarget;
 
   vtkImageRegistrationInfo        *RegistrationInfo;
 
@@ -0,0 +1,360 @@
+/*=========================================================================
+  Program:   Atamai Image Registration and Segmentation
+  Module:    vtkImageRegistrationTarget.cxx
+
+  Copyright (c) 2014 David Gobbi
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+
+  * Neither the name of the Calgary Image Processing and Analysis Centre
+    (CIPAC), the University of Calgary, nor the names of any authors nor
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+=========================================================================*/
+
+#include "vtkImageRegistrationTarget.h"
+#include "vtkImageRegistration.h"
+#include "vtkObjectFactory.h"
+#include "vtkImageData.h"
+#include "vtkImageStencilData.h"
+#include "vtkImageShiftScale.h"
+#include "vtkImageHistogramStatistics.h"
+#include "vtkImageBSplineCoefficients.h"
+#include "vtkImageBSplineInterpolator.h"
+#include "vtkImageSincInterpolator.h"
+#include "vtkImageInterpolator.h"
+#include "vtkLabelInterpolator.h"
+#include "vtkVersion.h"
+
+#include <math.h>
+
+// A macro to assist VTK 5 backwards compatibility
+#if VTK_MAJOR_VERSION >= 6
+#define SET_INPUT_DATA SetInputData
+#define SET_STENCIL_DATA SetStencilData
+#else
+#define SET_INPUT_DATA SetInput
+#define SET_STENCIL_DATA SetStencil
+#endif
+
+// The output scalar type and scale of vtkImageReslice appeared in VTK 6.2
+#if VTK_MAJOR_VERSION > 6 || (VTK_MAJOR_VERSION == 6 && VTK_MINOR_VERSION >= 2)
+#define VTK_RESLICE_HAS_OUTPUT_SCALAR_TYPE
+#endif
+
+vtkStandardNewMacro(vtkImageRegistrationTarget);
+vtkCxxSetObjectMacro(vtkImageRegistrationTarget, Image, vtkImageData);
+vtkCxxSetObjectMacro(vtkImageRegistrationTarget, Stencil, vtkImageStencilData);
+
+//----------------------------------------------------------------------------
+vtkImageRegistrationTarget::vtkImageRegistrationTarget()
+{
+  this->Image = NULL;
+  this->Stencil = NULL;
+
+  this->MetricType = vtkImageRegistration::MutualInformation;
+  this->InterpolatorType = vtkImageRegistration::Linear;
+  this->JointHistogramSize[0] = 64;
+  this->JointHistogramSize[1] = 64;
+  this->ImageRange[0] = 0.0;
+  this->ImageRange[1] = -1.0;
+  this->CompactStorage = 0;
+  this->CoefficientScalarType = VTK_FLOAT;
+
+  this->PreparedImage = NULL;
+  this->Interpolator = NULL;
+  this->DataRange[0] = 0.0;
+  this->DataRange[1] = 1.0;
+  this->HistogramRange[0] = 0.0;
+  this->HistogramRange[1] = 1.0;
+  this->CoefficientScale = 1.0;
+}
+
+//----------------------------------------------------------------------------
+vtkImageRegistrationTarget::~vtkImageRegistrationTarget()
+{
+  this->SetImage(NULL);
+  this->SetStencil(NULL);
+  if (this->PreparedImage)
+    {
+    this->PreparedImage->Delete();
+    }
+  if (this->Interpolator)
+    {
+    this->Interpolator->Delete();
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "Image: " << this->Image << "\n";
+  os << indent << "Stencil: " << this->Stencil << "\n";
+  os << indent << "MetricType: " << this->MetricType << "\n";
+  os << indent << "InterpolatorType: " << this->InterpolatorType << "\n";
+  os << indent << "JointHistogramSize: " << this->JointHistogramSize[0] << " "
+     << this->JointHistogramSize[1] << "\n";
+  os << indent << "ImageRange: " << this->ImageRange[0] << " "
+     << this->ImageRange[1] << "\n";
+  os << indent << "CompactStorage: "
+     << (this->CompactStorage ? "On\n" : "Off\n");
+  os << indent << "CoefficientScalarType: "
+     << this->CoefficientScalarType << "\n";
+  os << indent << "PreparedImage: " << this->PreparedImage << "\n";
+  os << indent << "Interpolator: " << this->Interpolator << "\n";
+  os << indent << "DataRange: " << this->DataRange[0] << " "
+     << this->DataRange[1] << "\n";
+  os << indent << "HistogramRange: " << this->HistogramRange[0] << " "
+     << this->HistogramRange[1] << "\n";
+  os << indent << "CoefficientScale: " << this->CoefficientScale << "\n";
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::ComputeImageRange(
+  vtkImageData *data, vtkImageStencilData *stencil, double range[2])
+{
+  vtkImageHistogramStatistics *hist =
+    vtkImageHistogramStatistics::New();
+  hist->SET_STENCIL_DATA(stencil);
+  hist->SET_INPUT_DATA(data);
+  hist->SetActiveComponent(0);
+  hist->Update();
+
+  range[0] = hist->GetMinimum();
+  range[1] = hist->GetMaximum();
+
+  if (range[0] >= range[1])
+    {
+    range[1] = range[0] + 1.0;
+    }
+
+  hist->SET_INPUT_DATA(NULL);
+  hist->Delete();
+}
+
+//----------------------------------------------------------------------------
+int vtkImageRegistrationTarget::IsPrepared()
+{
+  unsigned long t = this->PrepareTime.GetMTime();
+  return (this->PreparedImage != NULL &&
+          t > this->GetMTime() &&
+          (this->Image == NULL || t > this->Image->GetMTime()) &&
+          (this->Stencil == NULL || t > this->Stencil->GetMTime()));
+}
+
+//----------------------------------------------------------------------------
+void vtkImageRegistrationTarget::Prepare()
+{
+  if (this->IsPrepared())
+    {
+    return;
+    }
+
+  if (this->PreparedImage)
+    {
+    this->PreparedImage->Delete();
+    this->PreparedImage = NULL;
+    }
+  if (this->Interpolator)
+    {
+    this->Interpolator->Delete();
+    this->Interpolator = NULL;
+    }
+
+  if (this->Image == NULL)
+    {
+    vtkErrorMacro("Prepare: The image is not set");
+    return;
+    }
+
+  vtkImageData *image = this->Image;
+
+  // the range of the data, which is needed for the joint histogram
+  // and for the Moments initializer
+  this->ComputeImageRange(image, this->Stencil, this->DataRange);
+  this->HistogramRange[0] = this->ImageRange[0];
+  this->HistogramRange[1] = this->ImageRange[1];
+  if (this->HistogramRange[0] >= this->HistogramRange[1])
+    {
+    this->HistogramRange[0] = this->DataRange[0];
+    this->HistogramRange[1] = this->DataRange[1];
+    }
+
+  // the metric is computed directly from a buffer of source samples,
+  // except for NeighborhoodCorrelation, which needs whole neighborhoods,
+  // and for ASinc, which needs vtkImageReslice to set the blur factors
+  bool useSampleBuffer =
+    (this->MetricType != vtkImageRegistration::NeighborhoodCorrelation &&
+     this->InterpolatorType != vtkImageRegistration::ASinc);
+
+  bool compactCoefficients = false;
+#ifndef VTK_RESLICE_HAS_OUTPUT_SCALAR_TYPE
+  if (useSampleBuffer)
+#endif
+    {
+    compactCoefficients = (this->CompactStorage != 0);
+    }
+
+  // the filters that produce the prepared image
+  vtkImageShiftScale *quantizer = NULL;
+  vtkImageBSplineCoefficients *bspline = NULL;
+  this->CoefficientScale = 1.0;
+
+  if ((this->MetricType == vtkImageRegistration::MutualInformation ||
+       this->MetricType ==
+         vtkImageRegistration::NormalizedMutualInformation) &&
+      this->InterpolatorType == vtkImageRegistration::Nearest &&
+      this->JointHistogramSize[0] <= 256 &&
+      this->JointHistogramSize[1] <= 256)
+    {
+    // If nearest-neighbor interpolation is used, then the image instensity
+    // can be quantized once, instead of being done at each iteration of
+    // the registration.
+    double *range = this->HistogramRange;
+    double scale = (this->JointHistogramSize[0] - 1)/(range[1] - range[0]);
+    // The "0.5/scale" causes the vtkImageShiftScale filter to round the
+    // value, instead of truncating it.
+    double shift = (-range[0] + 0.5/scale);
+
+    quantizer = vtkImageShiftScale::New();
+    quantizer->SET_INPUT_DATA(image);
+    quantizer->SetOutputScalarTypeToUnsignedChar();
+    quantizer->ClampOverflowOn();
+    quantizer->SetShift(shift);
+    quantizer->SetScale(scale);
+    quantizer->Update();
+    image = quantizer->GetOutput();
+
+    // the rescaled image range is now the histogram range
+    this->HistogramRange[0] = 0;
+    this->HistogramRange[1] = this->JointHistogramSize[0] - 1;
+    }
+  else if (this->InterpolatorType == vtkImageRegistration::BSpline)
+    {
+    int scalarType = this->CoefficientScalarType;
+    if (image->GetScalarType() == VTK_DOUBLE)
+      {
+      scalarType = VTK_DOUBLE;
+      }
+
+    bspline = vtkImageBSplineCoefficients::New();
+    bspline->SET_INPUT_DATA(image);
+    bspline->SetOutputScalarType(compactCoefficients ? VTK_FLOAT : scalarType);
+    bspline->Update();
+    image = bspline->GetOutput();
+
+    if (compactCoefficients)
+      {
+      // quantize the coefficients to 16 bits, the interpolator will
+      // widen them to double precision as it interpolates
+      double crange[2];
+      image->GetScalarRange(crange);
+      double cmax = fabs(crange[0]);
+      cmax = (cmax > fabs(crange[1]) ? cmax : fabs(crange[1]));
+      if (cmax > 0)
+        {
+        this->CoefficientScale = VTK_SHORT_MAX/cmax;
+        }
+
+      quantizer = vtkImageShiftScale::New();
+      quantizer->SET_INPUT_DATA(image);
+      quantizer->SetOutputScalarTypeToShort();
+      quantizer->ClampOverflowOn();
+      quantizer->SetShift(0.0);
+      quantizer->SetScale(this->CoefficientScale);
+      quantizer->Update();
+      image = quantizer->GetOutput();
+      }
+    }
+
+  // keep the prepared image, but not the filters that produced it
+  this->PreparedImage = vtkImageData::New();
+  this->PreparedImage->ShallowCopy(image);
+  if (quantizer)
+    {
+    quantizer->Delete();
+    }
+  if (bspline)
+    {
+    bspline->Delete();
+    }
+
+  // create the interpolator for the prepared image
+  if (useSampleBuffer)
+    {
+    vtkAbstractImageInterpolator *interpolator = NULL;
+    switch (this->InterpolatorType)
+      {
+      case vtkImageRegistration::Nearest:
+        {
+        vtkImageInterpolator *interp = vtkImageInterpolator::New();
+        interp->SetInterpolationModeToNearest();
+        interpolator = interp;
+        }
+        break;
+      case vtkImageRegistration::Linear:
+        {
+        vtkImageInterpolator *interp = vtkImageInterpolator::New();
+        interp->SetInterpolationModeToLinear();
+        interpolator = interp;
+        }
+        break;
+      case vtkImageRegistration::Cubic:
+        {
+        vtkImageInterpolator *interp = vtkImageInterpolator::New();
+        interp->SetInterpolationModeToCubic();
+        interpolator = interp;
+        }
+        break;
+      case vtkImageRegistration::BSpline:
+        interpolator = vtkImageBSplineInterpolator::New();
+        break;
+      case vtkImageRegistration::Sinc:
+        {
+        vtkImageSincInterpolator *interp = vtkImageSincInterpolator::New();
+        interp->SetWindowFunctionToBlackman();
+        interpolator = interp;
+        }
+        break;
+      case vtkImageRegistration::Label:
+        interpolator = vtkLabelInterpolator::New();
+        break;
+      default:
+        interpolator = vtkImageInterpolator::New();
+        break;
+      }
+
+    // only the first component is used by the metrics
+    interpolator->SetComponentOffset(0);
+    interpolator->SetComponentCount(1);
+    interpolator->Initialize(this->PreparedImage);
+    interpolator->Update();
+    this->Interpolator = interpolator;
+    }
+
+  this->PrepareTime.Modified();
+}
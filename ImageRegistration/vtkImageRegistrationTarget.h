@@ -0,0 +1,170 @@
+/*=========================================================================
+  Program:   Atamai Image Registration and Segmentation
+  Module:    vtkImageRegistrationTarget.h
+
+  Copyright (c) 2014 David Gobbi
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+
+  * Neither the name of the Calgary Image Processing and Analysis Centre
+    (CIPAC), the University of Calgary, nor the names of any authors nor
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+=========================================================================*/
+// .NAME vtkImageRegistrationTarget - a target image prepared for registration
+// .SECTION Description
+// vtkImageRegistrationTarget does the preprocessing of a target image that
+// vtkImageRegistration would otherwise repeat every time it is initialized:
+// it computes the range of the data for the joint histogram, quantizes the
+// image for nearest-neighbor mutual information, computes the b-spline
+// coefficients, and builds the interpolator.  After Prepare() has been
+// called, the target can be given to any number of registrations with
+// vtkImageRegistration::SetPreparedTarget(), including registrations that
+// run concurrently on different threads, since the registrations only read
+// from it.  The MetricType, InterpolatorType, JointHistogramSize, ImageRange
+// and CompactStorage must match those of the registrations that use it.
+// .SECTION See also
+// vtkImageRegistration
+
+#ifndef __vtkImageRegistrationTarget_h
+#define __vtkImageRegistrationTarget_h
+
+#include "vtkObject.h"
+
+class vtkImageData;
+class vtkImageStencilData;
+class vtkAbstractImageInterpolator;
+
+class VTK_EXPORT vtkImageRegistrationTarget : public vtkObject
+{
+public:
+  static vtkImageRegistrationTarget *New();
+  vtkTypeMacro(vtkImageRegistrationTarget, vtkObject);
+  virtual void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // The target image.  Only the first component is used.
+  virtual void SetImage(vtkImageData *image);
+  vtkGetObjectMacro(Image, vtkImageData);
+
+  // Description:
+  // An optional stencil for the target image.  The range of the data is
+  // only computed within the stencil, and registrations will ignore the
+  // source voxels that map outside of the stencil.
+  virtual void SetStencil(vtkImageStencilData *stencil);
+  vtkGetObjectMacro(Stencil, vtkImageStencilData);
+
+  // Description:
+  // The settings that affect the preparation of the target.  These must
+  // be the same as for the registrations that use the target, and the
+  // defaults are the same as for vtkImageRegistration.
+  vtkSetMacro(MetricType, int);
+  vtkGetMacro(MetricType, int);
+  vtkSetMacro(InterpolatorType, int);
+  vtkGetMacro(InterpolatorType, int);
+  vtkSetVector2Macro(JointHistogramSize, int);
+  vtkGetVector2Macro(JointHistogramSize, int);
+  vtkSetVector2Macro(ImageRange, double);
+  vtkGetVector2Macro(ImageRange, double);
+  vtkSetMacro(CompactStorage, int);
+  vtkBooleanMacro(CompactStorage, int);
+  vtkGetMacro(CompactStorage, int);
+
+  // Description:
+  // The scalar type for the b-spline coefficients, either VTK_FLOAT
+  // or VTK_DOUBLE.  Double is always used if the image is double.
+  // The default is VTK_FLOAT.
+  vtkSetMacro(CoefficientScalarType, int);
+  vtkGetMacro(CoefficientScalarType, int);
+
+  // Description:
+  // Do all of the preprocessing.  This must be called after the image
+  // or the settings have been changed, before the target is used.  It
+  // does nothing if the target is already up to date.
+  void Prepare();
+
+  // Description:
+  // Check whether Prepare() has been called since the last change to
+  // the image or the settings.
+  int IsPrepared();
+
+  // Description:
+  // Get the image that the registration will interpolate, which is the
+  // original image unless it was quantized or converted to b-spline
+  // coefficients.
+  vtkImageData *GetPreparedImage() { return this->PreparedImage; }
+
+  // Description:
+  // Get the range of the data within the stencil, and the range for the
+  // joint histogram bins.  The latter is the ImageRange if one was set,
+  // or the data range otherwise, after any quantization was applied.
+  vtkGetVector2Macro(DataRange, double);
+  vtkGetVector2Macro(HistogramRange, double);
+
+  // Description:
+  // Get the scale that was applied to the compact b-spline coefficients.
+  vtkGetMacro(CoefficientScale, double);
+
+  // Description:
+  // Get the interpolator for the prepared image.  This is NULL if the
+  // metric and interpolator are computed with vtkImageReslice instead
+  // of from a sample buffer (NeighborhoodCorrelation, or ASinc).
+  vtkAbstractImageInterpolator *GetInterpolator() {
+    return this->Interpolator; }
+
+  // Description:
+  // Compute the range of the first component of an image, within the
+  // stencil if one is given.
+  static void ComputeImageRange(vtkImageData *data,
+                                vtkImageStencilData *stencil,
+                                double range[2]);
+
+protected:
+  vtkImageRegistrationTarget();
+  ~vtkImageRegistrationTarget();
+
+  vtkImageData *Image;
+  vtkImageStencilData *Stencil;
+
+  int MetricType;
+  int InterpolatorType;
+  int JointHistogramSize[2];
+  double ImageRange[2];
+  int CompactStorage;
+  int CoefficientScalarType;
+
+  vtkImageData *PreparedImage;
+  vtkAbstractImageInterpolator *Interpolator;
+  double DataRange[2];
+  double HistogramRange[2];
+  double CoefficientScale;
+  vtkTimeStamp PrepareTime;
+
+private:
+  vtkImageRegistrationTarget(const vtkImageRegistrationTarget&);  // Not implemented.
+  void operator=(const vtkImageRegistrationTarget&);  // Not implemented.
+};
+
+#endif
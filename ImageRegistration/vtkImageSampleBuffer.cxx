@@ -0,0 +1,386 @@
+/*=========================================================================
+  Program:   Atamai Image Registration and Segmentation
+  Module:    vtkImageSampleBuffer.cxx
+
+  Copyright (c) 2014 David Gobbi
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+
+  * Neither the name of the Calgary Image Processing and Analysis Centre
+    (CIPAC), the University of Calgary, nor the names of any authors nor
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+=========================================================================*/
+
+#include "vtkImageSampleBuffer.h"
+#include "vtkImageData.h"
+#include "vtkImageStencilData.h"
+#include "vtkObjectFactory.h"
+#include "vtkTemplateAliasMacro.h"
+
+#include <math.h>
+
+vtkStandardNewMacro(vtkImageSampleBuffer);
+
+//----------------------------------------------------------------------------
+vtkImageSampleBuffer::vtkImageSampleBuffer()
+{
+  this->SampleFraction = 1.0;
+  this->RandomSeed = 1;
+  this->TileSize = 0;
+  this->MaximumNumberOfSamples = 0;
+
+  this->NumberOfSamples = 0;
+  this->NumberOfRows = 0;
+  this->NumberOfBins = 0;
+  this->SampleCapacity = 0;
+  this->RowCapacity = 0;
+  this->BinCapacity = 0;
+
+  this->RowJ = NULL;
+  this->RowK = NULL;
+  this->RowStart = NULL;
+  this->SampleI = NULL;
+  this->SampleValue = NULL;
+  this->SampleBin = NULL;
+}
+
+//----------------------------------------------------------------------------
+vtkImageSampleBuffer::~vtkImageSampleBuffer()
+{
+  this->Initialize();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSampleBuffer::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os,indent);
+
+  os << indent << "SampleFraction: " << this->SampleFraction << "\n";
+  os << indent << "RandomSeed: " << this->RandomSeed << "\n";
+  os << indent << "TileSize: " << this->TileSize << "\n";
+  os << indent << "MaximumNumberOfSamples: "
+     << this->MaximumNumberOfSamples << "\n";
+  os << indent << "NumberOfSamples: " << this->NumberOfSamples << "\n";
+  os << indent << "NumberOfRows: " << this->NumberOfRows << "\n";
+  os << indent << "NumberOfBins: " << this->NumberOfBins << "\n";
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSampleBuffer::Initialize()
+{
+  delete [] this->RowJ;
+  delete [] this->RowK;
+  delete [] this->RowStart;
+  delete [] this->SampleI;
+  delete [] this->SampleValue;
+  delete [] this->SampleBin;
+
+  this->RowJ = NULL;
+  this->RowK = NULL;
+  this->RowStart = NULL;
+  this->SampleI = NULL;
+  this->SampleValue = NULL;
+  this->SampleBin = NULL;
+
+  this->NumberOfSamples = 0;
+  this->NumberOfRows = 0;
+  this->NumberOfBins = 0;
+  this->SampleCapacity = 0;
+  this->RowCapacity = 0;
+  this->BinCapacity = 0;
+}
+
+// begin anonymous namespace
+namespace {
+
+//----------------------------------------------------------------------------
+// A small, fast random number generator for choosing the samples.  It is
+// used instead of vtkMath::Random() so that the buffer can be filled in
+// two passes (one to count, one to fill) with identical results.
+class vtkImageSampleSelector
+{
+public:
+  vtkImageSampleSelector(double fraction, int seed) :
+    State(static_cast<unsigned int>(seed)),
+    Threshold(static_cast<unsigned int>(fraction*16777216.0)),
+    KeepAll(fraction >= 1.0) {}
+
+  bool Keep()
+  {
+    if (this->KeepAll)
+      {
+      return true;
+      }
+    this->State = this->State*1664525u + 1013904223u;
+    return ((this->State >> 8) < this->Threshold);
+  }
+
+private:
+  unsigned int State;
+  unsigned int Threshold;
+  bool KeepAll;
+};
+
+//----------------------------------------------------------------------------
+// Walk through the voxels within the stencil, tile by tile if a tile size
+// is given.  If the arrays are NULL, then only count the rows and samples.
+template<class T>
+void vtkImageSampleBufferExecute(
+  vtkImageData *image, vtkImageStencilData *stencil, T *inPtr,
+  double fraction, int seed, int tileSize, int *rowJ, int *rowK,
+  vtkIdType *rowStart, int *sampleI, float *sampleValue,
+  vtkIdType *numRows, vtkIdType *numSamples)
+{
+  int extent[6];
+  vtkIdType inc[3];
+  image->GetExtent(extent);
+  image->GetIncrements(inc);
+
+  vtkImageSampleSelector selector(fraction, seed);
+
+  // without tiling, each tile is a single row of the image
+  int tileWidth = extent[1] - extent[0] + 1;
+  int tileHeight = 1;
+  if (tileSize > 0)
+    {
+    tileWidth = tileSize;
+    tileHeight = tileSize;
+    }
+
+  vtkIdType r = 0;
+  vtkIdType s = 0;
+
+  for (int k = extent[4]; k <= extent[5]; k++)
+    {
+    for (int tj = extent[2]; tj <= extent[3]; tj += tileHeight)
+      {
+      int tjEnd = tj + (tileHeight - 1);
+      tjEnd = (tjEnd < extent[3] ? tjEnd : extent[3]);
+
+      for (int ti = extent[0]; ti <= extent[1]; ti += tileWidth)
+        {
+        int tiEnd = ti + (tileWidth - 1);
+        tiEnd = (tiEnd < extent[1] ? tiEnd : extent[1]);
+
+        for (int j = tj; j <= tjEnd; j++)
+          {
+          T *rowPtr = inPtr + (j - extent[2])*inc[1] +
+                              (k - extent[4])*inc[2];
+          vtkIdType s0 = s;
+          int iter = 0;
+          int r1 = ti;
+          int r2 = tiEnd;
+
+          for (;;)
+            {
+            if (stencil)
+              {
+              if (!stencil->GetNextExtent(r1, r2, ti, tiEnd, j, k, iter))
+                {
+                break;
+                }
+              }
+            else if (iter++ > 0)
+              {
+              break;
+              }
+
+            for (int i = r1; i <= r2; i++)
+              {
+              if (selector.Keep())
+                {
+                if (sampleI)
+                  {
+                  sampleI[s] = i;
+                  sampleValue[s] = static_cast<float>(
+                    rowPtr[(i - extent[0])*inc[0]]);
+                  }
+                s++;
+                }
+              }
+            }
+
+          // only store the rows that have samples
+          if (s > s0)
+            {
+            if (rowJ)
+              {
+              rowJ[r] = j;
+              rowK[r] = k;
+              rowStart[r] = s0;
+              }
+            r++;
+            }
+          }
+        }
+      }
+    }
+
+  if (rowStart)
+    {
+    rowStart[r] = s;
+    }
+
+  *numRows = r;
+  *numSamples = s;
+}
+
+} // end anonymous namespace
+
+//----------------------------------------------------------------------------
+void vtkImageSampleBuffer::BuildBuffer(
+  vtkImageData *image, vtkImageStencilData *stencil)
+{
+  // the arrays are kept if they are large enough, so that a sequence of
+  // images of the same size (e.g. tracked slices) can be buffered without
+  // any reallocation, but the bins are for the old values
+  this->NumberOfSamples = 0;
+  this->NumberOfRows = 0;
+  this->NumberOfBins = 0;
+
+  if (image == NULL)
+    {
+    vtkErrorMacro("BuildBuffer: no image was provided.");
+    return;
+    }
+
+  int extent[6];
+  image->GetExtent(extent);
+  if (extent[0] > extent[1] || extent[2] > extent[3] || extent[4] > extent[5])
+    {
+    return;
+    }
+
+  void *inPtr = image->GetScalarPointerForExtent(extent);
+  int scalarType = image->GetScalarType();
+
+  // the first pass counts the samples, the second pass fills the arrays
+  double fraction = this->SampleFraction;
+  for (int pass = 0; pass < 2; pass++)
+    {
+    vtkIdType numRows = 0;
+    vtkIdType numSamples = 0;
+
+    int *rowJ = NULL;
+    int *rowK = NULL;
+    vtkIdType *rowStart = NULL;
+    int *sampleI = NULL;
+    float *sampleValue = NULL;
+    if (pass == 1)
+      {
+      rowJ = this->RowJ;
+      rowK = this->RowK;
+      rowStart = this->RowStart;
+      sampleI = this->SampleI;
+      sampleValue = this->SampleValue;
+      }
+
+    switch (scalarType)
+      {
+      vtkTemplateAliasMacro(
+        vtkImageSampleBufferExecute(
+          image, stencil, static_cast<VTK_TT *>(inPtr),
+          fraction, this->RandomSeed, this->TileSize,
+          rowJ, rowK, rowStart, sampleI, sampleValue,
+          &numRows, &numSamples));
+      default:
+        vtkErrorMacro("BuildBuffer: Unknown ScalarType");
+        return;
+      }
+
+    if (pass == 0 && this->MaximumNumberOfSamples > 0 &&
+        numSamples > this->MaximumNumberOfSamples)
+      {
+      // keep fewer voxels, and count them again
+      fraction *= (static_cast<double>(this->MaximumNumberOfSamples)/
+                   static_cast<double>(numSamples));
+      pass = -1;
+      continue;
+      }
+
+    if (pass == 0)
+      {
+      if (numRows > this->RowCapacity || this->RowStart == NULL)
+        {
+        delete [] this->RowJ;
+        delete [] this->RowK;
+        delete [] this->RowStart;
+        this->RowJ = new int[numRows];
+        this->RowK = new int[numRows];
+        this->RowStart = new vtkIdType[numRows + 1];
+        this->RowCapacity = numRows;
+        }
+      if (numSamples > this->SampleCapacity || this->SampleI == NULL)
+        {
+        delete [] this->SampleI;
+        delete [] this->SampleValue;
+        this->SampleI = new int[numSamples];
+        this->SampleValue = new float[numSamples];
+        this->SampleCapacity = numSamples;
+        }
+      }
+
+    this->NumberOfRows = numRows;
+    this->NumberOfSamples = numSamples;
+    }
+
+  this->Modified();
+}
+
+//----------------------------------------------------------------------------
+void vtkImageSampleBuffer::ComputeBins(
+  double origin, double spacing, int numBins)
+{
+  if (numBins < 1 || numBins > 65536 || spacing <= 0)
+    {
+    vtkErrorMacro("ComputeBins: bad bin specification: " << numBins
+                  << " bins with spacing " << spacing);
+    return;
+    }
+
+  if (this->NumberOfSamples > this->BinCapacity || this->SampleBin == NULL)
+    {
+    delete [] this->SampleBin;
+    this->SampleBin = new unsigned short[this->NumberOfSamples];
+    this->BinCapacity = this->NumberOfSamples;
+    }
+  this->NumberOfBins = numBins;
+
+  double scale = 1.0/spacing;
+  double xmax = numBins - 1;
+  const float *valuePtr = this->SampleValue;
+  unsigned short *binPtr = this->SampleBin;
+
+  for (vtkIdType s = 0; s < this->NumberOfSamples; s++)
+    {
+    double x = (valuePtr[s] - origin)*scale;
+    x = (x > 0 ? x : 0);
+    x = (x < xmax ? x : xmax);
+    binPtr[s] = static_cast<unsigned short>(x);
+    }
+
+  this->Modified();
+}
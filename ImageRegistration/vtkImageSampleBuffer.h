@@ -0,0 +1,171 @@
+/*=========================================================================
+  Program:   Atamai Image Registration and Segmentation
+  Module:    vtkImageSampleBuffer.h
+
+  Copyright (c) 2014 David Gobbi
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+
+  * Redistributions in binary form must reproduce the above copyright
+    notice, this list of conditions and the following disclaimer in the
+    documentation and/or other materials provided with the distribution.
+
+  * Neither the name of the Calgary Image Processing and Analysis Centre
+    (CIPAC), the University of Calgary, nor the names of any authors nor
+    contributors may be used to endorse or promote products derived from
+    this software without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+  A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+  HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+  SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+  LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+  DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+  THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+  OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+=========================================================================*/
+// .NAME vtkImageSampleBuffer - compact list of image samples for metrics
+// .SECTION Description
+// vtkImageSampleBuffer stores the voxels of an image that lie within a
+// stencil as a compact structure-of-arrays, so that an image similarity
+// metric can be evaluated many times without iterating through the
+// stencil and without converting the voxel values each time.  The voxels
+// are grouped into rows: for each row, the buffer stores the j and k
+// indices and the position of the row's first sample, and for each sample
+// it stores the i index and the value of the first component as a float.
+// The rows can optionally be split and grouped into tiles.
+// Optionally, the values can also be pre-quantized into histogram bins.
+// If the SampleFraction is less than one, then a random subset of the
+// voxels is stored, and the subset is made smaller still if needed to
+// keep the number of samples within the MaximumNumberOfSamples.
+// .SECTION See also
+// vtkImageRegistration
+
+#ifndef __vtkImageSampleBuffer_h
+#define __vtkImageSampleBuffer_h
+
+#include "vtkObject.h"
+
+class vtkImageData;
+class vtkImageStencilData;
+
+class VTK_EXPORT vtkImageSampleBuffer : public vtkObject
+{
+public:
+  static vtkImageSampleBuffer *New();
+  vtkTypeMacro(vtkImageSampleBuffer, vtkObject);
+  virtual void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // The fraction of the voxels to keep.  If this is less than one,
+  // then voxels are chosen at random, with each voxel having this
+  // probability of being chosen.  The default is 1.0.
+  vtkSetClampMacro(SampleFraction, double, 0.0, 1.0);
+  vtkGetMacro(SampleFraction, double);
+
+  // Description:
+  // The seed to use for random sampling.  The same seed will always
+  // result in the same set of samples.  The default is 1.
+  vtkSetMacro(RandomSeed, int);
+  vtkGetMacro(RandomSeed, int);
+
+  // Description:
+  // Store the samples tile by tile, instead of row by row across the
+  // whole image.  The rows of the buffer are then the parts of the image
+  // rows that lie within each square tile of this size.  For very large
+  // 2D images, this keeps the samples that are processed together close
+  // to each other in both directions, so that the target voxels that they
+  // map to stay in the cache.  The default is 0, which means no tiling.
+  vtkSetClampMacro(TileSize, int, 0, VTK_INT_MAX);
+  vtkGetMacro(TileSize, int);
+
+  // Description:
+  // The maximum number of samples to store.  Each sample uses 10 bytes,
+  // so for very large images, this puts a limit on the memory that the
+  // buffer uses.  If there are more voxels than this, then the fraction
+  // of voxels that is kept is reduced until the samples fit.  The default
+  // is 0, which means no limit.
+  vtkSetClampMacro(MaximumNumberOfSamples, vtkIdType, 0, VTK_ID_MAX);
+  vtkGetMacro(MaximumNumberOfSamples, vtkIdType);
+
+  // Description:
+  // Fill the buffer from the first component of the image.  If a stencil
+  // is provided, then only the voxels within the stencil will be used.
+  // The memory from the previous call is reused if it is large enough,
+  // but any bins must be computed again.
+  void BuildBuffer(vtkImageData *image, vtkImageStencilData *stencil);
+
+  // Description:
+  // Compute a histogram bin index for each sample.  The bin index for
+  // value v is floor((v - origin)/spacing), clamped to [0, numBins-1].
+  // To round to the nearest bin instead of truncating, subtract half of
+  // the spacing from the origin.  At most 65536 bins are allowed.
+  void ComputeBins(double origin, double spacing, int numBins);
+
+  // Description:
+  // Release all of the memory used by the buffer.
+  void Initialize();
+
+  // Description:
+  // Get the total number of samples, and the number of rows.
+  vtkIdType GetNumberOfSamples() { return this->NumberOfSamples; }
+  vtkIdType GetNumberOfRows() { return this->NumberOfRows; }
+
+  // Description:
+  // Get the number of bins used by ComputeBins(), or zero if the
+  // bins have not been computed.
+  int GetNumberOfBins() { return this->NumberOfBins; }
+
+//BTX
+  // Description:
+  // Direct access to the arrays.  For row r, the j and k indices are
+  // RowJ[r] and RowK[r], and the samples are those from RowStart[r]
+  // to RowStart[r+1]-1.  For sample s, the i index is SampleI[s], the
+  // value is SampleValue[s], and the bin is SampleBin[s].
+  const int *GetRowJ() { return this->RowJ; }
+  const int *GetRowK() { return this->RowK; }
+  const vtkIdType *GetRowStart() { return this->RowStart; }
+  const int *GetSampleI() { return this->SampleI; }
+  const float *GetSampleValue() { return this->SampleValue; }
+  const unsigned short *GetSampleBin() {
+    return (this->NumberOfBins ? this->SampleBin : NULL); }
+//ETX
+
+protected:
+  vtkImageSampleBuffer();
+  ~vtkImageSampleBuffer();
+
+  double SampleFraction;
+  int RandomSeed;
+  int TileSize;
+  vtkIdType MaximumNumberOfSamples;
+
+  vtkIdType NumberOfSamples;
+  vtkIdType NumberOfRows;
+  int NumberOfBins;
+  vtkIdType SampleCapacity;
+  vtkIdType RowCapacity;
+  vtkIdType BinCapacity;
+
+  int *RowJ;
+  int *RowK;
+  vtkIdType *RowStart;
+  int *SampleI;
+  float *SampleValue;
+  unsigned short *SampleBin;
+
+private:
+  vtkImageSampleBuffer(const vtkImageSampleBuffer&);  // Not implemented.
+  void operator=(const vtkImageSampleBuffer&);  // Not implemented.
+};
+
+#endif
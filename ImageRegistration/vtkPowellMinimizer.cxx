@@ -15,6 +15,7 @@ vtkPowellMinimizer::vtkPowellMinimizer()
   this->Function = NULL;
   this->FunctionArg = NULL;
   this->FunctionArgDelete = NULL;
+  this->BatchFunction = NULL;
 
   this->NumberOfParameters = 0;
   this->ParameterNames = NULL;
@@ -25,6 +26,8 @@ vtkPowellMinimizer::vtkPowellMinimizer()
 
   this->Tolerance = 1e-4;
   this->ParameterTolerance = 1e-4;
+  this->NumberOfFidelityLevels = 1;
+  this->FidelityLevel = 0;
   this->MaxIterations = 1000;
   this->Iterations = 0;
   this->FunctionEvaluations = 0;
@@ -124,6 +127,8 @@ void vtkPowellMinimizer::PrintSelf(ostream& os, vtkIndent indent)
   os << indent << "MaxIterations: " << this->GetMaxIterations() << "\n";
   os << indent << "Tolerance: " << this->GetTolerance() << "\n";
   os << indent << "ParameterTolerance: " << this->GetParameterTolerance() << "\n";
+  os << indent << "NumberOfFidelityLevels: "
+     << this->GetNumberOfFidelityLevels() << "\n";
 }
 
 //----------------------------------------------------------------------------
@@ -152,6 +157,17 @@ void vtkPowellMinimizer::SetFunctionArgDelete(void (*f)(void *))
     }
 }
 
+//----------------------------------------------------------------------------
+void vtkPowellMinimizer::SetBatchFunction(
+  void (*f)(void *, int, const double *, double *))
+{
+  if (f != this->BatchFunction)
+    {
+    this->BatchFunction = f;
+    this->Modified();
+    }
+}
+
 //----------------------------------------------------------------------------
 double vtkPowellMinimizer::GetParameterValue(const char *name)
 {
@@ -321,6 +337,47 @@ void vtkPowellMinimizer::EvaluateFunction()
   this->FunctionEvaluations++;
 }
 
+//----------------------------------------------------------------------------
+void vtkPowellMinimizer::EvaluateFunctions(
+  int m, const double *parameters, double *values)
+{
+  int n = this->NumberOfParameters;
+
+  if (this->BatchFunction)
+    {
+    this->BatchFunction(this->FunctionArg, m, parameters, values);
+    this->FunctionEvaluations += m;
+    return;
+    }
+
+  // evaluate the points one at a time, and then restore the
+  // original parameters and value
+  double *saved = new double[n];
+  double savedValue = this->FunctionValue;
+  for (int i = 0; i < n; i++)
+    {
+    saved[i] = this->ParameterValues[i];
+    }
+
+  for (int k = 0; k < m; k++)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      this->ParameterValues[i] = parameters[k*n + i];
+      }
+    this->EvaluateFunction();
+    values[k] = this->FunctionValue;
+    }
+
+  for (int i = 0; i < n; i++)
+    {
+    this->ParameterValues[i] = saved[i];
+    }
+  this->FunctionValue = savedValue;
+
+  delete [] saved;
+}
+
 //----------------------------------------------------------------------------
 double vtkPowellMinimizer::PowellBrent(
   const double *p0, double y0, const double *vec, double *point, int n,
@@ -468,6 +525,31 @@ double vtkPowellMinimizer::PowellBracket(
   double xa = 0.0;
   double xb = 1.0;
 
+  // the length of the vector in units of the parameter scales, for
+  // choosing the fidelity from the length of the first step
+  double l = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    double w = vec[i]/this->ParameterScales[i];
+    l += w*w;
+    }
+  l = sqrt(l);
+
+  // the fidelity is chosen once, and all of the values that are compared
+  // while bracketing must be at that fidelity, including the start point
+  bool lowFidelity = this->PowellSetFidelity(l);
+  double ya = y0;
+  if (lowFidelity)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      point[i] = p0[i];
+      }
+    this->EvaluateFunction();
+    ya = this->FunctionValue;
+    fa = ya;
+    }
+
   for (int i = 0; i < n; i++)
     {
     point[i] = p0[i] + xb*vec[i];
@@ -479,7 +561,7 @@ double vtkPowellMinimizer::PowellBracket(
     xa = xb;
     xb = 0.0;
     fa = fb;
-    fb = y0;
+    fb = ya;
     }
 
   double xc = xb + g*(xb - xa);
@@ -614,9 +696,43 @@ double vtkPowellMinimizer::PowellBracket(
     {
     point[i] = p0[i] + xb*vec[i];
     }
+
+  // only the center of the bracket is evaluated again at full fidelity,
+  // since Brent's method will compare it to full fidelity values
+  this->FidelityLevel = 0;
+  if (lowFidelity)
+    {
+    if (xb == 0.0)
+      {
+      fb = y0;
+      }
+    else
+      {
+      this->EvaluateFunction();
+      fb = this->FunctionValue;
+      }
+    }
+
   return fb;
 }
 
+//----------------------------------------------------------------------------
+bool vtkPowellMinimizer::PowellSetFidelity(double width)
+{
+  // reduce the fidelity by one level for each factor of eight by which
+  // the width exceeds the tolerance
+  int level = 0;
+  double limit = 8*this->ParameterTolerance;
+  while (level + 1 < this->NumberOfFidelityLevels && width >= limit)
+    {
+    level++;
+    limit *= 8;
+    }
+
+  this->FidelityLevel = level;
+  return (level > 0);
+}
+
 //----------------------------------------------------------------------------
 void vtkPowellMinimizer::PowellInitialize()
 {
@@ -684,6 +800,12 @@ int vtkPowellMinimizer::PowellIterate()
       {
       y = this->PowellBrent(p0, y, v, p, n, bracket, gtol);
       }
+    if (y > y0)
+      {
+      // a low fidelity bracket can lead to a worse point
+      for (int i = 0; i < n; i++) { p[i] = p0[i]; }
+      y = y0;
+      }
     double dy = y0 - y;
     if (dy > dymax)
       {
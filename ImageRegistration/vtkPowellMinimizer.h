@@ -37,6 +37,17 @@ public:
   // Set a function to call when a void* argument is being discarded.
   void SetFunctionArgDelete(void (*f)(void *));
 
+  // Description:
+  // Specify a function that evaluates many sets of parameters at once.
+  // The parameter sets are packed one after another in "parameters",
+  // and the function must write one value per set into "values".  The
+  // function receives the same argument as the one given to SetFunction().
+  // This is used by subclasses that can evaluate several points at
+  // the same time.  If no batch function is set, then the points are
+  // evaluated one at a time with the function given to SetFunction().
+  void SetBatchFunction(
+    void (*f)(void *arg, int n, const double *parameters, double *values));
+
   // Description:
   // Set the initial value for the specified parameter.  Calling
   // this function for any parameter will reset the Iterations
@@ -110,6 +121,23 @@ public:
   vtkSetMacro(MaxIterations,int);
   vtkGetMacro(MaxIterations,int);
 
+  // Description:
+  // Set the number of fidelity levels that the function supports.  The
+  // default is 1, which means that the function is always evaluated at
+  // full fidelity.  If more levels are available, then the bracketing
+  // step of each line search will use a lower fidelity if the first step
+  // is long compared to the ParameterTolerance, and Brent's method will
+  // always use full fidelity.
+  vtkSetClampMacro(NumberOfFidelityLevels, int, 1, 16);
+  vtkGetMacro(NumberOfFidelityLevels, int);
+
+  // Description:
+  // Get the fidelity level that is requested for the current evaluation.
+  // The function should call this to decide how accurately it must be
+  // evaluated.  Level zero is full fidelity, and each level above zero
+  // can be evaluated with about half the effort of the level below it.
+  vtkGetMacro(FidelityLevel, int);
+
   // Description:
   // Return the number of interations that have been performed.  This
   // is not necessarily the same as the number of function evaluations.
@@ -124,6 +152,12 @@ public:
   // minimization code, but it is provided here as a public method.
   void EvaluateFunction();
 
+  // Description:
+  // Evaluate the function for "m" sets of parameters, with the batch
+  // function if one was set.  The ParameterValues and the FunctionValue
+  // are not changed.
+  void EvaluateFunctions(int m, const double *parameters, double *values);
+
 protected:
   vtkPowellMinimizer();
   ~vtkPowellMinimizer();
@@ -131,6 +165,7 @@ protected:
   void (*Function)(void *);
   void (*FunctionArgDelete)(void *);
   void *FunctionArg;
+  void (*BatchFunction)(void *, int, const double *, double *);
 
   int NumberOfParameters;
   char **ParameterNames;
@@ -140,6 +175,8 @@ protected:
 
   double Tolerance;
   double ParameterTolerance;
+  int NumberOfFidelityLevels;
+  int FidelityLevel;
   int MaxIterations;
   int Iterations;
   int FunctionEvaluations;
@@ -158,6 +195,12 @@ private:
     const double *p0, double y0, const double *v, double *p, int n,
     double bracket[3], bool *failed);
 
+  // Description:
+  // Set the fidelity level from the length of the first step of the
+  // bracket, measured in units of the parameter scales.  Returns true if
+  // the fidelity is low.
+  bool PowellSetFidelity(double width);
+
   // Description:
   // Initialize the workspace required for the method.
   void PowellInitialize();
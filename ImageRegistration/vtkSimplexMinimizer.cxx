@@ -0,0 +1,330 @@
+/*=========================================================================
+
+  Program:   Visualization Toolkit
+  Module:    vtkSimplexMinimizer.cxx
+
+=========================================================================*/
+#include "vtkSimplexMinimizer.h"
+#include "vtkObjectFactory.h"
+
+#include <math.h>
+
+vtkStandardNewMacro(vtkSimplexMinimizer);
+
+//----------------------------------------------------------------------------
+vtkSimplexMinimizer::vtkSimplexMinimizer()
+{
+  this->ExpansionRatio = 2.0;
+  this->ContractionRatio = 0.5;
+
+  // specific to the amoeba method
+  this->SimplexWorkspace = 0;
+  this->SimplexVertices = 0;
+  this->SimplexValues = 0;
+}
+
+//----------------------------------------------------------------------------
+vtkSimplexMinimizer::~vtkSimplexMinimizer()
+{
+  delete [] this->SimplexVertices;
+  delete [] this->SimplexWorkspace;
+}
+
+//----------------------------------------------------------------------------
+void vtkSimplexMinimizer::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+  os << indent << "ExpansionRatio: " << this->ExpansionRatio << "\n";
+  os << indent << "ContractionRatio: " << this->ContractionRatio << "\n";
+}
+
+//----------------------------------------------------------------------------
+// The workspace holds (in order): the n+1 vertices, the n+1 function
+// values, the centroid, two trial points, and the parameter values for
+// up to n+1 vertices that are evaluated together.  The vertices are
+// stored in units of the parameter scales.
+void vtkSimplexMinimizer::SimplexInitialize()
+{
+  int n = this->NumberOfParameters;
+
+  delete [] this->SimplexVertices;
+  delete [] this->SimplexWorkspace;
+
+  this->SimplexWorkspace = new double[2*(n + 1)*n + (n + 1) + 3*n];
+  this->SimplexVertices = new double *[n + 1];
+
+  double *work = this->SimplexWorkspace;
+  for (int k = 0; k <= n; k++)
+    {
+    this->SimplexVertices[k] = work + k*n;
+    }
+  this->SimplexValues = work + (n + 1)*n;
+
+  // the first vertex is the starting point, and each of the other
+  // vertices is one scale unit away along one of the parameters
+  double **vertices = this->SimplexVertices;
+  for (int i = 0; i < n; i++)
+    {
+    vertices[0][i] = this->ParameterValues[i]/this->ParameterScales[i];
+    }
+  for (int k = 1; k <= n; k++)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      vertices[k][i] = vertices[0][i] + (k - 1 == i ? 1.0 : 0.0);
+      }
+    }
+
+  // evaluate all of the vertices at once
+  double *parameters = this->SimplexValues + (n + 1) + 3*n;
+  for (int k = 0; k <= n; k++)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      parameters[k*n + i] = vertices[k][i]*this->ParameterScales[i];
+      }
+    }
+  this->EvaluateFunctions(n + 1, parameters, this->SimplexValues);
+
+  int best = 0;
+  for (int k = 1; k <= n; k++)
+    {
+    if (this->SimplexValues[k] < this->SimplexValues[best])
+      {
+      best = k;
+      }
+    }
+  this->SimplexSetBest(best);
+}
+
+//----------------------------------------------------------------------------
+double vtkSimplexMinimizer::SimplexEvaluate(const double *point)
+{
+  int n = this->NumberOfParameters;
+  double *parameters = this->SimplexValues + (n + 1) + 3*n;
+  for (int i = 0; i < n; i++)
+    {
+    parameters[i] = point[i]*this->ParameterScales[i];
+    }
+
+  double value;
+  this->EvaluateFunctions(1, parameters, &value);
+  return value;
+}
+
+//----------------------------------------------------------------------------
+void vtkSimplexMinimizer::SimplexSetBest(int best)
+{
+  int n = this->NumberOfParameters;
+  for (int i = 0; i < n; i++)
+    {
+    this->ParameterValues[i] =
+      this->SimplexVertices[best][i]*this->ParameterScales[i];
+    }
+  this->FunctionValue = this->SimplexValues[best];
+}
+
+//----------------------------------------------------------------------------
+int vtkSimplexMinimizer::SimplexIterate()
+{
+  int n = this->NumberOfParameters;
+  double **vertices = this->SimplexVertices;
+  double *y = this->SimplexValues;
+  double *centroid = y + (n + 1);
+  double *p1 = centroid + n;
+  double *p2 = p1 + n;
+
+  // find the best, the worst, and the second-worst vertices
+  int lo = 0;
+  int hi = (y[0] > y[1] ? 0 : 1);
+  int nhi = 1 - hi;
+  for (int k = 0; k <= n; k++)
+    {
+    if (y[k] < y[lo])
+      {
+      lo = k;
+      }
+    if (y[k] > y[hi])
+      {
+      nhi = hi;
+      hi = k;
+      }
+    else if (y[k] > y[nhi] && k != hi)
+      {
+      nhi = k;
+      }
+    }
+
+  // the centroid of all vertices except for the worst
+  for (int i = 0; i < n; i++)
+    {
+    double sum = 0.0;
+    for (int k = 0; k <= n; k++)
+      {
+      sum += (k == hi ? 0.0 : vertices[k][i]);
+      }
+    centroid[i] = sum/n;
+    }
+
+  // reflect the worst vertex through the centroid
+  for (int i = 0; i < n; i++)
+    {
+    p1[i] = 2*centroid[i] - vertices[hi][i];
+    }
+  double y1 = this->SimplexEvaluate(p1);
+
+  double *newVertex = 0;
+  double newValue = 0.0;
+
+  if (y1 < y[lo])
+    {
+    // the reflection was very good, so try to expand further
+    double e = this->ExpansionRatio;
+    for (int i = 0; i < n; i++)
+      {
+      p2[i] = centroid[i] + e*(p1[i] - centroid[i]);
+      }
+    double y2 = this->SimplexEvaluate(p2);
+    newVertex = (y2 < y1 ? p2 : p1);
+    newValue = (y2 < y1 ? y2 : y1);
+    }
+  else if (y1 < y[nhi])
+    {
+    // the reflection was an improvement
+    newVertex = p1;
+    newValue = y1;
+    }
+  else
+    {
+    // contract towards the centroid, either from the reflected
+    // point or from the worst vertex, whichever is better
+    double c = this->ContractionRatio;
+    const double *outer = (y1 < y[hi] ? p1 : vertices[hi]);
+    double yOuter = (y1 < y[hi] ? y1 : y[hi]);
+    for (int i = 0; i < n; i++)
+      {
+      p2[i] = centroid[i] + c*(outer[i] - centroid[i]);
+      }
+    double y2 = this->SimplexEvaluate(p2);
+    if (y2 < yOuter)
+      {
+      newVertex = p2;
+      newValue = y2;
+      }
+    }
+
+  if (newVertex)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      vertices[hi][i] = newVertex[i];
+      }
+    y[hi] = newValue;
+    }
+  else
+    {
+    // shrink the whole simplex around the best vertex, and evaluate
+    // all of the new vertices at once
+    double c = this->ContractionRatio;
+    double *parameters = p2 + n;
+    double *values = new double[n];
+    int m = 0;
+    for (int k = 0; k <= n; k++)
+      {
+      if (k != lo)
+        {
+        double *v = vertices[k];
+        for (int i = 0; i < n; i++)
+          {
+          v[i] = vertices[lo][i] + c*(v[i] - vertices[lo][i]);
+          parameters[m*n + i] = v[i]*this->ParameterScales[i];
+          }
+        m++;
+        }
+      }
+    this->EvaluateFunctions(n, parameters, values);
+    m = 0;
+    for (int k = 0; k <= n; k++)
+      {
+      if (k != lo)
+        {
+        y[k] = values[m++];
+        }
+      }
+    delete [] values;
+    }
+
+  // find the new best and worst vertices
+  lo = 0;
+  hi = 0;
+  for (int k = 1; k <= n; k++)
+    {
+    lo = (y[k] < y[lo] ? k : lo);
+    hi = (y[k] > y[hi] ? k : hi);
+    }
+  this->SimplexSetBest(lo);
+
+  // check the size of the simplex, in units of the parameter scales
+  double maxw = 0.0;
+  for (int k = 0; k <= n; k++)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      double w = fabs(vertices[k][i] - vertices[lo][i]);
+      maxw = (maxw > w ? maxw : w);
+      }
+    }
+
+  // check the spread of the function values over the simplex
+  double ftol = this->Tolerance;
+  const double tiny = 1e-20;
+  if (2*fabs(y[hi] - y[lo]) <= ftol*(fabs(y[hi]) + fabs(y[lo])) + tiny &&
+      maxw < this->ParameterTolerance)
+    {
+    return 0;
+    }
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkSimplexMinimizer::Iterate()
+{
+  if (this->Iterations == 0)
+    {
+    if (!this->Function)
+      {
+      vtkErrorMacro("Iterate: Function is NULL");
+      return 0;
+      }
+    this->SimplexInitialize();
+    }
+
+  int stillgood = this->SimplexIterate();
+  this->Iterations++;
+
+  return stillgood;
+}
+
+//----------------------------------------------------------------------------
+void vtkSimplexMinimizer::Minimize()
+{
+  if (this->Iterations == 0)
+    {
+    if (!this->Function)
+      {
+      vtkErrorMacro("Minimize: Function is NULL");
+      return;
+      }
+    this->SimplexInitialize();
+    }
+
+  for (; this->Iterations < this->MaxIterations; this->Iterations++)
+    {
+    int stillgood = this->SimplexIterate();
+    if (!stillgood)
+      {
+      break;
+      }
+    }
+}
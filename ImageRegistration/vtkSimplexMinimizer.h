@@ -0,0 +1,91 @@
+/*=========================================================================
+
+  Program:   Visualization Toolkit
+  Module:    vtkSimplexMinimizer.h
+
+=========================================================================*/
+// .NAME vtkSimplexMinimizer - use the amoeba method to minimize a function
+// .SECTION Description
+// vtkSimplexMinimizer will modify a set of parameters in order to find
+// the minimum of a specified function.  The method used is commonly
+// known as the amoeba method (or the Nelder-Mead method), it constructs
+// an n-dimensional simplex in parameter space (i.e. a tetrahedron if the
+// number of parameters is 3) and moves the vertices around parameter
+// space until a local minimum is found.  The size of the initial simplex
+// is given by the parameter scales.  The vertices of the initial simplex,
+// and the vertices of the simplex after each shrink step, are evaluated
+// all at once with the batch function, if one has been set.
+// .SECTION See also
+// vtkPowellMinimizer vtkCMAESMinimizer
+
+#ifndef __vtkSimplexMinimizer_h
+#define __vtkSimplexMinimizer_h
+
+#include "vtkPowellMinimizer.h"
+
+class VTK_EXPORT vtkSimplexMinimizer : public vtkPowellMinimizer
+{
+public:
+  static vtkSimplexMinimizer *New();
+  vtkTypeMacro(vtkSimplexMinimizer,vtkPowellMinimizer);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Set the amoeba expansion ratio.  The default is 2.0, which is
+  // what is used in Numerical Recipes.  The golden ratio 1.618 is
+  // also a good choice.
+  vtkSetClampMacro(ExpansionRatio, double, 1.0, VTK_DOUBLE_MAX);
+  vtkGetMacro(ExpansionRatio, double);
+
+  // Description:
+  // Set the amoeba contraction ratio.  The default is 0.5, which is
+  // what is used in Numerical Recipes.  The golden ratio 0.618 is
+  // also a good choice.  This ratio is also used when the whole
+  // simplex is shrunk around the best vertex.
+  vtkSetClampMacro(ContractionRatio, double, 0.0, 1.0);
+  vtkGetMacro(ContractionRatio, double);
+
+  // Description:
+  // Iterate until the minimum is found to within the specified tolerance,
+  // or until the MaxIterations has been reached.
+  virtual void Minimize();
+
+  // Description:
+  // Perform one iteration of minimization, i.e. move one vertex of the
+  // simplex, or shrink the whole simplex.  Returns zero if the tolerance
+  // stopping criterion has been met.
+  virtual int Iterate();
+
+protected:
+  vtkSimplexMinimizer();
+  ~vtkSimplexMinimizer();
+
+  double ExpansionRatio;
+  double ContractionRatio;
+
+private:
+  // Description:
+  // Initialize the simplex and evaluate all of its vertices.
+  void SimplexInitialize();
+
+  // Description:
+  // Run one iteration of the amoeba method.
+  int SimplexIterate();
+
+  // Description:
+  // Evaluate the function at a single point, given in scaled units.
+  double SimplexEvaluate(const double *point);
+
+  // Description:
+  // Copy the best vertex into the ParameterValues.
+  void SimplexSetBest(int best);
+
+  double *SimplexWorkspace;
+  double **SimplexVertices;
+  double *SimplexValues;
+
+  vtkSimplexMinimizer(const vtkSimplexMinimizer&);  // Not implemented.
+  void operator=(const vtkSimplexMinimizer&);  // Not implemented.
+};
+
+#endif
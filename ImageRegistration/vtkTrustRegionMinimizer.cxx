@@ -0,0 +1,692 @@
+/*=========================================================================
+
+  Program:   Visualization Toolkit
+  Module:    vtkTrustRegionMinimizer.cxx
+
+=========================================================================*/
+#include "vtkTrustRegionMinimizer.h"
+#include "vtkObjectFactory.h"
+#include "vtkMath.h"
+
+#include <math.h>
+
+vtkStandardNewMacro(vtkTrustRegionMinimizer);
+
+//----------------------------------------------------------------------------
+vtkTrustRegionMinimizer::vtkTrustRegionMinimizer()
+{
+  this->InitialTrustRadius = 1.0;
+  this->TrustRadius = 1.0;
+
+  // specific to the trust region method
+  this->TrustRegionWorkspace = 0;
+  this->TrustRegionMatrices = 0;
+  this->TrustRegionBest = 0;
+}
+
+//----------------------------------------------------------------------------
+vtkTrustRegionMinimizer::~vtkTrustRegionMinimizer()
+{
+  delete [] this->TrustRegionMatrices;
+  delete [] this->TrustRegionWorkspace;
+}
+
+//----------------------------------------------------------------------------
+void vtkTrustRegionMinimizer::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+  os << indent << "InitialTrustRadius: " << this->InitialTrustRadius << "\n";
+  os << indent << "TrustRadius: " << this->TrustRadius << "\n";
+}
+
+//----------------------------------------------------------------------------
+namespace {
+
+// Pointers into the workspace.  The points and the model are stored in
+// units of the parameter scales, the model of f(c + x) is g.x + 0.5*x.H.x
+// where c is the center of the model
+struct vtkTrustRegionLayout
+{
+  int N;            // number of parameters
+  int M;            // number of points, 2N+1
+  int K;            // size of the interpolation system, M+N+1
+  double **Points;  // M points
+  double *Values;   // M function values
+  double *Center;   // N
+  double *Gradient; // N
+  double **Hessian; // NxN
+  double **Vectors; // NxN eigenvectors of the Hessian
+  double **Scratch; // NxN
+  double *Eigen;    // N eigenvalues of the Hessian
+  double *Step;     // N
+  double *Trial;    // N
+  double **System;  // KxK
+  double *Solution; // K
+  double *Batch;    // MxN parameter values for batch evaluation
+
+  vtkTrustRegionLayout(double *work, double **matrices, int n)
+  {
+    int m = 2*n + 1;
+    int k = m + n + 1;
+    this->N = n;
+    this->M = m;
+    this->K = k;
+    this->Points = matrices;
+    this->Hessian = matrices + m;
+    this->Vectors = this->Hessian + n;
+    this->Scratch = this->Vectors + n;
+    this->System = this->Scratch + n;
+    this->Values = work;
+    this->Center = this->Values + m;
+    this->Gradient = this->Center + n;
+    this->Eigen = this->Gradient + n;
+    this->Step = this->Eigen + n;
+    this->Trial = this->Step + n;
+    this->Solution = this->Trial + n;
+    this->Batch = this->Solution + k;
+  }
+
+  static int VectorSize(int n)
+  {
+    int m = 2*n + 1;
+    int k = m + n + 1;
+    return m + 5*n + k + m*n;
+  }
+
+  static int WorkspaceSize(int n)
+  {
+    int m = 2*n + 1;
+    int k = m + n + 1;
+    return VectorSize(n) + (m + 3*n)*n + k*k;
+  }
+
+  static int MatrixCount(int n)
+  {
+    int m = 2*n + 1;
+    int k = m + n + 1;
+    return m + 3*n + k;
+  }
+};
+
+double vtkTrustRegionDistance(const double *a, const double *b, int n)
+{
+  double d = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    d += (a[i] - b[i])*(a[i] - b[i]);
+    }
+  return sqrt(d);
+}
+
+// The norm of the step for the shifted system (H + lambda*I)
+double vtkTrustRegionStepNorm(
+  const double *a, const double *w, double lambda, int n)
+{
+  double s = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    double d = w[i] + lambda;
+    if (d > 0)
+      {
+      s += (a[i]/d)*(a[i]/d);
+      }
+    }
+  return sqrt(s);
+}
+
+} // end anonymous namespace
+
+//----------------------------------------------------------------------------
+void vtkTrustRegionMinimizer::TrustRegionInitialize()
+{
+  int n = this->NumberOfParameters;
+
+  delete [] this->TrustRegionMatrices;
+  delete [] this->TrustRegionWorkspace;
+
+  int workSize = vtkTrustRegionLayout::WorkspaceSize(n);
+  int matrixCount = vtkTrustRegionLayout::MatrixCount(n);
+  this->TrustRegionWorkspace = new double[workSize];
+  this->TrustRegionMatrices = new double *[matrixCount];
+
+  // the rows of the matrices follow the vectors in the workspace
+  int m = 2*n + 1;
+  int k = m + n + 1;
+  double *rows = this->TrustRegionWorkspace;
+  rows += vtkTrustRegionLayout::VectorSize(n);
+  for (int j = 0; j < matrixCount; j++)
+    {
+    this->TrustRegionMatrices[j] = rows;
+    rows += (j < m + 3*n ? n : k);
+    }
+
+  vtkTrustRegionLayout t(
+    this->TrustRegionWorkspace, this->TrustRegionMatrices, n);
+
+  for (int i = 0; i < n; i++)
+    {
+    t.Points[0][i] = this->ParameterValues[i]/this->ParameterScales[i];
+    }
+  this->TrustRegionBest = 0;
+  this->TrustRadius = this->InitialTrustRadius;
+
+  this->TrustRegionSample(true);
+}
+
+//----------------------------------------------------------------------------
+// Place two points along each parameter axis, one trust radius away
+// from the best point, and evaluate them all at once.
+void vtkTrustRegionMinimizer::TrustRegionSample(bool evaluateCenter)
+{
+  int n = this->NumberOfParameters;
+  vtkTrustRegionLayout t(
+    this->TrustRegionWorkspace, this->TrustRegionMatrices, n);
+
+  // move the best point into the first slot, and discard the model
+  int b = this->TrustRegionBest;
+  for (int i = 0; i < n; i++)
+    {
+    t.Points[0][i] = t.Points[b][i];
+    t.Center[i] = t.Points[b][i];
+    t.Gradient[i] = 0.0;
+    for (int j = 0; j < n; j++)
+      {
+      t.Hessian[i][j] = 0.0;
+      }
+    }
+  t.Values[0] = t.Values[b];
+  this->TrustRegionBest = 0;
+
+  double r = this->TrustRadius;
+  for (int j = 1; j < t.M; j++)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      t.Points[j][i] = t.Points[0][i];
+      }
+    t.Points[j][(j - 1)/2] += ((j & 1) ? r : -r);
+    }
+
+  int first = (evaluateCenter ? 0 : 1);
+  int count = t.M - first;
+  for (int j = 0; j < count; j++)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      t.Batch[j*n + i] = t.Points[first + j][i]*this->ParameterScales[i];
+      }
+    }
+  this->EvaluateFunctions(count, t.Batch, t.Values + first);
+
+  for (int j = 1; j < t.M; j++)
+    {
+    if (t.Values[j] < t.Values[this->TrustRegionBest])
+      {
+      this->TrustRegionBest = j;
+      }
+    }
+
+  b = this->TrustRegionBest;
+  for (int i = 0; i < n; i++)
+    {
+    this->ParameterValues[i] = t.Points[b][i]*this->ParameterScales[i];
+    }
+  this->FunctionValue = t.Values[b];
+}
+
+//----------------------------------------------------------------------------
+double vtkTrustRegionMinimizer::TrustRegionEvaluate(const double *point)
+{
+  int n = this->NumberOfParameters;
+  vtkTrustRegionLayout t(
+    this->TrustRegionWorkspace, this->TrustRegionMatrices, n);
+
+  for (int i = 0; i < n; i++)
+    {
+    t.Batch[i] = point[i]*this->ParameterScales[i];
+    }
+
+  double value;
+  this->EvaluateFunctions(1, t.Batch, &value);
+  return value;
+}
+
+//----------------------------------------------------------------------------
+// Update the quadratic model so that it interpolates the function values
+// at all of the points, while making the least change to the curvature
+// (in the Frobenius norm), as in NEWUOA.  The model is moved to the best
+// point, and the offsets are divided by the trust radius to keep the
+// system well scaled.
+int vtkTrustRegionMinimizer::TrustRegionModel()
+{
+  int n = this->NumberOfParameters;
+  vtkTrustRegionLayout t(
+    this->TrustRegionWorkspace, this->TrustRegionMatrices, n);
+  int m = t.M;
+  int k = t.K;
+  int b = this->TrustRegionBest;
+  double r = this->TrustRadius;
+  const double *center = t.Points[b];
+
+  // the value of the old model at the best point
+  double *x = t.Step;
+  for (int l = 0; l < n; l++)
+    {
+    x[l] = center[l] - t.Center[l];
+    }
+  double qb = 0.0;
+  for (int l = 0; l < n; l++)
+    {
+    double hx = 0.0;
+    for (int p = 0; p < n; p++)
+      {
+      hx += t.Hessian[l][p]*x[p];
+      }
+    qb += x[l]*(t.Gradient[l] + 0.5*hx);
+    }
+
+  for (int i = 0; i < m; i++)
+    {
+    double *row = t.System[i];
+    for (int j = 0; j <= i; j++)
+      {
+      double dot = 0.0;
+      for (int l = 0; l < n; l++)
+        {
+        dot += ((t.Points[i][l] - center[l])*(t.Points[j][l] - center[l]));
+        }
+      dot /= r*r;
+      row[j] = 0.5*dot*dot;
+      t.System[j][i] = row[j];
+      }
+    row[m] = 1.0;
+    t.System[m][i] = 1.0;
+    for (int l = 0; l < n; l++)
+      {
+      double d = (t.Points[i][l] - center[l])/r;
+      row[m + 1 + l] = d;
+      t.System[m + 1 + l][i] = d;
+      }
+
+    // the residual of the old model at this point
+    for (int l = 0; l < n; l++)
+      {
+      x[l] = t.Points[i][l] - t.Center[l];
+      }
+    double q = 0.0;
+    for (int l = 0; l < n; l++)
+      {
+      double hx = 0.0;
+      for (int p = 0; p < n; p++)
+        {
+        hx += t.Hessian[l][p]*x[p];
+        }
+      q += x[l]*(t.Gradient[l] + 0.5*hx);
+      }
+    t.Solution[i] = (t.Values[i] - t.Values[b]) - (q - qb);
+    }
+  for (int i = m; i < k; i++)
+    {
+    for (int j = m; j < k; j++)
+      {
+      t.System[i][j] = 0.0;
+      }
+    t.Solution[i] = 0.0;
+    }
+
+  if (!vtkMath::SolveLinearSystem(t.System, t.Solution, k))
+    {
+    return 0;
+    }
+
+  // move the gradient of the old model to the best point, and add the
+  // change in the gradient
+  double check = 0.0;
+  for (int l = 0; l < n; l++)
+    {
+    double hx = 0.0;
+    for (int p = 0; p < n; p++)
+      {
+      hx += t.Hessian[l][p]*(center[p] - t.Center[p]);
+      }
+    x[l] = t.Gradient[l] + hx + t.Solution[m + 1 + l]/r;
+    check += x[l]*x[l];
+    }
+  for (int l = 0; l < n; l++)
+    {
+    t.Gradient[l] = x[l];
+    t.Center[l] = center[l];
+    }
+
+  // the change in the Hessian is the weighted sum of the outer products
+  // of the offsets
+  for (int i = 0; i < m; i++)
+    {
+    double lambda = t.Solution[i]/(r*r);
+    for (int l = 0; l < n; l++)
+      {
+      double dl = (t.Points[i][l] - center[l])/r;
+      for (int p = 0; p <= l; p++)
+        {
+        double dp = (t.Points[i][p] - center[p])/r;
+        t.Hessian[l][p] += lambda*dl*dp;
+        }
+      }
+    }
+  for (int l = 0; l < n; l++)
+    {
+    for (int p = 0; p <= l; p++)
+      {
+      t.Hessian[p][l] = t.Hessian[l][p];
+      check += t.Hessian[l][p]*t.Hessian[l][p];
+      }
+    }
+
+  // reject the model if the points were degenerate
+  if (!(check < VTK_DOUBLE_MAX))
+    {
+    return 0;
+    }
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+// Minimize the model within the trust region.  In units of the trust
+// radius r, this means minimizing g.u + 0.5*u.H.u subject to |u| <= 1,
+// by finding the shift lambda for which (H + lambda*I) u = -g has a
+// solution on the boundary.
+double vtkTrustRegionMinimizer::TrustRegionStep(double *u)
+{
+  int n = this->NumberOfParameters;
+  vtkTrustRegionLayout t(
+    this->TrustRegionWorkspace, this->TrustRegionMatrices, n);
+  double r = this->TrustRadius;
+  double *g = t.Gradient;
+  double *w = t.Eigen;
+  double *a = t.Trial;
+
+  // the eigenvalues are sorted from largest to smallest
+  for (int l = 0; l < n; l++)
+    {
+    for (int p = 0; p < n; p++)
+      {
+      t.Scratch[l][p] = r*r*t.Hessian[l][p];
+      }
+    }
+  vtkMath::JacobiN(t.Scratch, n, w, t.Vectors);
+
+  // the gradient in the eigenvector basis
+  double gnorm = 0.0;
+  for (int l = 0; l < n; l++)
+    {
+    double sum = 0.0;
+    for (int p = 0; p < n; p++)
+      {
+      sum += t.Vectors[p][l]*g[p];
+      }
+    a[l] = r*sum;
+    gnorm += g[l]*g[l];
+    }
+  gnorm = r*sqrt(gnorm);
+
+  double wmin = w[n - 1];
+  double lo = (wmin < 0 ? -wmin : 0.0);
+  double lambda = 0.0;
+  double tau = 0.0;
+
+  if (wmin > 0 && vtkTrustRegionStepNorm(a, w, 0.0, n) <= 1.0)
+    {
+    // the minimum of the model is inside the trust region
+    lambda = 0.0;
+    }
+  else
+    {
+    double tiny = 1e-12*(1.0 + lo);
+    double snorm = vtkTrustRegionStepNorm(a, w, lo + tiny, n);
+    if (snorm < 1.0)
+      {
+      // the "hard case": go along the direction of negative curvature
+      lambda = lo;
+      tau = sqrt(1.0 - snorm*snorm);
+      }
+    else
+      {
+      // use bisection to find the shift that puts the step on the
+      // boundary, the step norm decreases as the shift increases
+      double hi = lo + gnorm + 1.0;
+      lo += tiny;
+      for (int iter = 0; iter < 60; iter++)
+        {
+        double mid = 0.5*(lo + hi);
+        if (vtkTrustRegionStepNorm(a, w, mid, n) > 1.0)
+          {
+          lo = mid;
+          }
+        else
+          {
+          hi = mid;
+          }
+        }
+      lambda = hi;
+      }
+    }
+
+  for (int p = 0; p < n; p++)
+    {
+    u[p] = 0.0;
+    }
+  for (int l = 0; l < n; l++)
+    {
+    double d = w[l] + lambda;
+    double c = (d > 0 ? -a[l]/d : 0.0);
+    if (l == n - 1 && tau != 0.0)
+      {
+      c = (a[l] > 0 ? -tau : tau);
+      }
+    for (int p = 0; p < n; p++)
+      {
+      u[p] += c*t.Vectors[p][l];
+      }
+    }
+
+  // compute the reduction that is predicted by the model
+  double pred = 0.0;
+  for (int l = 0; l < n; l++)
+    {
+    double hu = 0.0;
+    for (int p = 0; p < n; p++)
+      {
+      hu += t.Hessian[l][p]*u[p];
+      }
+    pred -= r*u[l]*(g[l] + 0.5*r*hu);
+    }
+
+  return pred;
+}
+
+//----------------------------------------------------------------------------
+int vtkTrustRegionMinimizer::TrustRegionIterate()
+{
+  int n = this->NumberOfParameters;
+  vtkTrustRegionLayout t(
+    this->TrustRegionWorkspace, this->TrustRegionMatrices, n);
+  int m = t.M;
+  double r = this->TrustRadius;
+
+  if (!this->TrustRegionModel())
+    {
+    // the points are degenerate, so place them again
+    this->TrustRegionSample(false);
+    return 1;
+    }
+
+  // take a step to the minimum of the model
+  double *u = t.Step;
+  double pred = this->TrustRegionStep(u);
+  int b = this->TrustRegionBest;
+  double *trial = t.Trial;
+  double unorm = 0.0;
+  for (int i = 0; i < n; i++)
+    {
+    trial[i] = t.Points[b][i] + r*u[i];
+    unorm += u[i]*u[i];
+    }
+  unorm = sqrt(unorm);
+  double yb = t.Values[b];
+
+  // if the step is short and the model predicts a negligible decrease,
+  // then shrink the trust region without evaluating the function
+  if (unorm < 0.5 &&
+      2*pred <= this->Tolerance*fabs(yb) + 1e-20)
+    {
+    this->TrustRadius = 0.1*r;
+    return (this->TrustRadius >= this->ParameterTolerance);
+    }
+
+  double y = this->TrustRegionEvaluate(trial);
+  double rho = (pred > 0 ? (yb - y)/pred : -1.0);
+
+  // choose which point will be replaced by the trial point: a point
+  // that is almost the same as the trial point, or else the point
+  // that is farthest from the new best point
+  const double *center = (y < yb ? trial : t.Points[b]);
+  int replace = -1;
+  for (int j = 0; j < m; j++)
+    {
+    if (vtkTrustRegionDistance(t.Points[j], trial, n) < 1e-3*r)
+      {
+      replace = (y < t.Values[j] ? j : m);
+      break;
+      }
+    }
+  if (replace < 0)
+    {
+    double dmax = -1.0;
+    for (int j = 0; j < m; j++)
+      {
+      double d = vtkTrustRegionDistance(t.Points[j], center, n);
+      if (j != b && d > dmax)
+        {
+        dmax = d;
+        replace = j;
+        }
+      }
+    }
+  if (replace < m)
+    {
+    for (int i = 0; i < n; i++)
+      {
+      t.Points[replace][i] = trial[i];
+      }
+    t.Values[replace] = y;
+    if (y < yb)
+      {
+      this->TrustRegionBest = replace;
+      }
+    }
+  b = this->TrustRegionBest;
+
+  // update the trust radius, like in NEWUOA the radius follows the
+  // length of the step so that it shrinks as the steps get shorter
+  double dnorm = r*unorm;
+  if (rho >= 0.7)
+    {
+    this->TrustRadius = (2*dnorm > 0.5*r ? 2*dnorm : 0.5*r);
+    }
+  else if (rho > 0.1)
+    {
+    this->TrustRadius = (dnorm > 0.5*r ? dnorm : 0.5*r);
+    }
+  else
+    {
+    // if a point is far outside of the trust region, then the poor
+    // step might be due to the model, so bring that point closer
+    int farthest = -1;
+    double dmax = 2*r;
+    for (int j = 0; j < m; j++)
+      {
+      double d = vtkTrustRegionDistance(t.Points[j], t.Points[b], n);
+      if (d > dmax)
+        {
+        dmax = d;
+        farthest = j;
+        }
+      }
+    if (farthest >= 0)
+      {
+      for (int i = 0; i < n; i++)
+        {
+        t.Points[farthest][i] = (t.Points[b][i] +
+          (t.Points[farthest][i] - t.Points[b][i])*(r/dmax));
+        }
+      t.Values[farthest] = this->TrustRegionEvaluate(t.Points[farthest]);
+      if (t.Values[farthest] < t.Values[b])
+        {
+        this->TrustRegionBest = farthest;
+        b = farthest;
+        }
+      }
+    else
+      {
+      this->TrustRadius = 0.5*r;
+      }
+    }
+
+  for (int i = 0; i < n; i++)
+    {
+    this->ParameterValues[i] = t.Points[b][i]*this->ParameterScales[i];
+    }
+  this->FunctionValue = t.Values[b];
+
+  // the trust radius is in units of the parameter scales, like the
+  // tolerance for Powell's method
+  if (this->TrustRadius < this->ParameterTolerance)
+    {
+    return 0;
+    }
+
+  return 1;
+}
+
+//----------------------------------------------------------------------------
+int vtkTrustRegionMinimizer::Iterate()
+{
+  if (this->Iterations == 0)
+    {
+    if (!this->Function)
+      {
+      vtkErrorMacro("Iterate: Function is NULL");
+      return 0;
+      }
+    this->TrustRegionInitialize();
+    }
+
+  int stillgood = this->TrustRegionIterate();
+  this->Iterations++;
+
+  return stillgood;
+}
+
+//----------------------------------------------------------------------------
+void vtkTrustRegionMinimizer::Minimize()
+{
+  if (this->Iterations == 0)
+    {
+    if (!this->Function)
+      {
+      vtkErrorMacro("Minimize: Function is NULL");
+      return;
+      }
+    this->TrustRegionInitialize();
+    }
+
+  for (; this->Iterations < this->MaxIterations; this->Iterations++)
+    {
+    int stillgood = this->TrustRegionIterate();
+    if (!stillgood)
+      {
+      break;
+      }
+    }
+}
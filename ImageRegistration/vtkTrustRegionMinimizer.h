@@ -0,0 +1,101 @@
+/*=========================================================================
+
+  Program:   Visualization Toolkit
+  Module:    vtkTrustRegionMinimizer.h
+
+=========================================================================*/
+// .NAME vtkTrustRegionMinimizer - use quadratic models to minimize a function
+// .SECTION Description
+// vtkTrustRegionMinimizer will modify a set of parameters in order to find
+// the minimum of a specified function, without using derivatives.  It
+// keeps a set of 2N+1 points (where N is the number of parameters), and
+// a quadratic model that interpolates the function at those points.
+// Whenever a point changes, the model is updated with the least possible
+// change to its curvature, as in Powell's NEWUOA method.  Each
+// iteration minimizes the model within a trust region around the best
+// point, evaluates the function there, and uses the result to update
+// both the set of points and the size of the trust region.  For smooth
+// functions with up to a dozen or so parameters, this usually requires
+// far fewer function evaluations than Powell's method.  The initial set
+// of points (and any set that has to be rebuilt because it became
+// degenerate) is evaluated all at once with the batch function, if one
+// has been set.
+// .SECTION See also
+// vtkPowellMinimizer
+
+#ifndef __vtkTrustRegionMinimizer_h
+#define __vtkTrustRegionMinimizer_h
+
+#include "vtkPowellMinimizer.h"
+
+class VTK_EXPORT vtkTrustRegionMinimizer : public vtkPowellMinimizer
+{
+public:
+  static vtkTrustRegionMinimizer *New();
+  vtkTypeMacro(vtkTrustRegionMinimizer,vtkPowellMinimizer);
+  void PrintSelf(ostream& os, vtkIndent indent);
+
+  // Description:
+  // Set the initial radius of the trust region, as a multiple of the
+  // parameter scales.  The default is 1.0.  The minimization stops
+  // when the radius falls below the ParameterTolerance.
+  vtkSetMacro(InitialTrustRadius, double);
+  vtkGetMacro(InitialTrustRadius, double);
+
+  // Description:
+  // Get the current radius of the trust region.
+  vtkGetMacro(TrustRadius, double);
+
+  // Description:
+  // Iterate until the minimum is found to within the specified tolerance,
+  // or until the MaxIterations has been reached.
+  virtual void Minimize();
+
+  // Description:
+  // Perform one iteration of minimization, i.e. one trust region step.
+  // Returns zero if the tolerance stopping criterion has been met.
+  virtual int Iterate();
+
+protected:
+  vtkTrustRegionMinimizer();
+  ~vtkTrustRegionMinimizer();
+
+  double InitialTrustRadius;
+  double TrustRadius;
+
+private:
+  // Description:
+  // Initialize the workspace and evaluate the initial points.
+  void TrustRegionInitialize();
+
+  // Description:
+  // Place the points around the best point, and evaluate them.
+  void TrustRegionSample(bool evaluateCenter);
+
+  // Description:
+  // Fit the quadratic model to the points.  Returns zero if the
+  // points are degenerate.
+  int TrustRegionModel();
+
+  // Description:
+  // Minimize the model within the trust region.  Returns the
+  // predicted reduction in the function value.
+  double TrustRegionStep(double *step);
+
+  // Description:
+  // Run one iteration of the trust region method.
+  int TrustRegionIterate();
+
+  // Description:
+  // Evaluate the function at a single point, given in scaled units.
+  double TrustRegionEvaluate(const double *point);
+
+  double *TrustRegionWorkspace;
+  double **TrustRegionMatrices;
+  int TrustRegionBest;
+
+  vtkTrustRegionMinimizer(const vtkTrustRegionMinimizer&);  // Not implemented.
+  void operator=(const vtkTrustRegionMinimizer&);  // Not implemented.
+};
+
+#endif
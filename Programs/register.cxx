@@ -24,7 +24,10 @@ Module:    register.cxx
 #include <vtkImageHistogramStatistics.h>
 #include <vtkImageThreshold.h>
 #include <vtkImageCast.h>
+#include <vtkImageExtractComponents.h>
+#include <vtkImageAppendComponents.h>
 #include <vtkROIStencilSource.h>
+#include <vtkImageStencilData.h>
 #include <vtkImageData.h>
 #include <vtkPointData.h>
 #include <vtkMatrix4x4.h>
@@ -41,29 +44,35 @@ Module:    register.cxx
 #include <vtkMNITransformWriter.h>
 #include <vtkDICOMImageReader.h>
 
-#include <vtkRenderer.h>
-#include <vtkCamera.h>
-#include <vtkRenderWindow.h>
-#include <vtkRenderWindowInteractor.h>
-#include <vtkInteractorStyleImage.h>
-#include <vtkImageSlice.h>
-#include <vtkImageStack.h>
-#include <vtkImageResliceMapper.h>
-#include <vtkImageProperty.h>
-#include <vtkWindowToImageFilter.h>
 #include <vtkPNGWriter.h>
 #include <vtkTIFFWriter.h>
 #include <vtkJPEGWriter.h>
 
 #include <vtkTimerLog.h>
+#include <vtkMultiThreader.h>
+#include <vtkMutexLock.h>
+#include <vtkConditionVariable.h>
 #include <vtkVersion.h>
 
 #include <vtksys/SystemTools.hxx>
 
 #include "AIRSConfig.h"
+#ifndef AIRS_HEADLESS_PROGRAMS
+#include <vtkRenderer.h>
+#include <vtkCamera.h>
+#include <vtkRenderWindow.h>
+#include <vtkRenderWindowInteractor.h>
+#include <vtkInteractorStyleImage.h>
+#include <vtkImageSlice.h>
+#include <vtkImageStack.h>
+#include <vtkImageResliceMapper.h>
+#include <vtkImageProperty.h>
+#include <vtkWindowToImageFilter.h>
+#endif
 #include "vtkITKXFMReader.h"
 #include "vtkITKXFMWriter.h"
 #include "vtkImageRegistration.h"
+#include "vtkImageRegistrationTarget.h"
 #include "vtkLabelInterpolator.h"
 
 // optional readers
@@ -82,13 +91,29 @@ Module:    register.cxx
 
 #include <vector>
 #include <string>
+#include <set>
+
+// for the --server and --connect options
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#endif
 
 // A macro to assist VTK 5 backwards compatibility
 #if VTK_MAJOR_VERSION >= 6
 #define SET_INPUT_DATA SetInputData
+#define ADD_INPUT_DATA AddInputData
 #define SET_STENCIL_DATA SetStencilData
 #else
 #define SET_INPUT_DATA SetInput
+#define ADD_INPUT_DATA AddInput
 #define SET_STENCIL_DATA SetStencil
 #endif
 
@@ -206,17 +231,14 @@ int GuessFileType(const char *filename)
 }
 
 #ifdef AIRS_USE_DICOM
-vtkDICOMReader *ReadDICOMImage(
-  vtkImageData *data, vtkMatrix4x4 *matrix, const char *directoryName,
-  int coordSystem)
+// Give the files to the reader and read the meta data, but not the
+// pixel data.  Returns zero if the files cannot be read.
+int ReadDICOMInformation(
+  vtkDICOMReader *reader, const char *directoryName, int coordSystem)
 {
-  vtkDICOMReader *reader = vtkDICOMReader::New();
-
-  bool singleFile = true;
   if (vtksys::SystemTools::FileIsDirectory(directoryName))
     {
     // get all the DICOM files in the directory
-    singleFile = false;
     std::string dirString = directoryName;
     vtksys::SystemTools::ConvertToUnixSlashes(dirString);
     vtkSmartPointer<vtkGlobFileNames> glob =
@@ -233,13 +255,13 @@ vtkDICOMReader *ReadDICOMImage(
     if (sorter->GetNumberOfSeries() == 0)
       {
       fprintf(stderr, "Folder contains no DICOM files: %s\n", directoryName);
-      exit(1);
+      return 0;
       }
     else if (sorter->GetNumberOfSeries() > 1)
       {
       fprintf(stderr, "Folder contains more than one DICOM series: %s\n",
               directoryName);
-      exit(1);
+      return 0;
       }
     reader->SetFileNames(sorter->GetFileNamesForSeries(0));
     }
@@ -259,11 +281,21 @@ vtkDICOMReader *ReadDICOMImage(
     }
 
   reader->UpdateInformation();
-  if (reader->GetErrorCode())
+  return (reader->GetErrorCode() == 0);
+}
+
+vtkDICOMReader *ReadDICOMImage(
+  vtkImageData *data, vtkMatrix4x4 *matrix, const char *directoryName,
+  int coordSystem)
+{
+  vtkDICOMReader *reader = vtkDICOMReader::New();
+  if (!ReadDICOMInformation(reader, directoryName, coordSystem))
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
+  bool singleFile = !vtksys::SystemTools::FileIsDirectory(directoryName);
   if (!singleFile)
     {
     // when reading images, only read 1st component if the
@@ -300,7 +332,8 @@ vtkDICOMReader *ReadDICOMImage(
   reader->Update();
   if (reader->GetErrorCode())
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
   vtkImageData *image = reader->GetOutput();
@@ -429,7 +462,8 @@ vtkDICOMImageReader *ReadDICOMImage(
   reader->Update();
   if (reader->GetErrorCode())
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
   vtkSmartPointer<vtkImageData> image = reader->GetOutput();
@@ -518,7 +552,8 @@ vtkMINCImageReader *ReadMINCImage(
   reader->Update();
   if (reader->GetErrorCode())
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
   vtkSmartPointer<vtkImageData> image = reader->GetOutput();
@@ -597,7 +632,8 @@ vtkNIFTIReader *ReadNIFTIImage(
   reader->Update();
   if (reader->GetErrorCode())
     {
-    exit(1);
+    reader->Delete();
+    return NULL;
     }
 
   vtkSmartPointer<vtkImageData> image = reader->GetOutput();
@@ -689,6 +725,8 @@ void WriteNIFTIImage(
 
 #endif /* AIRS_USE_NIFTI */
 
+// Read an image, and correct any shear.  Returns NULL if the image could
+// not be read, otherwise the reader must be deleted by the caller.
 vtkImageReader2 *ReadImage(
   vtkImageData *image, vtkMatrix4x4 *matrix, double vrange[2],
   const char *filename, int coordSystem, int interpolator)
@@ -706,7 +744,6 @@ vtkImageReader2 *ReadImage(
     reader = ReadNIFTIImage(image, matrix, filename, coordSystem);
 #else
     fprintf(stderr, "NIFTI files are not supported.\n");
-    exit(1);
 #endif
     }
   else
@@ -714,6 +751,11 @@ vtkImageReader2 *ReadImage(
     reader = ReadDICOMImage(image, matrix, filename, coordSystem);
     }
 
+  if (reader == NULL)
+    {
+    return NULL;
+    }
+
   // compute the range of values present (between 1st and 99th percentile)
   double fill[2];
   ComputeRange(image, vrange, fill);
@@ -820,6 +862,46 @@ vtkImageReader2 *ReadImage(
   return reader;
 }
 
+// Check that an image can be read, by reading its header but not its
+// pixel data.  Returns zero if there is an error.
+int CheckImage(const char *filename, int coordSystem)
+{
+  int t = GuessFileType(filename);
+  vtkSmartPointer<vtkImageReader2> reader;
+
+  if (t == MINCImage)
+    {
+    reader = vtkSmartPointer<vtkMINCImageReader>::New();
+    reader->SetFileName(filename);
+    }
+  else if (t == NIFTIImage)
+    {
+#ifdef AIRS_USE_NIFTI
+    reader = vtkSmartPointer<vtkNIFTIReader>::New();
+    reader->SetFileName(filename);
+#else
+    fprintf(stderr, "NIFTI files are not supported.\n");
+    return 0;
+#endif
+    }
+  else
+    {
+#ifdef AIRS_USE_DICOM
+    vtkSmartPointer<vtkDICOMReader> dicomReader =
+      vtkSmartPointer<vtkDICOMReader>::New();
+    return ReadDICOMInformation(dicomReader, filename, coordSystem);
+#else
+    vtkSmartPointer<vtkDICOMImageReader> dicomReader =
+      vtkSmartPointer<vtkDICOMImageReader>::New();
+    dicomReader->SetDirectoryName(filename);
+    reader = dicomReader;
+#endif
+    }
+
+  reader->UpdateInformation();
+  return (reader->GetErrorCode() == 0);
+}
+
 int CoordSystem(const char *filename)
 {
   int t = GuessFileType(filename);
@@ -937,7 +1019,7 @@ void WriteImage(
     }
 }
 
-
+#ifndef AIRS_HEADLESS_PROGRAMS
 void SetViewFromMatrix(
   vtkRenderer *renderer,
   vtkInteractorStyleImage *istyle,
@@ -961,6 +1043,7 @@ void SetViewFromMatrix(
 
   istyle->SetImageOrientation(viewRight, viewUp);
 }
+#endif
 
 // a class to look for errors when reading transforms.
 class ErrorObserver : public vtkCommand
@@ -981,6 +1064,47 @@ void ErrorObserver::Execute(
   exit(1);
 }
 
+// the state that is shared between the registration thread and the
+// thread that does the rendering
+struct RegistrationThreadInfo
+{
+  vtkImageRegistration *Registration;
+  vtkMutexLock *Lock;
+  double Matrix[16];
+  int Version;
+  int Done;
+};
+
+// iterate the registration, and after each iteration publish a copy
+// of the matrix so that it can be rendered
+VTK_THREAD_RETURN_TYPE RegistrationThread(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  RegistrationThreadInfo *rti =
+    static_cast<RegistrationThreadInfo *>(ti->UserData);
+
+  int more = 1;
+  while (more)
+    {
+    more = rti->Registration->Iterate();
+    double matrix[16];
+    vtkMatrix4x4::DeepCopy(
+      matrix, rti->Registration->GetTransform()->GetMatrix());
+
+    rti->Lock->Lock();
+    for (int i = 0; i < 16; i++)
+      {
+      rti->Matrix[i] = matrix[i];
+      }
+    rti->Version++;
+    rti->Done = !more;
+    rti->Lock->Unlock();
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
 void ReadMatrix(vtkMatrix4x4 *matrix, const char *xfminput)
 {
   vtkSmartPointer<ErrorObserver> observer =
@@ -1115,6 +1239,28 @@ void WriteMatrix(
     }
 }
 
+double MaximumDisplacement(
+  vtkMatrix4x4 *matrix1, vtkMatrix4x4 *matrix2, const double bounds[6])
+{
+  // the largest distance between the two transformations of any of
+  // the corners of the bounds
+  double maxdist = 0.0;
+  for (int corner = 0; corner < 8; corner++)
+    {
+    double point[4], p1[4], p2[4];
+    point[0] = bounds[corner & 1];
+    point[1] = bounds[2 + ((corner >> 1) & 1)];
+    point[2] = bounds[4 + ((corner >> 2) & 1)];
+    point[3] = 1.0;
+    matrix1->MultiplyPoint(point, p1);
+    matrix2->MultiplyPoint(point, p2);
+    double dist = sqrt(vtkMath::Distance2BetweenPoints(p1, p2));
+    maxdist = (dist > maxdist ? dist : maxdist);
+    }
+  return maxdist;
+}
+
+#ifndef AIRS_HEADLESS_PROGRAMS
 void WriteScreenshot(vtkWindow *window, const char *filename)
 {
   vtkSmartPointer<vtkWindowToImageFilter> snap =
@@ -1150,12 +1296,12 @@ void WriteScreenshot(vtkWindow *window, const char *filename)
     snapWriter->Write();
     }
 }
+#endif
 
-void ComputeRange(vtkImageData *image, double range[2], double fill[2])
+vtkSmartPointer<vtkImageStencilData> ComputeFieldOfView(vtkImageData *image)
 {
-  // compute the range within a cylinder that is slightly smaller than
-  // the image bounds (the idea is to capture only the reconstructed
-  // portion of a CT image).
+  // make a cylinder that is slightly smaller than the image bounds
+  // (the idea is to capture only the reconstructed portion of a CT image).
   double spacing[3];
   double origin[3];
   int extent[6];
@@ -1187,12 +1333,21 @@ void ComputeRange(vtkImageData *image, double range[2], double fill[2])
   cylinder->SetBounds(bounds);
   cylinder->Update();
 
+  vtkSmartPointer<vtkImageStencilData> stencil = cylinder->GetOutput();
+  return stencil;
+}
+
+void ComputeRange(vtkImageData *image, double range[2], double fill[2])
+{
+  // compute the range within the reconstructed field of view
+  vtkSmartPointer<vtkImageStencilData> cylinder = ComputeFieldOfView(image);
+
   // get the range within the cylinder
   vtkSmartPointer<vtkImageHistogramStatistics> rangeFinder =
     vtkSmartPointer<vtkImageHistogramStatistics>::New();
 
   rangeFinder->SET_INPUT_DATA(image);
-  rangeFinder->SET_STENCIL_DATA(cylinder->GetOutput());
+  rangeFinder->SET_STENCIL_DATA(cylinder);
   rangeFinder->Update();
 
   rangeFinder->GetAutoRange(range);
@@ -1297,6 +1452,7 @@ struct register_options
   int metric;          // -M --metric
   int transform;       // -T --transform
   int interpolator;    // -I --interpolator
+  int optimizer;       // --optimizer
   int coords;          // -C --coords
   int maxiter[4];      // -M --maxiter
   int display;         // -d --display
@@ -1306,6 +1462,25 @@ struct register_options
   int mip;             // --mip
 #endif
   int source_to_target; // --source-to-target
+  int target_fov;      // --target-fov
+  int auto_stencil;    // --auto-stencil
+  int grid_search;     // --grid-search
+  int moments;         // --moments
+  int progressive;     // --progressive-fidelity
+  int auto_scales;     // --auto-scales
+  int adaptive;        // --adaptive
+  double deadline;     // --deadline
+  int tile_size;       // --tile-size
+  const char *batch;   // --batch
+  const char *all_pairs; // --all-pairs
+  const char *server;  // --server
+  const char *client;  // --connect
+  int cache_size;      // --cache-size
+  int jobs;            // --jobs
+  int threads;         // threads per registration (for --batch)
+  int start_level;     // first stage to run (for --series)
+  const char *series;  // --series
+  int reference_frame; // --reference-frame
   const char *outxfm;  // -o (output transform)
   const char *output;  // -o (output image)
   const char *screenshot; // -j (output screenshot)
@@ -1320,6 +1495,7 @@ void register_initialize_options(register_options *options)
   options->metric = vtkImageRegistration::MutualInformation;
   options->transform = vtkImageRegistration::Rigid;
   options->interpolator = vtkImageRegistration::Linear;
+  options->optimizer = vtkImageRegistration::Powell;
   options->coords = NativeCoords;
   options->maxiter[0] = 500;
   options->maxiter[1] = 500;
@@ -1332,6 +1508,25 @@ void register_initialize_options(register_options *options)
   options->mip = 0;
 #endif
   options->source_to_target = 0;
+  options->target_fov = 0;
+  options->auto_stencil = 0;
+  options->grid_search = 0;
+  options->moments = 0;
+  options->progressive = 0;
+  options->auto_scales = 0;
+  options->adaptive = 0;
+  options->deadline = 0.0;
+  options->tile_size = 0;
+  options->batch = NULL;
+  options->all_pairs = NULL;
+  options->server = NULL;
+  options->client = NULL;
+  options->cache_size = 8;
+  options->jobs = 0;
+  options->threads = 0;
+  options->start_level = 0;
+  options->series = NULL;
+  options->reference_frame = 0;
   options->screenshot = NULL;
   options->output = NULL;
   options->outxfm = NULL;
@@ -1487,6 +1682,19 @@ void register_show_help(FILE *fp, const char *command)
     "    the output sample spacing.  The image that is interpolated is the\n"
     "    target image.\n"
     "\n"
+    " --optimizer           (default: Powell)\n"
+    "                 PO        Powell\n"
+    "                 AM        Amoeba\n"
+    "                 CMAES     CMAES\n"
+    "                 TR        TrustRegion\n"
+    "\n"
+    "    Powell's method is a fast local search.  Amoeba is the simplex\n"
+    "    method, another local search.  CMA-ES is a population\n"
+    "    based search that needs more evaluations, but is less likely to\n"
+    "    stop in a local minimum when the initial alignment is poor.\n"
+    "    TrustRegion fits quadratic models to the metric, and usually\n"
+    "    needs the fewest metric evaluations of the local searches.\n"
+    "\n"
     " -C --coords           (default: guess from file type)\n"
     "                 DICOM     LPS\n"
     "                 NIFTI     RAS\n"
@@ -1511,6 +1719,144 @@ void register_show_help(FILE *fp, const char *command)
     "    useful for angiography, since it ensures that vessels will not be\n"
     "    lost.\n"
 #endif
+    "\n"
+    " --target-fov      (default: off)\n"
+    "\n"
+    "    Only use the portion of the target image that is within the\n"
+    "    reconstructed field of view, i.e. within a cylinder that is\n"
+    "    slightly smaller than the image bounds.  Source voxels that map\n"
+    "    outside of this cylinder are ignored.  This is useful for CT images\n"
+    "    that have a circular field of view.\n"
+    "\n"
+    " --auto-stencil    (default: off)\n"
+    "\n"
+    "    Only use the foreground of the source image for the registration.\n"
+    "    The foreground is found by thresholding the source image with a\n"
+    "    threshold that is computed from its histogram.  This can greatly\n"
+    "    speed up the registration of images that contain a lot of air.\n"
+    "\n"
+    " --grid-search     (default: off)\n"
+    "\n"
+    "    Before the first stage, center the images and then try a coarse\n"
+    "    grid of rotations to find the best initial orientation.  This is\n"
+    "    useful when the initial orientation might be far from correct.\n"
+    "\n"
+    " --moments         (default: off)\n"
+    "\n"
+    "    Before the first stage, align the centroids and the principal axes\n"
+    "    of the images.  This ignores any initial transforms.\n"
+    "\n"
+    " --progressive-fidelity (default: off)\n"
+    "\n"
+    "    Use a subset of the samples while each line search brackets the\n"
+    "    minimum, and all of the samples only for the final refinement.\n"
+    "    This only affects the Powell optimizer.\n"
+    "\n"
+    " --auto-scales     (default: off)\n"
+    "\n"
+    "    Probe the metric around the initial transform to measure its\n"
+    "    curvature along each parameter, and adjust the parameter scales\n"
+    "    to match.  The probes are done once and used for all stages.\n"
+    "\n"
+    " --adaptive        (default: off)\n"
+    "\n"
+    "    Skip to the final stage if a stage (after the first) moves the\n"
+    "    transform by less than the tolerance of the next stage, and use\n"
+    "    fewer iterations for the next stage if it moved only a little.\n"
+    "    The final stage is always done, since it is the only one that\n"
+    "    uses the full resolution.\n"
+    "\n"
+    " --deadline 2.5s   (default: none)\n"
+    "\n"
+    "    Set a time limit for the registration, in seconds.  The time is\n"
+    "    divided among the stages, with most of it given to the stages at\n"
+    "    higher resolution.  When the time runs out, the best transform\n"
+    "    found so far is used, and the remaining stages are skipped.\n"
+    "\n"
+    " --tile-size N     (default: none)\n"
+    "\n"
+    "    For very large 2D images, such as whole-slide histology, compute\n"
+    "    the metric over square tiles of N pixels (e.g. 256) instead of\n"
+    "    over whole rows.  The target is also downsampled for the lower\n"
+    "    resolution stages, rather than only being blurred, so that no\n"
+    "    full-size copies of it are made for those stages.  The metric\n"
+    "    uses at most 16 million source pixels (about 160 MB of samples),\n"
+    "    chosen at random if the source image is larger than that.\n"
+    "\n"
+    " --batch <manifest.tsv>\n"
+    "\n"
+    "    Run many registrations in one process.  Each line of the manifest\n"
+    "    gives the source image, the target image, the output transform,\n"
+    "    and optionally the output image, separated by tabs.  The images\n"
+    "    for the next job are read while the current jobs are running, the\n"
+    "    outputs are written in the background, and a target that is used\n"
+    "    by consecutive jobs is only read once.  The blurring and the other\n"
+    "    preprocessing of a shared target are also done only once, so for\n"
+    "    atlas registration, list the atlas as the target on every line.\n"
+    "    A summary line is printed for each job.  All other options apply\n"
+    "    to every job.\n"
+    "\n"
+    " --all-pairs <images.txt>\n"
+    "\n"
+    "    Register every image in the list to every other image, e.g. for\n"
+    "    the timepoints of a longitudinal study.  The list has one image\n"
+    "    per line, and the images are numbered from 1 in the order that\n"
+    "    they are listed.  The -o option must give a transform file name\n"
+    "    with two \"%d\" in it, which are replaced by the source number and\n"
+    "    the target number, e.g. \"-o pair_%d_%d.tfm\".  Each image is read\n"
+    "    and preprocessed only once.  Consecutive images are registered\n"
+    "    first, and the rest of the pairs are started from a combination\n"
+    "    of the transforms that have already been found.  The transforms\n"
+    "    are written after all of the registrations are done.\n"
+    "\n"
+    " --series <image>\n"
+    "\n"
+    "    Do motion correction for a 4D series, such as fMRI, by registering\n"
+    "    each frame to a reference frame.  The -o option can give a\n"
+    "    transform file name with a \"%d\" in it, which is replaced by the\n"
+    "    frame number (starting at 1), and it can also give an image file\n"
+    "    for the corrected series.  The reference frame is prepared once.\n"
+    "    The frames are done in order of their distance from the reference,\n"
+    "    and each starts from the transform of the nearest frame that has\n"
+    "    been done.  If that frame moved by less than one voxel, then the\n"
+    "    two lowest-resolution stages are skipped.  A summary line with\n"
+    "    the displacement from the reference is printed for each frame.\n"
+    "    Only 4D NIFTI files are supported.\n"
+    "\n"
+    " --reference-frame N (default: the middle frame)\n"
+    "\n"
+    "    Set the reference frame for --series, starting at 1.\n"
+    "\n"
+    " --jobs N          (default: one per four cores)\n"
+    "\n"
+    "    Set how many registrations to run at the same time with --batch,\n"
+    "    --all-pairs, or --series.  The cores are divided evenly among the\n"
+    "    jobs.  For --series, the default is one per core.\n"
+    "\n"
+    " --server <socket>\n"
+    "\n"
+    "    Run as a server that does registrations for \"register --connect\".\n"
+    "    The server listens on the given Unix domain socket, and keeps the\n"
+    "    images that it has read in memory so that later jobs that use the\n"
+    "    same images (as identified by their path and modification time)\n"
+    "    do not have to read them again.  The jobs are run one at a time,\n"
+    "    each in its own process, so an error in one job will not stop\n"
+    "    the server.  All other options are given by the clients.  The\n"
+    "    socket must be in a directory that only the server's user can\n"
+    "    access (mode 0700), which is created if it does not exist, and\n"
+    "    connections from other users are refused.\n"
+    "\n"
+    " --cache-size N    (default: 8)\n"
+    "\n"
+    "    Set how many images the server keeps in memory.  When this number\n"
+    "    is exceeded, the image that was least recently used is dropped.\n"
+    "\n"
+    " --connect <socket>\n"
+    "\n"
+    "    Send the registration to the server at the given socket, rather\n"
+    "    than doing it in this process.  The output of the registration is\n"
+    "    printed as it arrives.  If the server cannot be reached, or if -d\n"
+    "    or -j is used, then the registration is done locally.\n"
     "\n"
     " -d --display      (default: off)\n"
     "\n"
@@ -1579,6 +1925,12 @@ int register_read_options(
     "Antialiasing", "AS",
     "Label", "LA",
     0 };
+  static const char *optimizer_args[] = {
+    "Powell", "PO",
+    "Amoeba", "AM",
+    "CMAES",
+    "TrustRegion", "TR",
+    0 };
   static const char *coords_args[] = {
     "DICOM", "LPS",
     "NIFTI", "MINC", "RAS",
@@ -1742,6 +2094,28 @@ int register_read_options(
           options->interpolator = vtkImageRegistration::Label;
           }
         }
+      else if (strcmp(arg, "--optimizer") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, optimizer_args);
+        if (strcmp(arg, "CMAES") == 0)
+          {
+          options->optimizer = vtkImageRegistration::CMAES;
+          }
+        else if (strcmp(arg, "Amoeba") == 0 ||
+                 strcmp(arg, "AM") == 0)
+          {
+          options->optimizer = vtkImageRegistration::Amoeba;
+          }
+        else if (strcmp(arg, "TrustRegion") == 0 ||
+                 strcmp(arg, "TR") == 0)
+          {
+          options->optimizer = vtkImageRegistration::TrustRegion;
+          }
+        else
+          {
+          options->optimizer = vtkImageRegistration::Powell;
+          }
+        }
       else if (strcmp(arg, "-C") == 0 ||
                strcmp(arg, "--coords") == 0)
         {
@@ -1789,6 +2163,111 @@ int register_read_options(
         {
         options->source_to_target = 1;
         }
+      else if (strcmp(arg, "--target-fov") == 0)
+        {
+        options->target_fov = 1;
+        }
+      else if (strcmp(arg, "--auto-stencil") == 0)
+        {
+        options->auto_stencil = 1;
+        }
+      else if (strcmp(arg, "--grid-search") == 0)
+        {
+        options->grid_search = 1;
+        }
+      else if (strcmp(arg, "--moments") == 0)
+        {
+        options->moments = 1;
+        }
+      else if (strcmp(arg, "--progressive-fidelity") == 0)
+        {
+        options->progressive = 1;
+        }
+      else if (strcmp(arg, "--auto-scales") == 0)
+        {
+        options->auto_scales = 1;
+        }
+      else if (strcmp(arg, "--adaptive") == 0)
+        {
+        options->adaptive = 1;
+        }
+      else if (strcmp(arg, "--deadline") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        char *endp;
+        options->deadline = strtod(arg, &endp);
+        if (endp == arg || options->deadline <= 0 ||
+            (*endp != '\0' && strcmp(endp, "s") != 0))
+          {
+          fprintf(stderr, "Incorrect value for option \"--deadline\": %s\n",
+                  arg);
+          exit(1);
+          }
+        }
+      else if (strcmp(arg, "--tile-size") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        options->tile_size = atoi(arg);
+        if (options->tile_size <= 0)
+          {
+          fprintf(stderr, "Incorrect value for option \"--tile-size\": %s\n",
+                  arg);
+          exit(1);
+          }
+        }
+      else if (strcmp(arg, "--batch") == 0)
+        {
+        options->batch = check_next_arg(argc, argv, &argi, 0);
+        }
+      else if (strcmp(arg, "--all-pairs") == 0)
+        {
+        options->all_pairs = check_next_arg(argc, argv, &argi, 0);
+        }
+      else if (strcmp(arg, "--series") == 0)
+        {
+        options->series = check_next_arg(argc, argv, &argi, 0);
+        }
+      else if (strcmp(arg, "--reference-frame") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        options->reference_frame = atoi(arg);
+        if (options->reference_frame <= 0)
+          {
+          fprintf(stderr, "Incorrect value for option "
+                  "\"--reference-frame\": %s\n", arg);
+          exit(1);
+          }
+        }
+      else if (strcmp(arg, "--server") == 0)
+        {
+        options->server = check_next_arg(argc, argv, &argi, 0);
+        }
+      else if (strcmp(arg, "--connect") == 0)
+        {
+        options->client = check_next_arg(argc, argv, &argi, 0);
+        }
+      else if (strcmp(arg, "--cache-size") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        options->cache_size = atoi(arg);
+        if (options->cache_size <= 0)
+          {
+          fprintf(stderr, "Incorrect value for option \"--cache-size\": %s\n",
+                  arg);
+          exit(1);
+          }
+        }
+      else if (strcmp(arg, "--jobs") == 0)
+        {
+        arg = check_next_arg(argc, argv, &argi, 0);
+        options->jobs = atoi(arg);
+        if (options->jobs <= 0)
+          {
+          fprintf(stderr, "Incorrect value for option \"--jobs\": %s\n",
+                  arg);
+          exit(1);
+          }
+        }
       else if (strcmp(arg, "-s") == 0 ||
                strcmp(arg, "--silent") == 0)
         {
@@ -1852,114 +2331,511 @@ int register_read_options(
   return 1;
 }
 
-int main(int argc, char *argv[])
+// The blurred and prepared images for each resolution, which are shared
+// by all of the --batch jobs that have the same target, or by all of the
+// --all-pairs registrations that use the same image.  The images are
+// created by whichever registration needs them first.
+struct register_image_cache
 {
-  register_options options;
-  register_initialize_options(&options);
-  register_read_options(argc, argv, &options);
+  vtkMutexLock *Lock;
+  vtkConditionVariable *Condition;
+  int References;
+  vtkSmartPointer<vtkImageStencilData> FieldOfView;
+  std::vector<double> BlurFactors;
+  std::vector<vtkSmartPointer<vtkImageRegistrationTarget> > Targets;
+  std::vector<double> SourceSpacings;
+  std::vector<vtkSmartPointer<vtkImageData> > Sources;
+};
 
-  // -------------------------------------------------------
-  // the files
-  std::vector<TransformArg> *xfminputs = &options.transforms;
-  const char *xfmfile = options.outxfm;
-  const char *imagefile = options.output;
-  const char *sourcefile = options.source;
-  const char *targetfile = options.target;
-  bool display = (options.display != 0 ||
-                  options.screenshot != 0);
+register_image_cache *register_new_image_cache()
+{
+  register_image_cache *cache = new register_image_cache;
+  cache->Lock = vtkMutexLock::New();
+  cache->Condition = vtkConditionVariable::New();
+  cache->References = 1;
+  return cache;
+}
+
+void register_retain_image_cache(register_image_cache *cache)
+{
+  cache->Lock->Lock();
+  cache->References++;
+  cache->Lock->Unlock();
+}
 
-  if (!sourcefile || !targetfile)
+void register_release_image_cache(register_image_cache *cache)
+{
+  cache->Lock->Lock();
+  int references = --cache->References;
+  cache->Lock->Unlock();
+  if (references == 0)
     {
-    register_show_usage(stderr, argv[0]);
-    return 1;
+    cache->Lock->Delete();
+    cache->Condition->Delete();
+    delete cache;
     }
+}
 
-  // -------------------------------------------------------
-  // parameters for registration
+// Get the spacing for a target that is downsampled after being blurred
+// by the given factors.  The target is normally kept at full resolution,
+// but with --tile-size it is downsampled to half of the blur width, which
+// still gives enough samples for the blurred image.
+void register_target_spacing(
+  const double targetSpacing[3], const double blurFactors[3],
+  double spacing[3])
+{
+  for (int j = 0; j < 3; j++)
+    {
+    spacing[j] = fabs(targetSpacing[j]);
+    if (blurFactors[j] > 2.0)
+      {
+      spacing[j] *= 0.5*blurFactors[j];
+      }
+    }
+}
 
-  int interpolatorType = options.interpolator;
-  double transformTolerance = 0.1; // tolerance on transformation result
-  int numberOfBins = 64; // for Mattes' mutual information
-  double initialBlurFactor = 8.0;
+// Get the target for the given blur factors (all zero for no blurring),
+// and create it if it is not yet in the cache, and set it as the prepared
+// target of the registration.  The reference counts of the cached objects
+// are only changed while holding the lock, since the jobs run in separate
+// threads, but the target is blurred and prepared without the lock so
+// that jobs that need other targets are not kept waiting.
+void register_prepared_target(
+  register_image_cache *cache, vtkImageRegistration *registration,
+  const double blurFactors[3], vtkImageData *targetImage,
+  const double targetRange[2], register_options *options, int numberOfBins)
+{
+  cache->Lock->Lock();
 
-  // -------------------------------------------------------
-  // load and concatenate the initial matrix transforms
-  vtkSmartPointer<vtkMatrix4x4> initialMatrix =
-    vtkSmartPointer<vtkMatrix4x4>::New();
-  vtkSmartPointer<vtkMatrix4x4> tempMatrix =
-    vtkSmartPointer<vtkMatrix4x4>::New();
-  for (size_t ti = 0; ti < xfminputs->size(); ti++)
+  // a null target in the cache is in progress in another job
+  for (size_t i = 0; i < cache->Targets.size(); i++)
     {
-    TransformArg trans = xfminputs->at(ti);
-    if (!options.silent)
+    const double *f = &cache->BlurFactors[3*i];
+    if (f[0] == blurFactors[0] && f[1] == blurFactors[1] &&
+        f[2] == blurFactors[2])
       {
-      cout << "Reading initial transform: " << trans.filename << endl;
-      if (trans.invert)
+      while (!cache->Targets[i])
         {
-        cout << "Using inverse of transform." << endl;
+        cache->Condition->Wait(cache->Lock);
         }
+      registration->SetPreparedTarget(cache->Targets[i]);
+      cache->Lock->Unlock();
+      return;
       }
-
-    ReadMatrix(tempMatrix, trans.filename);
-    if (trans.invert)
-      {
-      tempMatrix->Invert();
-      }
-
-    vtkMatrix4x4::Multiply4x4(tempMatrix, initialMatrix, initialMatrix);
     }
 
-  // -------------------------------------------------------
-  // load the images
+  size_t index = cache->Targets.size();
+  cache->BlurFactors.push_back(blurFactors[0]);
+  cache->BlurFactors.push_back(blurFactors[1]);
+  cache->BlurFactors.push_back(blurFactors[2]);
+  cache->Targets.push_back(vtkSmartPointer<vtkImageRegistrationTarget>());
 
-  if (options.coords == NativeCoords)
+  // connect the shared images while holding the lock
+  vtkSmartPointer<vtkImageRegistrationTarget> target =
+    vtkSmartPointer<vtkImageRegistrationTarget>::New();
+  if (options->target_fov)
     {
-    int ic = CoordSystem(sourcefile);
-    int oc = CoordSystem(targetfile);
-
-    if (ic == DICOMCoords || oc == DICOMCoords)
-      {
-      options.coords = DICOMCoords;
-      }
-    else
+    if (!cache->FieldOfView)
       {
-      options.coords = NIFTICoords;
+      cache->FieldOfView = ComputeFieldOfView(targetImage);
       }
+    target->SetStencil(cache->FieldOfView);
     }
-
-  if (!options.silent)
+  vtkSmartPointer<vtkImageData> image =
+    vtkSmartPointer<vtkImageData>::New();
+  vtkSmartPointer<vtkImageResize> blur;
+  if (blurFactors[0] == 0)
+    {
+    image->ShallowCopy(targetImage);
+    }
+  else
+    {
+    blur = vtkSmartPointer<vtkImageResize>::New();
+    blur->SET_INPUT_DATA(targetImage);
+    }
+
+  cache->Lock->Unlock();
+
+  // blur the target in the same way as register_execute() does
+  if (blur)
+    {
+    vtkSmartPointer<vtkImageSincInterpolator> blurKernel =
+      vtkSmartPointer<vtkImageSincInterpolator>::New();
+    blurKernel->SetWindowFunctionToBlackman();
+    blurKernel->AntialiasingOn();
+    blurKernel->SetBlurFactors(
+      blurFactors[0], blurFactors[1], blurFactors[2]);
+
+    blur->SetResizeMethodToOutputSpacing();
+    if (options->tile_size > 0)
+      {
+      double spacing[3];
+      register_target_spacing(
+        targetImage->GetSpacing(), blurFactors, spacing);
+      blur->SetOutputSpacing(spacing);
+      }
+    blur->SetInterpolator(blurKernel);
+    blur->SetInterpolate(
+      options->interpolator != vtkImageRegistration::Nearest);
+    if (options->threads > 0)
+      {
+      blur->SetNumberOfThreads(options->threads);
+      }
+#if VTK_MAJOR_VERSION >= 6
+    blur->UpdateWholeExtent();
+#else
+    blur->GetOutput()->SetUpdateExtentToWholeExtent();
+    blur->Update();
+#endif
+    image->ShallowCopy(blur->GetOutput());
+    }
+
+  target->SetImage(image);
+  target->SetMetricType(options->metric);
+  target->SetInterpolatorType(options->interpolator);
+  target->SetJointHistogramSize(numberOfBins, numberOfBins);
+  target->SetImageRange(targetRange[0], targetRange[1]);
+  target->Prepare();
+
+  cache->Lock->Lock();
+  if (blur)
     {
-    cout << "Reading source image: " << sourcefile << endl;
+    blur->SET_INPUT_DATA(NULL);
     }
+  cache->Targets[index] = target;
+  registration->SetPreparedTarget(target);
+  cache->Condition->Broadcast();
+  cache->Lock->Unlock();
+}
+
+// Release the prepared target of the registration, while holding the
+// lock for the cache that the target came from.
+void register_release_prepared_target(
+  register_image_cache *cache, vtkImageRegistration *registration)
+{
+  cache->Lock->Lock();
+  registration->SetPreparedTarget(NULL);
+  cache->Lock->Unlock();
+}
 
-  double sourceRange[2] = { 0.0, 1.0 };
-  vtkSmartPointer<vtkImageData> sourceImage =
+// Get the source image resampled to the given spacing (all zero for full
+// resolution), and create it if it is not yet in the cache.  The returned
+// image is a shallow copy, so that each registration has its own input.
+vtkSmartPointer<vtkImageData> register_blurred_source(
+  register_image_cache *cache, const double spacing[3],
+  vtkImageData *sourceImage, register_options *options)
+{
+  vtkSmartPointer<vtkImageData> image =
     vtkSmartPointer<vtkImageData>::New();
-  vtkSmartPointer<vtkMatrix4x4> sourceMatrix =
-    vtkSmartPointer<vtkMatrix4x4>::New();
-  vtkSmartPointer<vtkImageReader2> sourceReader =
-    ReadImage(sourceImage, sourceMatrix, sourceRange,
-              sourcefile, options.coords, options.interpolator);
-  sourceReader->Delete();
 
-  if (!options.silent)
+  cache->Lock->Lock();
+
+  for (size_t i = 0; i < cache->Sources.size(); i++)
     {
-    cout << "Reading target image: " << targetfile << endl;
+    const double *s = &cache->SourceSpacings[3*i];
+    if (s[0] == spacing[0] && s[1] == spacing[1] && s[2] == spacing[2])
+      {
+      image->ShallowCopy(cache->Sources[i]);
+      cache->Lock->Unlock();
+      return image;
+      }
     }
 
-  double targetRange[2] = { 0.0, 1.0 };
-  vtkSmartPointer<vtkImageData> targetImage =
+  // blur the source in the same way as register_execute() does
+  vtkSmartPointer<vtkImageData> blurred =
     vtkSmartPointer<vtkImageData>::New();
-  vtkSmartPointer<vtkMatrix4x4> targetMatrix =
-    vtkSmartPointer<vtkMatrix4x4>::New();
-  vtkSmartPointer<vtkImageReader2> targetReader =
-    ReadImage(targetImage, targetMatrix, targetRange,
-              targetfile, options.coords, options.interpolator);
-  targetReader->Delete();
+  if (spacing[0] == 0)
+    {
+    blurred->ShallowCopy(sourceImage);
+    }
+  else
+    {
+    double sourceSpacing[3];
+    sourceImage->GetSpacing(sourceSpacing);
+
+    vtkSmartPointer<vtkImageSincInterpolator> blurKernel =
+      vtkSmartPointer<vtkImageSincInterpolator>::New();
+    blurKernel->SetWindowFunctionToBlackman();
+    blurKernel->AntialiasingOn();
+    blurKernel->SetBlurFactors(
+      spacing[0]/fabs(sourceSpacing[0]),
+      spacing[1]/fabs(sourceSpacing[1]),
+      spacing[2]/fabs(sourceSpacing[2]));
+
+    vtkSmartPointer<vtkImageResize> blur =
+      vtkSmartPointer<vtkImageResize>::New();
+    blur->SET_INPUT_DATA(sourceImage);
+    blur->SetResizeMethodToOutputSpacing();
+    blur->SetInterpolator(blurKernel);
+    blur->SetInterpolate(
+      options->interpolator != vtkImageRegistration::Nearest);
+    blur->SetOutputSpacing(spacing[0], spacing[1], spacing[2]);
+    if (options->threads > 0)
+      {
+      blur->SetNumberOfThreads(options->threads);
+      }
+#if VTK_MAJOR_VERSION >= 6
+    blur->UpdateWholeExtent();
+#else
+    blur->GetOutput()->SetUpdateExtentToWholeExtent();
+    blur->Update();
+#endif
+    blurred->ShallowCopy(blur->GetOutput());
+    }
 
-  if (!options.silent)
+  cache->SourceSpacings.push_back(spacing[0]);
+  cache->SourceSpacings.push_back(spacing[1]);
+  cache->SourceSpacings.push_back(spacing[2]);
+  cache->Sources.push_back(blurred);
+  image->ShallowCopy(blurred);
+
+  cache->Lock->Unlock();
+  return image;
+}
+
+// The images that are read for one registration.
+struct register_input
+{
+  vtkSmartPointer<vtkImageData> sourceImage;
+  vtkSmartPointer<vtkMatrix4x4> sourceMatrix;
+  vtkSmartPointer<vtkImageReader2> sourceReader;
+  double sourceRange[2];
+  vtkSmartPointer<vtkImageData> targetImage;
+  vtkSmartPointer<vtkMatrix4x4> targetMatrix;
+  vtkSmartPointer<vtkImageReader2> targetReader;
+  double targetRange[2];
+  register_image_cache *targetCache;
+  register_image_cache *sourceCache;
+  // a starting transform that is applied before the -i transforms
+  vtkSmartPointer<vtkMatrix4x4> initialMatrix;
+};
+
+// The result of one registration.
+struct register_result
+{
+  vtkSmartPointer<vtkMatrix4x4> matrix;
+  vtkSmartPointer<vtkMatrix4x4> sourceMatrix;
+  vtkSmartPointer<vtkMatrix4x4> targetMatrix;
+  double center[3];
+  double time;
+  int evaluations;
+  int converged;
+  double metric;
+#ifndef AIRS_HEADLESS_PROGRAMS
+  vtkSmartPointer<vtkRenderWindowInteractor> interactor;
+#endif
+};
+
+// An image that is kept in memory by the --server, so that later jobs
+// do not have to read it again.
+struct register_stored_image
+{
+  std::string filename;
+  long mtime;
+  int coords;
+  int interpolator;
+  vtkSmartPointer<vtkImageData> image;
+  vtkSmartPointer<vtkMatrix4x4> matrix;
+  vtkSmartPointer<vtkImageReader2> reader;
+  double range[2];
+  unsigned long lastUsed;
+};
+
+// The images that are kept by the --server.  When there are too many,
+// the one that was least recently used is dropped.
+struct register_image_store
+{
+  std::vector<register_stored_image> Images;
+  int MaximumNumberOfImages;
+  unsigned long UseCount;
+};
+
+// Find an image in the store.  The image is only used if the file has
+// not been modified since it was read, and if it was read with the same
+// options.  The filename must be a full path.
+register_stored_image *register_find_stored_image(
+  register_image_store *store, const char *filename,
+  const register_options *options)
+{
+  if (store)
+    {
+    long mtime = vtksys::SystemTools::ModifiedTime(filename);
+    for (size_t i = 0; i < store->Images.size(); i++)
+      {
+      register_stored_image *stored = &store->Images[i];
+      if (stored->filename == filename && stored->mtime == mtime &&
+          stored->coords == options->coords &&
+          stored->interpolator == options->interpolator)
+        {
+        stored->lastUsed = ++store->UseCount;
+        return stored;
+        }
+      }
+    }
+
+  return NULL;
+}
+
+// Read an image into the store, unless it is already there.  Returns zero
+// if the image cannot be read, so that the --server does not exit.
+int register_store_image(
+  register_image_store *store, const char *filename,
+  const register_options *options)
+{
+  if (register_find_stored_image(store, filename, options))
+    {
+    return 1;
+    }
+
+  // drop stale copies of this file, and then the least recently used
+  // images until there is room for another one
+  for (size_t i = store->Images.size(); i > 0; i--)
+    {
+    if (store->Images[i - 1].filename == filename)
+      {
+      store->Images.erase(store->Images.begin() + (i - 1));
+      }
+    }
+  while (static_cast<int>(store->Images.size()) >=
+         store->MaximumNumberOfImages)
+    {
+    size_t oldest = 0;
+    for (size_t i = 1; i < store->Images.size(); i++)
+      {
+      if (store->Images[i].lastUsed < store->Images[oldest].lastUsed)
+        {
+        oldest = i;
+        }
+      }
+    store->Images.erase(store->Images.begin() + oldest);
+    }
+
+  register_stored_image stored;
+  stored.filename = filename;
+  stored.mtime = vtksys::SystemTools::ModifiedTime(filename);
+  stored.coords = options->coords;
+  stored.interpolator = options->interpolator;
+  stored.image = vtkSmartPointer<vtkImageData>::New();
+  stored.matrix = vtkSmartPointer<vtkMatrix4x4>::New();
+  stored.range[0] = 0.0;
+  stored.range[1] = 1.0;
+  stored.reader =
+    ReadImage(stored.image, stored.matrix, stored.range,
+              filename, options->coords, options->interpolator);
+  if (stored.reader == NULL)
+    {
+    return 0;
+    }
+  stored.reader->Delete();
+  stored.lastUsed = ++store->UseCount;
+  store->Images.push_back(stored);
+
+  return 1;
+}
+
+// Read an image, or copy it from the store if the store has it.
+void register_read_image(
+  const register_options *options, const char *filename,
+  register_image_store *store, vtkImageData *image, vtkMatrix4x4 *matrix,
+  vtkSmartPointer<vtkImageReader2> *reader, double range[2])
+{
+  register_stored_image *stored =
+    register_find_stored_image(store, filename, options);
+  if (stored)
+    {
+    image->ShallowCopy(stored->image);
+    matrix->DeepCopy(stored->matrix);
+    *reader = stored->reader;
+    range[0] = stored->range[0];
+    range[1] = stored->range[1];
+    }
+  else
+    {
+    range[0] = 0.0;
+    range[1] = 1.0;
+    *reader = ReadImage(image, matrix, range,
+                        filename, options->coords, options->interpolator);
+    if (*reader == NULL)
+      {
+      exit(1);
+      }
+    (*reader)->Delete();
+    }
+}
+
+// If the coords are NativeCoords, then choose the coords according to the
+// types of the source and target files.
+void register_resolve_coords(register_options *options)
+{
+  if (options->coords == NativeCoords)
+    {
+    int ic = CoordSystem(options->source);
+    int oc = CoordSystem(options->target);
+
+    if (ic == DICOMCoords || oc == DICOMCoords)
+      {
+      options->coords = DICOMCoords;
+      }
+    else
+      {
+      options->coords = NIFTICoords;
+      }
+    }
+}
+
+// Read the source and target images.  If a previous input is given and
+// it has the same target, then its target image will be shared.  Images
+// that are in the store (if one is given) are not read again.
+void register_read_input(
+  register_options *options, register_input *input,
+  const register_options *prevOptions = 0,
+  const register_input *prevInput = 0,
+  register_image_store *store = 0)
+{
+  register_resolve_coords(options);
+
+  if (!options->silent)
+    {
+    cout << "Reading source image: " << options->source << endl;
+    }
+
+  input->targetCache = NULL;
+  input->sourceCache = NULL;
+  input->sourceImage = vtkSmartPointer<vtkImageData>::New();
+  input->sourceMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+  register_read_image(options, options->source, store,
+                      input->sourceImage, input->sourceMatrix,
+                      &input->sourceReader, input->sourceRange);
+
+  input->targetImage = vtkSmartPointer<vtkImageData>::New();
+  input->targetMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+
+  if (prevInput && prevOptions->coords == options->coords &&
+      strcmp(prevOptions->target, options->target) == 0)
+    {
+    // the image data is shared, but the matrix is modified by the
+    // registration so it must be copied
+    input->targetImage->ShallowCopy(prevInput->targetImage);
+    input->targetMatrix->DeepCopy(prevInput->targetMatrix);
+    input->targetReader = prevInput->targetReader;
+    input->targetRange[0] = prevInput->targetRange[0];
+    input->targetRange[1] = prevInput->targetRange[1];
+    }
+  else
+    {
+    if (!options->silent)
+      {
+      cout << "Reading target image: " << options->target << endl;
+      }
+
+    register_read_image(options, options->target, store,
+                        input->targetImage, input->targetMatrix,
+                        &input->targetReader, input->targetRange);
+    }
+
+  if (!options->silent)
     {
-    if (options.coords == DICOMCoords)
+    if (options->coords == DICOMCoords)
       {
       cout << "Using DICOM patient coords." << endl;;
       }
@@ -1968,6 +2844,71 @@ int main(int argc, char *argv[])
       cout << "Using NIFTI (or MINC) world coords." << endl;
       }
     }
+}
+
+// Register the images, and store the result.  The outputs are written
+// separately by register_write_output().
+int register_execute(
+  register_options *options, register_input *input, register_result *result)
+{
+  std::vector<TransformArg> *xfminputs = &options->transforms;
+  bool display = (options->display != 0 ||
+                  options->screenshot != 0);
+
+  vtkImageData *sourceImage = input->sourceImage;
+  vtkMatrix4x4 *sourceMatrix = input->sourceMatrix;
+  double *sourceRange = input->sourceRange;
+  vtkImageData *targetImage = input->targetImage;
+  vtkMatrix4x4 *targetMatrix = input->targetMatrix;
+  double *targetRange = input->targetRange;
+  register_image_cache *targetCache = input->targetCache;
+  register_image_cache *sourceCache = input->sourceCache;
+
+  // -------------------------------------------------------
+  // parameters for registration
+
+  int interpolatorType = options->interpolator;
+  double transformTolerance = 0.1; // tolerance on transformation result
+  int numberOfBins = 64; // for Mattes' mutual information
+  double initialBlurFactor = 8.0;
+
+  // skip the low-resolution stages, if requested
+  int startLevel = options->start_level;
+  for (int jj = 0; jj < startLevel; jj++)
+    {
+    initialBlurFactor /= 2.0;
+    }
+
+  // -------------------------------------------------------
+  // load and concatenate the initial matrix transforms
+  vtkSmartPointer<vtkMatrix4x4> initialMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkSmartPointer<vtkMatrix4x4> tempMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  if (input->initialMatrix)
+    {
+    initialMatrix->DeepCopy(input->initialMatrix);
+    }
+  for (size_t ti = 0; ti < xfminputs->size(); ti++)
+    {
+    TransformArg trans = xfminputs->at(ti);
+    if (!options->silent)
+      {
+      cout << "Reading initial transform: " << trans.filename << endl;
+      if (trans.invert)
+        {
+        cout << "Using inverse of transform." << endl;
+        }
+      }
+
+    ReadMatrix(tempMatrix, trans.filename);
+    if (trans.invert)
+      {
+      tempMatrix->Invert();
+      }
+
+    vtkMatrix4x4::Multiply4x4(tempMatrix, initialMatrix, initialMatrix);
+    }
 
   // -------------------------------------------------------
   // save the original source matrix
@@ -1988,95 +2929,10 @@ int main(int argc, char *argv[])
   vtkMatrix4x4::Multiply4x4(matrix, targetMatrix, targetMatrix);
 
   // -------------------------------------------------------
-  // display the images
-
-  vtkSmartPointer<vtkRenderWindow> renderWindow =
-    vtkSmartPointer<vtkRenderWindow>::New();
-  vtkSmartPointer<vtkRenderer> renderer =
-    vtkSmartPointer<vtkRenderer>::New();
-  vtkSmartPointer<vtkRenderWindowInteractor> interactor =
-    vtkSmartPointer<vtkRenderWindowInteractor>::New();
-  vtkSmartPointer<vtkInteractorStyleImage> istyle =
-    vtkSmartPointer<vtkInteractorStyleImage>::New();
-
-  istyle->SetInteractionModeToImageSlicing();
-  interactor->SetInteractorStyle(istyle);
-  renderWindow->SetInteractor(interactor);
-  renderWindow->AddRenderer(renderer);
-
-  vtkSmartPointer<vtkImageSlice> sourceActor =
-    vtkSmartPointer<vtkImageSlice>::New();
-  vtkSmartPointer<vtkImageResliceMapper> sourceMapper =
-    vtkSmartPointer<vtkImageResliceMapper>::New();
-  vtkSmartPointer<vtkImageProperty> sourceProperty =
-    vtkSmartPointer<vtkImageProperty>::New();
-
-  sourceMapper->SET_INPUT_DATA(sourceImage);
-  sourceMapper->SliceAtFocalPointOn();
-  sourceMapper->SliceFacesCameraOn();
-  sourceMapper->ResampleToScreenPixelsOff();
-
-  sourceProperty->SetColorWindow((sourceRange[1]-sourceRange[0]));
-  sourceProperty->SetColorLevel(0.5*(sourceRange[0]+sourceRange[1]));
-  if (options.translucent)
-    {
-    sourceProperty->SetOpacity(0.5);
-    }
-  else
-    {
-    sourceProperty->CheckerboardOn();
-    }
-
-  sourceActor->SetMapper(sourceMapper);
-  sourceActor->SetProperty(sourceProperty);
-  sourceActor->SetUserMatrix(sourceMatrix);
-
-  vtkSmartPointer<vtkImageSlice> targetActor =
-    vtkSmartPointer<vtkImageSlice>::New();
-  vtkSmartPointer<vtkImageResliceMapper> targetMapper =
-    vtkSmartPointer<vtkImageResliceMapper>::New();
-  vtkSmartPointer<vtkImageProperty> targetProperty =
-    vtkSmartPointer<vtkImageProperty>::New();
-
-  targetMapper->SET_INPUT_DATA(targetImage);
-  targetMapper->SliceAtFocalPointOn();
-  targetMapper->SliceFacesCameraOn();
-  targetMapper->ResampleToScreenPixelsOff();
-#ifdef VTK_HAS_SLAB_SPACING
-  if (options.mip)
-    {
-    targetMapper->SetSlabTypeToMax();
-    targetMapper->SetSlabSampleFactor(2);
-    targetMapper->SetSlabThickness(sourceImage->GetSpacing()[2]);
-    }
-#endif
-
-  targetProperty->SetColorWindow((targetRange[1]-targetRange[0]));
-  targetProperty->SetColorLevel(0.5*(targetRange[0]+targetRange[1]));
-
-  targetActor->SetMapper(targetMapper);
-  targetActor->SetProperty(targetProperty);
-  targetActor->SetUserMatrix(targetMatrix);
-
-  vtkSmartPointer<vtkImageStack> imageStack =
-    vtkSmartPointer<vtkImageStack>::New();
-  imageStack->AddImage(targetActor);
-  imageStack->AddImage(sourceActor);
-
-  renderer->AddViewProp(imageStack);
-  renderer->SetBackground(0,0,0);
-
-  renderWindow->SetSize(512,512);
-
-  if (interpolatorType == vtkImageRegistration::Nearest ||
-      interpolatorType == vtkImageRegistration::Label)
-    {
-    targetProperty->SetInterpolationTypeToNearest();
-    sourceProperty->SetInterpolationTypeToNearest();
-    }
+  // find the view center, which is also the center for ITK transforms
 
   // this variable says which image to move around
-  bool showTargetMoving = (options.source_to_target == 0);
+  bool showTargetMoving = (options->source_to_target == 0);
 
   vtkMatrix4x4 *cameraMatrix = originalTargetMatrix;
   vtkImageData *cameraImage = targetImage;
@@ -2086,32 +2942,125 @@ int main(int argc, char *argv[])
     cameraImage = sourceImage;
     }
 
-  double bounds[6], center[4], tspacing[3];
-  int extent[6];
+  double bounds[6], center[4];
   cameraImage->GetBounds(bounds);
-  cameraImage->GetExtent(extent);
-  cameraImage->GetSpacing(tspacing);
   center[0] = 0.5*(bounds[0] + bounds[1]);
   center[1] = 0.5*(bounds[2] + bounds[3]);
   center[2] = 0.5*(bounds[4] + bounds[5]);
   center[3] = 1.0;
   cameraMatrix->MultiplyPoint(center, center);
 
-  vtkCamera *camera = renderer->GetActiveCamera();
-  renderer->ResetCamera();
-  camera->SetFocalPoint(center);
-  camera->ParallelProjectionOn();
-  camera->SetParallelScale(0.5*(bounds[3] - bounds[2]));
-  SetViewFromMatrix(renderer, istyle, cameraMatrix, options.coords);
-  renderer->ResetCameraClippingRange();
+  // -------------------------------------------------------
+  // display the images, the rendering objects are only created if
+  // the images will be displayed or a screenshot will be taken
 
-  double checkSpacing = (extent[3] - extent[2] + 7)/7*tspacing[1];
-  sourceProperty->SetCheckerboardSpacing(checkSpacing, checkSpacing);
+#ifndef AIRS_HEADLESS_PROGRAMS
+  vtkSmartPointer<vtkRenderWindow> renderWindow;
+  vtkSmartPointer<vtkRenderWindowInteractor> interactor;
 
   if (display)
     {
+    renderWindow = vtkSmartPointer<vtkRenderWindow>::New();
+    vtkSmartPointer<vtkRenderer> renderer =
+      vtkSmartPointer<vtkRenderer>::New();
+    interactor = vtkSmartPointer<vtkRenderWindowInteractor>::New();
+    vtkSmartPointer<vtkInteractorStyleImage> istyle =
+      vtkSmartPointer<vtkInteractorStyleImage>::New();
+
+    istyle->SetInteractionModeToImageSlicing();
+    interactor->SetInteractorStyle(istyle);
+    renderWindow->SetInteractor(interactor);
+    renderWindow->AddRenderer(renderer);
+
+    vtkSmartPointer<vtkImageSlice> sourceActor =
+      vtkSmartPointer<vtkImageSlice>::New();
+    vtkSmartPointer<vtkImageResliceMapper> sourceMapper =
+      vtkSmartPointer<vtkImageResliceMapper>::New();
+    vtkSmartPointer<vtkImageProperty> sourceProperty =
+      vtkSmartPointer<vtkImageProperty>::New();
+
+    sourceMapper->SET_INPUT_DATA(sourceImage);
+    sourceMapper->SliceAtFocalPointOn();
+    sourceMapper->SliceFacesCameraOn();
+    sourceMapper->ResampleToScreenPixelsOff();
+
+    sourceProperty->SetColorWindow((sourceRange[1]-sourceRange[0]));
+    sourceProperty->SetColorLevel(0.5*(sourceRange[0]+sourceRange[1]));
+    if (options->translucent)
+      {
+      sourceProperty->SetOpacity(0.5);
+      }
+    else
+      {
+      sourceProperty->CheckerboardOn();
+      }
+
+    sourceActor->SetMapper(sourceMapper);
+    sourceActor->SetProperty(sourceProperty);
+    sourceActor->SetUserMatrix(sourceMatrix);
+
+    vtkSmartPointer<vtkImageSlice> targetActor =
+      vtkSmartPointer<vtkImageSlice>::New();
+    vtkSmartPointer<vtkImageResliceMapper> targetMapper =
+      vtkSmartPointer<vtkImageResliceMapper>::New();
+    vtkSmartPointer<vtkImageProperty> targetProperty =
+      vtkSmartPointer<vtkImageProperty>::New();
+
+    targetMapper->SET_INPUT_DATA(targetImage);
+    targetMapper->SliceAtFocalPointOn();
+    targetMapper->SliceFacesCameraOn();
+    targetMapper->ResampleToScreenPixelsOff();
+#ifdef VTK_HAS_SLAB_SPACING
+    if (options->mip)
+      {
+      targetMapper->SetSlabTypeToMax();
+      targetMapper->SetSlabSampleFactor(2);
+      targetMapper->SetSlabThickness(sourceImage->GetSpacing()[2]);
+      }
+#endif
+
+    targetProperty->SetColorWindow((targetRange[1]-targetRange[0]));
+    targetProperty->SetColorLevel(0.5*(targetRange[0]+targetRange[1]));
+
+    targetActor->SetMapper(targetMapper);
+    targetActor->SetProperty(targetProperty);
+    targetActor->SetUserMatrix(targetMatrix);
+
+    vtkSmartPointer<vtkImageStack> imageStack =
+      vtkSmartPointer<vtkImageStack>::New();
+    imageStack->AddImage(targetActor);
+    imageStack->AddImage(sourceActor);
+
+    renderer->AddViewProp(imageStack);
+    renderer->SetBackground(0,0,0);
+
+    renderWindow->SetSize(512,512);
+
+    if (interpolatorType == vtkImageRegistration::Nearest ||
+        interpolatorType == vtkImageRegistration::Label)
+      {
+      targetProperty->SetInterpolationTypeToNearest();
+      sourceProperty->SetInterpolationTypeToNearest();
+      }
+
+    vtkCamera *camera = renderer->GetActiveCamera();
+    renderer->ResetCamera();
+    camera->SetFocalPoint(center);
+    camera->ParallelProjectionOn();
+    camera->SetParallelScale(0.5*(bounds[3] - bounds[2]));
+    SetViewFromMatrix(renderer, istyle, cameraMatrix, options->coords);
+    renderer->ResetCameraClippingRange();
+
+    int extent[6];
+    double tspacing[3];
+    cameraImage->GetExtent(extent);
+    cameraImage->GetSpacing(tspacing);
+    double checkSpacing = (extent[3] - extent[2] + 7)/7*tspacing[1];
+    sourceProperty->SetCheckerboardSpacing(checkSpacing, checkSpacing);
+
     renderWindow->Render();
     }
+#endif
 
   // -------------------------------------------------------
   // prepare for registration
@@ -2175,18 +3124,83 @@ int main(int argc, char *argv[])
   // set up the registration
   vtkSmartPointer<vtkImageRegistration> registration =
     vtkSmartPointer<vtkImageRegistration>::New();
-  registration->SetTargetImageInputConnection(targetBlur->GetOutputPort());
-  registration->SetSourceImageInputConnection(sourceBlur->GetOutputPort());
+  if (options->threads > 0)
+    {
+    registration->SetNumberOfThreads(options->threads);
+    sourceBlur->SetNumberOfThreads(options->threads);
+    targetBlur->SetNumberOfThreads(options->threads);
+    }
+  if (targetCache)
+    {
+    // the target for the first stage is shared with the other jobs
+    double blurFactors[3];
+    for (int j = 0; j < 3; j++)
+      {
+      blurFactors[j] = initialBlurFactor*minSpacing/targetSpacing[j];
+      }
+    register_prepared_target(
+      targetCache, registration, blurFactors, targetImage, targetRange,
+      options, numberOfBins);
+    }
+  else
+    {
+    registration->SetTargetImageInputConnection(targetBlur->GetOutputPort());
+    if (options->target_fov)
+      {
+      registration->SetTargetImageStencil(ComputeFieldOfView(targetImage));
+      }
+    }
+  if (sourceCache)
+    {
+    // the source for the first stage is shared with the other jobs
+    double spacing[3];
+    for (int j = 0; j < 3; j++)
+      {
+      spacing[j] = initialBlurFactor*minSpacing;
+      if (spacing[j] < sourceSpacing[j])
+        {
+        spacing[j] = sourceSpacing[j];
+        }
+      }
+    registration->SetSourceImage(register_blurred_source(
+      sourceCache, spacing, sourceImage, options));
+    }
+  else
+    {
+    registration->SetSourceImageInputConnection(sourceBlur->GetOutputPort());
+    }
   registration->SetSourceImageRange(sourceRange);
   registration->SetTargetImageRange(targetRange);
-  registration->SetTransformDimensionality(options.dimensionality);
-  registration->SetTransformType(options.transform);
-  registration->SetMetricType(options.metric);
+  registration->SetAutomaticSourceStencil(options->auto_stencil);
+  registration->SetProgressiveFidelity(options->progressive);
+  registration->SetSampleTileSize(options->tile_size);
+  if (options->tile_size > 0)
+    {
+    // each sample needs 10 bytes, so limit the memory to around 160 MB
+    registration->SetMaximumNumberOfSamples(16777216);
+    }
+  registration->SetAutomaticParameterScales(options->auto_scales);
+  registration->SetTransformDimensionality(options->dimensionality);
+  registration->SetTransformType(options->transform);
+  registration->SetMetricType(options->metric);
+  registration->SetOptimizerType(options->optimizer);
   registration->SetInterpolatorType(interpolatorType);
   registration->SetJointHistogramSize(numberOfBins,numberOfBins);
   registration->SetMetricTolerance(1e-4);
   registration->SetTransformTolerance(transformTolerance);
-  if (xfminputs->size() > 0)
+  if (input->initialMatrix)
+    {
+    registration->SetInitializerTypeToNone();
+    }
+  else if (options->moments)
+    {
+    registration->SetInitializerTypeToMoments();
+    }
+  else if (options->grid_search)
+    {
+    registration->SetInitializerTypeToGridSearch();
+    }
+  else if (xfminputs->size() > 0)
     {
     registration->SetInitializerTypeToNone();
     }
@@ -2208,38 +3222,101 @@ int main(int argc, char *argv[])
 
   // the registration starts at low-resolution
   double blurFactor = initialBlurFactor;
-  int level = 0;
+  int level = startLevel;
   // will be set to "true" when registration is initialized
   bool initialized = false;
+  // for --adaptive, the fraction of the iterations to use at this level
+  double iterationFraction = 1.0;
+  // for --adaptive, the transform at the start of each level
+  vtkSmartPointer<vtkMatrix4x4> levelMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  double sourceBounds[6];
+  sourceImage->GetBounds(sourceBounds);
+
+  // for --deadline, whether every stage converged in time
+  bool converged = true;
+  // the total number of metric evaluations
+  int evaluations = 0;
+  // for display, the thread that runs the registration
+  vtkSmartPointer<vtkMultiThreader> threader =
+    vtkSmartPointer<vtkMultiThreader>::New();
+  vtkSmartPointer<vtkMutexLock> renderLock =
+    vtkSmartPointer<vtkMutexLock>::New();
+  vtkSmartPointer<vtkMatrix4x4> displayMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
 
-  while (level < 4 && options.maxiter[level] > 0)
+  while (level < 4 && options->maxiter[level] > 0)
     {
-    registration->SetMaximumNumberOfIterations(options.maxiter[level]);
+    // for --deadline, give each stage a share of the remaining time,
+    // weighted towards the stages at higher resolution
+    double stageEndTime = 0.0;
+    if (options->deadline > 0)
+      {
+      double remaining = startTime + options->deadline - lastTime;
+      if (remaining <= 0)
+        {
+        converged = false;
+        break;
+        }
+      double weight = 0.0;
+      double totalWeight = 0.0;
+      double f = blurFactor;
+      for (int j = level; j < 4 && options->maxiter[j] > 0; j++)
+        {
+        double w = (f > 1.0 ? 1.0/(f*f) : 1.0);
+        weight = (j == level ? w : weight);
+        totalWeight += w;
+        f /= 2.0;
+        }
+      stageEndTime = lastTime + remaining*weight/totalWeight;
+      }
+
+    int maxiter = static_cast<int>(options->maxiter[level]*iterationFraction);
+    registration->SetMaximumNumberOfIterations(maxiter > 1 ? maxiter : 1);
     registration->SetInterpolatorType(interpolatorType);
     registration->SetTransformTolerance(transformTolerance*blurFactor);
 
     if (blurFactor < 1.1)
       {
       // full resolution: no blurring or resampling
-      sourceBlur->SetInterpolator(0);
-      sourceBlur->InterpolateOff();
-      sourceBlur->SetOutputSpacing(sourceSpacing);
-#if VTK_MAJOR_VERSION >= 6
-      sourceBlur->UpdateWholeExtent();
+      if (sourceCache)
+        {
+        double spacing[3] = { 0.0, 0.0, 0.0 };
+        registration->SetSourceImage(register_blurred_source(
+          sourceCache, spacing, sourceImage, options));
+        }
+      else
+        {
+        sourceBlur->SetInterpolator(0);
+        sourceBlur->InterpolateOff();
+        sourceBlur->SetOutputSpacing(sourceSpacing);
+#if VTK_MAJOR_VERSION >= 6
+        sourceBlur->UpdateWholeExtent();
 #else
-      sourceBlur->GetOutput()->SetUpdateExtentToWholeExtent();
-      sourceBlur->Update();
+        sourceBlur->GetOutput()->SetUpdateExtentToWholeExtent();
+        sourceBlur->Update();
 #endif
+        }
 
-      targetBlur->SetInterpolator(0);
-      sourceBlur->InterpolateOff();
-      targetBlur->SetOutputSpacing(targetSpacing);
+      if (targetCache)
+        {
+        double blurFactors[3] = { 0.0, 0.0, 0.0 };
+        register_prepared_target(
+          targetCache, registration, blurFactors, targetImage, targetRange,
+          options, numberOfBins);
+        }
+      else
+        {
+        targetBlur->SetInterpolator(0);
+        sourceBlur->InterpolateOff();
+        targetBlur->SetOutputSpacing(targetSpacing);
 #if VTK_MAJOR_VERSION >= 6
-      targetBlur->UpdateWholeExtent();
+        targetBlur->UpdateWholeExtent();
 #else
-      targetBlur->GetOutput()->SetUpdateExtentToWholeExtent();
-      targetBlur->Update();
+        targetBlur->GetOutput()->SetUpdateExtentToWholeExtent();
+        targetBlur->Update();
 #endif
+        }
       }
     else
       {
@@ -2254,30 +3331,56 @@ int main(int argc, char *argv[])
           }
         }
 
-      sourceBlurKernel->SetBlurFactors(
-        spacing[0]/sourceSpacing[0],
-        spacing[1]/sourceSpacing[1],
-        spacing[2]/sourceSpacing[2]);
+      if (sourceCache)
+        {
+        registration->SetSourceImage(register_blurred_source(
+          sourceCache, spacing, sourceImage, options));
+        }
+      else
+        {
+        sourceBlurKernel->SetBlurFactors(
+          spacing[0]/sourceSpacing[0],
+          spacing[1]/sourceSpacing[1],
+          spacing[2]/sourceSpacing[2]);
 
-      sourceBlur->SetOutputSpacing(spacing);
+        sourceBlur->SetOutputSpacing(spacing);
 #if VTK_MAJOR_VERSION >= 6
-      sourceBlur->UpdateWholeExtent();
+        sourceBlur->UpdateWholeExtent();
 #else
-      sourceBlur->GetOutput()->SetUpdateExtentToWholeExtent();
-      sourceBlur->Update();
+        sourceBlur->GetOutput()->SetUpdateExtentToWholeExtent();
+        sourceBlur->Update();
 #endif
+        }
 
-      targetBlurKernel->SetBlurFactors(
-        blurFactor*minSpacing/targetSpacing[0],
-        blurFactor*minSpacing/targetSpacing[1],
-        blurFactor*minSpacing/targetSpacing[2]);
+      double blurFactors[3];
+      for (int j = 0; j < 3; j++)
+        {
+        blurFactors[j] = blurFactor*minSpacing/targetSpacing[j];
+        }
 
+      if (targetCache)
+        {
+        register_prepared_target(
+          targetCache, registration, blurFactors, targetImage, targetRange,
+          options, numberOfBins);
+        }
+      else
+        {
+        targetBlurKernel->SetBlurFactors(blurFactors);
+        if (options->tile_size > 0)
+          {
+          double targetLevelSpacing[3];
+          register_target_spacing(
+            targetSpacing, blurFactors, targetLevelSpacing);
+          targetBlur->SetOutputSpacing(targetLevelSpacing);
+          }
 #if VTK_MAJOR_VERSION >= 6
-      targetBlur->UpdateWholeExtent();
+        targetBlur->UpdateWholeExtent();
 #else
-      targetBlur->GetOutput()->SetUpdateExtentToWholeExtent();
-      targetBlur->Update();
+        targetBlur->GetOutput()->SetUpdateExtentToWholeExtent();
+        targetBlur->Update();
 #endif
+        }
       }
 
     if (initialized)
@@ -2287,40 +3390,97 @@ int main(int argc, char *argv[])
       matrix->DeepCopy(registration->GetTransform()->GetMatrix());
       }
 
+    if (options->deadline > 0)
+      {
+      // the blurring has already used part of the time for this stage
+      double t = stageEndTime - timer->GetUniversalTime();
+      registration->SetTimeLimit(t > 1e-3 ? t : 1e-3);
+      }
+
     registration->Initialize(matrix);
+    levelMatrix->DeepCopy(registration->GetTransform()->GetMatrix());
 
     initialized = true;
 
-    while (registration->Iterate())
+    if (!display)
       {
-      // registration->UpdateRegistration();
-      // will iterate until convergence or failure
-
-      if (showTargetMoving)
+      while (registration->Iterate())
         {
-        targetMatrix->DeepCopy(registration->GetTransform()->GetMatrix());
-        targetMatrix->Invert();
-        vtkMatrix4x4::Multiply4x4(
-          originalSourceMatrix, targetMatrix, targetMatrix);
-        targetMatrix->Modified();
+        // registration->UpdateRegistration();
+        // will iterate until convergence or failure
         }
-      else
+      }
+#ifndef AIRS_HEADLESS_PROGRAMS
+    else
+      {
+      // iterate on a separate thread, so that the registration does not
+      // wait for the rendering, and render at no more than 30 fps
+      RegistrationThreadInfo rti;
+      rti.Registration = registration;
+      rti.Lock = renderLock;
+      rti.Version = 0;
+      rti.Done = 0;
+      int threadId = threader->SpawnThread(&RegistrationThread, &rti);
+
+      const double frameInterval = 1.0/30.0;
+      double lastFrameTime = 0.0;
+      int version = 0;
+      bool done = false;
+      while (!done)
         {
-        sourceMatrix->DeepCopy(registration->GetTransform()->GetMatrix());
-        vtkMatrix4x4::Multiply4x4(
-          originalTargetMatrix, sourceMatrix, sourceMatrix);
-        sourceMatrix->Modified();
-        }
+        vtksys::SystemTools::Delay(5);
+        double frameTime = timer->GetUniversalTime();
+
+        // take a snapshot of the most recent matrix, if it is time to
+        // render a new frame or if the registration is finished
+        renderLock->Lock();
+        done = (rti.Done != 0);
+        bool changed = (rti.Version != version &&
+                        (done || frameTime - lastFrameTime >= frameInterval));
+        if (changed)
+          {
+          version = rti.Version;
+          displayMatrix->DeepCopy(rti.Matrix);
+          }
+        renderLock->Unlock();
 
-      if (display)
-        {
-        interactor->Render();
+        if (changed)
+          {
+          if (showTargetMoving)
+            {
+            targetMatrix->DeepCopy(displayMatrix);
+            targetMatrix->Invert();
+            vtkMatrix4x4::Multiply4x4(
+              originalSourceMatrix, targetMatrix, targetMatrix);
+            targetMatrix->Modified();
+            }
+          else
+            {
+            sourceMatrix->DeepCopy(displayMatrix);
+            vtkMatrix4x4::Multiply4x4(
+              originalTargetMatrix, sourceMatrix, sourceMatrix);
+            sourceMatrix->Modified();
+            }
+
+          interactor->Render();
+          lastFrameTime = frameTime;
+          }
         }
+
+      threader->TerminateThread(threadId);
       }
+#endif
 
     double newTime = timer->GetUniversalTime();
     double blurSpacing[3];
-    sourceBlur->GetOutputSpacing(blurSpacing);
+    if (sourceCache)
+      {
+      registration->GetSourceImage()->GetSpacing(blurSpacing);
+      }
+    else
+      {
+      sourceBlur->GetOutputSpacing(blurSpacing);
+      }
     double minBlurSpacing = VTK_DOUBLE_MAX;
     for (int kk = 0; kk < 3; kk++)
       {
@@ -2330,56 +3490,151 @@ int main(int argc, char *argv[])
         }
       }
 
-    if (!options.silent)
+    if (!options->silent)
       {
       cout << minBlurSpacing << " mm took "
            << (newTime - lastTime) << "s and "
-           << registration->GetNumberOfEvaluations() << " evaluations" << endl;
-      lastTime = newTime;
+           << registration->GetNumberOfEvaluations() << " evaluations ("
+           << registration->GetNumberOfCacheHits() << " cached)" << endl;
+      }
+    lastTime = newTime;
+    evaluations += registration->GetNumberOfEvaluations();
+
+    if (!registration->GetConverged())
+      {
+      converged = false;
       }
 
     // prepare for next iteration
     level++;
     blurFactor /= 2.0;
+
+    if (options->adaptive && level > 1 && level < 4)
+      {
+      // estimate how far the next level would move the transform from
+      // how far this level moved it, compared to the next tolerance
+      double displacement = MaximumDisplacement(
+        levelMatrix, registration->GetTransform()->GetMatrix(),
+        sourceBounds);
+      double nextTolerance = transformTolerance*blurFactor;
+      if (displacement < nextTolerance)
+        {
+        // skip the intermediate stages, but do the final stage with
+        // fewer iterations, since the small motion at this resolution
+        // says little about the motion at the full resolution
+        int finalLevel = level;
+        while (finalLevel + 1 < 4 && options->maxiter[finalLevel + 1] > 0)
+          {
+          finalLevel++;
+          }
+        if (!options->silent && finalLevel > level)
+          {
+          cout << "skipping to the final stage, last stage moved "
+               << displacement << " mm" << endl;
+          }
+        while (level < finalLevel)
+          {
+          level++;
+          blurFactor /= 2.0;
+          }
+        iterationFraction = 0.25;
+        }
+      else
+        {
+        iterationFraction = (displacement < 4*nextTolerance ? 0.25 : 1.0);
+        }
+      }
     }
 
-  if (!options.silent)
+  if (!options->silent)
     {
     cout << "registration took " << (lastTime - startTime) << "s" << endl;
+    if (options->deadline > 0)
+      {
+      cout << (converged ? "converged" : "did not converge")
+           << " within the deadline" << endl;
+      }
+    }
+
+#ifndef AIRS_HEADLESS_PROGRAMS
+  // -------------------------------------------------------
+  // capture a screen shot
+  if (options->screenshot)
+    {
+    WriteScreenshot(renderWindow, options->screenshot);
+    }
+#endif
+
+  // -------------------------------------------------------
+  // store the result
+
+  result->matrix = vtkSmartPointer<vtkMatrix4x4>::New();
+  result->matrix->DeepCopy(registration->GetTransform()->GetMatrix());
+  result->sourceMatrix = originalSourceMatrix;
+  result->targetMatrix = originalTargetMatrix;
+  result->center[0] = center[0];
+  result->center[1] = center[1];
+  result->center[2] = center[2];
+  result->time = lastTime - startTime;
+  result->evaluations = evaluations;
+  result->converged = converged;
+  result->metric = registration->GetMetricValue();
+#ifndef AIRS_HEADLESS_PROGRAMS
+  result->interactor = interactor;
+#endif
+
+  if (targetCache)
+    {
+    register_release_prepared_target(targetCache, registration);
     }
 
+  return 0;
+}
+
+// Compute the transform from the source patient coordinates to the
+// target patient coordinates, which is the transform that is written.
+void register_world_matrix(register_result *result, vtkMatrix4x4 *wmatrix)
+{
+  wmatrix->DeepCopy(result->sourceMatrix);
+  wmatrix->Invert();
+  vtkMatrix4x4::Multiply4x4(result->matrix, wmatrix, wmatrix);
+  vtkMatrix4x4::Multiply4x4(result->targetMatrix, wmatrix, wmatrix);
+}
+
+// Write the output transform and the output image.
+void register_write_output(
+  register_options *options, register_input *input, register_result *result)
+{
+  const char *xfmfile = options->outxfm;
+  const char *imagefile = options->output;
+  vtkImageData *sourceImage = input->sourceImage;
+  vtkImageData *targetImage = input->targetImage;
+  vtkImageReader2 *sourceReader = input->sourceReader;
+  vtkImageReader2 *targetReader = input->targetReader;
+  vtkMatrix4x4 *originalSourceMatrix = result->sourceMatrix;
+  vtkMatrix4x4 *originalTargetMatrix = result->targetMatrix;
+
   // -------------------------------------------------------
   // write the output matrix
   if (xfmfile)
     {
-    if (!options.silent)
+    if (!options->silent)
       {
       cout << "Writing transform file: " << xfmfile << endl;
       }
 
-    vtkMatrix4x4 *rmatrix = registration->GetTransform()->GetMatrix();
     vtkSmartPointer<vtkMatrix4x4> wmatrix =
       vtkSmartPointer<vtkMatrix4x4>::New();
-    wmatrix->DeepCopy(originalSourceMatrix);
-    wmatrix->Invert();
-    vtkMatrix4x4::Multiply4x4(rmatrix, wmatrix, wmatrix);
-    vtkMatrix4x4::Multiply4x4(originalTargetMatrix, wmatrix, wmatrix);
-
-    WriteMatrix(wmatrix, xfmfile, center);
-    }
+    register_world_matrix(result, wmatrix);
 
-  // -------------------------------------------------------
-  // capture a screen shot
-  if (options.screenshot)
-    {
-    WriteScreenshot(renderWindow, options.screenshot);
+    WriteMatrix(wmatrix, xfmfile, result->center);
     }
 
   // -------------------------------------------------------
   // write the output file
   if (imagefile)
     {
-    if (!options.silent)
+    if (!options->silent)
       {
       cout << "Writing transformed image: " << imagefile << endl;
       }
@@ -2387,7 +3642,7 @@ int main(int argc, char *argv[])
     // check which image is to be written
     vtkImageData *resliceImage = targetImage;
     vtkImageData *templateImage = sourceImage;
-    if (options.source_to_target)
+    if (options->source_to_target)
       {
       resliceImage = sourceImage;
       templateImage = targetImage;
@@ -2398,7 +3653,7 @@ int main(int argc, char *argv[])
     vtkSmartPointer<vtkImageBSplineCoefficients> bspline =
       vtkSmartPointer<vtkImageBSplineCoefficients>::New();
     // if bspline, need to filter the image first
-    if (options.interpolator == vtkImageRegistration::BSpline)
+    if (options->interpolator == vtkImageRegistration::BSpline)
       {
       bspline->SET_INPUT_DATA(resliceImage);
       bspline->Update();
@@ -2409,7 +3664,7 @@ int main(int argc, char *argv[])
       vtkSmartPointer<vtkImageReslice>::New();
     reslice->SetInformationInput(templateImage);
     reslice->SET_INPUT_DATA(resliceImage);
-    SetInterpolator(reslice, options.interpolator);
+    SetInterpolator(reslice, options->interpolator);
 
 #ifdef VTK_RESLICE_HAS_OUTPUT_SCALAR_TYPE
     if (outputScalarType != resliceImage->GetScalarType())
@@ -2418,19 +3673,20 @@ int main(int argc, char *argv[])
       }
 #endif
 
-    if (options.source_to_target)
+    vtkSmartPointer<vtkTransform> transform =
+      vtkSmartPointer<vtkTransform>::New();
+    transform->SetMatrix(result->matrix);
+    if (options->source_to_target)
       {
-      reslice->SetResliceTransform(
-        registration->GetTransform()->GetInverse());
+      reslice->SetResliceTransform(transform->GetInverse());
       }
     else
       {
-      reslice->SetResliceTransform(
-        registration->GetTransform());
+      reslice->SetResliceTransform(transform);
       }
 
 #ifdef VTK_HAS_SLAB_SPACING
-    if (options.mip)
+    if (options->mip)
       {
       double ss[3];
       double st[3];
@@ -2440,7 +3696,7 @@ int main(int argc, char *argv[])
       reslice->SetSlabModeToMax();
       reslice->SetSlabNumberOfSlices(sn);
       reslice->SetSlabSliceSpacingFraction(1.0/sn);
-      if (!options.silent)
+      if (!options->silent)
         {
         cout << "Wrote MIP slabs that are " << ss[2] << " mm thick." << endl;
         }
@@ -2463,32 +3719,1804 @@ int main(int argc, char *argv[])
       }
 #endif
 
-    if (options.source_to_target)
+    if (options->source_to_target)
       {
       WriteImage(targetReader, sourceReader,
         resliceImage, originalTargetMatrix, imagefile,
-        options.coords, options.interpolator);
+        options->coords, options->interpolator);
       }
     else
       {
       WriteImage(sourceReader, targetReader,
         resliceImage, originalSourceMatrix, imagefile,
-        options.coords, options.interpolator);
+        options->coords, options->interpolator);
       }
     }
+}
 
-  if (!options.silent)
+// One job from the manifest for --batch.
+struct register_batch_job
+{
+  std::string source;
+  std::string target;
+  std::string outxfm;
+  std::string output;
+  int line;
+  register_options options;
+  register_input input;
+  register_result result;
+};
+
+// The state that is shared between the threads for --batch.  The
+// reader thread reads the images ahead of the workers, the workers
+// run the registrations, and the writer thread writes the results.
+// The reader and the writer take turns with the IOLock, because the
+// MINC and netCDF libraries are not thread safe.
+struct register_batch_info
+{
+  std::vector<register_batch_job *> Jobs;
+  vtkMutexLock *Lock;
+  vtkMutexLock *IOLock;
+  vtkConditionVariable *Condition;
+  int NumberOfWorkers;
+  int NumberRead;
+  int NumberStarted;
+  int NumberWritten;
+  std::vector<int> Finished;
+};
+
+// Read the manifest, which has one job per line: the source image, the
+// target image, the output transform, and (optionally) the output image,
+// separated by tabs.  Blank lines and lines that start with '#' are
+// ignored.  Returns zero on failure.
+int register_read_manifest(
+  const char *filename, std::vector<register_batch_job *> *jobs)
+{
+  ifstream infile(filename);
+  if (!infile.good())
     {
-    cout << "Done!" << endl;
+    fprintf(stderr, "Unable to open manifest %s\n", filename);
+    return 0;
     }
 
-  // -------------------------------------------------------
-  // allow user to interact
+  std::string line;
+  int lineNumber = 0;
+  while (std::getline(infile, line))
+    {
+    lineNumber++;
+    if (line.size() > 0 && line[line.size() - 1] == '\r')
+      {
+      line.resize(line.size() - 1);
+      }
+    if (line.size() == 0 || line[0] == '#')
+      {
+      continue;
+      }
 
-  if (options.display)
+    std::vector<std::string> fields;
+    size_t pos = 0;
+    for (;;)
+      {
+      size_t tab = line.find('\t', pos);
+      fields.push_back(line.substr(pos, tab - pos));
+      if (tab == std::string::npos)
+        {
+        break;
+        }
+      pos = tab + 1;
+      }
+
+    int t = (fields.size() >= 3 ? GuessFileType(fields[2].c_str()) : 0);
+    int u = (fields.size() >= 4 ? GuessFileType(fields[3].c_str()) : 0);
+    if (fields.size() < 3 || fields.size() > 4 ||
+        t <= LastImageType || t > LastTransformType ||
+        (fields.size() == 4 && u > LastImageType))
+      {
+      fprintf(stderr, "%s:%d: each line must have a source image, a target "
+              "image, an output transform, and an optional output image, "
+              "separated by tabs\n", filename, lineNumber);
+      return 0;
+      }
+
+    register_batch_job *job = new register_batch_job;
+    job->source = fields[0];
+    job->target = fields[1];
+    job->outxfm = fields[2];
+    if (fields.size() == 4)
+      {
+      job->output = fields[3];
+      }
+    job->line = lineNumber;
+    jobs->push_back(job);
+    }
+
+  return 1;
+}
+
+// Check the headers of all the images in the manifest before starting,
+// since a job that cannot read its images would stop the whole batch.
+// Returns zero on failure.
+int register_check_manifest(
+  const char *filename, const std::vector<register_batch_job *>& jobs)
+{
+  std::set<std::string> checked;
+  for (size_t j = 0; j < jobs.size(); j++)
+    {
+    register_options options = jobs[j]->options;
+    register_resolve_coords(&options);
+    const char *filenames[2] = { options.source, options.target };
+    for (int i = 0; i < 2; i++)
+      {
+      if (checked.insert(filenames[i]).second &&
+          !CheckImage(filenames[i], options.coords))
+        {
+        fprintf(stderr, "%s:%d: unable to read image %s\n",
+                filename, jobs[j]->line, filenames[i]);
+        return 0;
+        }
+      }
+    }
+
+  return 1;
+}
+
+// Read the images for each job, staying no more than one job ahead of
+// the workers so that the memory use is bounded.  The most recent target
+// is kept, so that it can be shared by consecutive jobs.
+VTK_THREAD_RETURN_TYPE register_batch_reader(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  register_batch_info *bi =
+    static_cast<register_batch_info *>(ti->UserData);
+
+  register_input last;
+  register_image_cache *lastCache = NULL;
+  int n = static_cast<int>(bi->Jobs.size());
+  for (int i = 0; i < n; i++)
+    {
+    bi->Lock->Lock();
+    while (i > bi->NumberWritten + bi->NumberOfWorkers)
+      {
+      bi->Condition->Wait(bi->Lock);
+      }
+    bi->Lock->Unlock();
+
+    register_batch_job *job = bi->Jobs[i];
+    register_batch_job *prev = (i > 0 ? bi->Jobs[i - 1] : 0);
+    bi->IOLock->Lock();
+    register_read_input(&job->options, &job->input,
+                        (prev ? &prev->options : 0),
+                        (prev ? &last : 0));
+    bi->IOLock->Unlock();
+
+    // jobs that share the target image also share the prepared targets
+    if (!prev || job->input.targetReader != last.targetReader)
+      {
+      if (lastCache)
+        {
+        register_release_image_cache(lastCache);
+        }
+      lastCache = register_new_image_cache();
+      }
+    register_retain_image_cache(lastCache);
+    job->input.targetCache = lastCache;
+
+    // copy the target matrix before the registration modifies it
+    last.targetImage = job->input.targetImage;
+    last.targetMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    last.targetMatrix->DeepCopy(job->input.targetMatrix);
+    last.targetReader = job->input.targetReader;
+    last.targetRange[0] = job->input.targetRange[0];
+    last.targetRange[1] = job->input.targetRange[1];
+
+    bi->Lock->Lock();
+    bi->NumberRead++;
+    bi->Condition->Broadcast();
+    bi->Lock->Unlock();
+    }
+
+  if (lastCache)
+    {
+    register_release_image_cache(lastCache);
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+// Run the registration for each job after its images have been read.
+VTK_THREAD_RETURN_TYPE register_batch_worker(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  register_batch_info *bi =
+    static_cast<register_batch_info *>(ti->UserData);
+
+  int n = static_cast<int>(bi->Jobs.size());
+  for (;;)
+    {
+    bi->Lock->Lock();
+    while (bi->NumberStarted < n && bi->NumberStarted >= bi->NumberRead)
+      {
+      bi->Condition->Wait(bi->Lock);
+      }
+    int i = bi->NumberStarted;
+    if (i < n)
+      {
+      bi->NumberStarted++;
+      }
+    bi->Lock->Unlock();
+
+    if (i >= n)
+      {
+      break;
+      }
+
+    register_batch_job *job = bi->Jobs[i];
+    register_execute(&job->options, &job->input, &job->result);
+
+    bi->Lock->Lock();
+    bi->Finished[i] = 1;
+    bi->Condition->Broadcast();
+    bi->Lock->Unlock();
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+// Write the results in the order of the manifest, and print a summary
+// line for each job.
+VTK_THREAD_RETURN_TYPE register_batch_writer(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  register_batch_info *bi =
+    static_cast<register_batch_info *>(ti->UserData);
+
+  int n = static_cast<int>(bi->Jobs.size());
+  for (int i = 0; i < n; i++)
+    {
+    bi->Lock->Lock();
+    while (!bi->Finished[i])
+      {
+      bi->Condition->Wait(bi->Lock);
+      }
+    bi->Lock->Unlock();
+
+    register_batch_job *job = bi->Jobs[i];
+    bi->IOLock->Lock();
+    register_write_output(&job->options, &job->input, &job->result);
+    bi->IOLock->Unlock();
+
+    printf("%s -> %s: %.3fs, %d evaluations, %s, metric %g\n",
+           job->source.c_str(), job->target.c_str(), job->result.time,
+           job->result.evaluations,
+           (job->result.converged ? "converged" : "did not converge"),
+           job->result.metric);
+    fflush(stdout);
+
+    // release the images
+    register_release_image_cache(job->input.targetCache);
+    bi->Lock->Lock();
+    job->input = register_input();
+    job->result = register_result();
+    bi->NumberWritten++;
+    bi->Condition->Broadcast();
+    bi->Lock->Unlock();
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+// Run all of the registrations that are listed in the --batch manifest.
+int register_batch(register_options *options)
+{
+  std::vector<register_batch_job *> jobs;
+  if (!register_read_manifest(options->batch, &jobs))
+    {
+    for (size_t j = 0; j < jobs.size(); j++)
+      {
+      delete jobs[j];
+      }
+    return 1;
+    }
+
+  // by default, use one job for every four cores, since each job is
+  // itself multithreaded
+  int cores = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  int numberOfWorkers = options->jobs;
+  if (numberOfWorkers <= 0)
+    {
+    numberOfWorkers = cores/4;
+    }
+  numberOfWorkers = (numberOfWorkers > 1 ? numberOfWorkers : 1);
+  if (numberOfWorkers > static_cast<int>(jobs.size()))
+    {
+    numberOfWorkers = static_cast<int>(jobs.size());
+    }
+  int threads = cores/(numberOfWorkers > 1 ? numberOfWorkers : 1);
+
+  for (size_t j = 0; j < jobs.size(); j++)
+    {
+    register_batch_job *job = jobs[j];
+    job->options = *options;
+    job->options.batch = NULL;
+    job->options.silent = 1;
+    job->options.threads = (threads > 1 ? threads : 1);
+    job->options.source = job->source.c_str();
+    job->options.target = job->target.c_str();
+    job->options.outxfm = job->outxfm.c_str();
+    job->options.output = (job->output.size() ? job->output.c_str() : NULL);
+    }
+
+  if (!register_check_manifest(options->batch, jobs))
+    {
+    for (size_t j = 0; j < jobs.size(); j++)
+      {
+      delete jobs[j];
+      }
+    return 1;
+    }
+
+  register_batch_info bi;
+  bi.Jobs = jobs;
+  bi.Lock = vtkMutexLock::New();
+  bi.IOLock = vtkMutexLock::New();
+  bi.Condition = vtkConditionVariable::New();
+  bi.NumberOfWorkers = numberOfWorkers;
+  bi.NumberRead = 0;
+  bi.NumberStarted = 0;
+  bi.NumberWritten = 0;
+  bi.Finished.resize(jobs.size(), 0);
+
+  if (!options->silent)
+    {
+    cout << "Running " << jobs.size() << " registrations, "
+         << numberOfWorkers << " at a time." << endl;
+    }
+
+  vtkSmartPointer<vtkMultiThreader> threader =
+    vtkSmartPointer<vtkMultiThreader>::New();
+  std::vector<int> threadIds;
+  threadIds.push_back(threader->SpawnThread(&register_batch_reader, &bi));
+  for (int k = 0; k < numberOfWorkers; k++)
+    {
+    threadIds.push_back(threader->SpawnThread(&register_batch_worker, &bi));
+    }
+  threadIds.push_back(threader->SpawnThread(&register_batch_writer, &bi));
+  for (size_t k = 0; k < threadIds.size(); k++)
+    {
+    threader->TerminateThread(threadIds[k]);
+    }
+
+  bi.Condition->Delete();
+  bi.Lock->Delete();
+  bi.IOLock->Delete();
+  for (size_t j = 0; j < jobs.size(); j++)
+    {
+    delete jobs[j];
+    }
+
+  return 0;
+}
+
+// One image for --all-pairs, which is used as both a source and a target.
+struct register_pairs_image
+{
+  std::string filename;
+  vtkSmartPointer<vtkImageData> image;
+  vtkSmartPointer<vtkMatrix4x4> matrix;
+  vtkSmartPointer<vtkImageReader2> reader;
+  double range[2];
+  register_image_cache *cache;
+};
+
+// The state that is shared between the threads for --all-pairs.  The
+// pair that registers image i to image j is stored at index i*n + j.
+struct register_pairs_info
+{
+  register_options *Options;
+  std::vector<register_pairs_image> Images;
+  std::vector<int> Order;
+  std::vector<int> Status;
+  std::vector<register_result> Results;
+  std::vector<vtkSmartPointer<vtkMatrix4x4> > Transforms;
+  vtkMutexLock *Lock;
+  vtkConditionVariable *Condition;
+};
+
+// The status of each pair.
+enum { PairWaiting, PairRunning, PairDone };
+
+// Read the list of images, which has one image per line.  Blank lines and
+// lines that start with '#' are ignored.  Returns zero on failure.
+int register_read_image_list(
+  const char *filename, std::vector<register_pairs_image> *images)
+{
+  ifstream infile(filename);
+  if (!infile.good())
+    {
+    fprintf(stderr, "Unable to open image list %s\n", filename);
+    return 0;
+    }
+
+  std::string line;
+  int lineNumber = 0;
+  while (std::getline(infile, line))
+    {
+    lineNumber++;
+    if (line.size() > 0 && line[line.size() - 1] == '\r')
+      {
+      line.resize(line.size() - 1);
+      }
+    if (line.size() == 0 || line[0] == '#')
+      {
+      continue;
+      }
+
+    if (GuessFileType(line.c_str()) > LastImageType)
+      {
+      fprintf(stderr, "%s:%d: each line must have one image file\n",
+              filename, lineNumber);
+      return 0;
+      }
+
+    register_pairs_image image;
+    image.filename = line;
+    image.range[0] = 0.0;
+    image.range[1] = 1.0;
+    image.cache = NULL;
+    images->push_back(image);
+    }
+
+  return 1;
+}
+
+// Count the number of times that "%d" occurs in a file name pattern.
+int register_count_numbers(const char *pattern)
+{
+  int count = 0;
+  for (const char *cp = pattern; cp && *cp != '\0'; cp++)
     {
-    interactor->Start();
+    if (cp[0] == '%' && cp[1] == 'd')
+      {
+      count++;
+      cp++;
+      }
     }
 
+  return count;
+}
+
+// Make an output file name by replacing the first "%d" in the pattern
+// with the first number, and the second "%d" with the second number.
+std::string register_numbered_filename(
+  const char *pattern, int first, int second)
+{
+  std::string filename;
+  int numbers[2] = { first, second };
+  int count = 0;
+  for (const char *cp = pattern; *cp != '\0'; cp++)
+    {
+    if (cp[0] == '%' && cp[1] == 'd' && count < 2)
+      {
+      char text[16];
+      sprintf(text, "%d", numbers[count++]);
+      filename += text;
+      cp++;
+      }
+    else
+      {
+      filename += *cp;
+      }
+    }
+
+  return filename;
+}
+
+// Check whether the transform from image i to image j is known, either
+// because the pair (i,j) is done or because the pair (j,i) is done.
+bool register_pairs_known(register_pairs_info *pi, int i, int j)
+{
+  int n = static_cast<int>(pi->Images.size());
+  return (pi->Status[i*n + j] == PairDone || pi->Status[j*n + i] == PairDone);
+}
+
+// Get the transform from image i to image j, which must be known.
+void register_pairs_transform(
+  register_pairs_info *pi, int i, int j, vtkMatrix4x4 *matrix)
+{
+  int n = static_cast<int>(pi->Images.size());
+  if (pi->Status[i*n + j] == PairDone)
+    {
+    matrix->DeepCopy(pi->Transforms[i*n + j]);
+    }
+  else
+    {
+    vtkMatrix4x4::Invert(pi->Transforms[j*n + i], matrix);
+    }
+}
+
+// Find a starting transform for the pair (i,j) from the transforms that
+// are already known: either the inverse of (j,i), or the composition of
+// (i,k) and (k,j) for the image k that is closest to both i and j.
+// Returns zero if no starting transform can be found.
+int register_pairs_warm_start(
+  register_pairs_info *pi, int i, int j, vtkMatrix4x4 *matrix)
+{
+  if (register_pairs_known(pi, i, j))
+    {
+    register_pairs_transform(pi, i, j, matrix);
+    return 1;
+    }
+
+  int n = static_cast<int>(pi->Images.size());
+  int best = -1;
+  int bestDistance = 0;
+  for (int k = 0; k < n; k++)
+    {
+    if (k != i && k != j &&
+        register_pairs_known(pi, i, k) && register_pairs_known(pi, k, j))
+      {
+      int distance = (i > k ? i - k : k - i) + (j > k ? j - k : k - j);
+      if (best < 0 || distance < bestDistance)
+        {
+        best = k;
+        bestDistance = distance;
+        }
+      }
+    }
+
+  if (best < 0)
+    {
+    return 0;
+    }
+
+  vtkSmartPointer<vtkMatrix4x4> first =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  register_pairs_transform(pi, i, best, first);
+  register_pairs_transform(pi, best, j, matrix);
+  vtkMatrix4x4::Multiply4x4(matrix, first, matrix);
+
+  return 1;
+}
+
+// Run the registrations for the pairs.  Pairs of consecutive images can
+// always be started, but any other pair waits until a starting transform
+// can be made from the pairs that are done.  Since the pairs are ordered
+// by the distance between the images, there is always a pair that can be
+// started when none are running.
+VTK_THREAD_RETURN_TYPE register_pairs_worker(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  register_pairs_info *pi =
+    static_cast<register_pairs_info *>(ti->UserData);
+
+  int n = static_cast<int>(pi->Images.size());
+  vtkSmartPointer<vtkMatrix4x4> initialMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+
+  pi->Lock->Lock();
+  for (;;)
+    {
+    int pair = -1;
+    bool waiting = false;
+    bool warm = false;
+    for (size_t k = 0; k < pi->Order.size() && pair < 0; k++)
+      {
+      int p = pi->Order[k];
+      if (pi->Status[p] == PairWaiting)
+        {
+        waiting = true;
+        warm = (register_pairs_warm_start(pi, p/n, p%n, initialMatrix) != 0);
+        if (warm || p%n == p/n + 1)
+          {
+          pair = p;
+          }
+        }
+      }
+
+    if (pair < 0)
+      {
+      if (!waiting)
+        {
+        break;
+        }
+      pi->Condition->Wait(pi->Lock);
+      continue;
+      }
+
+    pi->Status[pair] = PairRunning;
+    pi->Lock->Unlock();
+
+    // each registration gets its own copies of the image data objects
+    // and matrices, but the image memory and the caches are shared
+    register_pairs_image *source = &pi->Images[pair/n];
+    register_pairs_image *target = &pi->Images[pair%n];
+    register_options options = *pi->Options;
+    options.source = source->filename.c_str();
+    options.target = target->filename.c_str();
+
+    register_input input;
+    input.sourceImage = vtkSmartPointer<vtkImageData>::New();
+    input.sourceImage->ShallowCopy(source->image);
+    input.sourceMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    input.sourceMatrix->DeepCopy(source->matrix);
+    input.sourceReader = source->reader;
+    input.sourceRange[0] = source->range[0];
+    input.sourceRange[1] = source->range[1];
+    input.targetImage = vtkSmartPointer<vtkImageData>::New();
+    input.targetImage->ShallowCopy(target->image);
+    input.targetMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    input.targetMatrix->DeepCopy(target->matrix);
+    input.targetReader = target->reader;
+    input.targetRange[0] = target->range[0];
+    input.targetRange[1] = target->range[1];
+    input.sourceCache = source->cache;
+    input.targetCache = target->cache;
+    if (warm)
+      {
+      input.initialMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+      input.initialMatrix->DeepCopy(initialMatrix);
+      }
+
+    register_result result;
+    register_execute(&options, &input, &result);
+
+    vtkSmartPointer<vtkMatrix4x4> wmatrix =
+      vtkSmartPointer<vtkMatrix4x4>::New();
+    register_world_matrix(&result, wmatrix);
+
+    pi->Lock->Lock();
+    pi->Results[pair] = result;
+    pi->Transforms[pair] = wmatrix;
+    pi->Status[pair] = PairDone;
+    pi->Condition->Broadcast();
+    }
+  pi->Lock->Unlock();
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+// Register every image in the --all-pairs list to every other image.
+int register_all_pairs(register_options *options)
+{
+  const char *pattern = options->outxfm;
+  if (register_count_numbers(pattern) != 2)
+    {
+    fprintf(stderr, "The --all-pairs option needs an output transform "
+            "with two \"%%d\" in its name, e.g. \"-o pair_%%d_%%d.tfm\".\n");
+    return 1;
+    }
+
+  register_pairs_info pi;
+  if (!register_read_image_list(options->all_pairs, &pi.Images))
+    {
+    return 1;
+    }
+
+  int n = static_cast<int>(pi.Images.size());
+  if (n < 2)
+    {
+    fprintf(stderr, "The --all-pairs list must have at least two images.\n");
+    return 1;
+    }
+
+  if (options->coords == NativeCoords)
+    {
+    options->coords = NIFTICoords;
+    for (int i = 0; i < n; i++)
+      {
+      if (CoordSystem(pi.Images[i].filename.c_str()) == DICOMCoords)
+        {
+        options->coords = DICOMCoords;
+        }
+      }
+    }
+
+  // read each image once, it will be used as a source and as a target
+  for (int i = 0; i < n; i++)
+    {
+    register_pairs_image *image = &pi.Images[i];
+    if (!options->silent)
+      {
+      cout << "Reading image " << (i + 1) << ": " << image->filename << endl;
+      }
+    image->image = vtkSmartPointer<vtkImageData>::New();
+    image->matrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    image->reader =
+      ReadImage(image->image, image->matrix, image->range,
+                image->filename.c_str(), options->coords,
+                options->interpolator);
+    if (image->reader == NULL)
+      {
+      exit(1);
+      }
+    image->reader->Delete();
+    image->cache = register_new_image_cache();
+    }
+
+  // order the pairs by the distance between the images, so that the
+  // transforms between nearby images are found first
+  for (int d = 1; d < n; d++)
+    {
+    for (int i = 0; i + d < n; i++)
+      {
+      pi.Order.push_back(i*n + (i + d));
+      pi.Order.push_back((i + d)*n + i);
+      }
+    }
+
+  int numberOfPairs = static_cast<int>(pi.Order.size());
+  int cores = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  int numberOfWorkers = options->jobs;
+  if (numberOfWorkers <= 0)
+    {
+    numberOfWorkers = cores/4;
+    }
+  numberOfWorkers = (numberOfWorkers > 1 ? numberOfWorkers : 1);
+  if (numberOfWorkers > numberOfPairs)
+    {
+    numberOfWorkers = numberOfPairs;
+    }
+  int threads = cores/numberOfWorkers;
+
+  register_options pairOptions = *options;
+  pairOptions.all_pairs = NULL;
+  pairOptions.silent = 1;
+  pairOptions.threads = (threads > 1 ? threads : 1);
+  pairOptions.outxfm = NULL;
+
+  pi.Options = &pairOptions;
+  pi.Status.resize(n*n, PairWaiting);
+  pi.Results.resize(n*n);
+  pi.Transforms.resize(n*n);
+  pi.Lock = vtkMutexLock::New();
+  pi.Condition = vtkConditionVariable::New();
+
+  if (!options->silent)
+    {
+    cout << "Running " << numberOfPairs << " registrations, "
+         << numberOfWorkers << " at a time." << endl;
+    }
+
+  vtkSmartPointer<vtkMultiThreader> threader =
+    vtkSmartPointer<vtkMultiThreader>::New();
+  std::vector<int> threadIds;
+  for (int k = 0; k < numberOfWorkers; k++)
+    {
+    threadIds.push_back(threader->SpawnThread(&register_pairs_worker, &pi));
+    }
+  for (size_t k = 0; k < threadIds.size(); k++)
+    {
+    threader->TerminateThread(threadIds[k]);
+    }
+
+  pi.Condition->Delete();
+  pi.Lock->Delete();
+
+  // write all of the transforms, and print a summary line for each pair
+  for (int i = 0; i < n; i++)
+    {
+    for (int j = 0; j < n; j++)
+      {
+      if (i != j)
+        {
+        register_result *result = &pi.Results[i*n + j];
+        std::string filename =
+          register_numbered_filename(pattern, i + 1, j + 1);
+        WriteMatrix(pi.Transforms[i*n + j], filename.c_str(), result->center);
+
+        printf("%s -> %s: %.3fs, %d evaluations, %s, metric %g\n",
+               pi.Images[i].filename.c_str(), pi.Images[j].filename.c_str(),
+               result->time, result->evaluations,
+               (result->converged ? "converged" : "did not converge"),
+               result->metric);
+        }
+      }
+    }
+  fflush(stdout);
+
+  for (int i = 0; i < n; i++)
+    {
+    register_release_image_cache(pi.Images[i].cache);
+    }
+
+  return 0;
+}
+
+// The state that is shared between the threads for --series.  The frames
+// are stored in the series as groups of scalar components.
+struct register_series_info
+{
+  register_options *Options;
+  vtkImageData *Series;
+  vtkMatrix4x4 *SeriesMatrix;
+  vtkImageReader2 *SeriesReader;
+  double SeriesRange[2];
+  int ComponentsPerFrame;
+  int ReferenceFrame;
+  vtkSmartPointer<vtkImageData> ReferenceImage;
+  register_image_cache *ReferenceCache;
+  std::vector<int> Order;
+  int NumberStarted;
+  std::vector<int> Done;
+  std::vector<register_result> Results;
+  std::vector<vtkSmartPointer<vtkMatrix4x4> > Transforms;
+  std::vector<double> Motion;
+  std::vector<vtkSmartPointer<vtkImageData> > Corrected;
+  vtkMutexLock *Lock;
+};
+
+// Extract the first component of one frame from the series.
+void register_extract_frame(
+  register_series_info *si, int frame, vtkImageData *output)
+{
+  // the series data object is not shared between threads
+  vtkSmartPointer<vtkImageData> series =
+    vtkSmartPointer<vtkImageData>::New();
+  series->ShallowCopy(si->Series);
+
+  vtkSmartPointer<vtkImageExtractComponents> extract =
+    vtkSmartPointer<vtkImageExtractComponents>::New();
+  extract->SET_INPUT_DATA(series);
+  extract->SetComponents(frame*si->ComponentsPerFrame);
+  if (si->Options->threads > 0)
+    {
+    extract->SetNumberOfThreads(si->Options->threads);
+    }
+  extract->Update();
+  output->ShallowCopy(extract->GetOutput());
+}
+
+// Compute the largest distance that any corner of the frame moves by
+// between two transforms, which are in patient coordinates.
+double register_frame_displacement(
+  vtkImageData *image, vtkMatrix4x4 *patientMatrix,
+  vtkMatrix4x4 *matrix1, vtkMatrix4x4 *matrix2)
+{
+  double bounds[6];
+  image->GetBounds(bounds);
+
+  vtkSmartPointer<vtkMatrix4x4> m1 =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkSmartPointer<vtkMatrix4x4> m2 =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  vtkMatrix4x4::Multiply4x4(matrix1, patientMatrix, m1);
+  vtkMatrix4x4::Multiply4x4(matrix2, patientMatrix, m2);
+
+  return MaximumDisplacement(m1, m2, bounds);
+}
+
+// Register the frames to the reference frame, in order of their distance
+// from the reference.  Each frame starts from the transform of the
+// nearest frame between it and the reference that is already done.
+VTK_THREAD_RETURN_TYPE register_series_worker(void *arg)
+{
+  vtkMultiThreader::ThreadInfo *ti =
+    static_cast<vtkMultiThreader::ThreadInfo *>(arg);
+  register_series_info *si =
+    static_cast<register_series_info *>(ti->UserData);
+
+  int n = static_cast<int>(si->Order.size());
+  int ref = si->ReferenceFrame;
+  vtkSmartPointer<vtkMatrix4x4> startMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+
+  double spacing[3];
+  si->Series->GetSpacing(spacing);
+  double minSpacing = fabs(spacing[0]);
+  minSpacing = (fabs(spacing[1]) < minSpacing ? fabs(spacing[1]) : minSpacing);
+  minSpacing = (fabs(spacing[2]) < minSpacing ? fabs(spacing[2]) : minSpacing);
+
+  for (;;)
+    {
+    si->Lock->Lock();
+    int k = si->NumberStarted;
+    int frame = -1;
+    int f = ref;
+    double motion = 0.0;
+    if (k < n)
+      {
+      si->NumberStarted++;
+      frame = si->Order[k];
+      int step = (frame > ref ? -1 : 1);
+      f = frame + step;
+      while (!si->Done[f])
+        {
+        f += step;
+        }
+      startMatrix->DeepCopy(si->Transforms[f]);
+      motion = si->Motion[f];
+      }
+    si->Lock->Unlock();
+
+    if (frame < 0)
+      {
+      break;
+      }
+
+    // if the nearest frame moved by less than a voxel from its own
+    // starting point, then the two lowest-resolution stages are not
+    // needed, but frames that start from the reference need them all
+    register_options options = *si->Options;
+    options.start_level = (f != ref && motion < minSpacing ? 2 : 0);
+
+    register_input input;
+    input.sourceImage = vtkSmartPointer<vtkImageData>::New();
+    register_extract_frame(si, frame, input.sourceImage);
+    input.sourceMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    input.sourceMatrix->DeepCopy(si->SeriesMatrix);
+    input.sourceReader = si->SeriesReader;
+    input.sourceRange[0] = si->SeriesRange[0];
+    input.sourceRange[1] = si->SeriesRange[1];
+    input.targetImage = vtkSmartPointer<vtkImageData>::New();
+    input.targetImage->ShallowCopy(si->ReferenceImage);
+    input.targetMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    input.targetMatrix->DeepCopy(si->SeriesMatrix);
+    input.targetReader = si->SeriesReader;
+    input.targetRange[0] = si->SeriesRange[0];
+    input.targetRange[1] = si->SeriesRange[1];
+    input.targetCache = si->ReferenceCache;
+    input.sourceCache = NULL;
+    input.initialMatrix = vtkSmartPointer<vtkMatrix4x4>::New();
+    input.initialMatrix->DeepCopy(startMatrix);
+
+    register_result result;
+    register_execute(&options, &input, &result);
+
+    vtkSmartPointer<vtkMatrix4x4> wmatrix =
+      vtkSmartPointer<vtkMatrix4x4>::New();
+    register_world_matrix(&result, wmatrix);
+    motion = register_frame_displacement(
+      input.sourceImage, si->SeriesMatrix, startMatrix, wmatrix);
+
+    // resample the frame onto the reference frame
+    vtkSmartPointer<vtkImageData> corrected;
+    if (options.output)
+      {
+      vtkImageData *frameImage = input.sourceImage;
+      int outputScalarType = frameImage->GetScalarType();
+      vtkSmartPointer<vtkImageBSplineCoefficients> bspline =
+        vtkSmartPointer<vtkImageBSplineCoefficients>::New();
+      if (options.interpolator == vtkImageRegistration::BSpline)
+        {
+        bspline->SET_INPUT_DATA(frameImage);
+        bspline->Update();
+        frameImage = bspline->GetOutput();
+        }
+
+      vtkSmartPointer<vtkTransform> transform =
+        vtkSmartPointer<vtkTransform>::New();
+      transform->SetMatrix(result.matrix);
+
+      vtkSmartPointer<vtkImageReslice> reslice =
+        vtkSmartPointer<vtkImageReslice>::New();
+      reslice->SetInformationInput(input.targetImage);
+      reslice->SET_INPUT_DATA(frameImage);
+      reslice->SetResliceTransform(transform->GetInverse());
+      SetInterpolator(reslice, options.interpolator);
+#ifdef VTK_RESLICE_HAS_OUTPUT_SCALAR_TYPE
+      // the frames must keep their type, so they can be appended
+      if (outputScalarType != frameImage->GetScalarType())
+        {
+        reslice->SetOutputScalarType(outputScalarType);
+        }
+#endif
+      if (options.threads > 0)
+        {
+        reslice->SetNumberOfThreads(options.threads);
+        }
+      reslice->Update();
+      frameImage = reslice->GetOutput();
+
+#ifndef VTK_RESLICE_HAS_OUTPUT_SCALAR_TYPE
+      vtkSmartPointer<vtkImageCast> imageCast =
+        vtkSmartPointer<vtkImageCast>::New();
+      if (outputScalarType != frameImage->GetScalarType())
+        {
+        imageCast->SET_INPUT_DATA(frameImage);
+        imageCast->SetOutputScalarType(outputScalarType);
+        imageCast->ClampOverflowOn();
+        imageCast->Update();
+        frameImage = imageCast->GetOutput();
+        }
+#endif
+
+      corrected = vtkSmartPointer<vtkImageData>::New();
+      corrected->ShallowCopy(frameImage);
+      }
+
+    si->Lock->Lock();
+    si->Results[frame] = result;
+    si->Transforms[frame] = wmatrix;
+    si->Motion[frame] = motion;
+    si->Corrected[frame] = corrected;
+    si->Done[frame] = 1;
+    si->Lock->Unlock();
+    }
+
+  return VTK_THREAD_RETURN_VALUE;
+}
+
+// Do motion correction for a 4D series, by registering every frame to
+// the reference frame.
+int register_series(register_options *options)
+{
+  const char *pattern = options->outxfm;
+  if ((pattern && register_count_numbers(pattern) != 1) ||
+      (!pattern && !options->output))
+    {
+    fprintf(stderr, "The --series option needs an output image, or an "
+            "output transform with\none \"%%d\" in its name, e.g. "
+            "\"-o frame_%%d.tfm\".\n");
+    return 1;
+    }
+
+  if (options->coords == NativeCoords)
+    {
+    options->coords = CoordSystem(options->series);
+    options->coords = (options->coords == DICOMCoords ?
+                       DICOMCoords : NIFTICoords);
+    }
+
+  if (!options->silent)
+    {
+    cout << "Reading series: " << options->series << endl;
+    }
+
+  register_series_info si;
+  vtkSmartPointer<vtkImageData> series =
+    vtkSmartPointer<vtkImageData>::New();
+  vtkSmartPointer<vtkMatrix4x4> seriesMatrix =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  si.SeriesRange[0] = 0.0;
+  si.SeriesRange[1] = 1.0;
+  vtkSmartPointer<vtkImageReader2> seriesReader =
+    ReadImage(series, seriesMatrix, si.SeriesRange, options->series,
+              options->coords, options->interpolator);
+  if (seriesReader == NULL)
+    {
+    exit(1);
+    }
+  seriesReader->Delete();
+
+  // only the NIFTI reader provides all of the frames
+  int numberOfFrames = 1;
+#ifdef AIRS_USE_NIFTI
+  vtkNIFTIReader *niftiReader = vtkNIFTIReader::SafeDownCast(seriesReader);
+  if (niftiReader)
+    {
+    numberOfFrames = niftiReader->GetTimeDimension();
+    }
+#endif
+  if (numberOfFrames < 2)
+    {
+    fprintf(stderr, "The --series image must be a 4D NIFTI file with more "
+            "than one frame: %s\n", options->series);
+    return 1;
+    }
+
+  int ref = (options->reference_frame > 0 ?
+             options->reference_frame - 1 : numberOfFrames/2);
+  if (ref >= numberOfFrames)
+    {
+    fprintf(stderr, "The reference frame must be between 1 and %d.\n",
+            numberOfFrames);
+    return 1;
+    }
+
+  // order the frames by their distance from the reference
+  for (int d = 1; d < numberOfFrames; d++)
+    {
+    if (ref - d >= 0)
+      {
+      si.Order.push_back(ref - d);
+      }
+    if (ref + d < numberOfFrames)
+      {
+      si.Order.push_back(ref + d);
+      }
+    }
+
+  // by default, use one job per core, since the frames are usually small
+  int numberOfJobs = static_cast<int>(si.Order.size());
+  int cores = vtkMultiThreader::GetGlobalDefaultNumberOfThreads();
+  int numberOfWorkers = (options->jobs > 0 ? options->jobs : cores);
+  numberOfWorkers = (numberOfWorkers > 1 ? numberOfWorkers : 1);
+  if (numberOfWorkers > numberOfJobs)
+    {
+    numberOfWorkers = numberOfJobs;
+    }
+  int threads = cores/numberOfWorkers;
+
+  register_options frameOptions = *options;
+  frameOptions.series = NULL;
+  frameOptions.silent = 1;
+  frameOptions.threads = (threads > 1 ? threads : 1);
+  frameOptions.outxfm = NULL;
+
+  si.Options = &frameOptions;
+  si.Series = series;
+  si.SeriesMatrix = seriesMatrix;
+  si.SeriesReader = seriesReader;
+  si.ComponentsPerFrame =
+    series->GetNumberOfScalarComponents()/numberOfFrames;
+  si.ComponentsPerFrame =
+    (si.ComponentsPerFrame > 1 ? si.ComponentsPerFrame : 1);
+  si.ReferenceFrame = ref;
+  si.NumberStarted = 0;
+  si.Done.resize(numberOfFrames, 0);
+  si.Results.resize(numberOfFrames);
+  si.Transforms.resize(numberOfFrames);
+  si.Motion.resize(numberOfFrames, 0.0);
+  si.Corrected.resize(numberOfFrames);
+  si.Lock = vtkMutexLock::New();
+
+  // the reference frame is prepared once, and shared by all the frames
+  si.ReferenceImage = vtkSmartPointer<vtkImageData>::New();
+  register_extract_frame(&si, ref, si.ReferenceImage);
+  si.ReferenceCache = register_new_image_cache();
+
+  // the reference frame is done already, with an identity transform
+  double bounds[6], center[4];
+  si.ReferenceImage->GetBounds(bounds);
+  center[0] = 0.5*(bounds[0] + bounds[1]);
+  center[1] = 0.5*(bounds[2] + bounds[3]);
+  center[2] = 0.5*(bounds[4] + bounds[5]);
+  center[3] = 1.0;
+  seriesMatrix->MultiplyPoint(center, center);
+  register_result *refResult = &si.Results[ref];
+  refResult->center[0] = center[0];
+  refResult->center[1] = center[1];
+  refResult->center[2] = center[2];
+  refResult->time = 0.0;
+  refResult->evaluations = 0;
+  refResult->converged = 1;
+  refResult->metric = 0.0;
+  si.Transforms[ref] = vtkSmartPointer<vtkMatrix4x4>::New();
+  si.Corrected[ref] = si.ReferenceImage;
+  si.Done[ref] = 1;
+
+  if (!options->silent)
+    {
+    cout << "Registering " << numberOfJobs << " frames to frame "
+         << (ref + 1) << ", " << numberOfWorkers << " at a time." << endl;
+    }
+
+  vtkSmartPointer<vtkMultiThreader> threader =
+    vtkSmartPointer<vtkMultiThreader>::New();
+  std::vector<int> threadIds;
+  for (int k = 0; k < numberOfWorkers; k++)
+    {
+    threadIds.push_back(threader->SpawnThread(&register_series_worker, &si));
+    }
+  for (size_t k = 0; k < threadIds.size(); k++)
+    {
+    threader->TerminateThread(threadIds[k]);
+    }
+
+  si.Lock->Delete();
+  register_release_image_cache(si.ReferenceCache);
+
+  // write the transforms, and print a summary line for each frame
+  vtkSmartPointer<vtkMatrix4x4> identity =
+    vtkSmartPointer<vtkMatrix4x4>::New();
+  for (int f = 0; f < numberOfFrames; f++)
+    {
+    register_result *result = &si.Results[f];
+    if (pattern)
+      {
+      std::string filename = register_numbered_filename(pattern, f + 1, 0);
+      WriteMatrix(si.Transforms[f], filename.c_str(), result->center);
+      }
+
+    double displacement = register_frame_displacement(
+      si.ReferenceImage, seriesMatrix, identity, si.Transforms[f]);
+    printf("frame %d: %.3fs, %d evaluations, %s, metric %g, "
+           "displacement %.3f mm\n", f + 1, result->time,
+           result->evaluations,
+           (result->converged ? "converged" : "did not converge"),
+           result->metric, displacement);
+    }
+  fflush(stdout);
+
+  // write the corrected series
+  if (options->output)
+    {
+    if (!options->silent)
+      {
+      cout << "Writing corrected series: " << options->output << endl;
+      }
+
+    vtkSmartPointer<vtkImageAppendComponents> append =
+      vtkSmartPointer<vtkImageAppendComponents>::New();
+    for (int f = 0; f < numberOfFrames; f++)
+      {
+      append->ADD_INPUT_DATA(si.Corrected[f]);
+      }
+    append->Update();
+
+    WriteImage(seriesReader, seriesReader, append->GetOutput(),
+               seriesMatrix, options->output, options->coords,
+               options->interpolator);
+    }
+
+  return 0;
+}
+
+#ifndef _WIN32
+// Write all of the data to a socket.  Returns zero on failure.
+int register_write_all(int fd, const char *data, size_t size)
+{
+  while (size > 0)
+    {
+    ssize_t n = write(fd, data, size);
+    if (n < 0 && errno == EINTR)
+      {
+      continue;
+      }
+    if (n <= 0)
+      {
+      return 0;
+      }
+    data += n;
+    size -= n;
+    }
+
+  return 1;
+}
+
+// A job for the --server, which is run in a child process.
+struct register_server_job
+{
+  std::vector<std::string> Args;
+  std::vector<char *> Argv;
+  register_options Options;
+  register_image_store *Store;
+};
+
+// The exit status of register_server_check() if the job can be run.  It
+// is distinct from the status of an exit within register_read_options(),
+// e.g. after "--help".
+enum { ServerJobReady = 100 };
+
+// Check the options, and check the headers of any images that are not in
+// the store.  This is done in a child process before the server reads the
+// images itself, since the program exits if there are errors.  Only the
+// headers are read, so that each new image is only read once in full.
+int register_server_check(register_server_job *job)
+{
+  register_options *options = &job->Options;
+  register_initialize_options(options);
+  register_read_options(static_cast<int>(job->Argv.size()) - 1,
+                        &job->Argv[0], options);
+
+  if (!options->source || !options->target)
+    {
+    register_show_usage(stderr, job->Argv[0]);
+    return 1;
+    }
+  if (options->display || options->screenshot || options->batch ||
+      options->all_pairs || options->server || options->client)
+    {
+    fprintf(stderr, "The --connect option cannot be used with -d, -j, "
+            "--batch, --all-pairs, or --server.\n");
+    return 1;
+    }
+
+  register_resolve_coords(options);
+  const char *filenames[2] = { options->source, options->target };
+  for (int i = 0; i < 2; i++)
+    {
+    std::string filename = vtksys::SystemTools::CollapseFullPath(filenames[i]);
+    if (!register_find_stored_image(job->Store, filename.c_str(), options))
+      {
+      if (!CheckImage(filename.c_str(), options->coords))
+        {
+        return 1;
+        }
+      }
+    }
+
+  return ServerJobReady;
+}
+
+// Run the registration, with the images from the store.
+int register_server_run(register_server_job *job)
+{
+  register_options *options = &job->Options;
+
+  register_input input;
+  register_read_input(options, &input, 0, 0, job->Store);
+
+  register_result result;
+  register_execute(options, &input, &result);
+  register_write_output(options, &input, &result);
+
+  if (!options->silent)
+    {
+    cout << "Done!" << endl;
+    }
+
+  return 0;
+}
+
+// Run one of the above functions in a child process, in the client's
+// directory and with its output going to the client, and wait for it
+// to finish.  Returns the exit status of the child.
+int register_server_fork(
+  int fd, register_server_job *job, int (*func)(register_server_job *))
+{
+  cout.flush();
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid == 0)
+    {
+    dup2(fd, 1);
+    dup2(fd, 2);
+    close(fd);
+    if (chdir(job->Args[0].c_str()) != 0)
+      {
+      fprintf(stderr, "Unable to change to directory %s\n",
+              job->Args[0].c_str());
+      exit(1);
+      }
+    int status = func(job);
+    cout.flush();
+    exit(status);
+    }
+
+  int status = 1;
+  int wstatus = 0;
+  if (pid > 0 && waitpid(pid, &wstatus, 0) == pid && WIFEXITED(wstatus))
+    {
+    status = WEXITSTATUS(wstatus);
+    }
+
+  return status;
+}
+
+// Limits on how long the server waits for a job, and on the size of
+// the job, so that a client cannot keep the server from other clients.
+enum { ServerReceiveTimeout = 10, ServerMaximumRequestSize = 1048576 };
+
+// Read a job from a client, which sends its directory and then its
+// arguments as null-terminated strings, followed by an empty string.
+// Returns zero on failure.
+int register_server_receive(int fd, register_server_job *job)
+{
+  struct timeval timeout;
+  timeout.tv_sec = ServerReceiveTimeout;
+  timeout.tv_usec = 0;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+                 &timeout, sizeof(timeout)) != 0)
+    {
+    return 0;
+    }
+
+  std::string text;
+  char buffer[4096];
+  while (text.size() < 2 ||
+         text[text.size() - 1] != '\0' || text[text.size() - 2] != '\0')
+    {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      {
+      continue;
+      }
+    // this also fails if the timeout expires
+    if (n <= 0)
+      {
+      return 0;
+      }
+    text.append(buffer, n);
+    if (text.size() > ServerMaximumRequestSize)
+      {
+      fprintf(stderr, "Refused a job that was too large.\n");
+      return 0;
+      }
+    }
+
+  size_t pos = 0;
+  while (pos < text.size() - 1)
+    {
+    size_t end = text.find('\0', pos);
+    job->Args.push_back(text.substr(pos, end - pos));
+    pos = end + 1;
+    }
+
+  // the directory and the command name are required
+  if (job->Args.size() < 2)
+    {
+    return 0;
+    }
+
+  for (size_t i = 1; i < job->Args.size(); i++)
+    {
+    job->Argv.push_back(&job->Args[i][0]);
+    }
+  job->Argv.push_back(NULL);
+
+  return 1;
+}
+
+// Check that the socket's directory can only be used by this user, since
+// a client can run a job with the server's privileges.  The directory is
+// created if it does not exist.  Returns zero on failure.
+int register_server_check_directory(const char *path)
+{
+  std::string dir = vtksys::SystemTools::GetFilenamePath(
+    vtksys::SystemTools::CollapseFullPath(path));
+
+  struct stat st;
+  if (lstat(dir.c_str(), &st) != 0)
+    {
+    if (errno != ENOENT || mkdir(dir.c_str(), 0700) != 0 ||
+        lstat(dir.c_str(), &st) != 0)
+      {
+      fprintf(stderr, "Unable to create socket directory %s: %s\n",
+              dir.c_str(), strerror(errno));
+      return 0;
+      }
+    }
+
+  if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() ||
+      (st.st_mode & 077) != 0)
+    {
+    fprintf(stderr, "The socket directory %s must be owned by this user "
+            "and have mode 0700.\n", dir.c_str());
+    return 0;
+    }
+
+  return 1;
+}
+
+// Check that the client is run by the same user as the server.
+int register_server_check_peer(int fd)
+{
+#if defined(SO_PEERCRED)
+  struct ucred cred;
+  socklen_t size = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &size) != 0)
+    {
+    return 0;
+    }
+  uid_t uid = cred.uid;
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) != 0)
+    {
+    return 0;
+    }
+#endif
+
+  return (uid == geteuid());
+}
+
+// Run as a server, doing the registrations that are sent by clients.
+int register_server(register_options *options)
+{
+  const char *path = options->server;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    {
+    fprintf(stderr, "The socket path is too long: %s\n", path);
+    return 1;
+    }
+  strcpy(addr.sun_path, path);
+
+  if (!register_server_check_directory(path))
+    {
+    return 1;
+    }
+
+  // only remove an old socket, never any other kind of file
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+    unlink(path);
+    }
+
+  // the socket is only accessible by this user
+  int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t mask = umask(077);
+  int bound = (sfd >= 0 &&
+               bind(sfd, reinterpret_cast<struct sockaddr *>(&addr),
+                    sizeof(addr)) == 0);
+  umask(mask);
+  if (!bound || chmod(path, 0600) != 0 || listen(sfd, 16) != 0)
+    {
+    fprintf(stderr, "Unable to listen on socket %s: %s\n",
+            path, strerror(errno));
+    return 1;
+    }
+
+  // a client that goes away should not stop the server
+  signal(SIGPIPE, SIG_IGN);
+
+  register_image_store store;
+  store.MaximumNumberOfImages = options->cache_size;
+  store.UseCount = 0;
+
+  if (!options->silent)
+    {
+    cout << "Listening on " << path << endl;
+    }
+
+  for (;;)
+    {
+    int fd = accept(sfd, NULL, NULL);
+    if (fd < 0)
+      {
+      if (errno == EINTR)
+        {
+        continue;
+        }
+      fprintf(stderr, "Unable to accept connection: %s\n", strerror(errno));
+      break;
+      }
+
+    if (!register_server_check_peer(fd))
+      {
+      fprintf(stderr, "Refused a connection from another user.\n");
+      close(fd);
+      continue;
+      }
+
+    register_server_job job;
+    job.Store = &store;
+    if (!register_server_receive(fd, &job))
+      {
+      close(fd);
+      continue;
+      }
+
+    int status = register_server_fork(fd, &job, &register_server_check);
+    if (status == ServerJobReady)
+      {
+      // the check succeeded, so these will also succeed
+      register_options *jobOptions = &job.Options;
+      register_initialize_options(jobOptions);
+      register_read_options(static_cast<int>(job.Argv.size()) - 1,
+                            &job.Argv[0], jobOptions);
+      register_resolve_coords(jobOptions);
+
+      // use full paths, since the server is in a different directory
+      std::string source = vtksys::SystemTools::CollapseFullPath(
+        jobOptions->source, job.Args[0].c_str());
+      std::string target = vtksys::SystemTools::CollapseFullPath(
+        jobOptions->target, job.Args[0].c_str());
+      jobOptions->source = source.c_str();
+      jobOptions->target = target.c_str();
+      // the check only read the headers, so the data might still be bad
+      if (register_store_image(&store, source.c_str(), jobOptions) &&
+          register_store_image(&store, target.c_str(), jobOptions))
+        {
+        status = register_server_fork(fd, &job, &register_server_run);
+        }
+      else
+        {
+        const char *message = "Unable to read the images.\n";
+        register_write_all(fd, message, strlen(message));
+        status = 1;
+        }
+      }
+
+    // the output is followed by a null and the exit status
+    char trailer[2] = { '\0', static_cast<char>(status) };
+    register_write_all(fd, trailer, 2);
+    close(fd);
+    }
+
+  close(sfd);
+  return 1;
+}
+
+// Send the registration to a server.  The output is copied to stdout
+// until the server sends the exit status, which is returned.  Returns
+// -1 if the server cannot be reached.
+int register_client(const char *path, int argc, char *argv[])
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    {
+    return -1;
+    }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+    return -1;
+    }
+  if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+              sizeof(addr)) != 0)
+    {
+    close(fd);
+    return -1;
+    }
+
+  // send the directory and the arguments, except for --connect
+  std::string text = vtksys::SystemTools::GetCurrentWorkingDirectory();
+  text.push_back('\0');
+  for (int i = 0; i < argc; i++)
+    {
+    if (strcmp(argv[i], "--connect") == 0 && i + 1 < argc)
+      {
+      i++;
+      continue;
+      }
+    text.append(argv[i]);
+    text.push_back('\0');
+    }
+  text.push_back('\0');
+
+  signal(SIGPIPE, SIG_IGN);
+  if (!register_write_all(fd, text.data(), text.size()))
+    {
+    close(fd);
+    return -1;
+    }
+
+  int status = 1;
+  bool trailer = false;
+  char buffer[4096];
+  for (;;)
+    {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      {
+      continue;
+      }
+    if (n <= 0)
+      {
+      break;
+      }
+    for (ssize_t i = 0; i < n; i++)
+      {
+      if (trailer)
+        {
+        status = static_cast<unsigned char>(buffer[i]);
+        }
+      else if (buffer[i] == '\0')
+        {
+        trailer = true;
+        }
+      else
+        {
+        fputc(buffer[i], stdout);
+        }
+      }
+    fflush(stdout);
+    }
+
+  close(fd);
+  return status;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+  register_options options;
+  register_initialize_options(&options);
+  register_read_options(argc, argv, &options);
+
+  bool display = (options.display != 0 ||
+                  options.screenshot != 0);
+
+#ifdef AIRS_HEADLESS_PROGRAMS
+  if (display)
+    {
+    fprintf(stderr, "Display and screenshots are not supported by this "
+            "build of %s.\n", argv[0]);
+    return 1;
+    }
+#endif
+
+  if (options.batch)
+    {
+    if (display || options.source || options.target || options.all_pairs)
+      {
+      fprintf(stderr, "The --batch option cannot be used with -d, -j, "
+              "--all-pairs, or image files.\n");
+      return 1;
+      }
+    return register_batch(&options);
+    }
+
+  if (options.all_pairs)
+    {
+    if (display || options.source || options.target ||
+        options.output || options.transforms.size() > 0)
+      {
+      fprintf(stderr, "The --all-pairs option cannot be used with -d, -j, "
+              "initial transforms, output images, or image files.\n");
+      return 1;
+      }
+    return register_all_pairs(&options);
+    }
+
+  if (options.series)
+    {
+    if (display || options.source || options.target ||
+        options.transforms.size() > 0)
+      {
+      fprintf(stderr, "The --series option cannot be used with -d, -j, "
+              "initial transforms, or image files.\n");
+      return 1;
+      }
+    return register_series(&options);
+    }
+
+  if (options.server)
+    {
+    if (display || options.source || options.target || options.client)
+      {
+      fprintf(stderr, "The --server option cannot be used with -d, -j, "
+              "--connect, or image files.\n");
+      return 1;
+      }
+#ifndef _WIN32
+    return register_server(&options);
+#else
+    fprintf(stderr, "The --server option is not supported on Windows.\n");
+    return 1;
+#endif
+    }
+
+  if (!options.source || !options.target)
+    {
+    register_show_usage(stderr, argv[0]);
+    return 1;
+    }
+
+#ifndef _WIN32
+  if (options.client && !display)
+    {
+    int status = register_client(options.client, argc, argv);
+    if (status >= 0)
+      {
+      return status;
+      }
+    if (!options.silent)
+      {
+      cout << "Unable to connect to " << options.client
+           << ", doing the registration locally." << endl;
+      }
+    }
+#endif
+
+  register_input input;
+  register_read_input(&options, &input);
+
+  register_result result;
+  register_execute(&options, &input, &result);
+  register_write_output(&options, &input, &result);
+
+  if (!options.silent)
+    {
+    cout << "Done!" << endl;
+    }
+
+  // -------------------------------------------------------
+  // allow user to interact
+
+#ifndef AIRS_HEADLESS_PROGRAMS
+  if (options.display)
+    {
+    result.interactor->Start();
+    }
+#endif
+
   return 0;
 }
@@ -31,16 +31,6 @@ Module:    skullstrip.cxx
 #include <vtkMINCImageWriter.h>
 #include <vtkDICOMImageReader.h>
 
-#include <vtkRenderer.h>
-#include <vtkCamera.h>
-#include <vtkRenderWindow.h>
-#include <vtkRenderWindowInteractor.h>
-#include <vtkInteractorStyleImage.h>
-#include <vtkImageSlice.h>
-#include <vtkImageStack.h>
-#include <vtkImageResliceMapper.h>
-#include <vtkImageProperty.h>
-#include <vtkWindowToImageFilter.h>
 #include <vtkPNGWriter.h>
 #include <vtkTIFFWriter.h>
 #include <vtkJPEGWriter.h>
@@ -54,6 +44,18 @@ Module:    skullstrip.cxx
 #include <vtksys/SystemTools.hxx>
 
 #include "AIRSConfig.h"
+#ifndef AIRS_HEADLESS_PROGRAMS
+#include <vtkRenderer.h>
+#include <vtkCamera.h>
+#include <vtkRenderWindow.h>
+#include <vtkRenderWindowInteractor.h>
+#include <vtkInteractorStyleImage.h>
+#include <vtkImageSlice.h>
+#include <vtkImageStack.h>
+#include <vtkImageResliceMapper.h>
+#include <vtkImageProperty.h>
+#include <vtkWindowToImageFilter.h>
+#endif
 #include "vtkImageMRIBrainExtractor.h"
 
 // optional readers
@@ -693,6 +695,7 @@ void WriteMesh(vtkPolyData *mesh, vtkMatrix4x4 *matrix,
     }
 }
 
+#ifndef AIRS_HEADLESS_PROGRAMS
 void SetViewFromMatrix(
   vtkRenderer *renderer,
   vtkInteractorStyleImage *istyle,
@@ -716,6 +719,7 @@ void SetViewFromMatrix(
 
   istyle->SetImageOrientation(viewRight, viewUp);
 }
+#endif
 
 // a class to look for errors when reading transforms.
 class ErrorObserver : public vtkCommand
@@ -736,6 +740,7 @@ void ErrorObserver::Execute(
   exit(1);
 }
 
+#ifndef AIRS_HEADLESS_PROGRAMS
 void WriteScreenshot(vtkWindow *window, const char *filename)
 {
   vtkSmartPointer<vtkWindowToImageFilter> snap =
@@ -771,6 +776,7 @@ void WriteScreenshot(vtkWindow *window, const char *filename)
     snapWriter->Write();
     }
 }
+#endif
 
 void ComputeRange(vtkImageData *image, double range[2])
 {
@@ -1159,6 +1165,15 @@ int main(int argc, char *argv[])
   bool display = (options.display != 0 ||
                   options.screenshot != 0);
 
+#ifdef AIRS_HEADLESS_PROGRAMS
+  if (display)
+    {
+    fprintf(stderr, "Display and screenshots are not supported by this "
+            "build of %s.\n", argv[0]);
+    return 1;
+    }
+#endif
+
   if (!sourcefile)
     {
     skullstrip_show_usage(stderr, argv[0]);
@@ -1271,121 +1286,127 @@ int main(int argc, char *argv[])
   double lastTime = timer->GetUniversalTime();
 
   // -------------------------------------------------------
-  // display the images
-
-  vtkSmartPointer<vtkRenderWindow> renderWindow =
-    vtkSmartPointer<vtkRenderWindow>::New();
-  vtkSmartPointer<vtkRenderer> renderer =
-    vtkSmartPointer<vtkRenderer>::New();
-  vtkSmartPointer<vtkRenderWindowInteractor> interactor =
-    vtkSmartPointer<vtkRenderWindowInteractor>::New();
-  vtkSmartPointer<vtkInteractorStyleImage> istyle =
-    vtkSmartPointer<vtkInteractorStyleImage>::New();
-
-  istyle->SetInteractionModeToImageSlicing();
-  interactor->SetInteractorStyle(istyle);
-  renderWindow->SetInteractor(interactor);
-  renderWindow->AddRenderer(renderer);
-
-  vtkSmartPointer<vtkImageSlice> sourceActor =
-    vtkSmartPointer<vtkImageSlice>::New();
-  vtkSmartPointer<vtkImageResliceMapper> sourceMapper =
-    vtkSmartPointer<vtkImageResliceMapper>::New();
-  vtkSmartPointer<vtkImageProperty> sourceProperty =
-    vtkSmartPointer<vtkImageProperty>::New();
-
-  sourceMapper->SET_INPUT_DATA(sourceImage);
-  sourceMapper->SliceAtFocalPointOn();
-  sourceMapper->SliceFacesCameraOn();
-  sourceMapper->ResampleToScreenPixelsOff();
-
-  double sourceRange[2];
-  sourceImage->GetScalarRange(sourceRange);
-  ComputeRange(sourceImage, sourceRange);
-
-  sourceProperty->SetInterpolationTypeToLinear();
-  sourceProperty->SetColorWindow((sourceRange[1]-sourceRange[0]));
-  sourceProperty->SetColorLevel(0.5*(sourceRange[0]+sourceRange[1]));
-
-  sourceActor->SetMapper(sourceMapper);
-  sourceActor->SetProperty(sourceProperty);
-  sourceActor->SetUserMatrix(sourceMatrix);
-
-  vtkSmartPointer<vtkImageSlice> brainActor =
-    vtkSmartPointer<vtkImageSlice>::New();
-  vtkSmartPointer<vtkImageResliceMapper> brainMapper =
-    vtkSmartPointer<vtkImageResliceMapper>::New();
-  vtkSmartPointer<vtkImageProperty> brainProperty =
-    vtkSmartPointer<vtkImageProperty>::New();
-  vtkSmartPointer<vtkLookupTable> brainTable =
-    vtkSmartPointer<vtkLookupTable>::New();
-
-  brainMapper->SET_INPUT_DATA(stripper->GetOutput());
-  brainMapper->SliceAtFocalPointOn();
-  brainMapper->SliceFacesCameraOn();
-  brainMapper->ResampleToScreenPixelsOff();
-
-  brainTable->SetRampToLinear();
-  brainTable->SetHueRange(0.0, 0.0);
-  brainTable->SetSaturationRange(1.0, 1.0);
-  brainTable->SetValueRange(0.0, 1.0);
-  brainTable->Build();
-  brainTable->SetTableValue(0, 0.0, 0.0, 0.0, 0.0);
-
-  brainProperty->SetInterpolationTypeToLinear();
-  brainProperty->SetColorWindow((sourceRange[1]-sourceRange[0]));
-  brainProperty->SetColorLevel(0.5*(sourceRange[0]+sourceRange[1]));
-  brainProperty->SetLookupTable(brainTable);
-
-  brainActor->SetMapper(brainMapper);
-  brainActor->SetProperty(brainProperty);
-  brainActor->SetUserMatrix(sourceMatrix);
-
-  vtkSmartPointer<vtkImageStack> imageStack =
-    vtkSmartPointer<vtkImageStack>::New();
-  imageStack->AddImage(sourceActor);
-  imageStack->AddImage(brainActor);
-
-  renderer->AddViewProp(imageStack);
-  renderer->SetBackground(0,0,0);
-
-  renderWindow->SetSize(512,512);
-
-  double bounds[6], center[4], tspacing[3];
-  int extent[6];
-  sourceImage->GetBounds(bounds);
-  sourceImage->GetExtent(extent);
-  sourceImage->GetSpacing(tspacing);
-  center[0] = 0.5*(bounds[0] + bounds[1]);
-  center[1] = 0.5*(bounds[2] + bounds[3]);
-  center[2] = 0.5*(bounds[4] + bounds[5]);
-  center[3] = 1.0;
-  sourceMatrix->MultiplyPoint(center, center);
-
-  vtkCamera *camera = renderer->GetActiveCamera();
-  renderer->ResetCamera();
-  camera->SetFocalPoint(center);
-  camera->ParallelProjectionOn();
-  camera->SetParallelScale(0.5*(bounds[3] - bounds[2]));
-  SetViewFromMatrix(renderer, istyle, sourceMatrix, options.coords);
-  renderer->ResetCameraClippingRange();
+  // display the images, the rendering objects are only created if
+  // the images will be displayed or a screenshot will be taken
+
+#ifndef AIRS_HEADLESS_PROGRAMS
+  vtkSmartPointer<vtkRenderWindow> renderWindow;
+  vtkSmartPointer<vtkRenderWindowInteractor> interactor;
 
   if (display)
     {
+    renderWindow = vtkSmartPointer<vtkRenderWindow>::New();
+    vtkSmartPointer<vtkRenderer> renderer =
+      vtkSmartPointer<vtkRenderer>::New();
+    interactor = vtkSmartPointer<vtkRenderWindowInteractor>::New();
+    vtkSmartPointer<vtkInteractorStyleImage> istyle =
+      vtkSmartPointer<vtkInteractorStyleImage>::New();
+
+    istyle->SetInteractionModeToImageSlicing();
+    interactor->SetInteractorStyle(istyle);
+    renderWindow->SetInteractor(interactor);
+    renderWindow->AddRenderer(renderer);
+
+    vtkSmartPointer<vtkImageSlice> sourceActor =
+      vtkSmartPointer<vtkImageSlice>::New();
+    vtkSmartPointer<vtkImageResliceMapper> sourceMapper =
+      vtkSmartPointer<vtkImageResliceMapper>::New();
+    vtkSmartPointer<vtkImageProperty> sourceProperty =
+      vtkSmartPointer<vtkImageProperty>::New();
+
+    sourceMapper->SET_INPUT_DATA(sourceImage);
+    sourceMapper->SliceAtFocalPointOn();
+    sourceMapper->SliceFacesCameraOn();
+    sourceMapper->ResampleToScreenPixelsOff();
+
+    double sourceRange[2];
+    sourceImage->GetScalarRange(sourceRange);
+    ComputeRange(sourceImage, sourceRange);
+
+    sourceProperty->SetInterpolationTypeToLinear();
+    sourceProperty->SetColorWindow((sourceRange[1]-sourceRange[0]));
+    sourceProperty->SetColorLevel(0.5*(sourceRange[0]+sourceRange[1]));
+
+    sourceActor->SetMapper(sourceMapper);
+    sourceActor->SetProperty(sourceProperty);
+    sourceActor->SetUserMatrix(sourceMatrix);
+
+    vtkSmartPointer<vtkImageSlice> brainActor =
+      vtkSmartPointer<vtkImageSlice>::New();
+    vtkSmartPointer<vtkImageResliceMapper> brainMapper =
+      vtkSmartPointer<vtkImageResliceMapper>::New();
+    vtkSmartPointer<vtkImageProperty> brainProperty =
+      vtkSmartPointer<vtkImageProperty>::New();
+    vtkSmartPointer<vtkLookupTable> brainTable =
+      vtkSmartPointer<vtkLookupTable>::New();
+
+    brainMapper->SET_INPUT_DATA(stripper->GetOutput());
+    brainMapper->SliceAtFocalPointOn();
+    brainMapper->SliceFacesCameraOn();
+    brainMapper->ResampleToScreenPixelsOff();
+
+    brainTable->SetRampToLinear();
+    brainTable->SetHueRange(0.0, 0.0);
+    brainTable->SetSaturationRange(1.0, 1.0);
+    brainTable->SetValueRange(0.0, 1.0);
+    brainTable->Build();
+    brainTable->SetTableValue(0, 0.0, 0.0, 0.0, 0.0);
+
+    brainProperty->SetInterpolationTypeToLinear();
+    brainProperty->SetColorWindow((sourceRange[1]-sourceRange[0]));
+    brainProperty->SetColorLevel(0.5*(sourceRange[0]+sourceRange[1]));
+    brainProperty->SetLookupTable(brainTable);
+
+    brainActor->SetMapper(brainMapper);
+    brainActor->SetProperty(brainProperty);
+    brainActor->SetUserMatrix(sourceMatrix);
+
+    vtkSmartPointer<vtkImageStack> imageStack =
+      vtkSmartPointer<vtkImageStack>::New();
+    imageStack->AddImage(sourceActor);
+    imageStack->AddImage(brainActor);
+
+    renderer->AddViewProp(imageStack);
+    renderer->SetBackground(0,0,0);
+
+    renderWindow->SetSize(512,512);
+
+    double bounds[6], center[4], tspacing[3];
+    int extent[6];
+    sourceImage->GetBounds(bounds);
+    sourceImage->GetExtent(extent);
+    sourceImage->GetSpacing(tspacing);
+    center[0] = 0.5*(bounds[0] + bounds[1]);
+    center[1] = 0.5*(bounds[2] + bounds[3]);
+    center[2] = 0.5*(bounds[4] + bounds[5]);
+    center[3] = 1.0;
+    sourceMatrix->MultiplyPoint(center, center);
+
+    vtkCamera *camera = renderer->GetActiveCamera();
+    renderer->ResetCamera();
+    camera->SetFocalPoint(center);
+    camera->ParallelProjectionOn();
+    camera->SetParallelScale(0.5*(bounds[3] - bounds[2]));
+    SetViewFromMatrix(renderer, istyle, sourceMatrix, options.coords);
+    renderer->ResetCameraClippingRange();
+
     renderWindow->Render();
     }
+#endif
 
   if (!options.silent)
     {
     cout << "stripping took " << (lastTime - startTime) << "s" << endl;
     }
 
+#ifndef AIRS_HEADLESS_PROGRAMS
   // -------------------------------------------------------
   // capture a screen shot
   if (options.screenshot)
     {
     WriteScreenshot(renderWindow, options.screenshot);
     }
+#endif
 
   // -------------------------------------------------------
   // write the output file
@@ -1417,10 +1438,12 @@ int main(int argc, char *argv[])
   // -------------------------------------------------------
   // allow user to interact
 
+#ifndef AIRS_HEADLESS_PROGRAMS
   if (options.display)
     {
     interactor->Start();
     }
+#endif
 
   return 0;
 }
@@ -0,0 +1,226 @@
+/*=========================================================================
+
+  Program:   Atamai Image Registration and Segmentation
+  Module:    TestImagePiecewiseRegistration.cxx
+
+  This software is distributed WITHOUT ANY WARRANTY; without even
+  the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+// Test the vtkImagePiecewiseRegistration class
+//
+// The source has two textured balls, each with its own label, and in the
+// target each ball has been moved by a different amount.  The test checks
+// the extents to which the images were cropped for each label, and that
+// each label's registration recovers the motion of its ball.
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkLinearTransform.h>
+#include <vtkMatrix4x4.h>
+#include <vtkVersion.h>
+
+#include "AIRSConfig.h"
+#include "vtkImageRegistration.h"
+#include "vtkImagePiecewiseRegistration.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+// The balls, each with a label, a center, a radius, and a shift
+struct TestBall
+{
+  int Label;
+  int Center[3];
+  int Radius;
+  double Shift[3];
+};
+
+const int NumberOfBalls = 2;
+const TestBall Balls[NumberOfBalls] = {
+  { 1, { 20, 32, 24 }, 10, { 2.0, -1.5, 1.0 } },
+  { 2, { 44, 32, 24 }, 10, { -1.0, 2.0, -2.0 } }
+};
+
+const int WholeExtent[6] = { 0, 63, 0, 63, 0, 47 };
+
+// A smooth texture, so that the registration has something to follow
+double Texture(double x, double y, double z)
+{
+  return 100.0 + 50.0*sin(x/3.0)*cos(y/4.0)*sin(z/5.0 + 0.5);
+}
+
+// Check whether a point is within a ball, after the ball is shifted
+bool InBall(const TestBall& ball, const double shift[3], const double p[3])
+{
+  double r2 = 0.0;
+  for (int i = 0; i < 3; i++)
+    {
+    double d = p[i] - shift[i] - ball.Center[i];
+    r2 += d*d;
+    }
+  return (r2 <= ball.Radius*ball.Radius);
+}
+
+// Create a float image or an unsigned char image with WholeExtent
+void AllocateImage(vtkImageData *image, int scalarType)
+{
+  image->SetExtent(const_cast<int *>(WholeExtent));
+  image->SetSpacing(1.0, 1.0, 1.0);
+  image->SetOrigin(0.0, 0.0, 0.0);
+#if VTK_MAJOR_VERSION >= 6
+  image->AllocateScalars(scalarType, 1);
+#else
+  image->SetScalarType(scalarType);
+  image->SetNumberOfScalarComponents(1);
+  image->AllocateScalars();
+#endif
+}
+
+// Fill the images.  If "moved" is set, then each ball is shifted.
+void FillImages(vtkImageData *image, vtkImageData *labels, bool moved)
+{
+  const double noShift[3] = { 0.0, 0.0, 0.0 };
+  for (int k = WholeExtent[4]; k <= WholeExtent[5]; k++)
+    {
+    for (int j = WholeExtent[2]; j <= WholeExtent[3]; j++)
+      {
+      for (int i = WholeExtent[0]; i <= WholeExtent[1]; i++)
+        {
+        double p[3] = { static_cast<double>(i), static_cast<double>(j),
+                        static_cast<double>(k) };
+        float v = 0.0f;
+        unsigned char l = 0;
+        for (int b = 0; b < NumberOfBalls; b++)
+          {
+          const double *shift = (moved ? Balls[b].Shift : noShift);
+          if (InBall(Balls[b], shift, p))
+            {
+            v = static_cast<float>(
+              Texture(p[0] - shift[0], p[1] - shift[1], p[2] - shift[2]));
+            l = static_cast<unsigned char>(Balls[b].Label);
+            }
+          }
+        *static_cast<float *>(image->GetScalarPointer(i, j, k)) = v;
+        if (labels)
+          {
+          *static_cast<unsigned char *>(labels->GetScalarPointer(i, j, k)) =
+            l;
+          }
+        }
+      }
+    }
+}
+
+} // end anonymous namespace
+
+int main(int, char *[])
+{
+  vtkSmartPointer<vtkImageData> source =
+    vtkSmartPointer<vtkImageData>::New();
+  vtkSmartPointer<vtkImageData> target =
+    vtkSmartPointer<vtkImageData>::New();
+  vtkSmartPointer<vtkImageData> labels =
+    vtkSmartPointer<vtkImageData>::New();
+  AllocateImage(source, VTK_FLOAT);
+  AllocateImage(target, VTK_FLOAT);
+  AllocateImage(labels, VTK_UNSIGNED_CHAR);
+  FillImages(source, labels, false);
+  FillImages(target, NULL, true);
+
+  vtkSmartPointer<vtkImageRegistration> settings =
+    vtkSmartPointer<vtkImageRegistration>::New();
+  settings->SetMetricTypeToSquaredDifference();
+  settings->SetOptimizerTypeToPowell();
+  settings->SetInterpolatorTypeToLinear();
+  settings->SetTransformTypeToRigid();
+  settings->SetInitializerTypeToNone();
+  settings->SetMetricTolerance(1e-6);
+  settings->SetTransformTolerance(1e-3);
+  settings->SetMaximumNumberOfIterations(500);
+
+  const double cropMargin = 4.0;
+  vtkSmartPointer<vtkImagePiecewiseRegistration> piecewise =
+    vtkSmartPointer<vtkImagePiecewiseRegistration>::New();
+  piecewise->SetSourceImage(source);
+  piecewise->SetTargetImage(target);
+  piecewise->SetLabelImage(labels);
+  piecewise->SetRegistration(settings);
+  piecewise->SetCropMargin(cropMargin);
+  piecewise->Register(NULL);
+
+  int success = 1;
+  if (piecewise->GetNumberOfLabels() != NumberOfBalls)
+    {
+    fprintf(stderr, "Found %d labels, expected %d\n",
+            piecewise->GetNumberOfLabels(), NumberOfBalls);
+    return EXIT_FAILURE;
+    }
+
+  for (int b = 0; b < NumberOfBalls; b++)
+    {
+    const TestBall& ball = Balls[b];
+    if (piecewise->GetLabel(b) != ball.Label)
+      {
+      fprintf(stderr, "Label %d is %d, expected %d\n",
+              b, piecewise->GetLabel(b), ball.Label);
+      success = 0;
+      continue;
+      }
+
+    // the source is cropped to the ball, and the target is cropped to
+    // the ball plus the margin
+    int sourceExtent[6], targetExtent[6];
+    piecewise->GetSourceExtent(b, sourceExtent);
+    piecewise->GetTargetExtent(b, targetExtent);
+    for (int i = 0; i < 6; i++)
+      {
+      int sign = ((i & 1) ? 1 : -1);
+      int expected = ball.Center[i/2] + sign*ball.Radius;
+      if (sourceExtent[i] != expected)
+        {
+        fprintf(stderr, "Label %d: source extent[%d] is %d, expected %d\n",
+                ball.Label, i, sourceExtent[i], expected);
+        success = 0;
+        }
+      expected += sign*static_cast<int>(cropMargin);
+      if (i & 1)
+        {
+        expected = (expected < WholeExtent[i] ? expected : WholeExtent[i]);
+        }
+      else
+        {
+        expected = (expected > WholeExtent[i] ? expected : WholeExtent[i]);
+        }
+      if (targetExtent[i] != expected)
+        {
+        fprintf(stderr, "Label %d: target extent[%d] is %d, expected %d\n",
+                ball.Label, i, targetExtent[i], expected);
+        success = 0;
+        }
+      }
+
+    // the transform maps source coordinates to target coordinates, so
+    // its translation is the shift of the ball
+    vtkMatrix4x4 *matrix = piecewise->GetTransform(b)->GetMatrix();
+    printf("Label %d: translation %g %g %g, metric %g\n", ball.Label,
+           matrix->GetElement(0, 3), matrix->GetElement(1, 3),
+           matrix->GetElement(2, 3), piecewise->GetMetricValue(b));
+    for (int i = 0; i < 3; i++)
+      {
+      double t = matrix->GetElement(i, 3);
+      if (fabs(t - ball.Shift[i]) > 0.2)
+        {
+        fprintf(stderr, "Label %d: translation[%d] is %g, expected %g\n",
+                ball.Label, i, t, ball.Shift[i]);
+        success = 0;
+        }
+      }
+    }
+
+  return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,250 @@
+/*=========================================================================
+
+  Program:   Atamai Image Registration and Segmentation
+  Module:    TestImageRegistrationSampleBuffer.cxx
+
+  This software is distributed WITHOUT ANY WARRANTY; without even
+  the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+// Test the sample buffer that vtkImageRegistration uses for the metrics
+//
+// Each metric is computed with the sample buffer and with vtkImageReslice
+// and the metric filters, at several fixed transforms, and the values
+// must agree.  Since the vtkImageReslice path ignores the target stencil,
+// the runs with a target stencil use whole-voxel translations, for which
+// the target stencil is the same as a shifted source stencil, and the
+// vtkImageReslice path is given that source stencil instead.
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkImageStencilData.h>
+#include <vtkMatrix4x4.h>
+#include <vtkTransform.h>
+#include <vtkVersion.h>
+
+#include "AIRSConfig.h"
+#include "vtkImageRegistration.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+const int WholeExtent[6] = { 0, 47, 0, 47, 0, 35 };
+
+// The stencils are boxes of voxels.  The source box leaves a margin, so
+// that every transform keeps the samples well within the target.
+const int SourceBox[6] = { 8, 39, 8, 39, 6, 29 };
+const int TargetBox[6] = { 12, 41, 5, 33, 9, 31 };
+
+// The metrics to compare
+const int NumberOfMetrics = 6;
+const int Metrics[NumberOfMetrics] = {
+  vtkImageRegistration::SquaredDifference,
+  vtkImageRegistration::CrossCorrelation,
+  vtkImageRegistration::NormalizedCrossCorrelation,
+  vtkImageRegistration::CorrelationRatio,
+  vtkImageRegistration::MutualInformation,
+  vtkImageRegistration::NormalizedMutualInformation
+};
+const char *MetricNames[NumberOfMetrics] = {
+  "SD", "CC", "NCC", "CR", "MI", "NMI"
+};
+
+// A smooth texture for the images
+double Texture(double x, double y, double z)
+{
+  return 100.0 + 40.0*sin(x/3.0)*cos(y/4.0) + 20.0*sin(z/5.0 + 0.3*x);
+}
+
+// Create a float image with WholeExtent
+void AllocateImage(vtkImageData *image)
+{
+  image->SetExtent(const_cast<int *>(WholeExtent));
+  image->SetSpacing(1.0, 1.0, 1.0);
+  image->SetOrigin(0.0, 0.0, 0.0);
+#if VTK_MAJOR_VERSION >= 6
+  image->AllocateScalars(VTK_FLOAT, 1);
+#else
+  image->SetScalarType(VTK_FLOAT);
+  image->SetNumberOfScalarComponents(1);
+  image->AllocateScalars();
+#endif
+}
+
+// Fill the images, with a target that is shifted and rescaled so that
+// none of the metrics are at their minimum
+void FillImages(vtkImageData *source, vtkImageData *target)
+{
+  for (int k = WholeExtent[4]; k <= WholeExtent[5]; k++)
+    {
+    for (int j = WholeExtent[2]; j <= WholeExtent[3]; j++)
+      {
+      for (int i = WholeExtent[0]; i <= WholeExtent[1]; i++)
+        {
+        *static_cast<float *>(source->GetScalarPointer(i, j, k)) =
+          static_cast<float>(Texture(i, j, k));
+        *static_cast<float *>(target->GetScalarPointer(i, j, k)) =
+          static_cast<float>(2.0*Texture(i - 1.3, j + 0.7, k - 0.4) + 10.0);
+        }
+      }
+    }
+}
+
+// Create a stencil for a box of voxels
+vtkSmartPointer<vtkImageStencilData> MakeStencil(const int box[6])
+{
+  vtkSmartPointer<vtkImageStencilData> stencil =
+    vtkSmartPointer<vtkImageStencilData>::New();
+  stencil->SetExtent(const_cast<int *>(WholeExtent));
+  stencil->SetSpacing(1.0, 1.0, 1.0);
+  stencil->SetOrigin(0.0, 0.0, 0.0);
+  stencil->AllocateExtents();
+  for (int k = box[4]; k <= box[5]; k++)
+    {
+    for (int j = box[2]; j <= box[3]; j++)
+      {
+      stencil->InsertNextExtent(box[0], box[1], j, k);
+      }
+    }
+  return stencil;
+}
+
+// Compute one metric at one transform
+double ComputeMetric(
+  vtkImageData *source, vtkImageData *target,
+  vtkImageStencilData *sourceStencil, vtkImageStencilData *targetStencil,
+  int metric, int useSampleBuffer, vtkMatrix4x4 *matrix)
+{
+  vtkSmartPointer<vtkImageRegistration> registration =
+    vtkSmartPointer<vtkImageRegistration>::New();
+  registration->SetSourceImage(source);
+  registration->SetTargetImage(target);
+  registration->SetSourceImageStencil(sourceStencil);
+  if (targetStencil)
+    {
+    registration->SetTargetImageStencil(targetStencil);
+    }
+  registration->SetMetricType(metric);
+  registration->SetInterpolatorTypeToLinear();
+  registration->SetTransformTypeToRigid();
+  registration->SetInitializerTypeToNone();
+  registration->SetOptimizerTypeToPowell();
+  // the ranges must not depend on the stencils
+  registration->SetSourceImageRange(source->GetScalarRange());
+  registration->SetTargetImageRange(target->GetScalarRange());
+  registration->SetUseSampleBuffer(useSampleBuffer);
+  registration->Initialize(NULL);
+
+  return registration->EvaluateMetric(matrix);
+}
+
+// Compare the two paths for all of the metrics.  Returns zero on failure.
+int CompareMetrics(
+  vtkImageData *source, vtkImageData *target,
+  vtkImageStencilData *sourceStencil, vtkImageStencilData *targetStencil,
+  vtkImageStencilData *resliceStencil, vtkMatrix4x4 *matrix,
+  const char *description)
+{
+  int success = 1;
+  for (int m = 0; m < NumberOfMetrics; m++)
+    {
+    double bufferValue = ComputeMetric(
+      source, target, sourceStencil, targetStencil, Metrics[m], 1, matrix);
+    double resliceValue = ComputeMetric(
+      source, target, resliceStencil, NULL, Metrics[m], 0, matrix);
+
+    printf("%s, %s: %.10g %.10g\n", description, MetricNames[m],
+           bufferValue, resliceValue);
+
+    // the sample buffer keeps the interpolated values at double precision,
+    // so a few values might fall into different histogram bins
+    double a = fabs(bufferValue);
+    double b = fabs(resliceValue);
+    double tol = 1e-3*(a > b ? a : b) + 1e-6;
+    if (bufferValue == VTK_DOUBLE_MAX || resliceValue == VTK_DOUBLE_MAX ||
+        fabs(bufferValue - resliceValue) > tol)
+      {
+      fprintf(stderr, "%s, %s: sample buffer gives %.10g, "
+              "vtkImageReslice gives %.10g\n", description, MetricNames[m],
+              bufferValue, resliceValue);
+      success = 0;
+      }
+    }
+
+  return success;
+}
+
+} // end anonymous namespace
+
+int main(int, char *[])
+{
+  vtkSmartPointer<vtkImageData> source =
+    vtkSmartPointer<vtkImageData>::New();
+  vtkSmartPointer<vtkImageData> target =
+    vtkSmartPointer<vtkImageData>::New();
+  AllocateImage(source);
+  AllocateImage(target);
+  FillImages(source, target);
+
+  vtkSmartPointer<vtkImageStencilData> sourceStencil =
+    MakeStencil(SourceBox);
+  vtkSmartPointer<vtkImageStencilData> targetStencil =
+    MakeStencil(TargetBox);
+
+  int success = 1;
+
+  // with a source stencil: the identity, a translation, and a rotation
+  // about the center with a translation
+  const double center[3] = { 23.5, 23.5, 17.5 };
+  vtkSmartPointer<vtkTransform> transform =
+    vtkSmartPointer<vtkTransform>::New();
+  transform->PostMultiply();
+  success &= CompareMetrics(source, target, sourceStencil, NULL,
+                            sourceStencil, transform->GetMatrix(),
+                            "identity");
+  transform->Translate(1.5, -2.25, 0.75);
+  success &= CompareMetrics(source, target, sourceStencil, NULL,
+                            sourceStencil, transform->GetMatrix(),
+                            "translation");
+  transform->Identity();
+  transform->Translate(-center[0], -center[1], -center[2]);
+  transform->RotateZ(5.0);
+  transform->RotateX(3.0);
+  transform->Translate(center[0] + 0.5, center[1] + 1.0, center[2] - 0.5);
+  success &= CompareMetrics(source, target, sourceStencil, NULL,
+                            sourceStencil, transform->GetMatrix(),
+                            "rotation");
+
+  // with a target stencil: whole-voxel translations, for which the
+  // equivalent source stencil is the source box intersected with the
+  // target box after it is shifted back into the source
+  const int shifts[2][3] = { { 0, 0, 0 }, { 2, -3, 1 } };
+  for (int s = 0; s < 2; s++)
+    {
+    int box[6];
+    for (int i = 0; i < 3; i++)
+      {
+      int lo = TargetBox[2*i] - shifts[s][i];
+      int hi = TargetBox[2*i + 1] - shifts[s][i];
+      box[2*i] = (lo > SourceBox[2*i] ? lo : SourceBox[2*i]);
+      box[2*i + 1] = (hi < SourceBox[2*i + 1] ? hi : SourceBox[2*i + 1]);
+      }
+
+    vtkSmartPointer<vtkMatrix4x4> matrix =
+      vtkSmartPointer<vtkMatrix4x4>::New();
+    for (int i = 0; i < 3; i++)
+      {
+      matrix->SetElement(i, 3, shifts[s][i]);
+      }
+    success &= CompareMetrics(source, target, sourceStencil, targetStencil,
+                              MakeStencil(box), matrix,
+                              (s == 0 ? "target stencil, identity" :
+                               "target stencil, translation"));
+    }
+
+  return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,181 @@
+/*=========================================================================
+
+  Program:   Atamai Image Registration and Segmentation
+  Module:    TestMinimizers.cxx
+
+  This software is distributed WITHOUT ANY WARRANTY; without even
+  the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+  PURPOSE.  See the above copyright notice for more information.
+
+=========================================================================*/
+// Test the minimizers on functions with known minima
+//
+// The simplex, CMA-ES, and trust region minimizers must each find the
+// minimum of a quadratic function and of a rotated Rosenbrock function,
+// without exceeding a fixed number of function evaluations.
+
+#include <vtkSmartPointer.h>
+
+#include "AIRSConfig.h"
+#include "vtkSimplexMinimizer.h"
+#include "vtkCMAESMinimizer.h"
+#include "vtkTrustRegionMinimizer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+
+// The functions to minimize
+enum { Quadratic, Rosenbrock };
+
+struct TestFunctionInfo
+{
+  vtkPowellMinimizer *Minimizer;
+  int Function;
+};
+
+// The rotation that is applied to the Rosenbrock function
+const double RotationCos = 0.8;
+const double RotationSin = 0.6;
+
+// The center of the quadratic function
+const double QuadraticCenter[3] = { 1.5, -2.0, 0.5 };
+
+// A quadratic with a minimum value of 1 at QuadraticCenter, whose axes
+// are not aligned with the parameters
+double EvaluateQuadratic(const double x[3])
+{
+  double d[3];
+  for (int i = 0; i < 3; i++)
+    {
+    d[i] = x[i] - QuadraticCenter[i];
+    }
+  return (1.0 + d[0]*d[0] + 4.0*d[1]*d[1] + 9.0*d[2]*d[2] +
+          2.0*d[0]*d[1] - 2.0*d[1]*d[2]);
+}
+
+// The Rosenbrock function, plus 1, after rotating the parameters
+double EvaluateRosenbrock(const double x[2])
+{
+  double u = RotationCos*x[0] - RotationSin*x[1];
+  double v = RotationSin*x[0] + RotationCos*x[1];
+  return 1.0 + 100.0*(v - u*u)*(v - u*u) + (1.0 - u)*(1.0 - u);
+}
+
+void TestFunction(void *arg)
+{
+  TestFunctionInfo *info = static_cast<TestFunctionInfo *>(arg);
+  vtkPowellMinimizer *minimizer = info->Minimizer;
+
+  double x[3];
+  int n = minimizer->GetNumberOfParameters();
+  for (int i = 0; i < n; i++)
+    {
+    x[i] = minimizer->GetParameterValue(i);
+    }
+
+  if (info->Function == Quadratic)
+    {
+    minimizer->SetFunctionValue(EvaluateQuadratic(x));
+    }
+  else
+    {
+    minimizer->SetFunctionValue(EvaluateRosenbrock(x));
+    }
+}
+
+// Run one minimizer on one function, and check the result.  Returns
+// zero on failure.
+int TestMinimizer(
+  vtkPowellMinimizer *minimizer, const char *name, int function,
+  int maxEvaluations)
+{
+  TestFunctionInfo info;
+  info.Minimizer = minimizer;
+  info.Function = function;
+
+  // the expected minimum
+  int n = 3;
+  double expected[3];
+  double start[3] = { 0.0, 0.0, 0.0 };
+  if (function == Quadratic)
+    {
+    for (int i = 0; i < 3; i++)
+      {
+      expected[i] = QuadraticCenter[i];
+      }
+    }
+  else
+    {
+    // rotate (1,1), the minimum of the unrotated function, backwards
+    n = 2;
+    expected[0] = RotationCos + RotationSin;
+    expected[1] = RotationCos - RotationSin;
+    start[0] = -1.0;
+    start[1] = 1.0;
+    }
+
+  minimizer->Initialize();
+  minimizer->SetFunction(&TestFunction, &info);
+  for (int i = 0; i < n; i++)
+    {
+    minimizer->SetParameterValue(i, start[i]);
+    minimizer->SetParameterScale(i, 0.5);
+    }
+  minimizer->SetTolerance(1e-12);
+  minimizer->SetParameterTolerance(1e-6);
+  // every iteration needs at least one evaluation
+  minimizer->SetMaxIterations(maxEvaluations);
+  minimizer->Minimize();
+
+  const char *functionName =
+    (function == Quadratic ? "quadratic" : "rotated Rosenbrock");
+  int evaluations = minimizer->GetFunctionEvaluations();
+  printf("%s, %s: %d evaluations, value %.10g\n",
+         name, functionName, evaluations, minimizer->GetFunctionValue());
+
+  int success = 1;
+  for (int i = 0; i < n; i++)
+    {
+    double x = minimizer->GetParameterValue(i);
+    if (fabs(x - expected[i]) > 1e-3)
+      {
+      fprintf(stderr, "%s, %s: parameter %d is %g, expected %g\n",
+              name, functionName, i, x, expected[i]);
+      success = 0;
+      }
+    }
+  if (evaluations > maxEvaluations)
+    {
+    fprintf(stderr, "%s, %s: %d evaluations, expected at most %d\n",
+            name, functionName, evaluations, maxEvaluations);
+    success = 0;
+    }
+
+  return success;
+}
+
+} // end anonymous namespace
+
+int main(int, char *[])
+{
+  vtkSmartPointer<vtkSimplexMinimizer> simplex =
+    vtkSmartPointer<vtkSimplexMinimizer>::New();
+  vtkSmartPointer<vtkCMAESMinimizer> cmaes =
+    vtkSmartPointer<vtkCMAESMinimizer>::New();
+  vtkSmartPointer<vtkTrustRegionMinimizer> trust =
+    vtkSmartPointer<vtkTrustRegionMinimizer>::New();
+
+  // the evaluation limits are a few times what each method needs
+  int success = 1;
+  success &= TestMinimizer(simplex, "Simplex", Quadratic, 1000);
+  success &= TestMinimizer(simplex, "Simplex", Rosenbrock, 1000);
+  success &= TestMinimizer(cmaes, "CMA-ES", Quadratic, 4000);
+  success &= TestMinimizer(cmaes, "CMA-ES", Rosenbrock, 4000);
+  success &= TestMinimizer(trust, "TrustRegion", Quadratic, 100);
+  success &= TestMinimizer(trust, "TrustRegion", Rosenbrock, 500);
+
+  return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+}